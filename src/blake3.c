@@ -0,0 +1,239 @@
+/*
+ * dfu-util - BLAKE3
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * BLAKE3 in its default hashing mode, as in the reference
+ * implementation of the specification: the input is split into
+ * chunks of 1 KiB, which are hashed on their own and combined in a
+ * binary tree. Only the 32 byte digest is supported, no keyed hashing
+ * or key derivation.
+ */
+
+#include <string.h>
+
+#include "blake3.h"
+
+#define CHUNK_START	(1 << 0)
+#define CHUNK_END	(1 << 1)
+#define PARENT		(1 << 2)
+#define ROOT		(1 << 3)
+
+static const uint32_t IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* message words used by each round, the permutation applied 0..6 times */
+static const unsigned char SCHEDULE[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y) do {			\
+	v[a] = v[a] + v[b] + (x);			\
+	v[d] = ROR(v[d] ^ v[a], 16);			\
+	v[c] = v[c] + v[d];				\
+	v[b] = ROR(v[b] ^ v[c], 12);			\
+	v[a] = v[a] + v[b] + (y);			\
+	v[d] = ROR(v[d] ^ v[a], 8);			\
+	v[c] = v[c] + v[d];				\
+	v[b] = ROR(v[b] ^ v[c], 7);			\
+} while (0)
+
+/* the first 8 words of the compression function's output */
+static void _compress(uint32_t out[8], const uint32_t cv[8],
+		      const unsigned char block[BLAKE3_BLOCK_LEN],
+		      uint64_t counter, uint32_t block_len, uint32_t flags)
+{
+	uint32_t m[16], v[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = block[4*i] | block[4*i+1] << 8 | block[4*i+2] << 16 |
+			(uint32_t)block[4*i+3] << 24;
+
+	memcpy(v, cv, 8 * sizeof(uint32_t));
+	memcpy(v + 8, IV, 4 * sizeof(uint32_t));
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (i = 0; i < 7; i++) {
+		const unsigned char *s = SCHEDULE[i];
+
+		G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+		G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+		G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+		G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+		G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+		G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+		G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		out[i] = v[i] ^ v[i+8];
+}
+
+static void _chunk_init(struct blake3_chunk *c, uint64_t counter)
+{
+	memcpy(c->cv, IV, sizeof(IV));
+	c->counter = counter;
+	c->block_len = 0;
+	c->blocks_compressed = 0;
+}
+
+static size_t _chunk_len(const struct blake3_chunk *c)
+{
+	return BLAKE3_BLOCK_LEN * c->blocks_compressed + c->block_len;
+}
+
+static uint32_t _chunk_start(const struct blake3_chunk *c)
+{
+	return c->blocks_compressed ? 0 : CHUNK_START;
+}
+
+static void _chunk_update(struct blake3_chunk *c, const unsigned char *p,
+			  size_t len)
+{
+	while (len) {
+		size_t n;
+
+		/* the last block of a chunk is compressed by _chunk_cv() */
+		if (c->block_len == BLAKE3_BLOCK_LEN) {
+			_compress(c->cv, c->cv, c->block, c->counter,
+				  BLAKE3_BLOCK_LEN, _chunk_start(c));
+			c->blocks_compressed++;
+			c->block_len = 0;
+		}
+
+		n = BLAKE3_BLOCK_LEN - c->block_len;
+		if (n > len)
+			n = len;
+		memcpy(c->block + c->block_len, p, n);
+		c->block_len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* chaining value of a complete chunk, or the root of a single one */
+static void _chunk_cv(const struct blake3_chunk *c, uint32_t flags,
+		      uint32_t out[8])
+{
+	unsigned char block[BLAKE3_BLOCK_LEN];
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, c->block, c->block_len);
+	_compress(out, c->cv, block, c->counter, c->block_len,
+		  _chunk_start(c) | CHUNK_END | flags);
+}
+
+static void _parent_cv(const uint32_t left[8], const uint32_t right[8],
+		       uint32_t flags, uint32_t out[8])
+{
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		const uint32_t w[2] = { left[i], right[i] };
+		int j;
+
+		for (j = 0; j < 2; j++) {
+			unsigned char *b = block + 32*j + 4*i;
+
+			b[0] = w[j];
+			b[1] = w[j] >> 8;
+			b[2] = w[j] >> 16;
+			b[3] = w[j] >> 24;
+		}
+	}
+	_compress(out, IV, block, 0, BLAKE3_BLOCK_LEN, PARENT | flags);
+}
+
+void blake3_init(struct blake3 *b)
+{
+	_chunk_init(&b->chunk, 0);
+	b->cv_stack_len = 0;
+}
+
+void blake3_update(struct blake3 *b, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len) {
+		size_t n;
+
+		/* a chunk is only finished once more input follows, as
+		   the last one is compressed with the ROOT flag */
+		if (_chunk_len(&b->chunk) == BLAKE3_CHUNK_LEN) {
+			uint64_t total = b->chunk.counter + 1;
+			uint32_t cv[8];
+
+			_chunk_cv(&b->chunk, 0, cv);
+			/* merge every subtree completed by this chunk */
+			while (!(total & 1)) {
+				b->cv_stack_len--;
+				_parent_cv(b->cv_stack[b->cv_stack_len], cv, 0,
+					   cv);
+				total >>= 1;
+			}
+			memcpy(b->cv_stack[b->cv_stack_len++], cv, sizeof(cv));
+			_chunk_init(&b->chunk, b->chunk.counter + 1);
+		}
+
+		n = BLAKE3_CHUNK_LEN - _chunk_len(&b->chunk);
+		if (n > len)
+			n = len;
+		_chunk_update(&b->chunk, p, n);
+		p += n;
+		len -= n;
+	}
+}
+
+void blake3_final(const struct blake3 *b, unsigned char digest[BLAKE3_OUT_LEN])
+{
+	unsigned int i = b->cv_stack_len;
+	uint32_t out[8];
+
+	if (!i)
+		_chunk_cv(&b->chunk, ROOT, out);
+	else {
+		_chunk_cv(&b->chunk, 0, out);
+		while (--i)
+			_parent_cv(b->cv_stack[i], out, 0, out);
+		_parent_cv(b->cv_stack[0], out, ROOT, out);
+	}
+
+	for (i = 0; i < 8; i++) {
+		digest[4*i] = out[i];
+		digest[4*i+1] = out[i] >> 8;
+		digest[4*i+2] = out[i] >> 16;
+		digest[4*i+3] = out[i] >> 24;
+	}
+}
@@ -0,0 +1,52 @@
+/*
+ * dfu-util - BLAKE3
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _BLAKE3_H
+#define _BLAKE3_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLAKE3_BLOCK_LEN	64
+#define BLAKE3_CHUNK_LEN	1024
+#define BLAKE3_OUT_LEN		32
+/* enough for 2^64 bytes */
+#define BLAKE3_MAX_DEPTH	54
+
+struct blake3_chunk {
+	uint32_t cv[8];
+	uint64_t counter;		/* index of the chunk */
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	unsigned int block_len;
+	unsigned int blocks_compressed;
+};
+
+struct blake3 {
+	struct blake3_chunk chunk;
+	/* chaining values of completed subtrees, largest first */
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	unsigned int cv_stack_len;
+};
+
+void blake3_init(struct blake3 *b);
+void blake3_update(struct blake3 *b, const void *data, size_t len);
+void blake3_final(const struct blake3 *b, unsigned char digest[BLAKE3_OUT_LEN]);
+
+#endif
@@ -21,7 +21,12 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "crc32.h"
 
 static uint32_t dfu_crc32_table[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -79,3 +84,205 @@ uint32_t crc32_byte(uint32_t accum, uint8_t delta)
     return dfu_crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
 }
 
+/* slicing-by-8 tables, derived from dfu_crc32_table on first use.
+   crc32_slice[0] is dfu_crc32_table itself. */
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_slice_once = PTHREAD_ONCE_INIT;
+
+static void crc32_slice_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		crc32_slice[0][i] = dfu_crc32_table[i];
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32_slice[j][i] = (crc32_slice[j-1][i] >> 8) ^
+				dfu_crc32_table[crc32_slice[j-1][i] & 0xff];
+}
+
+/**
+ * feed @p len bytes of @p buf into the CRC @p accum, eight bytes per
+ * step. The result is identical to calling crc32_byte() for every
+ * byte of @p buf.
+ */
+uint32_t crc32_buf(uint32_t accum, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc32_slice_once, crc32_slice_init);
+
+	while (len >= 8) {
+		uint32_t lo = accum ^ (p[0] | p[1] << 8 | p[2] << 16 |
+				       (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 |
+			(uint32_t)p[7] << 24;
+
+		accum = crc32_slice[7][lo & 0xff] ^
+			crc32_slice[6][(lo >> 8) & 0xff] ^
+			crc32_slice[5][(lo >> 16) & 0xff] ^
+			crc32_slice[4][lo >> 24] ^
+			crc32_slice[3][hi & 0xff] ^
+			crc32_slice[2][(hi >> 8) & 0xff] ^
+			crc32_slice[1][(hi >> 16) & 0xff] ^
+			crc32_slice[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		accum = crc32_byte(accum, *p++);
+
+	return accum;
+}
+
+/* multiply the 32x32 matrix @p mat over GF(2) by the vector @p vec */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/**
+ * the CRC @p accum after feeding it @p len zero bytes, in O(log len)
+ * steps. As the CRC is linear, crc32_shift(a, len) ^ crc32_buf(0, buf,
+ * len) equals crc32_buf(a, buf, len).
+ */
+uint32_t crc32_shift(uint32_t accum, unsigned long long len)
+{
+	uint32_t even[32], odd[32];
+	int n;
+
+	/* the operator for one zero bit */
+	odd[0] = 0xedb88320;
+	for (n = 1; n < 32; n++)
+		odd[n] = 1U << (n - 1);
+
+	/* two, four and then eight zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+	gf2_matrix_square(even, odd);
+
+	/* apply 2^k zero bytes for every bit k set in len */
+	while (len) {
+		if (len & 1)
+			accum = gf2_matrix_times(even, accum);
+		len >>= 1;
+		if (!len)
+			break;
+		gf2_matrix_square(odd, even);
+		memcpy(even, odd, sizeof(even));
+	}
+	return accum;
+}
+
+/**
+ * the CRC of two buffers one after the other, from the CRC @p crc1 of
+ * the first, and the CRC @p crc2 of the @p len2 bytes of the second,
+ * computed starting at 0
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2)
+{
+	return crc32_shift(crc1, len2) ^ crc2;
+}
+
+static unsigned int crc32_threads;
+
+/* threads used by crc32_buf_parallel(), 0 for one per CPU */
+void crc32_set_threads(unsigned int threads)
+{
+	crc32_threads = threads;
+}
+
+static unsigned int crc32_num_threads(void)
+{
+	const char *env;
+	long cpus;
+
+	if (crc32_threads)
+		return crc32_threads;
+	if ((env = getenv("DFU_UTIL_CRC_THREADS")) && atoi(env) > 0)
+		return atoi(env);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+struct crc32_part {
+	const uint8_t *buf;
+	size_t len;
+	uint32_t crc;
+	pthread_t thread;
+	int started;
+};
+
+static void *crc32_part_thread(void *v)
+{
+	struct crc32_part *part = v;
+
+	part->crc = crc32_buf(0, part->buf, part->len);
+	return NULL;
+}
+
+/**
+ * like crc32_buf(), with large buffers split into parts whose CRCs are
+ * computed by one thread each and combined. The result is identical.
+ */
+uint32_t crc32_buf_parallel(uint32_t accum, const void *buf, size_t len)
+{
+	struct crc32_part *parts;
+	unsigned int i, count = crc32_num_threads();
+	size_t part_len;
+
+	if (count > CRC32_MAX_THREADS)
+		count = CRC32_MAX_THREADS;
+	if (count > len / CRC32_PARALLEL_MIN)
+		count = len / CRC32_PARALLEL_MIN;
+	if (count < 2)
+		return crc32_buf(accum, buf, len);
+
+	parts = calloc(count, sizeof(*parts));
+	if (!parts)
+		return crc32_buf(accum, buf, len);
+
+	part_len = len / count;
+	for (i = 0; i < count; i++) {
+		parts[i].buf = (const uint8_t *)buf + i * part_len;
+		parts[i].len = i < count - 1 ? part_len :
+			len - (count - 1) * part_len;
+	}
+
+	/* the first part is done on this thread, starting at accum */
+	for (i = 1; i < count; i++)
+		parts[i].started = pthread_create(&parts[i].thread, NULL,
+						  crc32_part_thread,
+						  &parts[i]) == 0;
+	accum = crc32_buf(accum, parts[0].buf, parts[0].len);
+
+	for (i = 1; i < count; i++) {
+		if (parts[i].started)
+			pthread_join(parts[i].thread, NULL);
+		else
+			crc32_part_thread(&parts[i]);
+		accum = crc32_combine(accum, parts[i].crc, parts[i].len);
+	}
+
+	free(parts);
+	return accum;
+}
@@ -21,6 +21,9 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <stdint.h>
+#include <stddef.h>
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define cpu_to_le16(d)  (d)
 #define cpu_to_le32(d)  (d)
@@ -37,3 +40,13 @@
 
 uint32_t crc32_init(void);
 uint32_t crc32_byte(uint32_t accum, uint8_t delta);
+uint32_t crc32_buf(uint32_t accum, const void *buf, size_t len);
+
+/* bytes per thread below which crc32_buf_parallel() uses fewer threads */
+#define CRC32_PARALLEL_MIN	(4*1024*1024)
+#define CRC32_MAX_THREADS	64
+
+uint32_t crc32_shift(uint32_t accum, unsigned long long len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2);
+void crc32_set_threads(unsigned int threads);
+uint32_t crc32_buf_parallel(uint32_t accum, const void *buf, size_t len);
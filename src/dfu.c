@@ -31,6 +31,10 @@
 #include <usb.h>
 #include "dfu.h"
 #include "dfu_sm.h"
+#include "dfu_profile.h"
+#include "dfu_sm_prof.h"
+#include "dfu_heatmap.h"
+#include "dfu_clock.h"
 #include "crc32.h"
 
 static int _dfu_verify_init(dfu_handle *handle, const char *function );
@@ -42,8 +46,23 @@ static int _dfu_verify_init(dfu_handle *handle, const char *function );
 
 #define INVALID_DFU_TIMEOUT -1
 
+/* note when the first DNLOAD of a transfer goes out */
+static void _mark_dnload(dfu_handle *handle)
+{
+	if (!handle->dnload_start)
+		handle->dnload_start = dfu_clock_ms();
+}
+
 static int dfu_debug_level = 0;
 
+/* the handlers to use for a device */
+const struct dfu_transition_handlers *dfu_handlers(dfu_handle *handle)
+{
+	if (handle->handlers)
+		return handle->handlers;
+	return usb_dfu_handlers(handle->dfu_ver);
+}
+
 void dfu_init( dfu_handle *handle,
 	      const int usb_timeout)
 {
@@ -52,12 +71,26 @@ void dfu_init( dfu_handle *handle,
 
 	handle->device = NULL;
 	handle->interface = 0;
+	handle->sm_prof = NULL;
+	handle->heatmap = NULL;
+	handle->progress = NULL;
+	handle->name = NULL;
 	handle->dfu_ver = DFU_VERSION_1_0;
+	dfu_quirks_clear(&handle->quirk_flags);
 
 	dfu_sm_set_state_unchecked(handle, DFU_STATE_appIDLE);
 
 	handle->transaction = 0;
 
+	handle->handlers = NULL;
+	handle->transport = NULL;
+	handle->tune = NULL;
+	handle->profile = NULL;
+	handle->resume = 0;
+	handle->digest = NULL;
+	handle->dnload_start = 0;
+	dfu_timeout_init(&handle->timeouts);
+
 	handle->usb_timeout = -1;
 	if( usb_timeout > 0 ) {
 		handle->usb_timeout = usb_timeout;
@@ -130,12 +163,18 @@ int dfu_detach( dfu_handle *handle,
 {
 	int next_state = -1;
 
+	unsigned short wTimeout = timeout;
+
 	if( (next_state = dfu_sm_get_next_state(handle, DFU_EV_DETACH, 0)) < 0)
 		return -1;
 
+	if(handle->profile &&
+	   handle->profile->set & DFU_PROFILE_DETACH_TIMEOUT)
+		wTimeout = handle->profile->detach_timeout;
+
 	/* do the actual "work" */
-	if(usb_dfu_handlers(handle->dfu_ver)->detach(handle,
-					timeout) < 0)
+	if(dfu_handlers(handle)->detach(handle,
+					wTimeout) < 0)
 		return -1;
 
 	if(_dfu_state_verify(handle, next_state, __FUNCTION__) < 0)
@@ -164,7 +203,7 @@ int dfu_usb_reset( dfu_handle *handle )
 		return -1;
 
 	/* do the actual "work" */
-	if( (ret = usb_dfu_handlers(handle->dfu_ver)->device_reset(handle)) < 0)
+	if( (ret = dfu_handlers(handle)->device_reset(handle)) < 0)
 		return -1;
 
 	return dfu_sm_set_state_checked(handle, next_state);
@@ -196,7 +235,9 @@ int dfu_status_poll_timeout( dfu_handle *handle,
 		return -1;
 
 	/* do the actual "work" */
-	if(usb_dfu_handlers(handle->dfu_ver)->status_poll_timeout(handle,
+	if(handle->sm_prof)
+		dfu_sm_prof_busy(handle->sm_prof, poll_timeout);
+	if(dfu_handlers(handle)->status_poll_timeout(handle,
 						  poll_timeout) < 0)
 		return -1;
 
@@ -219,7 +260,7 @@ int dfu_status_poll_timeout( dfu_handle *handle,
  */
 int dfu_download( dfu_handle *handle,
                   const unsigned short length,
-                  char* data )
+                  const char* data )
 {
 	int ret = -1;
 	int next_state = -1;
@@ -253,7 +294,8 @@ int dfu_download( dfu_handle *handle,
 		return -1;
 
 	/* do the actual "work" */
-	if( (ret = usb_dfu_handlers(handle->dfu_ver)->download(handle,
+	_mark_dnload(handle);
+	if( (ret = dfu_handlers(handle)->download(handle,
 					       handle->transaction++,
 					       length, data)) < 0)
 		return -1;
@@ -267,6 +309,94 @@ int dfu_download( dfu_handle *handle,
 	return ret;
 }
 
+/*
+ *  Download one block, and poll the device's status until it is done
+ *  writing it (DFU Spec 1.0, Section 7.1.2 - 7.1.3)
+ *
+ *  length    - the number of bytes to transfer, 0 < length <=
+ *              wTransferSize
+ *  data      - the data to transfer
+ *  status    - the status the device reported last
+ *
+ *  Handlers offering download_block do all of this in one go, which
+ *  saves round trips to remote devices.
+ *
+ *  returns the number of bytes written or < 0 on error
+ */
+int dfu_download_block( dfu_handle *handle,
+                        const unsigned short length,
+                        const char* data,
+                        struct dfu_status *status )
+{
+	const struct dfu_transition_handlers *handlers;
+	int ret = -1;
+	int next_state = -1;
+
+	if( 0 != _dfu_verify_init(handle, __FUNCTION__) )
+		return -1;
+
+	if( (0 == length) || (NULL == data) ) {
+		if( 0 != dfu_debug_level )
+			fprintf( stderr,
+				 "%s: data was NULL, or length is 0\n",
+				 __FUNCTION__ );
+		return -1;
+	}
+
+	handlers = dfu_handlers(handle);
+	if(!handlers->download_block)
+	{
+		int sent;
+
+		if(handle->heatmap)
+			dfu_heatmap_start(handle->heatmap);
+		sent = dfu_download(handle, length, data);
+		if(sent < 0)
+			return sent;
+		if(handle->heatmap)
+			dfu_heatmap_sent(handle->heatmap);
+
+		do {
+			if( (ret = dfu_get_status(handle, status)) < 0)
+				return ret;
+
+			if(dfu_sm_get_state(handle) == DFU_STATE_dfuDNBUSY)
+			{
+				if(handle->heatmap)
+					dfu_heatmap_poll(handle->heatmap,
+							 status->bwPollTimeout);
+				if( (ret = dfu_status_poll_timeout(handle,
+						dfu_poll_timeout(handle, status))) < 0)
+					return ret;
+			}
+		} while (status->bState == DFU_STATE_dfuDNLOAD_SYNC ||
+			 status->bState == DFU_STATE_dfuDNBUSY);
+
+		return sent;
+	}
+
+	int guards = DFU_GUARD_WLENGTH_GT_ZERO;
+	if(handle->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
+		guards |= DFU_GUARD_BIT_CAN_DNLOAD;
+
+	if( (next_state = dfu_sm_get_next_state(handle, DFU_EV_DNLOAD, guards)) < 0)
+		return -1;
+
+	/* do the actual "work" */
+	_mark_dnload(handle);
+	if( (ret = handlers->download_block(handle, handle->transaction++,
+					    length, data, status)) < 0)
+		return -1;
+
+	/* dfuDNLOAD-SYNC, then whatever the last GETSTATUS reported */
+	if(dfu_sm_set_state_checked(handle, next_state) < 0)
+		return -1;
+	if(dfu_sm_set_state_checked(handle, status->bState) < 0)
+		return -1;
+
+	return ret;
+}
+
 /*
  *  DFU_UPLOAD Request (DFU Spec 1.0, Section 6.2)
  *
@@ -301,7 +431,7 @@ int dfu_upload( dfu_handle *handle,
 		return -1;
 
 	/* do the actual "work" */
-	if( (ret = usb_dfu_handlers(handle->dfu_ver)->upload(handle,
+	if( (ret = dfu_handlers(handle)->upload(handle,
 					     handle->transaction++,
 					     length, data)) < 0)
 	{
@@ -350,7 +480,7 @@ int dfu_get_status( dfu_handle *handle,
 		return -1;
 
 	/* do the actual "work" */
-	if(usb_dfu_handlers(handle->dfu_ver)->get_status( handle,
+	if(dfu_handlers(handle)->get_status( handle,
 					  status) < 0)
 		return -1;
 
@@ -378,7 +508,7 @@ int dfu_clear_status( dfu_handle *handle )
 		return -1;
 
 	/* do the actual "work" */
-	if( usb_dfu_handlers(handle->dfu_ver)->clear_status(handle) < 0)
+	if( dfu_handlers(handle)->clear_status(handle) < 0)
 		return -1;
 
 
@@ -409,7 +539,7 @@ int dfu_get_state( dfu_handle *handle )
 
 
 	/* do the actual "work" */
-	if( (ret = usb_dfu_handlers(handle->dfu_ver)->get_state(handle)) < 0)
+	if( (ret = dfu_handlers(handle)->get_state(handle)) < 0)
 		return -1;
 
 
@@ -442,7 +572,7 @@ int dfu_abort( dfu_handle *handle )
 
 
 	/* do the actual "work" */
-	if(usb_dfu_handlers(handle->dfu_ver)->abort(handle) < 0)
+	if(dfu_handlers(handle)->abort(handle) < 0)
 		return -1;
 
 
@@ -452,6 +582,99 @@ int dfu_abort( dfu_handle *handle )
 	return dfu_sm_set_state_checked(handle, next_state);
 }
 
+/*
+ *  The time to wait before the next DFU_GETSTATUS: the bwPollTimeout
+ *  of the last one, unless quirks or the device's profile say better.
+ *
+ *  status - the last status received
+ *
+ *  returns the timeout in milliseconds
+ */
+unsigned int dfu_poll_timeout( dfu_handle *handle,
+                               const struct dfu_status *status )
+{
+	const struct dfu_profile *profile = handle->profile;
+	unsigned int timeout = status->bwPollTimeout;
+
+	if(status->bState == DFU_STATE_dfuDNBUSY &&
+	   dfu_quirk_is_set(&handle->quirk_flags, QUIRK_OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT))
+		timeout = 5;
+	if(status->bState == DFU_STATE_dfuMANIFEST &&
+	   dfu_quirk_is_set(&handle->quirk_flags, QUIRK_OPENMOKO_MANIFEST_STATUS_POLL_TIMEOUT))
+		timeout = 1000;
+
+	if(!profile)
+		return timeout;
+	if(profile->set & DFU_PROFILE_POLL_TIMEOUT)
+		timeout = profile->poll_timeout;
+	if(profile->set & DFU_PROFILE_POLL_FLOOR &&
+	   timeout < profile->poll_floor)
+		timeout = profile->poll_floor;
+	return timeout;
+}
+
+/*
+ *  The transfer size to use: wTransferSize of the functional descriptor,
+ *  unless the device's profile says better.
+ */
+unsigned int dfu_transfer_size( dfu_handle *handle )
+{
+	if(handle->profile &&
+	   handle->profile->set & DFU_PROFILE_TRANSFER_SIZE)
+		return handle->profile->transfer_size;
+	return le16_to_cpu(handle->func_dfu.wTransferSize);
+}
+
+/*
+ *  The timeout for a request: adapted to the latency seen so far,
+ *  and never more than usb_timeout.
+ *
+ *  returns the timeout in milliseconds
+ */
+unsigned int dfu_request_timeout( dfu_handle *handle, int bRequest,
+                                  unsigned int wLength )
+{
+	if(handle->profile &&
+	   handle->profile->set & DFU_PROFILE_TIMEOUTS &&
+	   handle->profile->fixed_timeouts)
+		return handle->usb_timeout;
+	return dfu_timeout_get(&handle->timeouts, bRequest, wLength,
+			       handle->usb_timeout);
+}
+
+/*
+ *  Learn from a request that completed after elapsed_us, or timed out.
+ */
+void dfu_request_done( dfu_handle *handle, int bRequest,
+                       unsigned int wLength, unsigned long long elapsed_us,
+                       int timed_out )
+{
+	dfu_timeout_sample(&handle->timeouts, bRequest, wLength,
+			   elapsed_us, timed_out);
+}
+
+/*
+ *  Whether a request that timed out is sent again: only status
+ *  requests, only if the first attempt had an adapted timeout of
+ *  first ms, and only while the attempts, spent ms so far, stay within
+ *  DFU_TIMEOUT_RETRY_BUDGET times that.
+ *
+ *  returns the timeout of the next attempt in ms, or 0 to fail
+ */
+unsigned int dfu_request_retry( dfu_handle *handle, int bRequest,
+                                unsigned int wLength, unsigned int first,
+                                unsigned int spent )
+{
+	unsigned int budget = first * DFU_TIMEOUT_RETRY_BUDGET;
+	unsigned int timeout;
+
+	if(!dfu_timeout_idempotent(bRequest) ||
+	   first >= handle->usb_timeout || spent >= budget)
+		return 0;
+	timeout = dfu_request_timeout(handle, bRequest, wLength);
+	return timeout < budget - spent ? timeout : budget - spent;
+}
+
 
 char* dfu_state_to_string( int state )
 {
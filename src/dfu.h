@@ -24,6 +24,7 @@
 #include <usb.h>
 #include "usb_dfu.h"
 #include "dfu_quirks.h"
+#include "dfu_timeout.h"
 
 /* This is based off of DFU_GETSTATUS
  *
@@ -54,14 +55,24 @@ enum DFU_VERSION {
 	DFU_VERSION_1_1,
 };
 
+struct dfu_transition_handlers;
+struct dfu_tune;
+struct dfu_profile;
+struct dfu_digest;
+struct dfu_sm_prof;
+struct dfu_heatmap;
+struct dfu_progress_dev;
+
 /* dfu-util specific: structure containing various sorts of control
    information specific to the device we are currently attached to. */
 typedef struct _dfu_handle
 {
 	struct usb_dev_handle *device;
 	unsigned short interface;
-	/* usb timeout setting: msecs before a usb request fails */
+	/* usb timeout setting: msecs before a usb request fails. Once
+	   the latency of a kind of request is known, it fails earlier */
 	unsigned int usb_timeout;
+	struct dfu_timeouts timeouts;
 	/* DFU functional descriptor, containing some device
 	   configuration info */
 	struct usb_dfu_func_descriptor func_dfu;
@@ -69,13 +80,37 @@ typedef struct _dfu_handle
 	   accessed directly, but it's tracked automatically via dfu_*
 	   and dfu_sm_* functions. */
 	unsigned int dfu_state;
-	/* dfu upload/download request count */
+	/* dfu upload/download request count, sent as wBlockNum. It
+	   wraps from 65535 to 0, so images of more blocks than that
+	   are fine as long as the device only checks the sequence. */
 	unsigned short transaction;
 	/* dfu version being used */
 	unsigned int dfu_ver;
 	/* a set of quirks documenting the difference from the
 	   currently selected DFU version */
 	dfu_quirks quirk_flags;
+	/* handlers replacing the USB ones, for devices not attached
+	   locally, and their private data. NULL for USB devices. */
+	const struct dfu_transition_handlers *handlers;
+	void *transport;
+	/* transfer size autotuning in progress, or NULL */
+	struct dfu_tune *tune;
+	/* quirks and tuning of this device model, or NULL */
+	const struct dfu_profile *profile;
+	/* retry failed blocks and checkpoint the progress of transfers */
+	int resume;
+	/* digests taken of the firmware transferred, or NULL */
+	struct dfu_digest *digest;
+	/* dfu_clock_ms() the first DNLOAD was sent at, 0 before */
+	unsigned long long dnload_start;
+	/* told about every state change, or NULL */
+	struct dfu_sm_prof *sm_prof;
+	/* timing of each block downloaded, or NULL */
+	struct dfu_heatmap *heatmap;
+	/* counts the bytes transferred, or NULL */
+	struct dfu_progress_dev *progress;
+	/* the device in log records, or NULL */
+	const char *name;
 } dfu_handle;
 
 /* portable USB data endianness conversion */
@@ -104,7 +139,11 @@ int dfu_status_poll_timeout(dfu_handle *handle,
 			     unsigned int poll_timeout );
 int dfu_download( dfu_handle *handle,
                   const unsigned short length,
-                  char* data );
+                  const char* data );
+int dfu_download_block( dfu_handle *handle,
+                        const unsigned short length,
+                        const char* data,
+                        struct dfu_status *status );
 int dfu_upload( dfu_handle *handle,
                 const unsigned short length,
                 char* data );
@@ -113,6 +152,17 @@ int dfu_get_status( dfu_handle *handle,
 int dfu_clear_status( dfu_handle *handle );
 int dfu_get_state( dfu_handle *handle );
 int dfu_abort( dfu_handle *handle );
+unsigned int dfu_poll_timeout( dfu_handle *handle,
+                               const struct dfu_status *status );
+unsigned int dfu_transfer_size( dfu_handle *handle );
+unsigned int dfu_request_timeout( dfu_handle *handle, int bRequest,
+                                  unsigned int wLength );
+void dfu_request_done( dfu_handle *handle, int bRequest,
+                       unsigned int wLength, unsigned long long elapsed_us,
+                       int timed_out );
+unsigned int dfu_request_retry( dfu_handle *handle, int bRequest,
+                                unsigned int wLength, unsigned int first,
+                                unsigned int spent );
 
 char* dfu_state_to_string( int state );
 
@@ -120,8 +170,6 @@ const char *dfu_status_to_string(int status);
 
 const char *dfu_func_descriptor_to_string(struct usb_dfu_func_descriptor *func_desc);
 
-int add_file_suffix(const char *fname);
-
 /**
  * Descriptor of handlers for a specific DFU implementation
  */
@@ -134,7 +182,7 @@ struct dfu_transition_handlers {
 	int (*download)( dfu_handle *handle,
 			 const int transaction,
 			 const unsigned short length,
-			 char* data );
+			 const char* data );
 	int (*upload)( dfu_handle *handle,
 		       const int transaction,
 		       const unsigned short length,
@@ -144,6 +192,13 @@ struct dfu_transition_handlers {
 	int (*clear_status)( dfu_handle *handle );
 	int (*get_state)( dfu_handle *handle );
 	int (*abort)( dfu_handle *handle );
+	/* optional: DNLOAD a block and wait until the device is done
+	   with it, see dfu_download_block() */
+	int (*download_block)( dfu_handle *handle,
+			       const int transaction,
+			       const unsigned short length,
+			       const char* data,
+			       struct dfu_status *status );
 };
 
 /**
@@ -151,6 +206,11 @@ struct dfu_transition_handlers {
  */
 const struct dfu_transition_handlers *usb_dfu_handlers(enum DFU_VERSION version);
 
+/**
+ * the handlers in use for a device: its own, or the USB ones
+ */
+const struct dfu_transition_handlers *dfu_handlers(dfu_handle *handle);
+
 
 int debug;
 
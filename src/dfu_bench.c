@@ -0,0 +1,771 @@
+/*
+ * dfu-util - benchmarks
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * dfu-bench runs micro-benchmarks of the CRC, the state machine and
+ * the suffix check, and full download, upload and compare sessions
+ * against a simulated device. The results are written as JSON, and
+ * compared with those of an earlier run if one is given, so that
+ * `make bench` tells when a change made things slower. With -c, only
+ * the CRC of a given file is measured, on 1, 2, 4... threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <usb.h>
+
+#include "dfu.h"
+#include "usb_dfu.h"
+#include "dfu_sm.h"
+#include "dfu_sim.h"
+#include "dfu_image.h"
+#include "dfu_log.h"
+#include "dfu_clock.h"
+#include "sam7dfu.h"
+#include "crc32.h"
+
+#define BENCH_MAX		32
+#define BENCH_CRC_SIZE		(16 << 20)
+#define BENCH_SM_CYCLES		1000000
+#define BENCH_SIZE		(256 * 1024)
+#define BENCH_RUNS		3
+#define BENCH_THRESHOLD		10	/* percent */
+
+struct bench_result {
+	const char *name;
+	double value;
+	const char *unit;
+	int higher_is_better;
+};
+
+static struct bench_result results[BENCH_MAX];
+static int result_count;
+
+/* session parameters */
+static size_t size = BENCH_SIZE;
+static unsigned int poll_timeout;
+static unsigned int latency;
+static unsigned int xfer_size = DFU_SIM_TRANSFER_SIZE;
+static unsigned int runs = BENCH_RUNS;
+static int virtual_time;
+
+static char tmpdir[] = "/tmp/dfu-bench.XXXXXX";
+static char image_name[64];
+static char upload_name[64];
+
+static double _seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _result(const char *name, double value, const char *unit,
+		    int higher_is_better)
+{
+	struct bench_result *r = &results[result_count++];
+
+	r->name = name;
+	r->value = value;
+	r->unit = unit;
+	r->higher_is_better = higher_is_better;
+}
+
+static double _mib_s(size_t len, double secs)
+{
+	return secs > 0 ? len / secs / (1024 * 1024) : 0.0;
+}
+
+/* the sessions print what they are doing; that isn't measured */
+static int _quiet(void)
+{
+	int saved, fd;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+	return saved;
+}
+
+static void _unquiet(int saved)
+{
+	if (saved < 0)
+		return;
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+static void _fill(unsigned char *buf, size_t len)
+{
+	uint32_t x = 0x12345678;
+	size_t i;
+
+	/* xorshift, so that nothing compresses or predicts well */
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+}
+
+static void bench_crc(void)
+{
+	unsigned char *buf;
+	double t, best_buf = 0, best_par = 0;
+	unsigned int i;
+
+	buf = malloc(BENCH_CRC_SIZE);
+	if (!buf)
+		return;
+	_fill(buf, BENCH_CRC_SIZE);
+
+	for (i = 0; i < runs; i++) {
+		t = _seconds();
+		crc32_buf(crc32_init(), buf, BENCH_CRC_SIZE);
+		t = _seconds() - t;
+		if (!i || t < best_buf)
+			best_buf = t;
+
+		t = _seconds();
+		crc32_buf_parallel(crc32_init(), buf, BENCH_CRC_SIZE);
+		t = _seconds() - t;
+		if (!i || t < best_par)
+			best_par = t;
+	}
+	free(buf);
+
+	_result("crc32_buf", _mib_s(BENCH_CRC_SIZE, best_buf), "MiB/s", 1);
+	_result("crc32_buf_parallel", _mib_s(BENCH_CRC_SIZE, best_par),
+		"MiB/s", 1);
+}
+
+static void _crc_row(const char *method, unsigned int threads,
+		     size_t len, double secs, uint32_t crc, uint32_t ref)
+{
+	printf("%-10s %7u %10.1f   %08x%s\n", method, threads,
+	       _mib_s(len, secs), crc, crc == ref ? "" : "  MISMATCH");
+}
+
+/**
+ * measure the CRC of the whole file @p fname byte by byte, sliced and
+ * on 1, 2, 4, ... threads up to the number of CPUs, and check that
+ * all agree
+ *
+ * @return 0, or < 0 on error or if a result differs
+ */
+static int bench_crc_file(const char *fname)
+{
+	unsigned char *buf = NULL;
+	unsigned int threads, max_threads;
+	uint32_t ref, crc;
+	struct stat st;
+	size_t len = 0, i;
+	double t;
+	int fd, ret = -1;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(fname);
+		goto out;
+	}
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf) {
+		fprintf(stderr, "%s: too large to benchmark\n", fname);
+		goto out;
+	}
+	while (len < (size_t)st.st_size) {
+		ssize_t n = read(fd, buf + len, st.st_size - len);
+
+		if (n <= 0) {
+			perror(fname);
+			goto out;
+		}
+		len += n;
+	}
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 2)
+		max_threads = 2;
+	if (max_threads > CRC32_MAX_THREADS)
+		max_threads = CRC32_MAX_THREADS;
+
+	printf("CRC32 of %lu bytes, %ld CPU(s)\n", (unsigned long)len,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-10s %7s %10s   %s\n", "method", "threads", "MiB/s", "crc");
+
+	/* the reference everything has to agree with */
+	t = _seconds();
+	ref = crc32_init();
+	for (i = 0; i < len; i++)
+		ref = crc32_byte(ref, buf[i]);
+	_crc_row("byte", 1, len, _seconds() - t, ref, ref);
+
+	t = _seconds();
+	crc = crc32_buf(crc32_init(), buf, len);
+	_crc_row("sliced", 1, len, _seconds() - t, crc, ref);
+	ret = crc == ref ? 0 : -1;
+
+	for (threads = 2; threads <= max_threads; threads *= 2) {
+		crc32_set_threads(threads);
+		t = _seconds();
+		crc = crc32_buf_parallel(crc32_init(), buf, len);
+		_crc_row("parallel", threads, len, _seconds() - t, crc, ref);
+		if (crc != ref)
+			ret = -1;
+	}
+	crc32_set_threads(0);
+
+	if (len < 2 * CRC32_PARALLEL_MIN)
+		printf("Files of less than %u bytes are checksummed on a "
+		       "single thread\n", 2 * CRC32_PARALLEL_MIN);
+ out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/* the transitions of one block downloaded, and back to dfuIDLE */
+static const struct {
+	enum DFU_SM_EVENT event;
+	unsigned int guards;
+} sm_cycle[] = {
+	{ DFU_EV_DNLOAD, DFU_GUARD_WLENGTH_GT_ZERO | DFU_GUARD_BIT_CAN_DNLOAD },
+	{ DFU_EV_GETSTATUS, DFU_GUARD_BLOCK_IN_PROGRESS },
+	{ DFU_EV_STATUS_POLL_TIMEOUT, 0 },
+	{ DFU_EV_GETSTATUS, 0 },
+	{ DFU_EV_ABORT, 0 },
+};
+#define SM_CYCLE_LEN	(sizeof(sm_cycle) / sizeof(sm_cycle[0]))
+
+static int bench_sm(void)
+{
+	dfu_handle handle;
+	double t, best = 0;
+	unsigned int i, j, k;
+	int state;
+
+	dfu_init(&handle, 5000);
+
+	for (i = 0; i < runs; i++) {
+		dfu_sm_set_state_unchecked(&handle, DFU_STATE_dfuIDLE);
+		t = _seconds();
+		for (j = 0; j < BENCH_SM_CYCLES; j++) {
+			for (k = 0; k < SM_CYCLE_LEN; k++) {
+				state = dfu_sm_get_next_state(&handle,
+							      sm_cycle[k].event,
+							      sm_cycle[k].guards);
+				if (state < 0 ||
+				    dfu_sm_set_state_checked(&handle, state) < 0) {
+					fprintf(stderr, "state machine cycle "
+						"broken at step %u\n", k);
+					return -1;
+				}
+			}
+		}
+		t = _seconds() - t;
+		if (!i || t < best)
+			best = t;
+	}
+
+	_result("dfu_sm_transition",
+		best * 1e9 / ((double)BENCH_SM_CYCLES * SM_CYCLE_LEN), "ns", 0);
+	return 0;
+}
+
+/* write @p len bytes of firmware with a valid DFU suffix to @p fname */
+static int _write_image(const char *fname, size_t len)
+{
+	struct dfu_file_suffix suffix;
+	unsigned char *buf;
+	uint32_t crc;
+	FILE *f;
+	int ret = -1;
+
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+	_fill(buf, len);
+
+	memset(&suffix, 0xff, sizeof(suffix));
+	suffix.bcdDFU = cpu_to_le16(0x0100);
+	suffix.ucDfuSignature[0] = 'U';
+	suffix.ucDfuSignature[1] = 'F';
+	suffix.ucDfuSignature[2] = 'D';
+	suffix.bLength = DFU_FILE_SUFFIX_SIZE;
+	crc = crc32_buf(crc32_init(), buf, len);
+	crc = crc32_buf(crc, &suffix, DFU_FILE_SUFFIX_SIZE - 4);
+	suffix.dwCRC = cpu_to_le32(crc);
+
+	f = fopen(fname, "wb");
+	if (!f) {
+		perror(fname);
+		goto out;
+	}
+	if (fwrite(buf, 1, len, f) != len ||
+	    fwrite(&suffix, 1, DFU_FILE_SUFFIX_SIZE, f) !=
+	    DFU_FILE_SUFFIX_SIZE) {
+		perror(fname);
+		fclose(f);
+		goto out;
+	}
+	if (fclose(f) == 0)
+		ret = 0;
+ out:
+	free(buf);
+	return ret;
+}
+
+static int bench_suffix(void)
+{
+	struct dfu_image img;
+	double t, best = 0;
+	unsigned int i;
+	int saved, ret = 0;
+
+	saved = _quiet();
+	for (i = 0; i < runs; i++) {
+		t = _seconds();
+		if (dfu_image_open(&img, image_name, DFU_IMAGE_RECHECK) < 0) {
+			ret = -1;
+			break;
+		}
+		dfu_image_close(&img);
+		t = _seconds() - t;
+		if (!i || t < best)
+			best = t;
+	}
+	_unquiet(saved);
+	if (ret < 0)
+		return ret;
+
+	_result("suffix_check", _mib_s(size, best), "MiB/s", 1);
+	return 0;
+}
+
+enum session {
+	SESSION_DNLOAD,
+	SESSION_UPLOAD,
+	SESSION_COMPARE,
+};
+
+/* read back what was uploaded and compare it with the image */
+static int _compare(void)
+{
+	struct dfu_image img, up;
+	int ret = -1;
+
+	if (dfu_image_open(&img, image_name, DFU_IMAGE_TRUST) < 0)
+		return -1;
+	if (dfu_image_open(&up, upload_name, DFU_IMAGE_RECHECK) < 0)
+		goto out;
+	if (up.size == img.size && !memcmp(up.data, img.data, img.size))
+		ret = 0;
+	else
+		fprintf(stderr, "%s differs from %s\n", upload_name,
+			image_name);
+	dfu_image_close(&up);
+ out:
+	dfu_image_close(&img);
+	return ret;
+}
+
+/**
+ * run one session of kind @p kind against a new simulated device.
+ * Uploads and compares first download the image, untimed. Sessions
+ * are timed by dfu_clock, so in virtual time by what the device would
+ * have taken.
+ *
+ * @return the seconds the session took, or < 0 on error
+ */
+static double _session(enum session kind)
+{
+	struct dfu_sim sim;
+	dfu_handle handle;
+	unsigned long long start;
+	double t = -1;
+	int saved, ret;
+
+	dfu_init(&handle, 5000);
+	dfu_sim_init(&sim, "bench");
+	sim.poll_timeout = poll_timeout;
+	sim.latency = latency;
+	sim.func_dfu.wTransferSize = cpu_to_le16(xfer_size);
+	dfu_sim_attach(&sim, &handle);
+
+	saved = _quiet();
+	if (kind != SESSION_DNLOAD) {
+		if (sam7dfu_do_dnload(&handle, xfer_size, image_name,
+				      DFU_IMAGE_TRUST) < 0)
+			goto out;
+		handle.transaction = 0;
+	}
+
+	start = dfu_clock_us();
+	if (kind == SESSION_DNLOAD)
+		ret = sam7dfu_do_dnload(&handle, xfer_size, image_name,
+					DFU_IMAGE_RECHECK);
+	else
+		ret = sam7dfu_do_upload(&handle, xfer_size, upload_name, size);
+	if (ret >= 0 && kind == SESSION_COMPARE)
+		ret = _compare();
+	t = ret < 0 ? -1 : (dfu_clock_us() - start) / 1e6;
+ out:
+	_unquiet(saved);
+	dfu_sim_free(&sim);
+	return t;
+}
+
+static int bench_sessions(void)
+{
+	static const char *names[] = {
+		[SESSION_DNLOAD] = "session_download",
+		[SESSION_UPLOAD] = "session_upload",
+		[SESSION_COMPARE] = "session_compare",
+	};
+	enum session kind;
+	double t, best;
+	unsigned int i;
+
+	for (kind = SESSION_DNLOAD; kind <= SESSION_COMPARE; kind++) {
+		best = 0;
+		for (i = 0; i < runs; i++) {
+			t = _session(kind);
+			if (t < 0) {
+				fprintf(stderr, "%s failed\n", names[kind]);
+				return -1;
+			}
+			if (!i || t < best)
+				best = t;
+		}
+		/* a rate over no time at all means nothing */
+		if (best <= 0) {
+			printf("%s took no measurable time, not reported\n",
+			       names[kind]);
+			continue;
+		}
+		_result(names[kind], _mib_s(size, best), "MiB/s", 1);
+	}
+	return 0;
+}
+
+static int write_json(const char *fname)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+	fprintf(f, "{\"size\":%lu,\"poll_timeout\":%u,\"latency\":%u,"
+		"\"transfer_size\":%u,\"virtual_time\":%d,\"benchmarks\":[\n",
+		(unsigned long)size, poll_timeout, latency, xfer_size,
+		virtual_time);
+	for (i = 0; i < result_count; i++)
+		fprintf(f, "  {\"name\":\"%s\",\"value\":%.3f,\"unit\":\"%s\","
+			"\"higher_is_better\":%s}%s\n", results[i].name,
+			results[i].value, results[i].unit,
+			results[i].higher_is_better ? "true" : "false",
+			i + 1 < result_count ? "," : "");
+	fprintf(f, "]}\n");
+	if (fclose(f) != 0) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * find the value of benchmark @p name in the JSON @p json written by
+ * an earlier run
+ *
+ * @return 0, or < 0 if it isn't there
+ */
+static int _baseline_value(const char *json, const char *name, double *value)
+{
+	char key[64];
+	const char *p, *v;
+
+	snprintf(key, sizeof(key), "\"name\":\"%s\"", name);
+	p = strstr(json, key);
+	if (!p)
+		return -1;
+	v = strstr(p, "\"value\":");
+	if (!v || (strchr(p, '}') && v > strchr(p, '}')))
+		return -1;
+	*value = strtod(v + 8, NULL);
+	return 0;
+}
+
+/**
+ * warn if the sessions of @p json were run with other parameters
+ *
+ * @return 1 if its sessions compare with ours, 0 otherwise
+ */
+static int _check_params(const char *json, const char *fname)
+{
+	static const char *keys[] = {
+		"size", "poll_timeout", "latency", "transfer_size",
+		"virtual_time",
+	};
+	unsigned long ours[] = {
+		size, poll_timeout, latency, xfer_size, virtual_time,
+	};
+	char key[32];
+	const char *p;
+	unsigned int i;
+	int same = 1;
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		snprintf(key, sizeof(key), "\"%s\":", keys[i]);
+		p = strstr(json, key);
+		if (p && strtoul(p + strlen(key), NULL, 10) != ours[i]) {
+			printf("Warning: %s was run with another %s, the "
+			       "sessions don't compare\n", fname, keys[i]);
+			same = 0;
+		}
+	}
+	return same;
+}
+
+static char *_read_file(const char *fname)
+{
+	char *buf = NULL;
+	size_t len = 0, alloc = 0, n;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		return NULL;
+	}
+	do {
+		if (len + 1 >= alloc) {
+			char *b = realloc(buf, alloc ? alloc * 2 : 4096);
+
+			if (!b) {
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = b;
+			alloc = alloc ? alloc * 2 : 4096;
+		}
+		n = fread(buf + len, 1, alloc - len - 1, f);
+		len += n;
+	} while (n);
+	fclose(f);
+	buf[len] = '\0';
+	return buf;
+}
+
+/**
+ * print the results, with the change against @p baseline if given.
+ * Sessions are only compared if @p sessions says they were run alike.
+ *
+ * @return the number of results more than @p threshold percent worse
+ * than the baseline
+ */
+static int print_results(const char *baseline, int sessions,
+			 double threshold)
+{
+	int i, regressions = 0;
+
+	printf("%-22s %12s %-6s", "benchmark", "value", "unit");
+	if (baseline)
+		printf(" %12s %8s", "baseline", "change");
+	printf("\n");
+	for (i = 0; i < result_count; i++) {
+		const struct bench_result *r = &results[i];
+		double base, change;
+
+		printf("%-22s %12.3f %-6s", r->name, r->value, r->unit);
+		if (!baseline || _baseline_value(baseline, r->name, &base) < 0 ||
+		    base <= 0 ||
+		    (!sessions && !strncmp(r->name, "session_", 8))) {
+			printf("\n");
+			continue;
+		}
+		change = (r->value - base) * 100 / base;
+		printf(" %12.3f %+7.1f%%", base, change);
+		if (r->higher_is_better ? change < -threshold :
+		    change > threshold) {
+			printf("  REGRESSION");
+			regressions++;
+		}
+		printf("\n");
+	}
+	return regressions;
+}
+
+static void help(void)
+{
+	printf("Usage: dfu-bench [options]\n"
+		"  -h\t\tPrint this help message\n"
+		"  -o file\tWrite the results as JSON to file\n"
+		"  -b file\tCompare with the results of an earlier run\n"
+		"  -c file\tOnly measure the checksum speed over file on 1, "
+		"2, 4... threads\n"
+		"  -t percent\tChange counted as a regression (default %u)\n"
+		"  -s bytes\tImage size of the sessions (default %u)\n"
+		"  -p ms\t\tbwPollTimeout of the simulated device (default 0)\n"
+		"  -l us\t\tLatency of each request to it (default 0, or "
+		"%u in virtual time)\n"
+		"  -x bytes\tTransfer size (default %u)\n"
+		"  -n runs\tRuns of each benchmark, the best counts "
+		"(default %u)\n"
+		"  -v\t\tRun the sessions in virtual time, reporting the "
+		"modelled times\n", BENCH_THRESHOLD, BENCH_SIZE,
+		DFU_SIM_REQUEST_US, DFU_SIM_TRANSFER_SIZE, BENCH_RUNS);
+}
+
+static unsigned long _number(const char *arg, int opt)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(arg, &end, 0);
+	if (*end || end == arg) {
+		fprintf(stderr, "Bad number for -%c: %s\n", opt, arg);
+		exit(2);
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL, *baseline_name = NULL;
+	char *baseline = NULL;
+	double threshold = BENCH_THRESHOLD;
+	int c, ret = 1;
+
+	while ((c = getopt(argc, argv, "ho:b:c:t:s:p:l:x:n:v")) != -1) {
+		switch (c) {
+		case 'h':
+			help();
+			exit(0);
+		case 'o':
+			out = optarg;
+			break;
+		case 'b':
+			baseline_name = optarg;
+			break;
+		case 'c':
+			exit(bench_crc_file(optarg) < 0 ? 1 : 0);
+		case 't':
+			threshold = _number(optarg, c);
+			break;
+		case 's':
+			size = _number(optarg, c);
+			break;
+		case 'p':
+			poll_timeout = _number(optarg, c);
+			break;
+		case 'l':
+			latency = _number(optarg, c);
+			break;
+		case 'x':
+			xfer_size = _number(optarg, c);
+			break;
+		case 'n':
+			runs = _number(optarg, c);
+			break;
+		case 'v':
+			virtual_time = 1;
+			break;
+		default:
+			help();
+			exit(2);
+		}
+	}
+	if (!size || !xfer_size || xfer_size > 0xffff || !runs) {
+		fprintf(stderr, "Size, transfer size and runs must be "
+			"positive\n");
+		exit(2);
+	}
+	if (baseline_name) {
+		baseline = _read_file(baseline_name);
+		if (!baseline)
+			exit(1);
+	}
+
+	dfu_log_start(DFU_LOG_TEXT, DFU_LOG_WARN);
+
+	if (!mkdtemp(tmpdir)) {
+		perror(tmpdir);
+		goto out;
+	}
+	snprintf(image_name, sizeof(image_name), "%s/image.dfu", tmpdir);
+	snprintf(upload_name, sizeof(upload_name), "%s/upload.dfu", tmpdir);
+	if (_write_image(image_name, size) < 0)
+		goto out_rm;
+
+	printf("Image of %lu bytes, transfer size %u, bwPollTimeout %u ms, "
+	       "latency %u us, best of %u%s\n\n", (unsigned long)size,
+	       xfer_size, poll_timeout, latency, runs,
+	       virtual_time ? ", virtual time" : "");
+
+	bench_crc();
+	if (bench_sm() < 0 || bench_suffix() < 0)
+		goto out_rm;
+	dfu_clock_set_virtual(virtual_time);
+	if (bench_sessions() < 0)
+		goto out_rm;
+	dfu_clock_set_virtual(0);
+	dfu_log_flush();
+
+	if (out && write_json(out) < 0)
+		goto out_rm;
+	ret = print_results(baseline, baseline &&
+			    _check_params(baseline, baseline_name),
+			    threshold) ? 1 : 0;
+	if (ret)
+		printf("\nSlower than %s by more than %.0f%%\n",
+		       baseline_name, threshold);
+ out_rm:
+	unlink(upload_name);
+	unlink(image_name);
+	rmdir(tmpdir);
+ out:
+	dfu_log_stop();
+	free(baseline);
+	return ret;
+}
@@ -0,0 +1,315 @@
+/*
+ * dfu-util - persistent cache of image validation results
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Validating a DFU image means a CRC pass over the whole file. When
+ * the same image is flashed again and again, the result is looked up
+ * here instead. An entry is keyed by the file identity (device,
+ * inode, size, mtime and ctime in nanoseconds), and is only used if
+ * the DFU suffix currently in the file is still the one the CRC was
+ * computed for.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "dfu_cache.h"
+
+#define CACHE_HEADER "# dfu-util validation cache v1\n"
+
+struct cache_entry {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long size;
+	unsigned long long mtime_ns;
+	unsigned long long ctime_ns;
+	uint32_t crc;
+	unsigned char suffix[DFU_FILE_SUFFIX_SIZE];
+};
+
+static struct cache_entry cache_entries[DFU_CACHE_MAX_ENTRIES];
+static unsigned int cache_count;
+static int cache_loaded;
+static int cache_disabled;
+static char cache_file[4096];
+
+static unsigned int cache_hits;
+static unsigned int cache_misses;
+
+void dfu_cache_disable(void)
+{
+	cache_disabled = 1;
+}
+
+/**
+ * location of the cache: $DFU_UTIL_CACHE, or dfu-util/validate in
+ * $XDG_CACHE_HOME or ~/.cache
+ *
+ * @return the path, or NULL if caching is not possible
+ */
+const char *dfu_cache_path(void)
+{
+	const char *env;
+
+	if (cache_file[0])
+		return cache_file;
+
+	if ((env = getenv("DFU_UTIL_CACHE")) && *env)
+		snprintf(cache_file, sizeof(cache_file), "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		snprintf(cache_file, sizeof(cache_file),
+			 "%s/dfu-util/validate", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(cache_file, sizeof(cache_file),
+			 "%s/.cache/dfu-util/validate", env);
+	else
+		return NULL;
+
+	return cache_file;
+}
+
+static unsigned long long _ns(const struct timespec *ts)
+{
+	return (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void _entry_key(struct cache_entry *e, const struct stat *st)
+{
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_ns = _ns(&st->st_mtim);
+	e->ctime_ns = _ns(&st->st_ctim);
+}
+
+static int _hex_to_bytes(const char *hex, unsigned char *out, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned int v;
+
+		if (sscanf(hex + 2*i, "%2x", &v) != 1)
+			return -1;
+		out[i] = v;
+	}
+	return 0;
+}
+
+static void _load(void)
+{
+	char line[256];
+	const char *path;
+	FILE *f;
+
+	if (cache_loaded)
+		return;
+	cache_loaded = 1;
+
+	path = dfu_cache_path();
+	if (!path)
+		return;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	/* an unknown or damaged cache is simply ignored and rebuilt */
+	if (!fgets(line, sizeof(line), f) || strcmp(line, CACHE_HEADER))
+		goto out;
+
+	while (cache_count < DFU_CACHE_MAX_ENTRIES &&
+	       fgets(line, sizeof(line), f)) {
+		struct cache_entry *e = &cache_entries[cache_count];
+		char suffix_hex[2*DFU_FILE_SUFFIX_SIZE + 1];
+		unsigned int crc;
+
+		if (sscanf(line, "%llx %llx %llx %llx %llx %8x %32s",
+			   &e->dev, &e->ino, &e->size, &e->mtime_ns,
+			   &e->ctime_ns, &crc, suffix_hex) != 7 ||
+		    strlen(suffix_hex) != 2*DFU_FILE_SUFFIX_SIZE ||
+		    _hex_to_bytes(suffix_hex, e->suffix,
+				  DFU_FILE_SUFFIX_SIZE) < 0)
+			continue;
+
+		e->crc = crc;
+		cache_count++;
+	}
+
+ out:
+	fclose(f);
+}
+
+static int _mkdir_parents(const char *path)
+{
+	char dir[sizeof(cache_file)];
+	char *p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = dir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+/* write the cache to a temporary file, and atomically replace the
+   old one, so concurrent dfu-util runs never see a partial cache */
+static void _save(void)
+{
+	char tmp[sizeof(cache_file) + 32];
+	const char *path = dfu_cache_path();
+	unsigned int i;
+	FILE *f;
+
+	if (!path || _mkdir_parents(path) < 0)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fputs(CACHE_HEADER, f);
+	for (i = 0; i < cache_count; i++) {
+		struct cache_entry *e = &cache_entries[i];
+		int j;
+
+		fprintf(f, "%llx %llx %llx %llx %llx %08x ", e->dev, e->ino,
+			e->size, e->mtime_ns, e->ctime_ns, e->crc);
+		for (j = 0; j < DFU_FILE_SUFFIX_SIZE; j++)
+			fprintf(f, "%02x", e->suffix[j]);
+		fputc('\n', f);
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/**
+ * look up the CRC of the image described by @p st, whose DFU suffix
+ * is @p suffix (as read from the file, not converted)
+ *
+ * @return 1 and the CRC in @p calculated_crc on a hit, or 0
+ */
+int dfu_cache_lookup(const struct stat *st,
+		     const struct dfu_file_suffix *suffix,
+		     uint32_t *calculated_crc)
+{
+	struct cache_entry key;
+	unsigned int i;
+
+	if (cache_disabled)
+		return 0;
+
+	_load();
+	_entry_key(&key, st);
+
+	for (i = 0; i < cache_count; i++) {
+		struct cache_entry *e = &cache_entries[i];
+
+		if (e->dev != key.dev || e->ino != key.ino ||
+		    e->size != key.size || e->mtime_ns != key.mtime_ns ||
+		    e->ctime_ns != key.ctime_ns ||
+		    memcmp(e->suffix, suffix, DFU_FILE_SUFFIX_SIZE))
+			continue;
+
+		*calculated_crc = e->crc;
+		cache_hits++;
+
+		/* entries are kept in order of use, the last used last */
+		if (i < cache_count - 1) {
+			struct cache_entry hit = *e;
+
+			memmove(e, e + 1, (cache_count - i - 1) * sizeof(*e));
+			cache_entries[cache_count - 1] = hit;
+			_save();
+		}
+		return 1;
+	}
+
+	cache_misses++;
+	return 0;
+}
+
+/**
+ * remember the CRC computed for the image described by @p st. Any
+ * older entry for the same file is replaced.
+ */
+void dfu_cache_store(const struct stat *st,
+		     const struct dfu_file_suffix *suffix,
+		     uint32_t calculated_crc)
+{
+	struct cache_entry e;
+	unsigned int i;
+
+	if (cache_disabled)
+		return;
+
+	/* recently modified: a write in the same timestamp tick would
+	   keep the key, so don't trust it */
+	if (st->st_mtime + DFU_CACHE_RACY_SECONDS > time(NULL) ||
+	    st->st_ctime + DFU_CACHE_RACY_SECONDS > time(NULL))
+		return;
+
+	_load();
+	_entry_key(&e, st);
+	e.crc = calculated_crc;
+	memcpy(e.suffix, suffix, DFU_FILE_SUFFIX_SIZE);
+
+	/* drop the stale entry of this file, or the least recently used */
+	for (i = 0; i < cache_count; i++)
+		if (cache_entries[i].dev == e.dev &&
+		    cache_entries[i].ino == e.ino)
+			break;
+	if (i == cache_count && cache_count == DFU_CACHE_MAX_ENTRIES)
+		i = 0;
+	if (i < cache_count) {
+		memmove(&cache_entries[i], &cache_entries[i+1],
+			(cache_count - i - 1) * sizeof(e));
+		cache_count--;
+	}
+
+	cache_entries[cache_count++] = e;
+	_save();
+}
+
+void dfu_cache_print_stats(void)
+{
+	unsigned int lookups = cache_hits + cache_misses;
+
+	if (!lookups)
+		return;
+
+	printf("Validation cache: %u hit(s), %u miss(es), hit rate %u%%\n",
+	       cache_hits, cache_misses, cache_hits * 100 / lookups);
+}
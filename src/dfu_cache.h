@@ -0,0 +1,49 @@
+/*
+ * dfu-util - persistent cache of image validation results
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_CACHE_H
+#define _DFU_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "usb_dfu.h"
+
+/* number of images remembered; the least recently used one is dropped */
+#define DFU_CACHE_MAX_ENTRIES 256
+
+/* files modified less than this many seconds ago are not cached, as a
+   further change within the timestamp granularity would go unnoticed */
+#define DFU_CACHE_RACY_SECONDS 2
+
+void dfu_cache_disable(void);
+const char *dfu_cache_path(void);
+
+int dfu_cache_lookup(const struct stat *st,
+		     const struct dfu_file_suffix *suffix,
+		     uint32_t *calculated_crc);
+void dfu_cache_store(const struct stat *st,
+		     const struct dfu_file_suffix *suffix,
+		     uint32_t calculated_crc);
+
+void dfu_cache_print_stats(void);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * dfu-util - clock
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <time.h>
+#include <errno.h>
+
+#include "dfu_clock.h"
+
+static int _virtual;
+/* us, CLOCK_MONOTONIC when virtual time began, plus all waits since */
+static unsigned long long _virtual_now;
+
+static unsigned long long _real_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long long dfu_clock_us(void)
+{
+	if (__atomic_load_n(&_virtual, __ATOMIC_ACQUIRE))
+		return __atomic_load_n(&_virtual_now, __ATOMIC_ACQUIRE);
+	return _real_us();
+}
+
+unsigned long long dfu_clock_ms(void)
+{
+	return dfu_clock_us() / 1000;
+}
+
+/**
+ * wait @p us microseconds. In virtual time, only the clock moves on.
+ * Waits of several threads add up, as if they were taken in turn.
+ */
+void dfu_clock_sleep_us(unsigned long long us)
+{
+	struct timespec ts;
+
+	if (__atomic_load_n(&_virtual, __ATOMIC_ACQUIRE)) {
+		__atomic_fetch_add(&_virtual_now, us, __ATOMIC_ACQ_REL);
+		return;
+	}
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+void dfu_clock_sleep_ms(unsigned int ms)
+{
+	dfu_clock_sleep_us((unsigned long long)ms * 1000);
+}
+
+/**
+ * switch virtual time on or off. Virtual time starts at the real time,
+ * so that stamps taken before stay in order. Switch it before any
+ * transfer starts.
+ */
+void dfu_clock_set_virtual(int on)
+{
+	if (on)
+		__atomic_store_n(&_virtual_now, _real_us(), __ATOMIC_RELEASE);
+	__atomic_store_n(&_virtual, on != 0, __ATOMIC_RELEASE);
+}
+
+int dfu_clock_is_virtual(void)
+{
+	return __atomic_load_n(&_virtual, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,42 @@
+/*
+ * dfu-util - clock
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_CLOCK_H
+#define _DFU_CLOCK_H
+
+/**
+ * The clock transfers are timed and waited by. Normally that is
+ * CLOCK_MONOTONIC. In virtual time, waiting takes no time at all; the
+ * clock is moved on by the time waited instead, so that sessions with
+ * simulated devices run as fast as the host can compute them, and
+ * still report how long they would have taken. The time spent
+ * computing isn't counted in virtual time.
+ */
+
+unsigned long long dfu_clock_us(void);
+unsigned long long dfu_clock_ms(void);
+void dfu_clock_sleep_us(unsigned long long us);
+void dfu_clock_sleep_ms(unsigned int ms);
+
+void dfu_clock_set_virtual(int on);
+int dfu_clock_is_virtual(void);
+
+#endif
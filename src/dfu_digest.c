@@ -0,0 +1,149 @@
+/*
+ * dfu-util - digests of the transferred firmware
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Besides the CRC of the DFU suffix, the firmware can be hashed with
+ * SHA-256 and BLAKE3 while it is transferred, so a dump or a golden
+ * image doesn't need to be read once more to audit it. Only the
+ * firmware is hashed, not the suffix. The digests are printed at the
+ * end of a transfer and appended to an export file in the tagged
+ * format of "sha256sum --tag".
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dfu_digest.h"
+
+static const struct {
+	const char *name;	/* on the command line */
+	const char *tag;	/* in the export file */
+	const char *label;	/* printed */
+	unsigned int alg;
+} _algs[] = {
+	{ "sha256", "SHA256", "SHA-256", DFU_DIGEST_SHA256 },
+	{ "blake3", "BLAKE3", "BLAKE3", DFU_DIGEST_BLAKE3 },
+};
+
+#define NUM_ALGS	(sizeof(_algs) / sizeof(_algs[0]))
+
+/* where digests are appended to, or NULL */
+static const char *_export_path;
+
+/**
+ * parse a comma separated list of algorithm names like "sha256,blake3"
+ *
+ * @return 0, or < 0 if a name is unknown
+ */
+int dfu_digest_parse(const char *str, unsigned int *algs)
+{
+	*algs = 0;
+
+	while (*str) {
+		size_t len = strcspn(str, ",");
+		unsigned int i;
+
+		for (i = 0; i < NUM_ALGS; i++)
+			if (strlen(_algs[i].name) == len &&
+			    !strncmp(str, _algs[i].name, len))
+				break;
+		if (i == NUM_ALGS)
+			return -1;
+
+		*algs |= _algs[i].alg;
+		str += len;
+		if (*str)
+			str++;
+	}
+
+	return *algs ? 0 : -1;
+}
+
+void dfu_digest_set_export(const char *path)
+{
+	_export_path = path;
+}
+
+void dfu_digest_init(struct dfu_digest *d, unsigned int algs)
+{
+	d->algs = algs;
+	if (algs & DFU_DIGEST_SHA256)
+		sha256_init(&d->sha256);
+	if (algs & DFU_DIGEST_BLAKE3)
+		blake3_init(&d->blake3);
+}
+
+/* hash the next @p len bytes of firmware. @p d may be NULL. */
+void dfu_digest_update(struct dfu_digest *d, const void *data, size_t len)
+{
+	if (!d)
+		return;
+	if (d->algs & DFU_DIGEST_SHA256)
+		sha256_update(&d->sha256, data, len);
+	if (d->algs & DFU_DIGEST_BLAKE3)
+		blake3_update(&d->blake3, data, len);
+}
+
+/**
+ * finish the digests of the firmware @p name, print them and append
+ * them to the export file. @p d may be NULL.
+ *
+ * @return 0, or < 0 if they can't be exported
+ */
+int dfu_digest_report(struct dfu_digest *d, const char *name)
+{
+	char hex[NUM_ALGS][2 * SHA256_DIGEST_SIZE + 1];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	unsigned int i, j;
+	FILE *f;
+
+	if (!d)
+		return 0;
+
+	for (i = 0; i < NUM_ALGS; i++) {
+		if (!(d->algs & _algs[i].alg))
+			continue;
+		if (_algs[i].alg == DFU_DIGEST_SHA256)
+			sha256_final(&d->sha256, digest);
+		else
+			blake3_final(&d->blake3, digest);
+		for (j = 0; j < sizeof(digest); j++)
+			sprintf(hex[i] + 2*j, "%02x", digest[j]);
+
+		printf("Firmware %s\t%s\n", _algs[i].label, hex[i]);
+	}
+
+	if (!_export_path)
+		return 0;
+
+	f = fopen(_export_path, "a");
+	if (!f) {
+		perror(_export_path);
+		return -1;
+	}
+	for (i = 0; i < NUM_ALGS; i++)
+		if (d->algs & _algs[i].alg)
+			fprintf(f, "%s (%s) = %s\n", _algs[i].tag, name, hex[i]);
+	if (fclose(f) != 0) {
+		perror(_export_path);
+		return -1;
+	}
+	return 0;
+}
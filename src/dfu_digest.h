@@ -0,0 +1,46 @@
+/*
+ * dfu-util - digests of the transferred firmware
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_DIGEST_H
+#define _DFU_DIGEST_H
+
+#include <stddef.h>
+
+#include "sha256.h"
+#include "blake3.h"
+
+#define DFU_DIGEST_SHA256	0x0001
+#define DFU_DIGEST_BLAKE3	0x0002
+
+/* the digests taken of one firmware */
+struct dfu_digest {
+	unsigned int algs;
+	struct sha256 sha256;
+	struct blake3 blake3;
+};
+
+int dfu_digest_parse(const char *str, unsigned int *algs);
+void dfu_digest_set_export(const char *path);
+
+void dfu_digest_init(struct dfu_digest *d, unsigned int algs);
+void dfu_digest_update(struct dfu_digest *d, const void *data, size_t len);
+int dfu_digest_report(struct dfu_digest *d, const char *name);
+
+#endif
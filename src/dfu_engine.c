@@ -0,0 +1,1309 @@
+/*
+ * dfu-util - single threaded download engine for many devices
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every device is a resumable state machine: a step issues one control
+ * request and returns, and the device is advanced again once that
+ * request completed or its bwPollTimeout has passed. The DFU states
+ * are tracked with the dfu_sm_* functions, just like the synchronous
+ * dfu_* calls do.
+ *
+ * libusb-0.1 only has synchronous control transfers, so USB devices
+ * are driven through their own usbfs file descriptor with asynchronous
+ * URBs; completions are signalled by epoll. All waits, and the timeouts
+ * of requests in flight, are kept on a single timer wheel. Devices
+ * ready to continue are served round robin, one request each.
+ *
+ * Devices only start once their bus and hub have room, see dfu_sched.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_LINUX_USBDEVICE_FS_H)
+#define DFU_ENGINE
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/usbdevice_fs.h>
+#endif
+
+#include "dfu.h"
+#include "dfu_sm.h"
+#include "usb_dfu.h"
+#include "dfu_quirks.h"
+#include "dfu_profile.h"
+#include "dfu_engine.h"
+#include "dfu_clock.h"
+#include "dfu_sched.h"
+#include "dfu_progress.h"
+#include "dfu_log.h"
+
+#ifdef DFU_ENGINE
+
+/* length of a control SETUP packet, preceding the data in usbfs */
+#define SETUP_SIZE 8
+
+enum engine_step {
+	STEP_START,
+	STEP_STATUS,		/* bring the device to dfuIDLE */
+	STEP_CLRSTATUS,
+	STEP_ABORT,
+	STEP_FUNC_DESC,
+	STEP_DNLOAD,
+	STEP_DNLOAD_STATUS,
+	STEP_DNLOAD_POLL,	/* waiting for bwPollTimeout */
+	STEP_ZLP,
+	STEP_MANIFEST_STATUS,
+	STEP_MANIFEST_POLL,
+	STEP_DONE,
+};
+
+struct engine_timer {
+	struct engine_timer *prev, *next;
+	unsigned long long due;
+	int armed;
+};
+
+struct engine_dev;
+
+struct engine_transport {
+	int (*submit)(struct dfu_engine *e, struct engine_dev *d);
+	void (*reap)(struct dfu_engine *e, struct engine_dev *d);
+	void (*cancel)(struct dfu_engine *e, struct engine_dev *d);
+	void (*reset)(struct engine_dev *d);
+	void (*close)(struct dfu_engine *e, struct engine_dev *d);
+};
+
+struct engine_dev {
+	char name[40];
+	dfu_handle handle;
+	const struct engine_transport *tp;
+	int fd;
+	struct dfu_sim *sim;
+	struct usbdevfs_urb urb;
+
+	/* SETUP packet followed by the data stage */
+	unsigned char *buf;
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wLength;
+	const unsigned char *out;
+	unsigned int timeout;		/* of the request in flight, ms */
+	unsigned int timeout_first;	/* of its first attempt */
+	unsigned int timeout_spent;	/* by the attempts that timed out */
+	int result;
+	int in_flight;
+
+	const struct dfu_image *image;	/* downloaded to this device */
+	unsigned char *block;		/* of a loaded image, or NULL */
+	enum engine_step step;
+	int next_state;
+	unsigned int transfer_size;
+	size_t offset;
+	unsigned int cur_len;
+	struct dfu_status status;
+	struct engine_timer timer;
+
+	struct engine_dev *ready_next;
+	int queued;
+
+	/* scheduling groups, and whether the device was started */
+	int bus;
+	int hub;
+	int admitted;
+	char port[32];			/* position in the hub tree */
+
+	/* statistics */
+	int result_code;
+	unsigned int requests;
+	unsigned int polls;
+	unsigned long long poll_wait;
+	unsigned long long submitted;
+	unsigned long long max_latency;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+struct dfu_engine {
+	const struct dfu_image *image;
+	int epfd;
+
+	struct engine_dev **devs;
+	int count;
+	int alloc;
+	int active;
+
+	struct engine_dev *ready_head, *ready_tail;
+	struct dfu_sched sched;
+
+	struct engine_timer wheel[DFU_ENGINE_WHEEL_SLOTS];
+	unsigned long long tick;
+	unsigned int timers;
+
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long long loops;
+	unsigned long long wakeups;
+
+	dfu_engine_progress_cb progress;
+	void *progress_user;
+	unsigned long long progress_last;
+	unsigned long long bytes;
+	struct dfu_progress *meter;
+};
+
+/* timer wheel */
+
+static void _timer_del(struct dfu_engine *e, struct engine_timer *t)
+{
+	if (!t->armed)
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->armed = 0;
+	e->timers--;
+}
+
+static void _timer_add(struct dfu_engine *e, struct engine_timer *t,
+		       unsigned long long due)
+{
+	struct engine_timer *slot = &e->wheel[due % DFU_ENGINE_WHEEL_SLOTS];
+
+	_timer_del(e, t);
+	t->due = due;
+	t->next = slot;
+	t->prev = slot->prev;
+	slot->prev->next = t;
+	slot->prev = t;
+	t->armed = 1;
+	e->timers++;
+}
+
+static void _ready(struct dfu_engine *e, struct engine_dev *d)
+{
+	if (d->queued)
+		return;
+	d->queued = 1;
+	d->ready_next = NULL;
+	if (e->ready_tail)
+		e->ready_tail->ready_next = d;
+	else
+		e->ready_head = d;
+	e->ready_tail = d;
+}
+
+static void _timer_fire(struct dfu_engine *e, struct engine_dev *d);
+
+/* fire all timers due up to @p now */
+static void _wheel_advance(struct dfu_engine *e, unsigned long long now)
+{
+	unsigned long long t = e->tick;
+
+	if (!e->timers) {
+		e->tick = now + 1;
+		return;
+	}
+
+	/* one round covers every slot */
+	if (now >= t + DFU_ENGINE_WHEEL_SLOTS)
+		t = now - DFU_ENGINE_WHEEL_SLOTS + 1;
+
+	for (; t <= now; t++) {
+		struct engine_timer *slot = &e->wheel[t % DFU_ENGINE_WHEEL_SLOTS];
+		struct engine_timer *tm, *next;
+
+		for (tm = slot->next; tm != slot; tm = next) {
+			next = tm->next;
+			if (tm->due > now)
+				continue;
+			_timer_del(e, tm);
+			_timer_fire(e, (struct engine_dev *)
+				    ((char *) tm - offsetof(struct engine_dev, timer)));
+		}
+	}
+	e->tick = now + 1;
+}
+
+/* milliseconds until the next timer is due, or -1 */
+static int _wheel_timeout(struct dfu_engine *e, unsigned long long now)
+{
+	unsigned int i;
+
+	if (!e->timers)
+		return -1;
+
+	for (i = 0; i < DFU_ENGINE_WHEEL_SLOTS; i++) {
+		unsigned long long t = e->tick + i;
+		struct engine_timer *slot = &e->wheel[t % DFU_ENGINE_WHEEL_SLOTS];
+		struct engine_timer *tm;
+
+		for (tm = slot->next; tm != slot; tm = tm->next)
+			if (tm->due <= t)
+				return t > now ? t - now : 0;
+	}
+
+	/* nothing within one round */
+	return DFU_ENGINE_WHEEL_SLOTS;
+}
+
+/* scheduling */
+
+/* start waiting devices, least loaded links first, while there's room */
+static void _admit(struct dfu_engine *e)
+{
+	for (;;) {
+		struct engine_dev *best = NULL;
+		unsigned int best_load = UINT_MAX;
+		int i;
+
+		for (i = 0; i < e->count; i++) {
+			struct engine_dev *d = e->devs[i];
+			unsigned int load;
+
+			if (d->admitted || d->step == STEP_DONE ||
+			    !dfu_sched_may_start(&e->sched, d->bus, d->hub))
+				continue;
+			load = dfu_sched_load(&e->sched, d->bus, d->hub);
+			if (load < best_load) {
+				best = d;
+				best_load = load;
+			}
+		}
+		if (!best)
+			return;
+
+		best->admitted = 1;
+		dfu_progress_begin(best->handle.progress, best->image->size, 0);
+		dfu_sched_start(&e->sched, best->bus, best->hub, dfu_clock_ms());
+		_ready(e, best);
+	}
+}
+
+/* device steps */
+
+static void _finish(struct dfu_engine *e, struct engine_dev *d, int result)
+{
+	_timer_del(e, &d->timer);
+	d->step = STEP_DONE;
+	d->result_code = result;
+	d->end = dfu_clock_ms();
+	dfu_progress_end(d->handle.progress, result == 0);
+	if (d->tp->close)
+		d->tp->close(e, d);
+	e->active--;
+
+	/* a request timing out is taken as a sign of a congested link */
+	dfu_sched_stop(&e->sched, d->bus, d->hub, d->end,
+		       result < 0 && d->result == -ETIMEDOUT);
+	_admit(e);
+}
+
+static void _fail(struct dfu_engine *e, struct engine_dev *d, const char *msg)
+{
+	dfu_log(DFU_LOG_ERROR, d->name, "%s (state %s)", msg,
+		dfu_state_to_string(dfu_sm_get_state(&d->handle)));
+	_finish(e, d, -1);
+}
+
+/* DFU requests, as opposed to standard ones like GET_DESCRIPTOR */
+static int _is_class_request(uint8_t bmRequestType)
+{
+	return (bmRequestType & (0x03 << 5)) == USB_TYPE_CLASS;
+}
+
+static void _complete(struct dfu_engine *e, struct engine_dev *d, int result)
+{
+	unsigned long long latency = dfu_clock_ms() - d->submitted;
+
+	if (latency > d->max_latency)
+		d->max_latency = latency;
+	if (_is_class_request(d->bmRequestType))
+		dfu_request_done(&d->handle, d->bRequest, d->wLength,
+				 latency * 1000, result == -ETIMEDOUT);
+	_timer_del(e, &d->timer);
+	d->in_flight = 0;
+	d->result = result;
+	_ready(e, d);
+}
+
+/* send the request set up in @p d, timing out after @p timeout ms */
+static void _submit(struct dfu_engine *e, struct engine_dev *d,
+		    unsigned int timeout)
+{
+	int ret;
+
+	d->requests++;
+	d->submitted = dfu_clock_ms();
+	d->in_flight = 1;
+	d->timeout = timeout;
+	_timer_add(e, &d->timer, d->submitted + timeout);
+
+	ret = d->tp->submit(e, d);
+	if (ret < 0) {
+		d->in_flight = 0;
+		_timer_del(e, &d->timer);
+		d->result = ret;
+		_ready(e, d);
+	}
+}
+
+static void _timer_fire(struct dfu_engine *e, struct engine_dev *d)
+{
+	unsigned int timeout = 0;
+
+	if (d->in_flight) {
+		/* the request timed out */
+		d->tp->cancel(e, d);
+		d->timeout_spent += d->timeout;
+		if (_is_class_request(d->bmRequestType))
+			timeout = dfu_request_retry(&d->handle, d->bRequest,
+						    d->wLength,
+						    d->timeout_first,
+						    d->timeout_spent);
+		if (timeout) {
+			/* ask again */
+			dfu_request_done(&d->handle, d->bRequest, d->wLength,
+					 d->timeout * 1000ULL, 1);
+			_submit(e, d, timeout);
+			return;
+		}
+		_complete(e, d, -ETIMEDOUT);
+		return;
+	}
+	_ready(e, d);
+}
+
+static void _request(struct dfu_engine *e, struct engine_dev *d,
+		     enum engine_step step, uint8_t bmRequestType,
+		     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		     const unsigned char *out, uint16_t wLength)
+{
+	unsigned int timeout = d->handle.usb_timeout;
+	unsigned char *setup = d->buf;
+
+	setup[0] = bmRequestType;
+	setup[1] = bRequest;
+	setup[2] = wValue & 0xff;
+	setup[3] = wValue >> 8;
+	setup[4] = wIndex & 0xff;
+	setup[5] = wIndex >> 8;
+	setup[6] = wLength & 0xff;
+	setup[7] = wLength >> 8;
+
+	d->step = step;
+	d->bmRequestType = bmRequestType;
+	d->bRequest = bRequest;
+	d->wLength = wLength;
+	d->out = out;
+
+	/* usbfs URBs have no timeout of their own */
+	if (_is_class_request(bmRequestType))
+		timeout = dfu_request_timeout(&d->handle, bRequest, wLength);
+	d->timeout_first = timeout;
+	d->timeout_spent = 0;
+	_submit(e, d, timeout);
+}
+
+static void _dfu_request(struct dfu_engine *e, struct engine_dev *d,
+			 enum engine_step step, int dir, uint8_t bRequest,
+			 uint16_t wValue, const unsigned char *out,
+			 uint16_t wLength)
+{
+	_request(e, d, step, dir | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+		 bRequest, wValue, d->handle.interface, out, wLength);
+}
+
+static void _get_status(struct dfu_engine *e, struct engine_dev *d,
+			enum engine_step step)
+{
+	if (!dfu_sm_state_has_event(&d->handle, DFU_EV_GETSTATUS)) {
+		_fail(e, d, "GETSTATUS not allowed");
+		return;
+	}
+	_dfu_request(e, d, step, USB_ENDPOINT_IN, USB_REQ_DFU_GETSTATUS, 0,
+		     NULL, 6);
+}
+
+/* evaluate a completed GETSTATUS, and follow the device's state */
+static int _status_done(struct engine_dev *d, int checked)
+{
+	const unsigned char *buf = d->buf + SETUP_SIZE;
+
+	if (d->result != 6)
+		return -1;
+
+	d->status.bStatus = buf[0];
+	d->status.bwPollTimeout = buf[1] | (buf[2] << 8) | (buf[3] << 16);
+	d->status.bState = buf[4];
+	d->status.iString = buf[5];
+
+	if (!checked) {
+		dfu_sm_set_state_unchecked(&d->handle, d->status.bState);
+		return 0;
+	}
+	return dfu_sm_set_state_checked(&d->handle, d->status.bState);
+}
+
+static void _wait(struct dfu_engine *e, struct engine_dev *d,
+		  enum engine_step step, unsigned int timeout, int guards)
+{
+	d->next_state = dfu_sm_get_next_state(&d->handle,
+					      DFU_EV_STATUS_POLL_TIMEOUT,
+					      guards);
+	if (d->next_state < 0) {
+		_fail(e, d, "can't wait for bwPollTimeout");
+		return;
+	}
+	d->step = step;
+	d->polls++;
+	d->poll_wait += timeout;
+	/* the wheel's granularity would make it a millisecond */
+	if (!timeout)
+		_ready(e, d);
+	else
+		_timer_add(e, &d->timer, dfu_clock_ms() + timeout);
+}
+
+static void _dnload_next(struct dfu_engine *e, struct engine_dev *d)
+{
+	const struct dfu_image *img = d->image;
+	dfu_handle *h = &d->handle;
+	int guards = 0;
+
+	if (h->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
+		guards |= DFU_GUARD_BIT_CAN_DNLOAD;
+
+	if (d->offset < img->size) {
+		/* the rest of a large image doesn't fit cur_len */
+		d->cur_len = d->transfer_size;
+		if (img->size - d->offset < d->transfer_size)
+			d->cur_len = img->size - d->offset;
+		guards |= DFU_GUARD_WLENGTH_GT_ZERO;
+	} else
+		d->cur_len = 0;
+
+	d->next_state = dfu_sm_get_next_state(h, DFU_EV_DNLOAD, guards);
+	if (d->next_state < 0) {
+		_fail(e, d, "DNLOAD not allowed");
+		return;
+	}
+
+	/* blocks of loaded images are built here, one at a time */
+	if (!img->data && !d->block) {
+		d->block = malloc(d->transfer_size);
+		if (!d->block) {
+			_fail(e, d, "no memory for a block");
+			return;
+		}
+	}
+
+	_dfu_request(e, d, d->cur_len ? STEP_DNLOAD : STEP_ZLP,
+		     USB_ENDPOINT_OUT, USB_REQ_DFU_DNLOAD, h->transaction++,
+		     d->cur_len ? dfu_image_block(img, d->offset, d->cur_len,
+						  d->block) : NULL,
+		     d->cur_len);
+}
+
+static void _func_desc_done(struct dfu_engine *e, struct engine_dev *d)
+{
+	dfu_handle *h = &d->handle;
+	unsigned int page_size = getpagesize();
+
+	if (d->result < 0) {
+		if (!dfu_quirk_is_set(&h->quirk_flags,
+				      QUIRK_IGNORE_INVALID_FUNCTIONAL_DESCRIPTOR)) {
+			_fail(e, d, "error obtaining DFU functional descriptor");
+			return;
+		}
+		h->func_dfu.bmAttributes = USB_DFU_CAN_DOWNLOAD |
+			USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL;
+		h->func_dfu.bcdDFUVersion = USB_DFU_VER_1_0;
+		if (!d->transfer_size)
+			d->transfer_size = page_size;
+	} else {
+		memcpy(&h->func_dfu, d->buf + SETUP_SIZE,
+		       d->result < sizeof(h->func_dfu) ?
+		       d->result : sizeof(h->func_dfu));
+		if (!d->transfer_size)
+			d->transfer_size = dfu_transfer_size(h);
+	}
+
+	if (d->transfer_size > page_size)
+		d->transfer_size = page_size;
+	if (!d->transfer_size) {
+		_fail(e, d, "device reports a transfer size of 0");
+		return;
+	}
+
+	/* quirk overwriting DFU version */
+	if (dfu_quirk_is_set(&h->quirk_flags, QUIRK_FORCE_DFU_VERSION_1_0))
+		h->func_dfu.bcdDFUVersion = USB_DFU_VER_1_0;
+	else if (dfu_quirk_is_set(&h->quirk_flags, QUIRK_FORCE_DFU_VERSION_1_1))
+		h->func_dfu.bcdDFUVersion = USB_DFU_VER_1_1;
+	h->dfu_ver = h->func_dfu.bcdDFUVersion == USB_DFU_VER_1_1 ?
+		DFU_VERSION_1_1 : DFU_VERSION_1_0;
+
+	d->start = dfu_clock_ms();
+	_dnload_next(e, d);
+}
+
+static void _manifest_done(struct dfu_engine *e, struct engine_dev *d)
+{
+	dfu_handle *h = &d->handle;
+
+	switch (dfu_sm_get_state(h)) {
+	case DFU_STATE_dfuIDLE:
+		if (!(h->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL))
+			dfu_log(DFU_LOG_WARN, d->name,
+				"WARNING: expected state dfuMANIFEST_WAIT_RESET but new state is dfuIDLE");
+		break;
+	case DFU_STATE_dfuMANIFEST_WAIT_RESET:
+		if (h->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
+			dfu_log(DFU_LOG_WARN, d->name,
+				"WARNING: expected state dfuIDLE but new state is dfuMANIFEST_WAIT_RESET");
+		d->tp->reset(d);
+		break;
+	default:
+		dfu_log(DFU_LOG_WARN, d->name,
+			"Unexpected device state %s while doing manifestation.",
+			dfu_state_to_string(dfu_sm_get_state(h)));
+		break;
+	}
+	_finish(e, d, 0);
+}
+
+/* continue a device whose request completed or whose wait is over */
+static void _advance(struct dfu_engine *e, struct engine_dev *d)
+{
+	dfu_handle *h = &d->handle;
+	unsigned int timeout;
+
+	switch (d->step) {
+	case STEP_START:
+		_get_status(e, d, STEP_STATUS);
+		break;
+
+	case STEP_STATUS:
+		if (_status_done(d, 0) < 0) {
+			_fail(e, d, "error get_status");
+			break;
+		}
+		switch (d->status.bState) {
+		case DFU_STATE_dfuIDLE:
+			/* Obtain DFU functional descriptor */
+			_request(e, d, STEP_FUNC_DESC, USB_ENDPOINT_IN,
+				 USB_REQ_GET_DESCRIPTOR, 0x2100 | h->interface,
+				 0, NULL, sizeof(h->func_dfu));
+			break;
+		case DFU_STATE_dfuERROR:
+			d->next_state = dfu_sm_get_next_state(h, DFU_EV_CLRSTATUS, 0);
+			_dfu_request(e, d, STEP_CLRSTATUS, USB_ENDPOINT_OUT,
+				     USB_REQ_DFU_CLRSTATUS, 0, NULL, 0);
+			break;
+		case DFU_STATE_dfuDNLOAD_IDLE:
+		case DFU_STATE_dfuUPLOAD_IDLE:
+			d->next_state = dfu_sm_get_next_state(h, DFU_EV_ABORT, 0);
+			_dfu_request(e, d, STEP_ABORT, USB_ENDPOINT_OUT,
+				     USB_REQ_DFU_ABORT, 0, NULL, 0);
+			break;
+		default:
+			_fail(e, d, "device is not in DFU mode");
+			break;
+		}
+		break;
+
+	case STEP_CLRSTATUS:
+	case STEP_ABORT:
+		if (d->result < 0 || d->next_state < 0 ||
+		    dfu_sm_set_state_checked(h, d->next_state) < 0) {
+			_fail(e, d, "can't return to dfuIDLE");
+			break;
+		}
+		_get_status(e, d, STEP_STATUS);
+		break;
+
+	case STEP_FUNC_DESC:
+		_func_desc_done(e, d);
+		break;
+
+	case STEP_DNLOAD:
+		if (d->result < 0 ||
+		    dfu_sm_set_state_checked(h, d->next_state) < 0) {
+			_fail(e, d, "Error during download");
+			break;
+		}
+		d->cur_len = d->result;
+		_get_status(e, d, STEP_DNLOAD_STATUS);
+		break;
+
+	case STEP_DNLOAD_STATUS:
+		if (_status_done(d, 1) < 0) {
+			_fail(e, d, "Error during download get_status");
+			break;
+		}
+		if (dfu_sm_get_state(h) == DFU_STATE_dfuDNBUSY) {
+			timeout = dfu_poll_timeout(h, &d->status);
+			_wait(e, d, STEP_DNLOAD_POLL, timeout, 0);
+			break;
+		}
+		if (d->status.bState == DFU_STATE_dfuERROR ||
+		    (d->status.bState == DFU_STATE_dfuDNLOAD_IDLE &&
+		     d->status.bStatus != DFU_STATUS_OK)) {
+			dfu_log(DFU_LOG_ERROR, d->name, "status(%u) = %s",
+				d->status.bStatus,
+				dfu_status_to_string(d->status.bStatus));
+			_fail(e, d, "download failed");
+			break;
+		}
+		if (d->status.bState != DFU_STATE_dfuDNLOAD_IDLE) {
+			_get_status(e, d, STEP_DNLOAD_STATUS);
+			break;
+		}
+		d->offset += d->cur_len;
+		dfu_sched_account(&e->sched, d->bus, d->hub, d->cur_len);
+		e->bytes += d->cur_len;
+		dfu_progress_add(d->handle.progress, d->cur_len);
+		_dnload_next(e, d);
+		break;
+
+	case STEP_DNLOAD_POLL:
+		if (dfu_sm_set_state_checked(h, d->next_state) < 0) {
+			_fail(e, d, "illegal state after bwPollTimeout");
+			break;
+		}
+		_get_status(e, d, STEP_DNLOAD_STATUS);
+		break;
+
+	case STEP_ZLP:
+		/* like the synchronous download, ignore errors here
+		   and let the status tell */
+		if (d->result >= 0)
+			dfu_sm_set_state_checked(h, d->next_state);
+		_get_status(e, d, STEP_MANIFEST_STATUS);
+		break;
+
+	case STEP_MANIFEST_STATUS:
+		if (_status_done(d, 1) < 0) {
+			_fail(e, d, "unable to read DFU status");
+			break;
+		}
+		if (dfu_sm_get_state(h) == DFU_STATE_dfuMANIFEST) {
+			timeout = dfu_poll_timeout(h, &d->status);
+			_wait(e, d, STEP_MANIFEST_POLL, timeout,
+			      h->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL ?
+			      DFU_GUARD_BIT_MANIFESTATION_TOLERANT : 0);
+			break;
+		}
+		_manifest_done(e, d);
+		break;
+
+	case STEP_MANIFEST_POLL:
+		if (dfu_sm_set_state_checked(h, d->next_state) < 0) {
+			_fail(e, d, "illegal state after manifestation");
+			break;
+		}
+		if (dfu_sm_get_state(h) == DFU_STATE_dfuMANIFEST_SYNC)
+			_get_status(e, d, STEP_MANIFEST_STATUS);
+		else
+			_manifest_done(e, d);
+		break;
+
+	case STEP_DONE:
+		break;
+	}
+}
+
+/* usbfs transport */
+
+static int _usbfs_submit(struct dfu_engine *e, struct engine_dev *d)
+{
+	/* usbfs wants the data right behind the SETUP packet */
+	if (!(d->bmRequestType & USB_ENDPOINT_IN) && d->wLength)
+		memcpy(d->buf + SETUP_SIZE, d->out, d->wLength);
+
+	memset(&d->urb, 0, sizeof(d->urb));
+	d->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+	d->urb.endpoint = 0;
+	d->urb.buffer = d->buf;
+	d->urb.buffer_length = SETUP_SIZE + d->wLength;
+	d->urb.usercontext = d;
+
+	if (ioctl(d->fd, USBDEVFS_SUBMITURB, &d->urb) < 0)
+		return -errno;
+	return 0;
+}
+
+static void _usbfs_reap(struct dfu_engine *e, struct engine_dev *d)
+{
+	struct usbdevfs_urb *urb;
+
+	while (ioctl(d->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+		if (!d->in_flight || urb != &d->urb)
+			continue;
+		_complete(e, d, urb->status < 0 ? urb->status :
+			  urb->actual_length);
+	}
+
+	/* device gone */
+	if (errno == ENODEV && d->in_flight)
+		_complete(e, d, -ENODEV);
+}
+
+static void _usbfs_cancel(struct dfu_engine *e, struct engine_dev *d)
+{
+	struct usbdevfs_urb *urb;
+
+	if (ioctl(d->fd, USBDEVFS_DISCARDURB, &d->urb) == 0)
+		ioctl(d->fd, USBDEVFS_REAPURB, &urb);
+}
+
+static void _usbfs_reset(struct engine_dev *d)
+{
+	if (ioctl(d->fd, USBDEVFS_RESET, NULL) < 0 && errno != ENODEV)
+		dfu_log(DFU_LOG_ERROR, d->name, "USB reset failed: %s",
+			strerror(errno));
+}
+
+static void _usbfs_close(struct dfu_engine *e, struct engine_dev *d)
+{
+	unsigned int interface = d->handle.interface;
+
+	if (d->fd < 0)
+		return;
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, d->fd, NULL);
+	ioctl(d->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	close(d->fd);
+	d->fd = -1;
+}
+
+static const struct engine_transport _usbfs_transport = {
+	.submit = _usbfs_submit,
+	.reap = _usbfs_reap,
+	.cancel = _usbfs_cancel,
+	.reset = _usbfs_reset,
+	.close = _usbfs_close,
+};
+
+/* simulated devices answer at once, if at all */
+
+static int _sim_submit(struct dfu_engine *e, struct engine_dev *d)
+{
+	unsigned char *data = d->buf + SETUP_SIZE;
+	int ret;
+
+	/* OUT data is passed on without a copy */
+	if (!(d->bmRequestType & USB_ENDPOINT_IN) && d->wLength)
+		data = (unsigned char *) d->out;
+
+	ret = dfu_sim_control(d->sim, d->bmRequestType, d->bRequest,
+			      d->buf[2] | (d->buf[3] << 8),
+			      d->buf[4] | (d->buf[5] << 8), data, d->wLength);
+	/* a hung device never answers; the request timer fires */
+	if (ret != -ETIMEDOUT)
+		_complete(e, d, ret);
+	return 0;
+}
+
+static void _sim_cancel(struct dfu_engine *e, struct engine_dev *d)
+{
+}
+
+static void _sim_reset(struct engine_dev *d)
+{
+	dfu_sim_reset(d->sim);
+}
+
+static const struct engine_transport _sim_transport = {
+	.submit = _sim_submit,
+	.cancel = _sim_cancel,
+	.reset = _sim_reset,
+};
+
+/* engine */
+
+int dfu_engine_supported(void)
+{
+	return 1;
+}
+
+struct dfu_engine *dfu_engine_new(const struct dfu_image *img)
+{
+	struct dfu_engine *e;
+	int i;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->epfd = epoll_create(DFU_ENGINE_MAX_EVENTS);
+	if (e->epfd < 0) {
+		perror("epoll_create");
+		free(e);
+		return NULL;
+	}
+
+	for (i = 0; i < DFU_ENGINE_WHEEL_SLOTS; i++)
+		e->wheel[i].next = e->wheel[i].prev = &e->wheel[i];
+
+	e->image = img;
+	e->tick = dfu_clock_ms();
+	dfu_sched_init(&e->sched, 0, 0);
+	return e;
+}
+
+/* have @p cb called with the progress of the download while it runs */
+void dfu_engine_set_progress(struct dfu_engine *e, dfu_engine_progress_cb cb,
+			     void *user)
+{
+	e->progress = cb;
+	e->progress_user = user;
+}
+
+/* count the bytes sent to each device in @p p, which has to have room
+ * for all of them */
+void dfu_engine_set_meter(struct dfu_engine *e, struct dfu_progress *p)
+{
+	e->meter = p;
+}
+
+/**
+ * set the number of devices downloading at the same time per bus and
+ * per external hub; 0 selects a default by link speed. This has to be
+ * done before devices are added.
+ */
+void dfu_engine_set_budget(struct dfu_engine *e, unsigned int bus,
+			   unsigned int hub)
+{
+	e->sched.bus_budget = bus;
+	e->sched.hub_budget = hub;
+}
+
+static struct engine_dev *_add_dev(struct dfu_engine *e, const char *name,
+				   int interface, unsigned int transfer_size,
+				   dfu_quirks quirks)
+{
+	struct engine_dev *d;
+	unsigned int page_size = getpagesize();
+
+	if (e->count == e->alloc) {
+		int alloc = e->alloc ? 2 * e->alloc : 16;
+		struct engine_dev **devs;
+
+		devs = realloc(e->devs, alloc * sizeof(*devs));
+		if (!devs)
+			return NULL;
+		e->devs = devs;
+		e->alloc = alloc;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	/* room for the largest transfer size dfu-util ever uses */
+	d->buf = malloc(SETUP_SIZE + (page_size > 64 ? page_size : 64));
+	if (!d->buf) {
+		free(d);
+		return NULL;
+	}
+
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	dfu_init(&d->handle, 5000);
+	d->handle.name = d->name;
+	d->handle.interface = interface;
+	d->handle.quirk_flags = quirks;
+	d->transfer_size = transfer_size;
+	d->image = e->image;
+	d->fd = -1;
+	d->step = STEP_START;
+	d->bus = d->hub = -1;
+
+	e->devs[e->count++] = d;
+	return d;
+}
+
+/**
+ * add a DFU mode USB device. It is opened through usbfs, and the
+ * DFU interface is claimed right away. The device is sent @p img,
+ * or the engine's image if that is NULL.
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_engine_add_usb(struct dfu_engine *e, struct usb_device *dev,
+		       int interface, int altsetting,
+		       unsigned int transfer_size, dfu_quirks quirks,
+		       const struct dfu_image *img)
+{
+	struct usbdevfs_setinterface setintf;
+	struct epoll_event ev;
+	struct engine_dev *d;
+	char name[40], path[PATH_MAX];
+	unsigned int intf = interface;
+
+	snprintf(name, sizeof(name), "%.32s/%03u", dev->bus->dirname,
+		 dev->devnum);
+	d = _add_dev(e, name, interface, transfer_size, quirks);
+	if (!d)
+		return -ENOMEM;
+	d->tp = &_usbfs_transport;
+	if (img)
+		d->image = img;
+	d->handle.profile = dfu_profile_lookup(dev->descriptor.idVendor,
+					       dev->descriptor.idProduct,
+					       dev->descriptor.bcdDevice);
+
+	if (dfu_sched_locate(&e->sched, dev, &d->bus, &d->hub, d->port,
+			     sizeof(d->port)) < 0)
+		return -ENOMEM;
+
+	/* the same device nodes libusb-0.1 uses */
+	snprintf(path, sizeof(path), "/dev/bus/usb/%.64s/%.64s",
+		 dev->bus->dirname, dev->filename);
+	d->fd = open(path, O_RDWR);
+	if (d->fd < 0) {
+		snprintf(path, sizeof(path), "/proc/bus/usb/%.64s/%.64s",
+			 dev->bus->dirname, dev->filename);
+		d->fd = open(path, O_RDWR);
+	}
+	if (d->fd < 0) {
+		dfu_log(DFU_LOG_ERROR, d->name, "cannot open device: %s",
+			strerror(errno));
+		goto out_fail;
+	}
+
+	if (ioctl(d->fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0) {
+		dfu_log(DFU_LOG_ERROR, d->name, "cannot claim interface: %s",
+			strerror(errno));
+		goto out_fail;
+	}
+
+	setintf.interface = interface;
+	setintf.altsetting = altsetting;
+	if (ioctl(d->fd, USBDEVFS_SETINTERFACE, &setintf) < 0) {
+		dfu_log(DFU_LOG_ERROR, d->name,
+			"cannot set alternate interface: %s", strerror(errno));
+		goto out_fail;
+	}
+
+	/* usbfs signals reapable URBs as writable */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.ptr = d;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, d->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto out_fail;
+	}
+
+	return 0;
+
+ out_fail:
+	/* keep the device, so it's listed as failed */
+	if (d->fd >= 0)
+		close(d->fd);
+	d->fd = -1;
+	d->step = STEP_DONE;
+	d->result_code = -1;
+	return -1;
+}
+
+/**
+ * add a simulated device, see dfu_sim.h
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_engine_add_sim(struct dfu_engine *e, struct dfu_sim *sim,
+		       unsigned int transfer_size)
+{
+	struct engine_dev *d;
+	dfu_quirks quirks;
+
+	dfu_quirks_clear(&quirks);
+	d = _add_dev(e, sim->name, 0, transfer_size, quirks);
+	if (!d)
+		return -ENOMEM;
+	d->tp = &_sim_transport;
+	d->sim = sim;
+
+	/* all simulated devices share one virtual high speed bus */
+	d->bus = dfu_sched_group(&e->sched, "bus sim", 1, 1);
+	if (d->bus < 0)
+		return -ENOMEM;
+	e->sched.groups[d->bus].devices++;
+	return 0;
+}
+
+/* report how far the download got, at most every DFU_ENGINE_PROGRESS_MS */
+static void _progress(struct dfu_engine *e, unsigned long long now, int final)
+{
+	struct dfu_engine_progress p;
+	int i;
+
+	if (!e->progress ||
+	    (!final && now < e->progress_last + DFU_ENGINE_PROGRESS_MS))
+		return;
+	e->progress_last = now;
+
+	memset(&p, 0, sizeof(p));
+	p.count = e->count;
+	p.bytes = e->bytes;
+	for (i = 0; i < e->count; i++) {
+		struct engine_dev *d = e->devs[i];
+
+		if (d->step == STEP_DONE) {
+			if (d->result_code < 0)
+				p.failed++;
+			else
+				p.done++;
+		}
+		if (d->step != STEP_DONE || d->result_code == 0)
+			p.total += d->image->size;
+	}
+	e->progress(e->progress_user, &p);
+}
+
+/* give every ready device one step, in the order they became ready */
+static void _run_ready(struct dfu_engine *e)
+{
+	struct engine_dev *tail = e->ready_tail;
+
+	while (e->ready_head) {
+		struct engine_dev *d = e->ready_head;
+
+		e->ready_head = d->ready_next;
+		if (!e->ready_head)
+			e->ready_tail = NULL;
+		d->queued = 0;
+
+		_advance(e, d);
+
+		/* devices that became ready again wait for the next round */
+		if (d == tail)
+			break;
+	}
+}
+
+/**
+ * download the image to all devices
+ *
+ * @return the number of devices that failed
+ */
+int dfu_engine_run(struct dfu_engine *e)
+{
+	struct epoll_event events[DFU_ENGINE_MAX_EVENTS];
+	int i, failed = 0;
+
+	e->start = dfu_clock_ms();
+	e->tick = e->start;
+
+	for (i = 0; i < e->count; i++) {
+		struct engine_dev *d = e->devs[i];
+
+		d->handle.progress = dfu_progress_dev(e->meter, d->name);
+		if (d->step != STEP_DONE)
+			e->active++;
+	}
+	_admit(e);
+
+	while (e->active) {
+		unsigned long long now;
+		int n, timeout;
+
+		e->loops++;
+		_run_ready(e);
+
+		now = dfu_clock_ms();
+		_wheel_advance(e, now);
+		if (!e->active)
+			break;
+		_progress(e, now, 0);
+
+		timeout = e->ready_head ? 0 : _wheel_timeout(e, now);
+		/* in virtual time, skip ahead to the next timer. Only
+		   simulated devices are run then, which have no fds. */
+		if (timeout > 0 && dfu_clock_is_virtual()) {
+			dfu_clock_sleep_ms(timeout);
+			timeout = 0;
+		}
+		n = epoll_wait(e->epfd, events, DFU_ENGINE_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		if (n)
+			e->wakeups++;
+
+		for (i = 0; i < n; i++) {
+			struct engine_dev *d = events[i].data.ptr;
+
+			if (d->tp->reap && d->fd >= 0)
+				d->tp->reap(e, d);
+		}
+	}
+
+	e->end = dfu_clock_ms();
+	_progress(e, e->end, 1);
+
+	for (i = 0; i < e->count; i++)
+		if (e->devs[i]->step != STEP_DONE ||
+		    e->devs[i]->result_code < 0)
+			failed++;
+	return failed;
+}
+
+void dfu_engine_print_stats(struct dfu_engine *e)
+{
+	unsigned long long total = 0, elapsed = e->end - e->start;
+	int i, ok = 0;
+
+	printf("%-16s %-10s %-8s %10s %8s %9s %7s %6s %8s %8s\n", "device",
+	       "port", "result", "bytes", "ms", "KiB/s", "reqs", "polls", "wait-ms",
+	       "max-lat");
+	for (i = 0; i < e->count; i++) {
+		struct engine_dev *d = e->devs[i];
+		unsigned long long ms = d->start && d->end > d->start ?
+			d->end - d->start : 0;
+		int success = d->step == STEP_DONE && d->result_code == 0;
+
+		if (success)
+			ok++;
+		total += d->offset;
+		printf("%-16s %-10s %-8s %10llu %8llu %9.1f %7u %6u %8llu %8llu\n",
+		       d->name, d->port[0] ? d->port : "-", success ? "ok" : "FAILED",
+		       (unsigned long long) d->offset, ms,
+		       ms ? d->offset / 1.024 / ms : 0.0, d->requests,
+		       d->polls, d->poll_wait, d->max_latency);
+	}
+
+	printf("%d of %d device(s) updated successfully, %llu bytes in %llu ms",
+	       ok, e->count, total, elapsed);
+	if (elapsed)
+		printf(" (%.1f KiB/s aggregate)", total / 1.024 / elapsed);
+	printf(", %llu loop iterations, %llu wakeups\n", e->loops, e->wakeups);
+
+	dfu_sched_print(&e->sched, e->end);
+}
+
+/**
+ * @return 0 if the @p index'th device added was updated, or < 0 if
+ * it wasn't
+ */
+int dfu_engine_result(struct dfu_engine *e, int index)
+{
+	struct engine_dev *d = e->devs[index];
+
+	if (d->step != STEP_DONE)
+		return -1;
+	return d->result_code;
+}
+
+void dfu_engine_free(struct dfu_engine *e)
+{
+	int i;
+
+	if (!e)
+		return;
+
+	for (i = 0; i < e->count; i++) {
+		struct engine_dev *d = e->devs[i];
+
+		if (d->tp && d->tp->close)
+			d->tp->close(e, d);
+		free(d->buf);
+		free(d->block);
+		free(d);
+	}
+	free(e->devs);
+	dfu_sched_free(&e->sched);
+	close(e->epfd);
+	free(e);
+}
+
+#else /* DFU_ENGINE */
+
+int dfu_engine_supported(void)
+{
+	return 0;
+}
+
+struct dfu_engine *dfu_engine_new(const struct dfu_image *img)
+{
+	fprintf(stderr, "The download engine is not supported on this platform\n");
+	return NULL;
+}
+
+void dfu_engine_free(struct dfu_engine *e)
+{
+}
+
+void dfu_engine_set_budget(struct dfu_engine *e, unsigned int bus,
+			   unsigned int hub)
+{
+}
+
+void dfu_engine_set_progress(struct dfu_engine *e, dfu_engine_progress_cb cb,
+			     void *user)
+{
+}
+
+void dfu_engine_set_meter(struct dfu_engine *e, struct dfu_progress *p)
+{
+}
+
+int dfu_engine_add_usb(struct dfu_engine *e, struct usb_device *dev,
+		       int interface, int altsetting,
+		       unsigned int transfer_size, dfu_quirks quirks,
+		       const struct dfu_image *img)
+{
+	return -ENOSYS;
+}
+
+int dfu_engine_add_sim(struct dfu_engine *e, struct dfu_sim *sim,
+		       unsigned int transfer_size)
+{
+	return -ENOSYS;
+}
+
+int dfu_engine_run(struct dfu_engine *e)
+{
+	return -ENOSYS;
+}
+
+void dfu_engine_print_stats(struct dfu_engine *e)
+{
+}
+
+int dfu_engine_result(struct dfu_engine *e, int index)
+{
+	return -ENOSYS;
+}
+
+#endif /* !DFU_ENGINE */
@@ -0,0 +1,72 @@
+/*
+ * dfu-util - single threaded download engine for many devices
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_ENGINE_H
+#define _DFU_ENGINE_H
+
+#include <usb.h>
+
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_sim.h"
+
+/* resolution and size of the timer wheel for bwPollTimeout waits */
+#define DFU_ENGINE_WHEEL_SLOTS	256	/* one slot per millisecond */
+/* completions handled per epoll_wait() */
+#define DFU_ENGINE_MAX_EVENTS	64
+/* interval of progress reports */
+#define DFU_ENGINE_PROGRESS_MS	250
+
+struct dfu_engine;
+struct dfu_progress;
+
+struct dfu_engine_progress {
+	int count;			/* devices */
+	int done;			/* finished successfully */
+	int failed;
+	unsigned long long bytes;	/* downloaded so far */
+	unsigned long long total;	/* to download, without failed devices */
+};
+
+typedef void (*dfu_engine_progress_cb)(void *user,
+				       const struct dfu_engine_progress *p);
+
+int dfu_engine_supported(void);
+
+struct dfu_engine *dfu_engine_new(const struct dfu_image *img);
+void dfu_engine_free(struct dfu_engine *e);
+void dfu_engine_set_budget(struct dfu_engine *e, unsigned int bus,
+			   unsigned int hub);
+void dfu_engine_set_progress(struct dfu_engine *e, dfu_engine_progress_cb cb,
+			     void *user);
+void dfu_engine_set_meter(struct dfu_engine *e, struct dfu_progress *p);
+
+int dfu_engine_add_usb(struct dfu_engine *e, struct usb_device *dev,
+		       int interface, int altsetting,
+		       unsigned int transfer_size, dfu_quirks quirks,
+		       const struct dfu_image *img);
+int dfu_engine_add_sim(struct dfu_engine *e, struct dfu_sim *sim,
+		       unsigned int transfer_size);
+
+int dfu_engine_run(struct dfu_engine *e);
+void dfu_engine_print_stats(struct dfu_engine *e);
+int dfu_engine_result(struct dfu_engine *e, int index);
+
+#endif
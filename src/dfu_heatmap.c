@@ -0,0 +1,262 @@
+/*
+ * dfu-util - flash timing heatmap
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Every block of a download is timed: sending the DNLOAD, and the time
+ * from then on until a GETSTATUS finds the block written, together
+ * with the bwPollTimeouts the device gave meanwhile. The blocks are
+ * summed up by the region of the image they start in, so downloads of
+ * different transfer sizes, and of many devices, line up. Regions
+ * taking much longer than the rest show worn or erase-heavy sectors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dfu_heatmap.h"
+#include "dfu_clock.h"
+
+void dfu_heatmap_init(struct dfu_heatmap *h, unsigned int bucket_size)
+{
+	memset(h, 0, sizeof(*h));
+	h->bucket_size = bucket_size ? bucket_size : DFU_HEATMAP_BUCKET;
+}
+
+/* a DNLOAD request is about to be sent */
+void dfu_heatmap_start(struct dfu_heatmap *h)
+{
+	h->start = h->sent = dfu_clock_us();
+	h->requested = 0;
+	h->polls = 0;
+}
+
+/* the device has the data of the block */
+void dfu_heatmap_sent(struct dfu_heatmap *h)
+{
+	h->sent = dfu_clock_us();
+}
+
+/* a GETSTATUS said the device is busy for @p bwPollTimeout ms */
+void dfu_heatmap_poll(struct dfu_heatmap *h, unsigned int bwPollTimeout)
+{
+	h->requested += bwPollTimeout * 1000ULL;
+	h->polls++;
+}
+
+/**
+ * the block of @p len bytes at @p offset is written
+ *
+ * @return 0, or < 0 if out of memory
+ */
+int dfu_heatmap_block(struct dfu_heatmap *h, unsigned long long offset,
+		      unsigned int len)
+{
+	unsigned long long now = dfu_clock_us();
+	size_t i = offset / h->bucket_size;
+	struct dfu_heatmap_bucket *b;
+
+	if (i >= h->count) {
+		size_t count = h->count ? h->count : 64;
+
+		while (count <= i)
+			count *= 2;
+		b = realloc(h->buckets, count * sizeof(*b));
+		if (!b)
+			return -ENOMEM;
+		memset(b + h->count, 0, (count - h->count) * sizeof(*b));
+		h->buckets = b;
+		h->count = count;
+	}
+
+	b = &h->buckets[i];
+	b->blocks++;
+	b->polls += h->polls;
+	b->bytes += len;
+	b->xfer += h->sent - h->start;
+	b->requested += h->requested;
+	b->busy += now - h->sent;
+	return 0;
+}
+
+/* regions up to the last one written */
+static size_t _used(const struct dfu_heatmap *h)
+{
+	size_t n = h->count;
+
+	while (n && !h->buckets[n - 1].blocks)
+		n--;
+	return n;
+}
+
+/* busy time per KiB written, the measure of a region */
+static double _rate(const struct dfu_heatmap_bucket *b)
+{
+	return b->bytes ? b->busy / 1000.0 / (b->bytes / 1024.0) : 0.0;
+}
+
+/**
+ * print the busy time per KiB over the image as rows of characters,
+ * from '.' for the fastest region to '@' for the slowest, and the
+ * regions taking longest
+ */
+void dfu_heatmap_print(const struct dfu_heatmap *h)
+{
+	static const char ramp[] = ".:-=+*#%@";
+	const int levels = sizeof(ramp) - 1;
+	double rate[DFU_HEATMAP_COLUMNS * DFU_HEATMAP_ROWS];
+	double min = 0.0, max = 0.0;
+	struct dfu_heatmap_bucket total, cell;
+	size_t used = _used(h), per_cell, cells, i, j;
+	int slow[5], k, n = 0;
+
+	if (!used) {
+		printf("Heatmap: no blocks were timed\n");
+		return;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < used; i++) {
+		const struct dfu_heatmap_bucket *b = &h->buckets[i];
+
+		total.blocks += b->blocks;
+		total.bytes += b->bytes;
+		total.xfer += b->xfer;
+		total.requested += b->requested;
+		total.busy += b->busy;
+	}
+
+	printf("Heatmap: %u blocks, %llu ms sending, device busy %llu ms "
+	       "for %llu ms of bwPollTimeout", total.blocks,
+	       total.xfer / 1000, total.busy / 1000, total.requested / 1000);
+	if (total.requested)
+		printf(" (%+.1f%%)", 100.0 * total.busy / total.requested -
+		       100.0);
+	printf("\n");
+
+	/* several regions per cell if there are more than fit */
+	per_cell = (used + DFU_HEATMAP_COLUMNS * DFU_HEATMAP_ROWS - 1) /
+		(DFU_HEATMAP_COLUMNS * DFU_HEATMAP_ROWS);
+	cells = (used + per_cell - 1) / per_cell;
+
+	for (i = 0; i < cells; i++) {
+		memset(&cell, 0, sizeof(cell));
+		for (j = i * per_cell; j < (i + 1) * per_cell && j < used; j++) {
+			cell.bytes += h->buckets[j].bytes;
+			cell.busy += h->buckets[j].busy;
+		}
+		/* < 0: nothing was written there */
+		rate[i] = cell.bytes ? _rate(&cell) : -1.0;
+		if (rate[i] < 0)
+			continue;
+		if (!n++ || rate[i] < min)
+			min = rate[i];
+		if (rate[i] > max)
+			max = rate[i];
+	}
+
+	for (i = 0; i < cells; i++) {
+		if (i % DFU_HEATMAP_COLUMNS == 0)
+			printf("%010llx |", (unsigned long long) i * per_cell *
+			       h->bucket_size);
+		if (rate[i] < 0)
+			putchar(' ');
+		else if (max > min)
+			putchar(ramp[(int)((rate[i] - min) / (max - min) *
+					   (levels - 1) + 0.5)]);
+		else
+			putchar(ramp[0]);
+		if (i % DFU_HEATMAP_COLUMNS == DFU_HEATMAP_COLUMNS - 1 ||
+		    i == cells - 1)
+			printf("|\n");
+	}
+	printf("each cell %zu bytes, '%c' %.2f to '%c' %.2f ms busy per KiB\n",
+	       per_cell * h->bucket_size, ramp[0], min, ramp[levels - 1], max);
+
+	/* the slowest regions, slowest first */
+	n = 0;
+	for (i = 0; i < used; i++) {
+		if (!h->buckets[i].bytes)
+			continue;
+		for (k = n; k > 0 && _rate(&h->buckets[i]) >
+			     _rate(&h->buckets[slow[k - 1]]); k--)
+			if (k < 5)
+				slow[k] = slow[k - 1];
+		if (k < 5) {
+			slow[k] = i;
+			if (n < 5)
+				n++;
+		}
+	}
+	printf("Slowest regions:\n");
+	for (k = 0; k < n; k++) {
+		const struct dfu_heatmap_bucket *b = &h->buckets[slow[k]];
+
+		printf("  0x%010llx %8.1f ms busy, %8.1f ms requested, "
+		       "%.2f ms/KiB\n",
+		       (unsigned long long) slow[k] * h->bucket_size,
+		       b->busy / 1000.0, b->requested / 1000.0, _rate(b));
+	}
+}
+
+/**
+ * write the regions to @p fname as CSV, one line each
+ *
+ * @return 0, or < 0 if it can't be written
+ */
+int dfu_heatmap_write_csv(const struct dfu_heatmap *h, const char *fname)
+{
+	size_t used = _used(h), i;
+	FILE *f;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+
+	fprintf(f, "offset,bytes,blocks,polls,xfer_us,requested_us,busy_us,"
+		"busy_us_per_kib\n");
+	for (i = 0; i < used; i++) {
+		const struct dfu_heatmap_bucket *b = &h->buckets[i];
+
+		if (!b->blocks)
+			continue;
+		fprintf(f, "%llu,%llu,%u,%u,%llu,%llu,%llu,%.0f\n",
+			(unsigned long long) i * h->bucket_size, b->bytes,
+			b->blocks, b->polls, b->xfer, b->requested, b->busy,
+			_rate(b) * 1000.0);
+	}
+
+	if (fclose(f) < 0) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
+
+void dfu_heatmap_free(struct dfu_heatmap *h)
+{
+	free(h->buckets);
+	h->buckets = NULL;
+	h->count = 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * dfu-util - flash timing heatmap
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_HEATMAP_H
+#define _DFU_HEATMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* default size of a region, a common flash sector size */
+#define DFU_HEATMAP_BUCKET	4096
+/* cells of the text rendering */
+#define DFU_HEATMAP_COLUMNS	64
+#define DFU_HEATMAP_ROWS	16
+
+/* the blocks downloaded into one region of the image */
+struct dfu_heatmap_bucket {
+	unsigned int blocks;
+	unsigned int polls;
+	unsigned long long bytes;
+	unsigned long long xfer;	/* us sending DNLOAD */
+	unsigned long long requested;	/* us asked for by bwPollTimeout */
+	unsigned long long busy;	/* us until the block was written */
+};
+
+/**
+ * how long the device took to write each region of the image, next
+ * to the time it said it would need
+ */
+struct dfu_heatmap {
+	unsigned int bucket_size;
+	struct dfu_heatmap_bucket *buckets;
+	size_t count;
+
+	/* the block in flight */
+	unsigned long long start;
+	unsigned long long sent;
+	unsigned long long requested;
+	unsigned int polls;
+};
+
+void dfu_heatmap_init(struct dfu_heatmap *h, unsigned int bucket_size);
+void dfu_heatmap_start(struct dfu_heatmap *h);
+void dfu_heatmap_sent(struct dfu_heatmap *h);
+void dfu_heatmap_poll(struct dfu_heatmap *h, unsigned int bwPollTimeout);
+int dfu_heatmap_block(struct dfu_heatmap *h, unsigned long long offset,
+		      unsigned int len);
+void dfu_heatmap_print(const struct dfu_heatmap *h);
+int dfu_heatmap_write_csv(const struct dfu_heatmap *h, const char *fname);
+void dfu_heatmap_free(struct dfu_heatmap *h);
+
+#endif
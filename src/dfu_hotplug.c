@@ -0,0 +1,317 @@
+/*
+ * dfu-util - USB hotplug events
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * USB devices coming and going, as told by the kernel's uevents on a
+ * netlink socket, so nobody has to enumerate the bus to notice them.
+ * Devices are named by their port (the kernel's "1-2.3"), which stays
+ * the same when a board re-enumerates after a detach or an update.
+ * Where no netlink socket can be had, e.g. in some containers, the
+ * device list in sysfs is compared every DFU_HOTPLUG_POLL_MS; that
+ * reads a few small files and doesn't touch the bus either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LINUX_NETLINK_H
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#endif
+
+#include "dfu_hotplug.h"
+
+#define SYSFS_USB_DEVICES	"/sys/bus/usb/devices"
+
+struct dfu_hotplug_port {
+	char port[32];
+	unsigned int busnum;
+	unsigned int devnum;
+};
+
+static unsigned long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a device, not a root hub ("usb1") or an interface ("1-2:1.0") */
+static int _is_port(const char *name)
+{
+	return name[0] >= '0' && name[0] <= '9' && strchr(name, '-') &&
+		!strchr(name, ':') && strlen(name) < 32;
+}
+
+static unsigned int _read_attr(const char *port, const char *attr)
+{
+	char path[128];
+	unsigned int val = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), SYSFS_USB_DEVICES "/%s/%s", port, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%u", &val) != 1)
+		val = 0;
+	fclose(f);
+	return val;
+}
+
+/* all devices in sysfs, or < 0 if it can't be read */
+static int _scan(struct dfu_hotplug_port **ports)
+{
+	struct dfu_hotplug_port *p = NULL;
+	struct dirent *de;
+	int count = 0, alloc = 0;
+	DIR *dir;
+
+	dir = opendir(SYSFS_USB_DEVICES);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (!_is_port(de->d_name))
+			continue;
+		if (count == alloc) {
+			struct dfu_hotplug_port *n;
+
+			alloc = alloc ? 2 * alloc : 32;
+			n = realloc(p, alloc * sizeof(*p));
+			if (!n) {
+				closedir(dir);
+				free(p);
+				return -ENOMEM;
+			}
+			p = n;
+		}
+		snprintf(p[count].port, sizeof(p[count].port), "%.31s",
+			 de->d_name);
+		p[count].busnum = _read_attr(de->d_name, "busnum");
+		p[count].devnum = _read_attr(de->d_name, "devnum");
+		count++;
+	}
+
+	closedir(dir);
+	*ports = p;
+	return count;
+}
+
+static int _find(const struct dfu_hotplug_port *ports, int count,
+		 const struct dfu_hotplug_port *p)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(ports[i].port, p->port) &&
+		    ports[i].devnum == p->devnum)
+			return i;
+	return -1;
+}
+
+static void _event(struct dfu_hotplug_event *ev, int added,
+		   const struct dfu_hotplug_port *p, unsigned long long now)
+{
+	ev->added = added;
+	snprintf(ev->port, sizeof(ev->port), "%s", p->port);
+	ev->busnum = p->busnum;
+	ev->devnum = p->devnum;
+	ev->time = now;
+}
+
+/* compare sysfs against the last scan. A device re-enumerated in the
+   meantime is reported as removed and added again; events beyond @p
+   max are lost, like those of an overrun netlink socket. */
+static int _read_sysfs(struct dfu_hotplug *h, struct dfu_hotplug_event *ev,
+		       int max)
+{
+	struct dfu_hotplug_port *ports;
+	unsigned long long now = _now_ms();
+	int i, n = 0, count;
+
+	count = _scan(&ports);
+	if (count < 0)
+		return count;
+
+	for (i = 0; i < h->count && n < max; i++)
+		if (_find(ports, count, &h->ports[i]) < 0)
+			_event(&ev[n++], 0, &h->ports[i], now);
+	for (i = 0; i < count && n < max; i++)
+		if (_find(h->ports, h->count, &ports[i]) < 0)
+			_event(&ev[n++], 1, &ports[i], now);
+
+	free(h->ports);
+	h->ports = ports;
+	h->count = count;
+	return n;
+}
+
+#ifdef HAVE_LINUX_NETLINK_H
+/* one uevent: "add@/devices/...", then KEY=value strings */
+static int _parse_uevent(const char *buf, int len,
+			 struct dfu_hotplug_event *ev)
+{
+	const char *p = buf, *end = buf + len;
+	const char *subsystem = NULL, *devtype = NULL, *devpath = NULL;
+	const char *action = NULL, *slash;
+	struct dfu_hotplug_port port;
+
+	memset(&port, 0, sizeof(port));
+	for (; p < end; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVTYPE=", 8))
+			devtype = p + 8;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+		else if (!strncmp(p, "BUSNUM=", 7))
+			port.busnum = atoi(p + 7);
+		else if (!strncmp(p, "DEVNUM=", 7))
+			port.devnum = atoi(p + 7);
+	}
+
+	if (!action || !subsystem || !devtype || !devpath ||
+	    strcmp(subsystem, "usb") || strcmp(devtype, "usb_device"))
+		return 0;
+	if (strcmp(action, "add") && strcmp(action, "remove"))
+		return 0;
+
+	slash = strrchr(devpath, '/');
+	if (!slash || !_is_port(slash + 1))
+		return 0;
+	snprintf(port.port, sizeof(port.port), "%s", slash + 1);
+
+	_event(ev, !strcmp(action, "add"), &port, _now_ms());
+	return 1;
+}
+
+static int _read_netlink(struct dfu_hotplug *h, struct dfu_hotplug_event *ev,
+			 int max)
+{
+	char buf[4096];
+	int n = 0, len;
+
+	while (n < max) {
+		len = recv(h->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* ENOBUFS: the socket overran, events were lost */
+			return -errno;
+		}
+		buf[len] = '\0';
+		n += _parse_uevent(buf, len, &ev[n]);
+	}
+	return n;
+}
+
+static int _open_netlink(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = 1;	/* the kernel's own events, not udev's */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = errno;
+
+		close(fd);
+		return -err;
+	}
+	return fd;
+}
+#endif
+
+/**
+ * start listening for devices being attached and removed. Devices
+ * already attached are not reported.
+ *
+ * @return 0, or < 0 if neither hotplug events nor sysfs are available
+ */
+int dfu_hotplug_open(struct dfu_hotplug *h)
+{
+	int ret;
+
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+
+#ifdef HAVE_LINUX_NETLINK_H
+	h->fd = _open_netlink();
+	if (h->fd >= 0)
+		return 0;
+#endif
+
+	ret = _scan(&h->ports);
+	if (ret < 0) {
+		fprintf(stderr, "Can't watch for USB devices: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+	h->count = ret;
+	return 0;
+}
+
+/**
+ * the devices attached and removed since the last call, up to @p max.
+ * With a netlink socket, it doesn't block; otherwise sysfs is scanned.
+ *
+ * @return the number of events, or < 0 on error
+ */
+int dfu_hotplug_read(struct dfu_hotplug *h, struct dfu_hotplug_event *ev,
+		     int max)
+{
+#ifdef HAVE_LINUX_NETLINK_H
+	if (h->fd >= 0)
+		return _read_netlink(h, ev, max);
+#endif
+	return _read_sysfs(h, ev, max);
+}
+
+void dfu_hotplug_close(struct dfu_hotplug *h)
+{
+	if (h->fd >= 0)
+		close(h->fd);
+	h->fd = -1;
+	free(h->ports);
+	h->ports = NULL;
+	h->count = 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * dfu-util - USB hotplug events
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_HOTPLUG_H
+#define _DFU_HOTPLUG_H
+
+/* interval of sysfs scans where there are no hotplug events */
+#define DFU_HOTPLUG_POLL_MS	500
+
+struct dfu_hotplug_port;
+
+struct dfu_hotplug {
+	int fd;			/* netlink socket, -1 when scanning sysfs */
+	/* the devices seen by the last sysfs scan */
+	struct dfu_hotplug_port *ports;
+	int count;
+};
+
+struct dfu_hotplug_event {
+	int added;		/* 1 if attached, 0 if removed */
+	char port[32];		/* kernel name, e.g. "1-2.3" */
+	unsigned int busnum;
+	unsigned int devnum;
+	unsigned long long time;	/* ms, CLOCK_MONOTONIC */
+};
+
+int dfu_hotplug_open(struct dfu_hotplug *h);
+int dfu_hotplug_read(struct dfu_hotplug *h, struct dfu_hotplug_event *ev,
+		     int max);
+void dfu_hotplug_close(struct dfu_hotplug *h);
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * dfu-util - shared read-only firmware image
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Raw images are mapped read-only, so all download sessions share the
+ * page cache pages of the file and nothing is copied per device.
+ * Without mmap(), raw images are read into memory once. Intel HEX,
+ * S-record and ELF images are decoded once into their range list;
+ * each session builds the blocks it sends from it, gaps filled, so a
+ * sparse image never takes memory for the space between its ranges.
+ *
+ * The file must not be truncated while it is mapped; that is no
+ * different from any other program executing from a mapped file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(HAVE_MMAP) || defined(HAVE_MLOCK)
+#include <sys/mman.h>
+#endif
+
+#include "dfu.h"
+#include "crc32.h"
+#include "dfu_image.h"
+#include "dfu_cache.h"
+
+/* ugly hack for Win32 */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static int _read_file(int fd, const char *fname, unsigned char *buf,
+		      size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+
+		if (ret <= 0) {
+			fprintf(stderr, "Can't read firmware file %s\n",
+				fname);
+			return -EIO;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* read all of stdin, which can neither be mapped nor sized up front */
+static int _read_stdin(struct dfu_image *img, size_t *len)
+{
+	size_t alloc = 0;
+
+	*len = 0;
+	while (1) {
+		ssize_t ret;
+
+		if (*len == alloc) {
+			unsigned char *buf;
+
+			alloc = alloc ? 2 * alloc : 1024 * 1024;
+			buf = realloc(img->buf, alloc);
+			if (!buf)
+				return -ENOMEM;
+			img->buf = buf;
+		}
+
+		ret = read(STDIN_FILENO, img->buf + *len, alloc - *len);
+		if (ret == 0)
+			return 0;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("stdin");
+			return -EIO;
+		}
+		*len += ret;
+	}
+}
+
+/**
+ * map a raw image and check its DFU suffix. The CRC of an unchanged
+ * file is taken from the validation cache, unless DFU_IMAGE_RECHECK
+ * is in @p flags. With DFU_IMAGE_TRUST it isn't checked at all. An
+ * image named "-" is read from stdin, and always checked.
+ *
+ * @return 0, or < 0 if the file can't be read or the image is corrupt
+ */
+static int _open_raw(struct dfu_image *img, int flags)
+{
+	struct dfu_file_suffix suffix;
+	const unsigned char *file = NULL;
+	unsigned long long len;
+	struct stat st;
+	int fd = -1, ret;
+
+	if (!strcmp(img->fname, "-")) {
+		size_t n;
+
+		ret = _read_stdin(img, &n);
+		if (ret < 0)
+			return ret;
+		file = img->buf;
+		len = n;
+		flags |= DFU_IMAGE_RECHECK;
+		if (len > DFU_FILE_SUFFIX_SIZE)
+			goto check;
+		goto too_small;
+	}
+
+	fd = open(img->fname, O_RDONLY|O_BINARY);
+	if (fd < 0) {
+		perror(img->fname);
+		return fd;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		perror(img->fname);
+		goto out_close;
+	}
+	len = st.st_size;
+
+	if (len <= DFU_FILE_SUFFIX_SIZE)
+		goto too_small;
+
+	/* the image is addressed in memory as a whole */
+	if ((unsigned long long)st.st_size > SIZE_MAX) {
+		fprintf(stderr, "firmware image of %llu bytes is too large for "
+			"this host\n", (unsigned long long)st.st_size);
+		ret = -EFBIG;
+		goto out_close;
+	}
+
+#ifdef HAVE_MMAP
+	img->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (img->map == MAP_FAILED) {
+		/* e.g. a file system without mmap support */
+		img->map = NULL;
+	} else {
+		img->map_len = st.st_size;
+		file = img->map;
+	}
+#endif
+	if (!file) {
+		img->buf = malloc(st.st_size);
+		if (!img->buf) {
+			ret = -ENOMEM;
+			goto out_close;
+		}
+		ret = _read_file(fd, img->fname, img->buf, st.st_size);
+		if (ret < 0)
+			goto out_close;
+		file = img->buf;
+	}
+
+ check:
+	memcpy(&suffix, file + len - DFU_FILE_SUFFIX_SIZE,
+	       DFU_FILE_SUFFIX_SIZE);
+
+	img->suffix = suffix;
+	/* take care of endianness */
+	img->suffix.bcdDevice = le16_to_cpu(suffix.bcdDevice);
+	img->suffix.idProduct = le16_to_cpu(suffix.idProduct);
+	img->suffix.idVendor = le16_to_cpu(suffix.idVendor);
+	img->suffix.bcdDFU = le16_to_cpu(suffix.bcdDFU);
+	img->suffix.dwCRC = le32_to_cpu(suffix.dwCRC);
+
+	img->data = file;
+	img->size = len - DFU_FILE_SUFFIX_SIZE;
+
+	if (flags & DFU_IMAGE_TRUST) {
+		printf("Firmware Checksum\t%08x (not checked)\n",
+		       img->suffix.dwCRC);
+		img->calculated_crc = img->suffix.dwCRC;
+		ret = 0;
+		goto out_close;
+	}
+
+	if (flags & DFU_IMAGE_RECHECK ||
+	    !dfu_cache_lookup(&st, &suffix, &img->calculated_crc)) {
+		/* the CRC covers everything but the dwCRC field itself */
+		img->calculated_crc = crc32_buf_parallel(crc32_init(), file,
+							    len - 4);
+		if (fd >= 0)
+			dfu_cache_store(&st, &suffix, img->calculated_crc);
+	}
+
+	printf("Firmware Checksum\t%08x ", img->calculated_crc);
+	if (img->calculated_crc == img->suffix.dwCRC) {
+		printf("(%s)\n", "valid");
+		ret = 0;
+	} else {
+		printf("(%s, expected %08x)\n", "corrupt", img->suffix.dwCRC);
+		ret = -EINVAL;
+	}
+
+	goto out_close;
+
+ too_small:
+	fprintf(stderr, "firmware image too small. it needs to be at least dfu suffix size\n");
+	ret = -EINVAL;
+ out_close:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/* decode an addressed image. It is sent from the lowest address that
+   holds data on; gaps are filled with DFU_LOADER_FILL */
+static int _open_loaded(struct dfu_image *img)
+{
+	struct dfu_range_list *list = &img->ranges;
+	unsigned long long end;
+	int ret;
+
+	ret = dfu_load_file(img->fname, img->format, list);
+	if (ret < 0)
+		return ret;
+
+	img->base = dfu_range_list_base(list);
+	end = dfu_range_list_end(list);
+
+	printf("%s image: 0x%08x-0x%08x, %u bytes of data in %u range(s)",
+	       dfu_image_format_to_string(img->format), img->base,
+	       (uint32_t)(end - 1),
+	       (unsigned int)dfu_range_list_bytes(list), list->count);
+	if (list->has_entry)
+		printf(", entry 0x%08x", list->entry);
+	printf("\n");
+
+	if (end - img->base > (size_t)-1) {
+		fprintf(stderr, "image spans %llu bytes, too large to send\n",
+			end - img->base);
+		return -EFBIG;
+	}
+	img->size = end - img->base;
+	return 0;
+}
+
+/**
+ * the @p len bytes of the image at @p offset. Those of raw images are
+ * returned in place; those of loaded images are built in @p buf,
+ * which must hold @p len bytes.
+ *
+ * @return the bytes
+ */
+const unsigned char *dfu_image_block(const struct dfu_image *img,
+				     size_t offset, size_t len,
+				     unsigned char *buf)
+{
+	if (img->data)
+		return img->data + offset;
+	dfu_range_list_read(&img->ranges, img->base + offset, buf, len);
+	return buf;
+}
+
+/**
+ * continue the CRC in @p crc over the whole image, as it is sent
+ *
+ * @return 0, or -ENOMEM
+ */
+int dfu_image_crc(const struct dfu_image *img, uint32_t *crc)
+{
+	unsigned char *buf;
+	size_t offset, len;
+
+	if (img->data) {
+		*crc = crc32_buf_parallel(*crc, img->data, img->size);
+		return 0;
+	}
+
+	buf = malloc(DFU_IMAGE_CHUNK);
+	if (!buf) {
+		fprintf(stderr, "%s: no memory to checksum the image\n",
+			img->fname);
+		return -ENOMEM;
+	}
+	for (offset = 0; offset < img->size; offset += len) {
+		len = img->size - offset < DFU_IMAGE_CHUNK ?
+			img->size - offset : DFU_IMAGE_CHUNK;
+		*crc = crc32_buf(*crc, dfu_image_block(img, offset, len, buf),
+				 len);
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * load the firmware image @p fname, in any format known to
+ * dfu_loader_detect(). With DFU_IMAGE_LOCK in @p flags the image is
+ * also locked into memory, so no session ever waits for it to be
+ * paged in again.
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_image_open(struct dfu_image *img, const char *fname, int flags)
+{
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	img->fname = fname;
+	/* only raw images can be read from stdin */
+	img->format = strcmp(fname, "-") ? dfu_loader_detect(fname) :
+		DFU_FMT_RAW;
+
+	if (img->format == DFU_FMT_RAW)
+		ret = _open_raw(img, flags);
+	else
+		ret = _open_loaded(img);
+	if (ret < 0) {
+		dfu_image_close(img);
+		return ret;
+	}
+
+	if (flags & DFU_IMAGE_LOCK) {
+#ifdef HAVE_MLOCK
+		if (!img->data)
+			fprintf(stderr, "WARNING: only raw images are locked "
+				"into memory\n");
+		else if (mlock(img->data, img->size) < 0)
+			fprintf(stderr, "WARNING: can't lock %s into memory: %s\n",
+				fname, strerror(errno));
+		else
+			img->locked = 1;
+#else
+		fprintf(stderr, "WARNING: locking images into memory is not supported\n");
+#endif
+	}
+
+	return 0;
+}
+
+/**
+ * match the ids in the suffix of a raw image against those of a
+ * device. 0xffff in the suffix stands for any value.
+ *
+ * @return the number of ids that are equal (0 to 3), or < 0 if one
+ * of them differs, or the image has no suffix
+ */
+int dfu_image_match(const struct dfu_image *img, uint16_t idVendor,
+		    uint16_t idProduct, uint16_t bcdDevice)
+{
+	const uint16_t want[3] = { img->suffix.idVendor,
+				   img->suffix.idProduct,
+				   img->suffix.bcdDevice };
+	const uint16_t have[3] = { idVendor, idProduct, bcdDevice };
+	int i, exact = 0;
+
+	if (img->format != DFU_FMT_RAW)
+		return -ENOENT;
+
+	for (i = 0; i < 3; i++) {
+		if (want[i] == 0xffff)
+			continue;
+		if (want[i] != have[i])
+			return -EINVAL;
+		exact++;
+	}
+	return exact;
+}
+
+void dfu_image_close(struct dfu_image *img)
+{
+#ifdef HAVE_MLOCK
+	if (img->locked)
+		munlock(img->data, img->size);
+#endif
+#ifdef HAVE_MMAP
+	if (img->map)
+		munmap(img->map, img->map_len);
+#endif
+	free(img->buf);
+	dfu_range_list_free(&img->ranges);
+
+	img->map = NULL;
+	img->buf = NULL;
+	img->data = NULL;
+	img->locked = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * dfu-util - shared read-only firmware image
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_IMAGE_H
+#define _DFU_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "usb_dfu.h"
+#include "dfu_loader.h"
+
+/* dfu_image_open() flags */
+#define DFU_IMAGE_LOCK		0x0001	/* mlock() the image into memory */
+#define DFU_IMAGE_RECHECK	0x0002	/* don't use the validation cache */
+#define DFU_IMAGE_TRUST		0x0004	/* don't check the suffix CRC */
+
+/* bytes read at once when going through a whole image */
+#define DFU_IMAGE_CHUNK		(64 * 1024)
+
+/**
+ * a firmware image, loaded once and only read afterwards. any number
+ * of download sessions may send blocks of it at the same time; those
+ * of raw images come straight out of @p data, those of loaded ones
+ * are built from @p ranges by dfu_image_block().
+ */
+struct dfu_image {
+	const char *fname;
+	enum dfu_image_format format;
+	/* the firmware as sent to the device, without DFU suffix. Raw
+	   images only, NULL for loaded ones */
+	const unsigned char *data;
+	/* bytes sent: for loaded images from the lowest to the highest
+	   address holding data, gaps included */
+	size_t size;
+	/* loaded images only: the data, and the address of offset 0 */
+	struct dfu_range_list ranges;
+	uint32_t base;
+	/* raw images only: suffix (in host byte order) and the
+	   checksum calculated over the file */
+	struct dfu_file_suffix suffix;
+	uint32_t calculated_crc;
+
+	/* private */
+	void *map;		/* mmap()ed file, or NULL */
+	size_t map_len;
+	unsigned char *buf;	/* malloc()ed copy, or NULL */
+	int locked;
+};
+
+int dfu_image_open(struct dfu_image *img, const char *fname, int flags);
+int dfu_image_match(const struct dfu_image *img, uint16_t idVendor,
+		    uint16_t idProduct, uint16_t bcdDevice);
+const unsigned char *dfu_image_block(const struct dfu_image *img,
+				     size_t offset, size_t len,
+				     unsigned char *buf);
+int dfu_image_crc(const struct dfu_image *img, uint32_t *crc);
+void dfu_image_close(struct dfu_image *img);
+
+#endif
@@ -0,0 +1,766 @@
+/*
+ * dfu-util - firmware image loaders (Intel HEX, S-record, ELF)
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "usb_dfu.h"
+#include "dfu_loader.h"
+
+/* ugly hack for Win32 */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* longest record we accept: 255 data bytes, hex encoded, plus framing */
+#define LOADER_LINE_MAX 600
+
+/* chunk size used while copying ELF segments into the range list */
+#define LOADER_ELF_CHUNK 65536
+
+const char *dfu_image_format_to_string(enum dfu_image_format fmt)
+{
+	switch(fmt)
+	{
+	case DFU_FMT_RAW:
+		return "raw binary";
+	case DFU_FMT_IHEX:
+		return "Intel HEX";
+	case DFU_FMT_SREC:
+		return "Motorola S-record";
+	case DFU_FMT_ELF:
+		return "ELF";
+	}
+	return "unknown";
+}
+
+/**
+ * Guess the format of @p fname from its contents. A file that ends
+ * with a DFU suffix is always treated as raw binary, so that raw
+ * images which happen to start with ':' or 'S' are not misdetected.
+ */
+enum dfu_image_format dfu_loader_detect(const char *fname)
+{
+	unsigned char magic[4];
+	struct dfu_file_suffix suffix;
+	struct stat st;
+	int fd;
+	enum dfu_image_format fmt = DFU_FMT_RAW;
+
+	fd = open(fname, O_RDONLY|O_BINARY);
+	if (fd < 0)
+		return DFU_FMT_RAW;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(magic))
+		goto out;
+
+	if (st.st_size >= DFU_FILE_SUFFIX_SIZE &&
+	    pread(fd, &suffix, DFU_FILE_SUFFIX_SIZE,
+		  st.st_size - DFU_FILE_SUFFIX_SIZE) == DFU_FILE_SUFFIX_SIZE &&
+	    suffix.ucDfuSignature[0] == 'U' &&
+	    suffix.ucDfuSignature[1] == 'F' &&
+	    suffix.ucDfuSignature[2] == 'D')
+		goto out;
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		goto out;
+
+	if (magic[0] == 0x7f && magic[1] == 'E' &&
+	    magic[2] == 'L' && magic[3] == 'F')
+		fmt = DFU_FMT_ELF;
+	else if (magic[0] == ':')
+		fmt = DFU_FMT_IHEX;
+	else if (magic[0] == 'S' && magic[1] >= '0' && magic[1] <= '9')
+		fmt = DFU_FMT_SREC;
+
+ out:
+	close(fd);
+	return fmt;
+}
+
+void dfu_range_list_init(struct dfu_range_list *list)
+{
+	memset(list, 0, sizeof(*list));
+}
+
+void dfu_range_list_free(struct dfu_range_list *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; i++)
+		free(list->ranges[i].data);
+	free(list->ranges);
+	dfu_range_list_init(list);
+}
+
+/* make room for @p len more bytes at the end of @p r */
+static int _range_reserve(struct dfu_range *r, uint32_t len)
+{
+	uint32_t alloc = r->alloc ? r->alloc : 256;
+	unsigned char *data;
+
+	if (r->len + len <= r->alloc)
+		return 0;
+
+	while (alloc < r->len + len)
+		alloc *= 2;
+
+	data = realloc(r->data, alloc);
+	if (!data)
+		return -ENOMEM;
+
+	r->data = data;
+	r->alloc = alloc;
+	return 0;
+}
+
+static int _range_append(struct dfu_range *r,
+			 const unsigned char *data, uint32_t len)
+{
+	if (_range_reserve(r, len) < 0)
+		return -ENOMEM;
+	memcpy(r->data + r->len, data, len);
+	r->len += len;
+	return 0;
+}
+
+/* index of the first range which ends after @p addr */
+static unsigned int _range_find(const struct dfu_range_list *list,
+				uint32_t addr)
+{
+	unsigned int lo = 0, hi = list->count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		const struct dfu_range *r = &list->ranges[mid];
+
+		if ((uint64_t)r->addr + r->len <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * add @p len bytes of @p data at target address @p addr. Records
+ * usually arrive in ascending order, so appending to the last range
+ * is the fast path.
+ *
+ * @return 0 on success, -EINVAL on overlapping data, -ENOMEM
+ */
+int dfu_range_list_add(struct dfu_range_list *list, uint32_t addr,
+		       const unsigned char *data, uint32_t len)
+{
+	struct dfu_range *prev = NULL, *next = NULL;
+	unsigned int i;
+
+	if (!len)
+		return 0;
+
+	if ((uint64_t)addr + len > 0x100000000ULL) {
+		fprintf(stderr, "data at 0x%08x exceeds the 32 bit address space\n",
+			addr);
+		return -EINVAL;
+	}
+
+	if (list->count) {
+		prev = &list->ranges[list->count-1];
+		if ((uint64_t)prev->addr + prev->len == addr)
+			return _range_append(prev, data, len);
+	}
+
+	i = _range_find(list, addr);
+	prev = i > 0 ? &list->ranges[i-1] : NULL;
+	next = i < list->count ? &list->ranges[i] : NULL;
+
+	if (next && next->addr < (uint64_t)addr + len) {
+		fprintf(stderr, "overlapping data at 0x%08x\n",
+			next->addr > addr ? next->addr : addr);
+		return -EINVAL;
+	}
+
+	if (prev && (uint64_t)prev->addr + prev->len == addr) {
+		if (_range_append(prev, data, len) < 0)
+			return -ENOMEM;
+		if (next && (uint64_t)prev->addr + prev->len == next->addr) {
+			if (_range_append(prev, next->data, next->len) < 0)
+				return -ENOMEM;
+			free(next->data);
+			memmove(next, next+1,
+				(list->count - i - 1) * sizeof(*next));
+			list->count--;
+		}
+		return 0;
+	}
+
+	if (next && (uint64_t)addr + len == next->addr) {
+		if (_range_reserve(next, len) < 0)
+			return -ENOMEM;
+		memmove(next->data + len, next->data, next->len);
+		memcpy(next->data, data, len);
+		next->addr = addr;
+		next->len += len;
+		return 0;
+	}
+
+	if (list->count == list->alloc) {
+		unsigned int alloc = list->alloc ? list->alloc * 2 : 16;
+		struct dfu_range *ranges;
+
+		ranges = realloc(list->ranges, alloc * sizeof(*ranges));
+		if (!ranges)
+			return -ENOMEM;
+		list->ranges = ranges;
+		list->alloc = alloc;
+	}
+
+	memmove(&list->ranges[i+1], &list->ranges[i],
+		(list->count - i) * sizeof(*list->ranges));
+	list->count++;
+
+	memset(&list->ranges[i], 0, sizeof(list->ranges[i]));
+	list->ranges[i].addr = addr;
+	return _range_append(&list->ranges[i], data, len);
+}
+
+/* lowest address holding data */
+uint32_t dfu_range_list_base(const struct dfu_range_list *list)
+{
+	if (!list->count)
+		return 0;
+	return list->ranges[0].addr;
+}
+
+/* first address after the highest byte holding data, up to 4 GiB */
+uint64_t dfu_range_list_end(const struct dfu_range_list *list)
+{
+	const struct dfu_range *last;
+
+	if (!list->count)
+		return 0;
+	last = &list->ranges[list->count-1];
+	return (uint64_t)last->addr + last->len;
+}
+
+/* number of bytes actually present in the image */
+size_t dfu_range_list_bytes(const struct dfu_range_list *list)
+{
+	size_t bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < list->count; i++)
+		bytes += list->ranges[i].len;
+	return bytes;
+}
+
+/**
+ * copy the memory image between @p addr and @p addr + @p len into
+ * @p buf. Holes between the ranges read as DFU_LOADER_FILL, so a
+ * block can be produced for any address without ever materialising
+ * the whole address space.
+ *
+ * @return number of bytes stored in @p buf
+ */
+size_t dfu_range_list_read(const struct dfu_range_list *list, uint32_t addr,
+			   unsigned char *buf, size_t len)
+{
+	uint64_t end = (uint64_t)addr + len;
+	unsigned int i;
+
+	memset(buf, DFU_LOADER_FILL, len);
+
+	for (i = _range_find(list, addr); i < list->count; i++) {
+		const struct dfu_range *r = &list->ranges[i];
+		uint64_t from, to;
+
+		if (r->addr >= end)
+			break;
+
+		from = r->addr > addr ? r->addr : addr;
+		to = (uint64_t)r->addr + r->len < end ?
+			(uint64_t)r->addr + r->len : end;
+
+		memcpy(buf + (from - addr), r->data + (from - r->addr),
+		       to - from);
+	}
+
+	return len;
+}
+
+static int _hexnibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * decode the hex digits of @p line into @p out
+ *
+ * @return number of bytes decoded, or -1 on a malformed line
+ */
+static int _hexdecode(const char *line, unsigned char *out, int max)
+{
+	int n = 0;
+
+	while (line[0] && line[0] != '\r' && line[0] != '\n') {
+		int hi = _hexnibble(line[0]);
+		int lo = _hexnibble(line[1]);
+
+		if (hi < 0 || lo < 0 || n >= max)
+			return -1;
+		out[n++] = (hi << 4) | lo;
+		line += 2;
+	}
+	return n;
+}
+
+static int _blank_line(const char *line)
+{
+	while (*line == ' ' || *line == '\t' || *line == '\r' || *line == '\n')
+		line++;
+	return *line == '\0';
+}
+
+/**
+ * load an Intel HEX file (record types 00-05) into @p list
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int dfu_load_ihex(const char *fname, struct dfu_range_list *list)
+{
+	char line[LOADER_LINE_MAX];
+	unsigned char rec[(LOADER_LINE_MAX)/2];
+	uint32_t base = 0;
+	int lineno = 0;
+	int seen_eof = 0;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		return -errno;
+	}
+
+	while (!seen_eof && fgets(line, sizeof(line), f)) {
+		uint8_t sum = 0;
+		uint32_t offset;
+		int n, i;
+
+		lineno++;
+		if (_blank_line(line))
+			continue;
+
+		n = line[0] == ':' ? _hexdecode(line+1, rec, sizeof(rec)) : -1;
+		if (n < 5 || n != rec[0] + 5) {
+			fprintf(stderr, "%s:%d: malformed Intel HEX record\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum) {
+			fprintf(stderr, "%s:%d: Intel HEX checksum mismatch\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		offset = (rec[1] << 8) | rec[2];
+
+		switch (rec[3]) {
+		case 0x00:	/* data */
+			if ((uint64_t)base + offset + rec[0] > 0x100000000ULL) {
+				fprintf(stderr, "%s:%d: record beyond the 32 bit "
+					"address space\n", fname, lineno);
+				ret = -EINVAL;
+				goto out;
+			}
+			ret = dfu_range_list_add(list, base + offset,
+						 rec+4, rec[0]);
+			if (ret < 0) {
+				fprintf(stderr, "%s:%d: cannot add record\n",
+					fname, lineno);
+				goto out;
+			}
+			break;
+		case 0x01:	/* end of file */
+			seen_eof = 1;
+			break;
+		case 0x02:	/* extended segment address */
+			if (rec[0] != 2)
+				goto bad_length;
+			base = ((rec[4] << 8) | rec[5]) << 4;
+			break;
+		case 0x03:	/* start segment address (CS:IP) */
+			if (rec[0] != 4)
+				goto bad_length;
+			list->entry = (((rec[4] << 8) | rec[5]) << 4) +
+				((rec[6] << 8) | rec[7]);
+			list->has_entry = 1;
+			break;
+		case 0x04:	/* extended linear address */
+			if (rec[0] != 2)
+				goto bad_length;
+			base = (uint32_t)((rec[4] << 8) | rec[5]) << 16;
+			break;
+		case 0x05:	/* start linear address */
+			if (rec[0] != 4)
+				goto bad_length;
+			list->entry = ((uint32_t)rec[4] << 24) |
+				((uint32_t)rec[5] << 16) |
+				(rec[6] << 8) | rec[7];
+			list->has_entry = 1;
+			break;
+		default:
+			fprintf(stderr, "%s:%d: unknown Intel HEX record type %02x\n",
+				fname, lineno, rec[3]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (ferror(f)) {
+		perror(fname);
+		ret = -EIO;
+		goto out;
+	}
+
+	if (!seen_eof)
+		fprintf(stderr, "WARNING: %s: no Intel HEX end of file record\n",
+			fname);
+	goto out;
+
+ bad_length:
+	fprintf(stderr, "%s:%d: bad length for Intel HEX record type %02x\n",
+		fname, lineno, rec[3]);
+	ret = -EINVAL;
+ out:
+	fclose(f);
+	return ret;
+}
+
+/**
+ * load a Motorola S-record file (S0-S9) into @p list
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int dfu_load_srec(const char *fname, struct dfu_range_list *list)
+{
+	char line[LOADER_LINE_MAX];
+	unsigned char rec[(LOADER_LINE_MAX)/2];
+	int lineno = 0;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		perror(fname);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		uint8_t sum = 0;
+		uint32_t addr = 0;
+		int type, addr_len, n, i;
+
+		lineno++;
+		if (_blank_line(line))
+			continue;
+
+		if (line[0] != 'S' || line[1] < '0' || line[1] > '9') {
+			fprintf(stderr, "%s:%d: malformed S-record\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+		type = line[1] - '0';
+
+		n = _hexdecode(line+2, rec, sizeof(rec));
+		if (n < 1 || n != rec[0] + 1) {
+			fprintf(stderr, "%s:%d: malformed S-record\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum != 0xff) {
+			fprintf(stderr, "%s:%d: S-record checksum mismatch\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		switch (type) {
+		case 0: case 1: case 5: case 9:
+			addr_len = 2;
+			break;
+		case 2: case 6: case 8:
+			addr_len = 3;
+			break;
+		case 3: case 7:
+			addr_len = 4;
+			break;
+		default:
+			fprintf(stderr, "%s:%d: unknown S-record type S%d\n",
+				fname, lineno, type);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		if (rec[0] < addr_len + 1) {
+			fprintf(stderr, "%s:%d: S-record too short\n",
+				fname, lineno);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (i = 0; i < addr_len; i++)
+			addr = (addr << 8) | rec[1+i];
+
+		switch (type) {
+		case 1: case 2: case 3:
+			ret = dfu_range_list_add(list, addr, rec+1+addr_len,
+						 rec[0] - addr_len - 1);
+			if (ret < 0) {
+				fprintf(stderr, "%s:%d: cannot add record\n",
+					fname, lineno);
+				goto out;
+			}
+			break;
+		case 7: case 8: case 9:
+			list->entry = addr;
+			list->has_entry = 1;
+			goto out;
+		default:
+			/* S0 header, S5/S6 record counts */
+			break;
+		}
+	}
+
+	if (ferror(f)) {
+		perror(fname);
+		ret = -EIO;
+	}
+
+ out:
+	fclose(f);
+	return ret;
+}
+
+/* ELF field access independent of host and target byte order */
+static uint64_t _elf_get(const unsigned char *p, int size, int big_endian)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int idx = big_endian ? i : size - 1 - i;
+		v = (v << 8) | p[idx];
+	}
+	return v;
+}
+
+#define ELF_PT_LOAD 1
+
+/**
+ * load the PT_LOAD program headers of an ELF32/ELF64 file into @p
+ * list. Segments are placed at their physical (load) address, and
+ * only p_filesz bytes are taken, so .bss and other NOLOAD space is
+ * never part of the image.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int dfu_load_elf(const char *fname, struct dfu_range_list *list)
+{
+	unsigned char ehdr[64], phdr[56];
+	unsigned char *chunk = NULL;
+	uint64_t phoff, entry;
+	int is64, be, phentsize, phnum, i;
+	int ret = 0;
+	int fd;
+
+	fd = open(fname, O_RDONLY|O_BINARY);
+	if (fd < 0) {
+		perror(fname);
+		return -errno;
+	}
+
+	if (pread(fd, ehdr, 16, 0) != 16 ||
+	    memcmp(ehdr, "\177ELF", 4) ||
+	    (ehdr[4] != 1 && ehdr[4] != 2) ||
+	    (ehdr[5] != 1 && ehdr[5] != 2)) {
+		fprintf(stderr, "%s: not a valid ELF file\n", fname);
+		ret = -EINVAL;
+		goto out;
+	}
+	is64 = ehdr[4] == 2;
+	be = ehdr[5] == 2;
+
+	if (pread(fd, ehdr, is64 ? 64 : 52, 0) != (is64 ? 64 : 52)) {
+		fprintf(stderr, "%s: truncated ELF header\n", fname);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (is64) {
+		entry = _elf_get(ehdr+24, 8, be);
+		phoff = _elf_get(ehdr+32, 8, be);
+		phentsize = _elf_get(ehdr+54, 2, be);
+		phnum = _elf_get(ehdr+56, 2, be);
+	} else {
+		entry = _elf_get(ehdr+24, 4, be);
+		phoff = _elf_get(ehdr+28, 4, be);
+		phentsize = _elf_get(ehdr+42, 2, be);
+		phnum = _elf_get(ehdr+44, 2, be);
+	}
+
+	if (!phnum || phentsize < (is64 ? 56 : 32)) {
+		fprintf(stderr, "%s: ELF file has no program headers\n", fname);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (entry <= 0xffffffffULL) {
+		list->entry = entry;
+		list->has_entry = 1;
+	}
+
+	chunk = malloc(LOADER_ELF_CHUNK);
+	if (!chunk) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < phnum; i++) {
+		uint64_t type, offset, paddr, filesz, done;
+
+		if (pread(fd, phdr, is64 ? 56 : 32,
+			  phoff + (uint64_t)i * phentsize) != (is64 ? 56 : 32)) {
+			fprintf(stderr, "%s: truncated ELF program header\n",
+				fname);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		type = _elf_get(phdr, 4, be);
+		if (is64) {
+			offset = _elf_get(phdr+8, 8, be);
+			paddr = _elf_get(phdr+24, 8, be);
+			filesz = _elf_get(phdr+32, 8, be);
+		} else {
+			offset = _elf_get(phdr+4, 4, be);
+			paddr = _elf_get(phdr+12, 4, be);
+			filesz = _elf_get(phdr+16, 4, be);
+		}
+
+		if (type != ELF_PT_LOAD || !filesz)
+			continue;
+
+		if (filesz > 0x100000000ULL ||
+		    paddr > 0x100000000ULL - filesz) {
+			fprintf(stderr, "%s: segment at 0x%llx is outside of the "
+				"32 bit address space\n", fname,
+				(unsigned long long)paddr);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		for (done = 0; done < filesz; ) {
+			size_t len = filesz - done < LOADER_ELF_CHUNK ?
+				filesz - done : LOADER_ELF_CHUNK;
+			ssize_t rc = pread(fd, chunk, len, offset + done);
+
+			if (rc <= 0) {
+				fprintf(stderr, "%s: truncated ELF segment\n",
+					fname);
+				ret = -EINVAL;
+				goto out;
+			}
+			ret = dfu_range_list_add(list, paddr + done, chunk, rc);
+			if (ret < 0)
+				goto out;
+			done += rc;
+		}
+	}
+
+ out:
+	free(chunk);
+	close(fd);
+	return ret;
+}
+
+/**
+ * load @p fname, which is of format @p fmt, into @p list. The list
+ * is emptied on error.
+ */
+int dfu_load_file(const char *fname, enum dfu_image_format fmt,
+		  struct dfu_range_list *list)
+{
+	int ret;
+
+	dfu_range_list_init(list);
+
+	switch (fmt) {
+	case DFU_FMT_IHEX:
+		ret = dfu_load_ihex(fname, list);
+		break;
+	case DFU_FMT_SREC:
+		ret = dfu_load_srec(fname, list);
+		break;
+	case DFU_FMT_ELF:
+		ret = dfu_load_elf(fname, list);
+		break;
+	default:
+		fprintf(stderr, "%s: no loader for %s images\n", fname,
+			dfu_image_format_to_string(fmt));
+		ret = -EINVAL;
+		break;
+	}
+
+	if (ret == 0 && !list->count) {
+		fprintf(stderr, "%s: image doesn't contain any data\n", fname);
+		ret = -EINVAL;
+	}
+
+	if (ret < 0)
+		dfu_range_list_free(list);
+
+	return ret;
+}
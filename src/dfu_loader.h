@@ -0,0 +1,85 @@
+/*
+ * dfu-util - firmware image loaders (Intel HEX, S-record, ELF)
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_LOADER_H
+#define _DFU_LOADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * on-disk formats understood by dfu_loader_detect(). raw images are
+ * expected to carry a DFU suffix and are sent as they are.
+ */
+enum dfu_image_format {
+	DFU_FMT_RAW = 0,
+	DFU_FMT_IHEX,
+	DFU_FMT_SREC,
+	DFU_FMT_ELF,
+};
+
+/* one contiguous piece of firmware data at a target address */
+struct dfu_range {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t alloc;		/* allocated size of data */
+	unsigned char *data;
+};
+
+/**
+ * sparse memory image: only the bytes actually present in the source
+ * file are stored. ranges are sorted by address, never overlap, and
+ * adjacent ranges are merged.
+ */
+struct dfu_range_list {
+	struct dfu_range *ranges;
+	unsigned int count;
+	unsigned int alloc;
+	/* entry point / start address record, if the file has one */
+	uint32_t entry;
+	int has_entry;
+};
+
+/* value of unprogrammed flash, used for gaps between ranges */
+#define DFU_LOADER_FILL 0xff
+
+const char *dfu_image_format_to_string(enum dfu_image_format fmt);
+
+enum dfu_image_format dfu_loader_detect(const char *fname);
+
+void dfu_range_list_init(struct dfu_range_list *list);
+void dfu_range_list_free(struct dfu_range_list *list);
+int dfu_range_list_add(struct dfu_range_list *list, uint32_t addr,
+		       const unsigned char *data, uint32_t len);
+
+uint32_t dfu_range_list_base(const struct dfu_range_list *list);
+uint64_t dfu_range_list_end(const struct dfu_range_list *list);
+size_t dfu_range_list_bytes(const struct dfu_range_list *list);
+
+size_t dfu_range_list_read(const struct dfu_range_list *list, uint32_t addr,
+			   unsigned char *buf, size_t len);
+
+int dfu_load_ihex(const char *fname, struct dfu_range_list *list);
+int dfu_load_srec(const char *fname, struct dfu_range_list *list);
+int dfu_load_elf(const char *fname, struct dfu_range_list *list);
+int dfu_load_file(const char *fname, enum dfu_image_format fmt,
+		  struct dfu_range_list *list);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * dfu-util - asynchronous logging
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Threads talking to devices must not wait for a terminal or pipe, so
+ * they only format their message into a slot of a ring buffer. The
+ * ring is a bounded queue of many producers and one consumer: a slot
+ * is claimed by advancing the head with a compare and swap, and its
+ * sequence number tells the consumer when the record is complete. If
+ * the ring is full, the record is dropped and counted instead. A
+ * thread of its own writes the records out as text or JSON.
+ *
+ * Until dfu_log_start() and after dfu_log_stop(), records are written
+ * at once by the thread logging them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dfu_log.h"
+
+struct log_rec {
+	unsigned long seq;
+	unsigned long long time;	/* ms */
+	int level;
+	char dev[40];
+	char msg[DFU_LOG_MSG_MAX];
+};
+
+static struct log_rec _ring[DFU_LOG_RING];
+static unsigned long _head;		/* next slot to claim */
+static unsigned long _tail;		/* next slot to write out */
+static unsigned long _dropped;
+
+static enum dfu_log_format _format = DFU_LOG_TEXT;
+static int _max_level = DFU_LOG_INFO;
+static int _running;
+static int _stop;
+static pthread_t _thread;
+static unsigned long long _start;
+
+static const char *_levels[] = {
+	[DFU_LOG_ERROR] = "error",
+	[DFU_LOG_WARN] = "warning",
+	[DFU_LOG_INFO] = "info",
+	[DFU_LOG_DEBUG] = "debug",
+};
+
+static unsigned long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _json_string(FILE *f, const char *s)
+{
+	putc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			putc(*s, f);
+	}
+	putc('"', f);
+}
+
+static void _write(const struct log_rec *r)
+{
+	FILE *f = r->level <= DFU_LOG_WARN ? stderr : stdout;
+
+	if (_format == DFU_LOG_JSON) {
+		f = stderr;
+		fprintf(f, "{\"time\":%llu,\"level\":\"%s\",", r->time - _start,
+			_levels[r->level]);
+		if (r->dev[0]) {
+			fprintf(f, "\"device\":");
+			_json_string(f, r->dev);
+			putc(',', f);
+		}
+		fprintf(f, "\"msg\":");
+		_json_string(f, r->msg);
+		fprintf(f, "}\n");
+	} else if (r->dev[0])
+		fprintf(f, "%s: %s\n", r->dev, r->msg);
+	else
+		fprintf(f, "%s\n", r->msg);
+}
+
+static void _fill(struct log_rec *r, int level, const char *dev,
+		  const char *fmt, va_list ap)
+{
+	size_t len;
+
+	r->time = _now_ms();
+	r->level = level;
+	snprintf(r->dev, sizeof(r->dev), "%s", dev ? dev : "");
+	vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+	/* a record is a line */
+	len = strlen(r->msg);
+	if (len && r->msg[len - 1] == '\n')
+		r->msg[len - 1] = '\0';
+}
+
+/**
+ * log a message about device @p dev, or about no device in particular
+ * if it is NULL. Only formats the message and queues it; never waits
+ * for the output.
+ */
+void dfu_log(int level, const char *dev, const char *fmt, ...)
+{
+	unsigned long pos;
+	struct log_rec *r;
+	va_list ap;
+
+	if (level > _max_level)
+		return;
+
+	if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+		struct log_rec rec;
+
+		va_start(ap, fmt);
+		_fill(&rec, level, dev, fmt, ap);
+		va_end(ap);
+		_write(&rec);
+		return;
+	}
+
+	pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+	for (;;) {
+		long diff;
+
+		r = &_ring[pos & (DFU_LOG_RING - 1)];
+		diff = (long) (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&_head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* full */
+			__atomic_fetch_add(&_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else
+			pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+	}
+
+	va_start(ap, fmt);
+	_fill(r, level, dev, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* write out all complete records, @return how many. Drops are told
+ * about once a second, and with @p final set. */
+static int _drain(int final)
+{
+	static unsigned long reported;
+	static unsigned long long last;
+	unsigned long dropped;
+	int n = 0;
+
+	for (;;) {
+		struct log_rec *r = &_ring[_tail & (DFU_LOG_RING - 1)];
+
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != _tail + 1)
+			break;
+		_write(r);
+		__atomic_store_n(&r->seq, _tail + DFU_LOG_RING,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&_tail, _tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	dropped = __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported && (final || _now_ms() >= last + 1000)) {
+		fprintf(stderr, "%lu log record(s) dropped, output too slow\n",
+			dropped - reported);
+		reported = dropped;
+		last = _now_ms();
+	}
+	if (n) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+	return n;
+}
+
+static void *_log_thread(void *arg)
+{
+	struct timespec ts = { 0, DFU_LOG_FLUSH_MS * 1000000 };
+
+	while (!__atomic_load_n(&_stop, __ATOMIC_ACQUIRE))
+		if (!_drain(0))
+			nanosleep(&ts, NULL);
+	_drain(1);
+	return NULL;
+}
+
+/**
+ * write the records from now on as @p format on a thread of its own,
+ * leaving out those less severe than @p max_level
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_log_start(enum dfu_log_format format, int max_level)
+{
+	unsigned long i;
+
+	_format = format;
+	_max_level = max_level;
+	_start = _now_ms();
+	if (_running)
+		return 0;
+
+	for (i = 0; i < DFU_LOG_RING; i++)
+		_ring[i].seq = i;
+	_head = _tail = 0;
+	_stop = 0;
+	if (pthread_create(&_thread, NULL, _log_thread, NULL) != 0) {
+		perror("log");
+		return -1;
+	}
+	__atomic_store_n(&_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* wait until what was logged so far is written */
+void dfu_log_flush(void)
+{
+	struct timespec ts = { 0, 1000000 };
+
+	if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE))
+		return;
+	while (__atomic_load_n(&_head, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&_tail, __ATOMIC_ACQUIRE))
+		nanosleep(&ts, NULL);
+}
+
+/* write what is left, and log synchronously again. No other thread
+ * may be logging anymore. */
+void dfu_log_stop(void)
+{
+	if (!_running)
+		return;
+	__atomic_store_n(&_running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(_thread, NULL);
+}
@@ -0,0 +1,50 @@
+/*
+ * dfu-util - asynchronous logging
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_LOG_H
+#define _DFU_LOG_H
+
+/* records in flight, a power of two; more are dropped */
+#define DFU_LOG_RING		1024
+#define DFU_LOG_MSG_MAX		240
+/* how often the ring is emptied */
+#define DFU_LOG_FLUSH_MS	20
+
+enum dfu_log_level {
+	DFU_LOG_ERROR,
+	DFU_LOG_WARN,
+	DFU_LOG_INFO,
+	DFU_LOG_DEBUG,
+};
+
+enum dfu_log_format {
+	DFU_LOG_TEXT,
+	DFU_LOG_JSON,
+};
+
+void dfu_log(int level, const char *dev, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+int dfu_log_start(enum dfu_log_format format, int max_level);
+void dfu_log_flush(void);
+void dfu_log_stop(void);
+
+#endif
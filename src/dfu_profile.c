@@ -0,0 +1,462 @@
+/*
+ * dfu-util - per-device profiles
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Device specific quirks and tuning come from profiles instead of being
+ * compiled in. A profile is one line, a device pattern followed by
+ * settings:
+ *
+ *   # vendor:product[:release]  setting=value...
+ *   1457:5119        name=neo1973 quirks=OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT
+ *   0483:df11:*      transfer-size=2048 poll-floor=2
+ *   1d50:*:0100      verify=never reset-delay=500
+ *
+ * Any field of the pattern may be *. The built-in profiles are read
+ * first, then DFU_PROFILE_SYSTEM_FILE, then $DFU_UTIL_PROFILES (or
+ * dfu-util/profiles in $XDG_CONFIG_HOME or ~/.config), and later lines
+ * add to the profiles of earlier ones with the same pattern.
+ *
+ * For a device, the profiles of all matching patterns are merged, from
+ * the most general one to the exact match, each overriding the
+ * settings of the ones before. Patterns are kept in a hash table, so
+ * a lookup is at most eight probes however many profiles there are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_profile.h"
+
+/* profile_entry.wild */
+#define ANY_VENDOR	0x1
+#define ANY_PRODUCT	0x2
+#define ANY_DEVICE	0x4
+
+struct profile_entry {
+	struct profile_entry *next;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	unsigned int wild;
+	struct dfu_profile profile;
+};
+
+/* merged profiles of the devices looked up so far */
+struct profile_result {
+	struct profile_result *next;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	struct dfu_profile profile;
+};
+
+/* the patterns matching a device, most general first */
+static const unsigned int match_order[] = {
+	ANY_VENDOR|ANY_PRODUCT|ANY_DEVICE,
+	ANY_PRODUCT|ANY_DEVICE,
+	ANY_VENDOR|ANY_DEVICE,
+	ANY_VENDOR|ANY_PRODUCT,
+	ANY_DEVICE,
+	ANY_PRODUCT,
+	ANY_VENDOR,
+	0,
+};
+
+#define OPENMOKO(pid)							\
+	"1457:" #pid " name=openmoko quirks=OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT", \
+	"5117:" #pid " name=openmoko quirks=OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT"
+
+static const char *builtin_profiles[] = {
+	/* http://wiki.openmoko.org/wiki/USB_Product_IDs, 2010-04-09 */
+	OPENMOKO(5117),	/* Neo1973/FreeRunner kernel usbnet (g_ether, CDC Ethernet) Mode */
+	OPENMOKO(5118),	/* Debug Board (FT2232D) for Neo1973/FreeRunner */
+	OPENMOKO(5119),	/* Neo1973/FreeRunner u-boot usbtty CDC ACM Mode */
+	OPENMOKO(511a),	/* HXD8 u-boot usbtty CDC ACM Mode */
+	OPENMOKO(511b),	/* SMDK2440 u-boot usbtty CDC ACM mode */
+	OPENMOKO(511c),	/* SMDK2443 u-boot usbtty CDC ACM mode */
+	OPENMOKO(511d),	/* QT2410 u-boot usbtty CDC ACM mode */
+	OPENMOKO(511e),	/* Reserved */
+	OPENMOKO(511f),	/* Reserved */
+	OPENMOKO(5120),	/* Neo1973/FreeRunner u-boot generic serial Mode */
+	OPENMOKO(5121),	/* Neo1973/FreeRunner kernel mass storage (g_storage) Mode */
+	OPENMOKO(5122),	/* Neo1973/FreeRunner kernel usbnet (g_ether, RNDIS) Mode */
+	OPENMOKO(5123),	/* Neo1973/FreeRunner internal USB Bluetooth CSR4 module */
+	OPENMOKO(5124),	/* Neo1973/FreeRunner Bluetooth Device ID service */
+	OPENMOKO(5125),	/* TBD */
+	OPENMOKO(5126),	/* TBD */
+	NULL
+};
+
+static struct profile_entry *profile_index[DFU_PROFILE_BUCKETS];
+static struct profile_result *profile_results;
+static struct dfu_profile profile_default;
+static int profiles_loaded;
+static int profiles_disabled;
+
+/* ignore all profiles, and the built-in quirks with them */
+void dfu_profile_disable(void)
+{
+	profiles_disabled = 1;
+}
+
+static unsigned int _hash(uint16_t idVendor, uint16_t idProduct,
+			  uint16_t bcdDevice, unsigned int wild)
+{
+	uint32_t h;
+
+	h = ((uint32_t)idVendor << 16 | idProduct) ^
+		((uint32_t)bcdDevice << 3 | wild) * 0x9e3779b1u;
+	h *= 0x9e3779b1u;
+	return h >> 24 & (DFU_PROFILE_BUCKETS - 1);
+}
+
+static struct profile_entry *_find(uint16_t idVendor, uint16_t idProduct,
+				   uint16_t bcdDevice, unsigned int wild)
+{
+	struct profile_entry *e;
+
+	/* wildcard fields are stored as 0 */
+	if (wild & ANY_VENDOR)
+		idVendor = 0;
+	if (wild & ANY_PRODUCT)
+		idProduct = 0;
+	if (wild & ANY_DEVICE)
+		bcdDevice = 0;
+
+	e = profile_index[_hash(idVendor, idProduct, bcdDevice, wild)];
+	for (; e; e = e->next)
+		if (e->idVendor == idVendor && e->idProduct == idProduct &&
+		    e->bcdDevice == bcdDevice && e->wild == wild)
+			return e;
+	return NULL;
+}
+
+/* settings of @p src override those of @p dst, quirks add up */
+static void _merge(struct dfu_profile *dst, const struct dfu_profile *src)
+{
+	if (src->name[0])
+		memcpy(dst->name, src->name, sizeof(dst->name));
+	dfu_quirks_insert(&dst->quirks, (dfu_quirks *) &src->quirks);
+	if (src->set & DFU_PROFILE_TRANSFER_SIZE)
+		dst->transfer_size = src->transfer_size;
+	if (src->set & DFU_PROFILE_POLL_TIMEOUT)
+		dst->poll_timeout = src->poll_timeout;
+	if (src->set & DFU_PROFILE_POLL_FLOOR)
+		dst->poll_floor = src->poll_floor;
+	if (src->set & DFU_PROFILE_DETACH_TIMEOUT)
+		dst->detach_timeout = src->detach_timeout;
+	if (src->set & DFU_PROFILE_RESET_DELAY)
+		dst->reset_delay = src->reset_delay;
+	if (src->set & DFU_PROFILE_VERIFY)
+		dst->verify = src->verify;
+	if (src->set & DFU_PROFILE_TIMEOUTS)
+		dst->fixed_timeouts = src->fixed_timeouts;
+	dst->set |= src->set;
+}
+
+/* one field of a pattern: hex, or * */
+static int _parse_id(const char *s, char **end, uint16_t *id,
+		     unsigned int *wild, unsigned int any)
+{
+	unsigned long v;
+
+	if (*s == '*') {
+		*id = 0;
+		*wild |= any;
+		*end = (char *) s + 1;
+		return 0;
+	}
+	v = strtoul(s, end, 16);
+	if (*end == s || v > 0xffff)
+		return -1;
+	*id = v;
+	return 0;
+}
+
+static int _parse_pattern(const char *s, uint16_t *idVendor,
+			  uint16_t *idProduct, uint16_t *bcdDevice,
+			  unsigned int *wild)
+{
+	char *end;
+
+	*wild = 0;
+	if (_parse_id(s, &end, idVendor, wild, ANY_VENDOR) < 0 ||
+	    *end != ':' ||
+	    _parse_id(end + 1, &end, idProduct, wild, ANY_PRODUCT) < 0)
+		return -1;
+
+	/* the release is optional */
+	*bcdDevice = 0;
+	if (!*end) {
+		*wild |= ANY_DEVICE;
+		return 0;
+	}
+	if (*end != ':' ||
+	    _parse_id(end + 1, &end, bcdDevice, wild, ANY_DEVICE) < 0 ||
+	    *end)
+		return -1;
+	return 0;
+}
+
+static int _parse_quirks(struct dfu_profile *p, char *list)
+{
+	char *name, *save;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		int quirk = dfu_quirk_lookup(name);
+
+		if (quirk < 0)
+			return -1;
+		dfu_quirk_set(&p->quirks, quirk);
+	}
+	return 0;
+}
+
+static int _parse_ms(const char *value, unsigned int *ms)
+{
+	char *end;
+
+	*ms = strtoul(value, &end, 0);
+	return *end || end == value ? -1 : 0;
+}
+
+static int _parse_setting(struct dfu_profile *p, char *key, char *value)
+{
+	if (!strcmp(key, "name")) {
+		snprintf(p->name, sizeof(p->name), "%s", value);
+		return 0;
+	}
+	if (!strcmp(key, "quirks"))
+		return _parse_quirks(p, value);
+	if (!strcmp(key, "transfer-size")) {
+		p->set |= DFU_PROFILE_TRANSFER_SIZE;
+		return _parse_ms(value, &p->transfer_size);
+	}
+	if (!strcmp(key, "poll-timeout")) {
+		p->set |= DFU_PROFILE_POLL_TIMEOUT;
+		return _parse_ms(value, &p->poll_timeout);
+	}
+	if (!strcmp(key, "poll-floor")) {
+		p->set |= DFU_PROFILE_POLL_FLOOR;
+		return _parse_ms(value, &p->poll_floor);
+	}
+	if (!strcmp(key, "detach-timeout")) {
+		p->set |= DFU_PROFILE_DETACH_TIMEOUT;
+		return _parse_ms(value, &p->detach_timeout);
+	}
+	if (!strcmp(key, "reset-delay")) {
+		p->set |= DFU_PROFILE_RESET_DELAY;
+		return _parse_ms(value, &p->reset_delay);
+	}
+	if (!strcmp(key, "verify")) {
+		p->set |= DFU_PROFILE_VERIFY;
+		if (!strcmp(value, "cached"))
+			p->verify = DFU_VERIFY_CACHED;
+		else if (!strcmp(value, "always"))
+			p->verify = DFU_VERIFY_ALWAYS;
+		else if (!strcmp(value, "never"))
+			p->verify = DFU_VERIFY_NEVER;
+		else
+			return -1;
+		return 0;
+	}
+	if (!strcmp(key, "timeouts")) {
+		p->set |= DFU_PROFILE_TIMEOUTS;
+		if (!strcmp(value, "adaptive"))
+			p->fixed_timeouts = 0;
+		else if (!strcmp(value, "fixed"))
+			p->fixed_timeouts = 1;
+		else
+			return -1;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * parse a profile line and add it to the index
+ *
+ * @return 0, or < 0 if the line is malformed
+ */
+static int _parse_line(const char *text, const char *source,
+		       unsigned int lineno)
+{
+	struct profile_entry *e;
+	struct dfu_profile p;
+	uint16_t idVendor, idProduct, bcdDevice;
+	unsigned int wild;
+	char line[512], *tok, *save;
+
+	snprintf(line, sizeof(line), "%s", text);
+	if ((tok = strchr(line, '#')))
+		*tok = '\0';
+
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
+		return 0;
+
+	if (_parse_pattern(tok, &idVendor, &idProduct, &bcdDevice, &wild) < 0) {
+		fprintf(stderr, "%s:%u: invalid device `%s'\n",
+			source, lineno, tok);
+		return -1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		char *value = strchr(tok, '=');
+
+		if (value)
+			*value++ = '\0';
+		if (!value || _parse_setting(&p, tok, value) < 0) {
+			fprintf(stderr, "%s:%u: invalid setting `%s%s%s'\n",
+				source, lineno, tok, value ? "=" : "",
+				value ? value : "");
+			return -1;
+		}
+	}
+
+	e = _find(idVendor, idProduct, bcdDevice, wild);
+	if (!e) {
+		unsigned int bucket;
+
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			return -1;
+		e->idVendor = idVendor;
+		e->idProduct = idProduct;
+		e->bcdDevice = bcdDevice;
+		e->wild = wild;
+		bucket = _hash(idVendor, idProduct, bcdDevice, wild);
+		e->next = profile_index[bucket];
+		profile_index[bucket] = e;
+	}
+	_merge(&e->profile, &p);
+	return 0;
+}
+
+static void _load_file(const char *path)
+{
+	char line[512];
+	unsigned int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		_parse_line(line, path, ++lineno);
+	fclose(f);
+}
+
+static void _load(void)
+{
+	char path[4096];
+	const char *env;
+	unsigned int i;
+
+	if (profiles_loaded)
+		return;
+	profiles_loaded = 1;
+
+	for (i = 0; builtin_profiles[i]; i++)
+		_parse_line(builtin_profiles[i], "built-in", i + 1);
+
+	_load_file(DFU_PROFILE_SYSTEM_FILE);
+
+	if ((env = getenv("DFU_UTIL_PROFILES")) && *env)
+		snprintf(path, sizeof(path), "%s", env);
+	else if ((env = getenv("XDG_CONFIG_HOME")) && *env)
+		snprintf(path, sizeof(path), "%s/dfu-util/profiles", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(path, sizeof(path), "%s/.config/dfu-util/profiles",
+			 env);
+	else
+		return;
+	_load_file(path);
+}
+
+/**
+ * the profile of a device, merged from all patterns matching it
+ *
+ * @return the profile, never NULL. It stays valid until exit.
+ */
+const struct dfu_profile *dfu_profile_lookup(uint16_t idVendor,
+					     uint16_t idProduct,
+					     uint16_t bcdDevice)
+{
+	struct profile_result *r;
+	unsigned int i;
+
+	if (profiles_disabled)
+		return &profile_default;
+
+	for (r = profile_results; r; r = r->next)
+		if (r->idVendor == idVendor && r->idProduct == idProduct &&
+		    r->bcdDevice == bcdDevice)
+			return &r->profile;
+
+	_load();
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return &profile_default;
+	r->idVendor = idVendor;
+	r->idProduct = idProduct;
+	r->bcdDevice = bcdDevice;
+
+	for (i = 0; i < sizeof(match_order) / sizeof(match_order[0]); i++) {
+		struct profile_entry *e = _find(idVendor, idProduct,
+						bcdDevice, match_order[i]);
+		if (e)
+			_merge(&r->profile, &e->profile);
+	}
+
+	r->next = profile_results;
+	profile_results = r;
+	return &r->profile;
+}
+
+void dfu_profile_print(const struct dfu_profile *p)
+{
+	static const char *verify[] = { "cached", "always", "never" };
+
+	printf("%s", p->name[0] ? p->name : "(unnamed)");
+	if (p->set & DFU_PROFILE_TRANSFER_SIZE)
+		printf(", transfer size %u", p->transfer_size);
+	if (p->set & DFU_PROFILE_POLL_TIMEOUT)
+		printf(", poll timeout %u ms", p->poll_timeout);
+	if (p->set & DFU_PROFILE_POLL_FLOOR)
+		printf(", poll timeout at least %u ms", p->poll_floor);
+	if (p->set & DFU_PROFILE_DETACH_TIMEOUT)
+		printf(", detach timeout %u ms", p->detach_timeout);
+	if (p->set & DFU_PROFILE_RESET_DELAY)
+		printf(", reset delay %u ms", p->reset_delay);
+	if (p->set & DFU_PROFILE_VERIFY)
+		printf(", verify %s", verify[p->verify]);
+	if (p->set & DFU_PROFILE_TIMEOUTS)
+		printf(", %s timeouts", p->fixed_timeouts ? "fixed" : "adaptive");
+	if (!dfu_quirks_is_empty((dfu_quirks *) &p->quirks)) {
+		printf(", quirks ");
+		dfu_quirks_print_set((dfu_quirks *) &p->quirks);
+	}
+	printf("\n");
+}
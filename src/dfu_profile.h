@@ -0,0 +1,71 @@
+/*
+ * dfu-util - per-device profiles
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_PROFILE_H
+#define _DFU_PROFILE_H
+
+#include <stdint.h>
+#include "dfu_quirks.h"
+
+/* the system wide profiles, read before the user's */
+#define DFU_PROFILE_SYSTEM_FILE	"/etc/dfu-util/profiles"
+/* buckets of the profile index, a power of two */
+#define DFU_PROFILE_BUCKETS	256
+
+/* dfu_profile.set: the settings a profile carries */
+#define DFU_PROFILE_TRANSFER_SIZE	0x0001
+#define DFU_PROFILE_POLL_TIMEOUT	0x0002
+#define DFU_PROFILE_POLL_FLOOR		0x0004
+#define DFU_PROFILE_DETACH_TIMEOUT	0x0008
+#define DFU_PROFILE_RESET_DELAY		0x0010
+#define DFU_PROFILE_VERIFY		0x0020
+#define DFU_PROFILE_TIMEOUTS		0x0040
+
+/* how much checking a downloaded image gets */
+enum dfu_verify {
+	DFU_VERIFY_CACHED = 0,	/* check the suffix CRC, use the cache */
+	DFU_VERIFY_ALWAYS,	/* check the suffix CRC, never cached */
+	DFU_VERIFY_NEVER,	/* trust the image */
+};
+
+/**
+ * quirks and tuning of one device model, or of all devices matching
+ * a pattern. Settings not in @p set are the DFU defaults.
+ */
+struct dfu_profile {
+	char name[32];
+	dfu_quirks quirks;
+	unsigned int set;
+	unsigned int transfer_size;	/* replaces wTransferSize */
+	unsigned int poll_timeout;	/* ms, replaces bwPollTimeout */
+	unsigned int poll_floor;	/* ms, bwPollTimeout is at least */
+	unsigned int detach_timeout;	/* ms, wTimeout of DFU_DETACH */
+	unsigned int reset_delay;	/* ms to wait for re-enumeration */
+	enum dfu_verify verify;
+	int fixed_timeouts;		/* don't adapt request timeouts */
+};
+
+const struct dfu_profile *dfu_profile_lookup(uint16_t idVendor,
+					     uint16_t idProduct,
+					     uint16_t bcdDevice);
+void dfu_profile_disable(void);
+void dfu_profile_print(const struct dfu_profile *p);
+
+#endif
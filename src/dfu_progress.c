@@ -0,0 +1,388 @@
+/*
+ * dfu-util - transfer progress
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * The transfer loops only add to a counter per device, without locks
+ * or system calls. A thread of its own samples the counters at a fixed
+ * interval, averages the throughput and renders it, so a slow console
+ * costs the transfer nothing. The average is exponentially weighted
+ * with a time constant of DFU_PROGRESS_TAU_MS, independent of the
+ * interval, which keeps the ETA steady over blocks of uneven speed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dfu_progress.h"
+#include "dfu_clock.h"
+
+static int _finished(int state)
+{
+	return state == DFU_PROGRESS_DONE || state == DFU_PROGRESS_FAILED;
+}
+
+/**
+ * render at most every @p interval ms, or at the default rate for
+ * the terminal or file on stdout if it is 0. Up to @p max_devs
+ * devices may be registered. @p p has to be freed even if this fails.
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_progress_init(struct dfu_progress *p, enum dfu_progress_mode mode,
+		      unsigned int interval, int max_devs)
+{
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	p->devs = calloc(max_devs, sizeof(*p->devs));
+	if (!p->devs)
+		return -ENOMEM;
+	p->alloc = max_devs;
+	p->mode = mode;
+	p->tty = mode == DFU_PROGRESS_BAR && isatty(STDOUT_FILENO);
+	if (!interval)
+		interval = p->tty ? DFU_PROGRESS_MS : DFU_PROGRESS_PIPE_MS;
+	p->interval = interval;
+	p->start = dfu_clock_ms();
+	return 0;
+}
+
+/**
+ * register a device called @p name. Devices are only registered by
+ * one thread, but may be while the renderer runs.
+ *
+ * @return the device's counters, or NULL if there is no room left
+ */
+struct dfu_progress_dev *dfu_progress_dev(struct dfu_progress *p,
+					  const char *name)
+{
+	struct dfu_progress_dev *d;
+
+	if (!p || p->count >= p->alloc)
+		return NULL;
+	d = &p->devs[p->count];
+	d->owner = p;
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	/* the renderer only looks at devices filled in completely */
+	__atomic_store_n(&p->count, p->count + 1, __ATOMIC_RELEASE);
+	return d;
+}
+
+/* take a sample of every device, and update its average rate */
+static void _sample(struct dfu_progress *p, unsigned long long now)
+{
+	int i, count = __atomic_load_n(&p->count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		struct dfu_progress_dev *d = &p->devs[i];
+		int state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+		unsigned long long bytes, dt, t;
+		double rate;
+
+		if (state == DFU_PROGRESS_IDLE)
+			continue;
+		bytes = __atomic_load_n(&d->bytes, __ATOMIC_RELAXED);
+		if (!d->last) {
+			d->last = d->start;
+			d->last_bytes = d->base;
+		}
+		/* a finished device is sampled at its end */
+		t = _finished(state) ? d->end : now;
+		dt = t > d->last ? t - d->last : 0;
+		if (dt) {
+			rate = (bytes - d->last_bytes) * 1000.0 / dt;
+			if (d->rate == 0)
+				d->rate = rate;
+			else
+				d->rate += (rate - d->rate) * dt /
+					(DFU_PROGRESS_TAU_MS + dt);
+			d->last = t;
+			d->last_bytes = bytes;
+		}
+	}
+}
+
+static const char *_size(char *buf, size_t len, double bytes)
+{
+	if (bytes < 1024 * 1024)
+		snprintf(buf, len, "%.1f KiB", bytes / 1024);
+	else if (bytes < 1024 * 1024 * 1024)
+		snprintf(buf, len, "%.1f MiB", bytes / (1024 * 1024));
+	else
+		snprintf(buf, len, "%.2f GiB", bytes / (1024 * 1024 * 1024));
+	return buf;
+}
+
+/* seconds left, or -1 if unknown */
+static long _eta(const struct dfu_progress_dev *d, unsigned long long bytes,
+		 unsigned long long total)
+{
+	if (!total || bytes >= total || d->rate < 1)
+		return -1;
+	return (total - bytes) / d->rate + 0.5;
+}
+
+/* one device as a line of text, without a line break */
+static void _line(struct dfu_progress *p, struct dfu_progress_dev *d,
+		  int state)
+{
+	unsigned long long bytes = __atomic_load_n(&d->bytes, __ATOMIC_RELAXED);
+	unsigned long long total = __atomic_load_n(&d->total, __ATOMIC_RELAXED);
+	char a[16], b[16], c[16];
+	long eta;
+
+	if (p->count > 1)
+		printf("%-12s ", d->name);
+
+	if (total) {
+		int i, fill = bytes >= total ? DFU_PROGRESS_WIDTH :
+			bytes * DFU_PROGRESS_WIDTH / total;
+
+		putchar('[');
+		for (i = 0; i < DFU_PROGRESS_WIDTH; i++)
+			putchar(i < fill ? '#' : ' ');
+		printf("] %3u%%  %s of %s", (unsigned int)
+		       (bytes >= total ? 100 : bytes * 100 / total),
+		       _size(a, sizeof(a), bytes), _size(b, sizeof(b), total));
+	} else
+		printf("%s", _size(a, sizeof(a), bytes));
+
+	if (_finished(state)) {
+		unsigned long long ms = d->end - d->start;
+
+		printf("  %s in %llu.%llu s", state == DFU_PROGRESS_DONE ?
+		       "done" : "FAILED", ms / 1000, ms % 1000 / 100);
+		if (ms)
+			printf(", %s/s", _size(c, sizeof(c), (bytes - d->base) *
+					       1000.0 / ms));
+		return;
+	}
+
+	printf("  %s/s", _size(c, sizeof(c), d->rate));
+	eta = _eta(d, bytes, total);
+	if (eta >= 3600)
+		printf("  ETA %ld:%02ld:%02ld", eta / 3600, eta / 60 % 60,
+		       eta % 60);
+	else if (eta >= 0)
+		printf("  ETA %ld:%02ld", eta / 60, eta % 60);
+}
+
+static void _json(struct dfu_progress *p, struct dfu_progress_dev *d,
+		  int state, unsigned long long now)
+{
+	static const char *states[] = {
+		[DFU_PROGRESS_IDLE] = "idle",
+		[DFU_PROGRESS_RUNNING] = "running",
+		[DFU_PROGRESS_DONE] = "done",
+		[DFU_PROGRESS_FAILED] = "failed",
+	};
+	unsigned long long bytes = __atomic_load_n(&d->bytes, __ATOMIC_RELAXED);
+	unsigned long long total = __atomic_load_n(&d->total, __ATOMIC_RELAXED);
+	const char *c;
+	long eta;
+
+	printf("{\"time\":%llu,\"device\":\"", now - p->start);
+	for (c = d->name; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			putchar('\\');
+		putchar(*c);
+	}
+	printf("\",\"state\":\"%s\",\"bytes\":%llu,\"total\":%llu,"
+	       "\"rate\":%.0f", states[state], bytes, total, d->rate);
+	eta = _finished(state) ? -1 : _eta(d, bytes, total);
+	if (eta >= 0)
+		printf(",\"eta\":%ld}\n", eta);
+	else
+		printf(",\"eta\":null}\n");
+}
+
+/* draw all devices, with p->lock held. If @p final is set, this is
+ * the last time. Unless drawing over the lines on a terminal, only
+ * @p only is drawn if it isn't NULL. */
+static void _render(struct dfu_progress *p, int final,
+		    struct dfu_progress_dev *only)
+{
+	unsigned long long now = dfu_clock_ms();
+	int i, count, pending = 0, lines = 0;
+
+	if (p->mode == DFU_PROGRESS_NONE)
+		return;
+	_sample(p, now);
+	count = __atomic_load_n(&p->count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++)
+		if (p->devs[i].last && !p->devs[i].reported)
+			pending++;
+	if (!pending)
+		return;
+
+	/* draw over the lines of the last render */
+	if (p->tty && p->lines > 1)
+		printf("\033[%dA", p->lines - 1);
+
+	for (i = 0; i < count; i++) {
+		struct dfu_progress_dev *d = &p->devs[i];
+		int state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+
+		/* finished devices stay in the block until all are */
+		if (!d->last || (d->reported && !(p->tty && p->lines)) ||
+		    (only && d != only && !p->tty))
+			continue;
+
+		if (p->mode == DFU_PROGRESS_JSON)
+			_json(p, d, state, now);
+		else {
+			if (p->tty && lines)
+				putchar('\n');
+			if (p->tty)
+				putchar('\r');
+			_line(p, d, state);
+			lines++;
+			if (p->tty)
+				printf("\033[K");
+			else
+				putchar('\n');
+		}
+		if (_finished(state))
+			d->reported = 1;
+		else
+			pending = -1;
+	}
+
+	/* once nothing runs anymore, leave the lines behind */
+	if (p->tty) {
+		p->lines = lines;
+		if (final || pending > 0) {
+			putchar('\n');
+			p->lines = 0;
+			for (i = 0; i < count; i++)
+				p->devs[i].reported = p->devs[i].last != 0;
+		}
+	}
+	fflush(stdout);
+}
+
+static void *_render_thread(void *arg)
+{
+	struct dfu_progress *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += p->interval / 1000;
+		ts.tv_nsec += (p->interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&p->wake, &p->lock, &ts) ==
+		    ETIMEDOUT && !p->stop)
+			_render(p, 0, NULL);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/**
+ * start rendering
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_progress_start(struct dfu_progress *p)
+{
+	if (!p || p->mode == DFU_PROGRESS_NONE || p->running)
+		return 0;
+	if (pthread_create(&p->thread, NULL, _render_thread, p) != 0) {
+		perror("progress");
+		return -1;
+	}
+	p->running = 1;
+	return 0;
+}
+
+/* stop rendering, after a last render of what changed since */
+void dfu_progress_stop(struct dfu_progress *p)
+{
+	if (!p)
+		return;
+	if (p->running) {
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_signal(&p->wake);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->thread, NULL);
+		p->running = 0;
+	}
+	pthread_mutex_lock(&p->lock);
+	_render(p, 1, NULL);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void dfu_progress_free(struct dfu_progress *p)
+{
+	if (!p)
+		return;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->wake);
+	free(p->devs);
+	p->devs = NULL;
+}
+
+/* the transfer of @p total bytes (0 if unknown) starts, @p done of
+ * them were transferred before */
+void dfu_progress_begin(struct dfu_progress_dev *d, unsigned long long total,
+			unsigned long long done)
+{
+	if (!d)
+		return;
+	d->start = dfu_clock_ms();
+	d->base = done;
+	__atomic_store_n(&d->total, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bytes, done, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->state, DFU_PROGRESS_RUNNING, __ATOMIC_RELEASE);
+}
+
+void dfu_progress_add(struct dfu_progress_dev *d, unsigned int bytes)
+{
+	if (d)
+		__atomic_fetch_add(&d->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* the transfer is over, unless it was ended before. The result is
+ * rendered at once, so it comes before whatever the caller prints
+ * next. */
+void dfu_progress_end(struct dfu_progress_dev *d, int ok)
+{
+	if (!d || _finished(__atomic_load_n(&d->state, __ATOMIC_RELAXED)))
+		return;
+	d->end = dfu_clock_ms();
+	__atomic_store_n(&d->state, ok ? DFU_PROGRESS_DONE : DFU_PROGRESS_FAILED,
+			 __ATOMIC_RELEASE);
+	pthread_mutex_lock(&d->owner->lock);
+	_render(d->owner, 0, d);
+	pthread_mutex_unlock(&d->owner->lock);
+}
@@ -0,0 +1,107 @@
+/*
+ * dfu-util - transfer progress
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_PROGRESS_H
+#define _DFU_PROGRESS_H
+
+#include <pthread.h>
+
+/* render interval on a terminal, and when writing to a file or pipe */
+#define DFU_PROGRESS_MS		250
+#define DFU_PROGRESS_PIPE_MS	2000
+/* time constant of the throughput average */
+#define DFU_PROGRESS_TAU_MS	2000
+/* width of the bar */
+#define DFU_PROGRESS_WIDTH	30
+
+enum dfu_progress_mode {
+	DFU_PROGRESS_BAR,		/* a line per device */
+	DFU_PROGRESS_JSON,		/* a JSON object per device and render */
+	DFU_PROGRESS_NONE,
+};
+
+enum dfu_progress_state {
+	DFU_PROGRESS_IDLE,
+	DFU_PROGRESS_RUNNING,
+	DFU_PROGRESS_DONE,
+	DFU_PROGRESS_FAILED,
+};
+
+/**
+ * one device's transfer. The counters are written by the thread doing
+ * the transfer and read by the renderer, with atomic accesses only;
+ * the times are set before @p state changes. The rest belongs to the
+ * renderer.
+ */
+struct dfu_progress_dev {
+	struct dfu_progress *owner;
+	char name[40];
+
+	unsigned long long bytes;
+	unsigned long long total;	/* 0 if not known */
+	int state;
+	unsigned long long start;	/* ms */
+	unsigned long long end;
+	unsigned long long base;	/* bytes done before, e.g. resumed */
+
+	unsigned long long last;	/* ms of the last sample */
+	unsigned long long last_bytes;
+	double rate;			/* bytes/s, averaged */
+	int reported;			/* the final state was rendered */
+};
+
+/**
+ * samples the counters of all devices every @p interval ms on a
+ * thread of its own, so the transfer loops never block on the
+ * console
+ */
+struct dfu_progress {
+	enum dfu_progress_mode mode;
+	unsigned int interval;
+	int tty;
+
+	struct dfu_progress_dev *devs;
+	int count;			/* registered, read atomically */
+	int alloc;
+
+	pthread_mutex_t lock;		/* held while rendering */
+	pthread_cond_t wake;
+	pthread_t thread;
+	int running;
+	int stop;
+	int lines;			/* drawn by the last render */
+	unsigned long long start;
+};
+
+int dfu_progress_init(struct dfu_progress *p, enum dfu_progress_mode mode,
+		      unsigned int interval, int max_devs);
+struct dfu_progress_dev *dfu_progress_dev(struct dfu_progress *p,
+					  const char *name);
+int dfu_progress_start(struct dfu_progress *p);
+void dfu_progress_stop(struct dfu_progress *p);
+void dfu_progress_free(struct dfu_progress *p);
+
+void dfu_progress_begin(struct dfu_progress_dev *d, unsigned long long total,
+			unsigned long long done);
+void dfu_progress_add(struct dfu_progress_dev *d, unsigned int bytes);
+void dfu_progress_end(struct dfu_progress_dev *d, int ok);
+
+#endif
@@ -20,7 +20,10 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "dfu_quirks.h"
+#include "dfu_profile.h"
 
 typedef struct _dfu_quirk_descriptor {
 	unsigned int id;
@@ -55,78 +58,63 @@ dfu_quirk_descriptor _quirks[] = {
 void dfu_quirk_set(dfu_quirks *quirks,
 		   enum DFU_QUIRK quirk)
 {
-	if(!quirks)
+	if(!quirks || quirk >= DFU_QUIRK_MAX)
 		return;
-	(quirks->q1) |= (1<<quirk);
+	quirks->bits[quirk / 32] |= 1u << (quirk % 32);
 }
 void dfu_quirk_clear(dfu_quirks *quirks,
 		     enum DFU_QUIRK quirk)
 {
-	if(!quirks)
+	if(!quirks || quirk >= DFU_QUIRK_MAX)
 		return;
-	(quirks->q1) &= ~ (1<<quirk);
+	quirks->bits[quirk / 32] &= ~(1u << (quirk % 32));
 }
 int dfu_quirk_is_set(dfu_quirks *quirks,
 		     enum DFU_QUIRK quirk)
 {
-	if(!quirks)
+	if(!quirks || quirk >= DFU_QUIRK_MAX)
 		return 0;
-	return 	(quirks->q1) & (1<<quirk);
+	return (quirks->bits[quirk / 32] >> (quirk % 32)) & 1;
 }
 
 void dfu_quirks_clear(dfu_quirks *quirks)
 {
 	if(!quirks)
 		return;
-	quirks->q1 = 0;
+	memset(quirks, 0, sizeof(*quirks));
 }
 
-dfu_quirks dfu_quirks_detect(uint16_t bcdDFU, uint16_t idVendor, uint16_t idProduct, uint16_t bcdDevice)
+/**
+ * find a quirk by its name, with or without the QUIRK_ prefix, or by
+ * its number
+ *
+ * @return the quirk ID, or < 0 if there is no such quirk
+ */
+int dfu_quirk_lookup(const char *name)
 {
-	dfu_quirks q;
-	dfu_quirks_clear(&q);
+	char *end;
+	int i;
 
-	/* http://wiki.openmoko.org/wiki/USB_Product_IDs, 2010-04-09 */
-	switch(idVendor)
-	{
-	case 0x1d50:
-		switch(idProduct)
-		{
-		case 0x1db5: 	/* IDBG in DFU mode */
-		case 0x1db6:    /* IDBG in normal mode */
-			break;
-		}
-		break;
+	i = strtol(name, &end, 0);
+	if (end != name && !*end)
+		return i > 0 && i < DFU_QUIRK_COUNT ? i : -1;
 
-	case 0x1457:		/* FIC, Inc */
-	case 0x5117:		/* Openmoko, Inc */
-		switch(idProduct)
-		{
-		case 0x5117:	/* Neo1973/FreeRunner kernel usbnet (g_ether, CDC Ethernet) Mode */
-
-		case 0x5118: 	/* Debug Board (FT2232D) for Neo1973/FreeRunner  */
-		case 0x5119: 	/* Neo1973/FreeRunner u-boot usbtty CDC ACM Mode  */
-		case 0x511a: 	/* HXD8 u-boot usbtty CDC ACM Mode  */
-		case 0x511b: 	/* SMDK2440 u-boot usbtty CDC ACM mode  */
-		case 0x511c: 	/* SMDK2443 u-boot usbtty CDC ACM mode  */
-		case 0x511d: 	/* QT2410 u-boot usbtty CDC ACM mode  */
-		case 0x511e: 	/* Reserved  */
-		case 0x511f: 	/* Reserved  */
-		case 0x5120: 	/* Neo1973/FreeRunner u-boot generic serial Mode  */
-		case 0x5121: 	/* Neo1973/FreeRunner kernel mass storage (g_storage) Mode  */
-		case 0x5122: 	/* Neo1973/FreeRunner kernel usbnet (g_ether, RNDIS) Mode  */
-		case 0x5123: 	/* Neo1973/FreeRunner internal USB Bluetooth CSR4 module  */
-		case 0x5124: 	/* Neo1973/FreeRunner Bluetooth Device ID service  */
-		case 0x5125: 	/* TBD  */
-		case 0x5126: 	/* TBD */
-			/* todo limit bcdDevice version. */
-			dfu_quirk_set(&q, QUIRK_OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT);
-			break;
-		}
-		break;
+	if (!strncmp(name, "QUIRK_", 6))
+		name += 6;
+	for(i = 1; i < DFU_QUIRK_COUNT; ++i)
+	{
+		if(!strcmp(_quirks[i].name + 6, name))
+			return i;
 	}
+	return -1;
+}
 
-	return q;
+/* the quirks of a device, from its profile (see dfu_profile.c). The
+   profiles don't match on bcdDFU, as quirks are needed before the
+   functional descriptor can be read. */
+dfu_quirks dfu_quirks_detect(uint16_t bcdDFU, uint16_t idVendor, uint16_t idProduct, uint16_t bcdDevice)
+{
+	return dfu_profile_lookup(idVendor, idProduct, bcdDevice)->quirks;
 }
 
 void dfu_quirks_print()
@@ -170,9 +158,16 @@ void dfu_quirks_print_set(dfu_quirks *quirks)
 
 int dfu_quirks_is_empty(dfu_quirks *quirks)
 {
+	unsigned int i;
+
 	if(!quirks)
 		return 1;
-	return quirks->q1 == 0;
+	for(i = 0; i < DFU_QUIRK_MAX / 32; ++i)
+	{
+		if(quirks->bits[i])
+			return 0;
+	}
+	return 1;
 }
 
 
@@ -46,9 +46,12 @@ typedef struct _dfu_quirk_apply_entry {
 	uint16_t apply_bcdDFU;	    /* Version, or 0xffff for any DFU version */
 } dfu_quirk_apply_entry;
 
+/* room for this many quirks, whatever DFU_QUIRK_COUNT is now */
+#define DFU_QUIRK_MAX	128
+
 /* internal storage of a set of quirks */
 typedef struct _dfu_quirks {
-	unsigned int q1;
+	uint32_t bits[DFU_QUIRK_MAX / 32];
 } dfu_quirks;
 
 void dfu_quirks_print();
@@ -65,6 +68,7 @@ void dfu_quirk_clear(dfu_quirks *quirks,
 int dfu_quirk_is_set(dfu_quirks *quirks,
 		     enum DFU_QUIRK quirk);
 int dfu_quirks_is_empty(dfu_quirks *quirks);
+int dfu_quirk_lookup(const char *name);
 
 dfu_quirks dfu_quirks_detect(uint16_t bcdDFU, uint16_t idVendor, uint16_t idProduct, uint16_t bcdDevice);
 
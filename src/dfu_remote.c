@@ -0,0 +1,646 @@
+/*
+ * dfu-util - DFU requests over a stream socket
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * An agent on the PC a device is attached to serves the
+ * dfu_transition_handlers of that device to one client, which uses
+ * them through a handler table of its own. The state machine runs on
+ * the client only; the agent executes the bare requests.
+ *
+ * Every request is answered by exactly one reply. Downloads use
+ * DFU_REMOTE_DNLOAD_BLOCK, which covers all requests for a block, so
+ * the link latency is paid once per block instead of once per
+ * request. bwPollTimeout waits within a block happen on the agent.
+ *
+ * Addresses are "unix:PATH", or any PATH containing a slash, for a
+ * local socket, and "HOST:PORT" for TCP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "dfu.h"
+#include "dfu_sm.h"
+#include "dfu_remote.h"
+#include "dfu_clock.h"
+
+struct remote {
+	int fd;
+	unsigned char buf[DFU_REMOTE_MAX_DATA];
+};
+
+#define REMOTE(handle) ((struct remote *) (handle)->transport)
+
+/* socket helpers */
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int _read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int _send(int fd, struct dfu_remote_msg *msg, const void *data)
+{
+	uint32_t length = msg->length;
+
+	msg->op = htonl(msg->op);
+	msg->result = htonl(msg->result);
+	msg->value = htonl(msg->value);
+	msg->want = htonl(msg->want);
+	msg->length = htonl(msg->length);
+
+	if (_write_all(fd, msg, sizeof(*msg)) < 0)
+		return -1;
+	if (length && _write_all(fd, data, length) < 0)
+		return -1;
+	return 0;
+}
+
+/* receive a message, with up to @p max bytes of data into @p data */
+static int _recv(int fd, struct dfu_remote_msg *msg, void *data, size_t max)
+{
+	if (_read_all(fd, msg, sizeof(*msg)) < 0)
+		return -1;
+
+	msg->op = ntohl(msg->op);
+	msg->result = ntohl(msg->result);
+	msg->value = ntohl(msg->value);
+	msg->want = ntohl(msg->want);
+	msg->length = ntohl(msg->length);
+
+	if (msg->length > max) {
+		fprintf(stderr, "remote: message of %u bytes is too long\n",
+			msg->length);
+		return -1;
+	}
+	if (msg->length && _read_all(fd, data, msg->length) < 0)
+		return -1;
+	return 0;
+}
+
+/* split "HOST:PORT", or recognize a local socket path */
+static int _is_local(const char *addr, const char **path)
+{
+	if (!strncmp(addr, "unix:", 5)) {
+		*path = addr + 5;
+		return 1;
+	}
+	*path = addr;
+	return strchr(addr, '/') != NULL;
+}
+
+/*
+ * parse "HOST:PORT". HOST is an IPv4 address, an IPv6 one in brackets,
+ * localhost, or empty for any address (listening) or this host. Names
+ * are not looked up, so the static build needs no NSS modules.
+ */
+static int _inet_addr(struct sockaddr_storage *ss, socklen_t *len,
+		      const char *addr, int passive)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+	const char *port = strrchr(addr, ':'), *h = addr;
+	unsigned long portnum;
+	char host[64], *end;
+	size_t n;
+
+	if (!port)
+		goto bad;
+	portnum = strtoul(port + 1, &end, 10);
+	if (*end || end == port + 1 || portnum > 0xffff)
+		goto bad;
+
+	n = port - addr;
+	if (n >= 2 && addr[0] == '[' && addr[n-1] == ']') {
+		h++;
+		n -= 2;
+	}
+	if (n >= sizeof(host))
+		goto bad;
+	memcpy(host, h, n);
+	host[n] = '\0';
+
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(portnum);
+		*len = sizeof(*sin6);
+		return 0;
+	}
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(portnum);
+	*len = sizeof(*sin);
+	if (!host[0])
+		sin->sin_addr.s_addr = htonl(passive ? INADDR_ANY :
+					     INADDR_LOOPBACK);
+	else if (!strcmp(host, "localhost"))
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+		goto bad;
+	return 0;
+
+ bad:
+	fprintf(stderr, "remote: address `%s' is not HOST:PORT with an IP "
+		"address as HOST\n", addr);
+	return -1;
+}
+
+static int _unix_addr(struct sockaddr_un *sa, const char *path)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		fprintf(stderr, "remote: socket path `%s' is too long\n", path);
+		return -1;
+	}
+	strcpy(sa->sun_path, path);
+	return 0;
+}
+
+static void _nodelay(int fd)
+{
+	int one = 1;
+
+	/* requests are small and each waits for its reply */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int _listen(const char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	const char *path;
+	int fd, one = 1;
+
+	if (_is_local(addr, &path)) {
+		struct sockaddr_un sa;
+
+		if (_unix_addr(&sa, path) < 0)
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			goto out_err;
+		unlink(path);
+		if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+		    listen(fd, 1) < 0)
+			goto out_close;
+		return fd;
+	}
+
+	if (_inet_addr(&ss, &len, addr, 1) < 0)
+		return -1;
+	fd = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto out_err;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &ss, len) < 0 || listen(fd, 1) < 0)
+		goto out_close;
+	return fd;
+
+ out_close:
+	close(fd);
+ out_err:
+	fprintf(stderr, "remote: cannot listen on `%s': %s\n", addr,
+		strerror(errno));
+	return -1;
+}
+
+static int _connect(const char *addr)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	const char *path;
+	int fd = -1;
+
+	if (_is_local(addr, &path)) {
+		struct sockaddr_un sa;
+
+		if (_unix_addr(&sa, path) < 0)
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 &&
+		    connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		if (_inet_addr(&ss, &len, addr, 0) < 0)
+			return -1;
+		fd = socket(ss.ss_family, SOCK_STREAM, 0);
+		if (fd >= 0 &&
+		    connect(fd, (struct sockaddr *) &ss, len) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd >= 0)
+			_nodelay(fd);
+	}
+
+	if (fd < 0)
+		fprintf(stderr, "remote: cannot connect to `%s': %s\n", addr,
+			strerror(errno));
+	return fd;
+}
+
+static void _pack_status(uint8_t *buf, const struct dfu_status *status)
+{
+	buf[0] = status->bStatus;
+	buf[1] = status->bwPollTimeout & 0xff;
+	buf[2] = (status->bwPollTimeout >> 8) & 0xff;
+	buf[3] = (status->bwPollTimeout >> 16) & 0xff;
+	buf[4] = status->bState;
+	buf[5] = status->iString;
+}
+
+static void _unpack_status(struct dfu_status *status, const uint8_t *buf)
+{
+	status->bStatus = buf[0];
+	status->bwPollTimeout = buf[1] | (buf[2] << 8) | (buf[3] << 16);
+	status->bState = buf[4];
+	status->iString = buf[5];
+}
+
+/* agent */
+
+/* download a block and wait until the device is done with it */
+static int _agent_dnload_block(dfu_handle *handle, int transaction,
+			       unsigned short length, const char *data,
+			       struct dfu_status *status)
+{
+	const struct dfu_transition_handlers *h = dfu_handlers(handle);
+	int ret;
+
+	ret = h->download(handle, transaction, length, data);
+	if (ret < 0)
+		return ret;
+
+	for (;;) {
+		if (h->get_status(handle, status) < 0)
+			return -1;
+		dfu_sm_set_state_unchecked(handle, status->bState);
+		if (status->bState != DFU_STATE_dfuDNBUSY &&
+		    status->bState != DFU_STATE_dfuDNLOAD_SYNC)
+			break;
+
+		h->status_poll_timeout(handle,
+				       dfu_poll_timeout(handle, status));
+	}
+	return ret;
+}
+
+static int _agent_request(dfu_handle *handle, struct dfu_remote_msg *msg,
+			  unsigned char *buf)
+{
+	const struct dfu_transition_handlers *h = dfu_handlers(handle);
+	struct dfu_status status;
+	uint32_t length = msg->length;
+
+	msg->length = 0;
+	memset(&status, 0, sizeof(status));
+
+	switch (msg->op) {
+	case DFU_REMOTE_DETACH:
+		msg->result = h->detach(handle, msg->value);
+		break;
+	case DFU_REMOTE_RESET:
+		msg->result = h->device_reset(handle);
+		break;
+	case DFU_REMOTE_DNLOAD:
+		msg->result = h->download(handle, msg->value, length,
+					  length ? (char *) buf : NULL);
+		break;
+	case DFU_REMOTE_DNLOAD_BLOCK:
+		msg->result = _agent_dnload_block(handle, msg->value, length,
+						  (char *) buf, &status);
+		_pack_status(msg->status, &status);
+		break;
+	case DFU_REMOTE_UPLOAD:
+		if (msg->want > DFU_REMOTE_MAX_DATA) {
+			msg->result = -1;
+			break;
+		}
+		msg->result = h->upload(handle, msg->value, msg->want,
+					(char *) buf);
+		if (msg->result > 0)
+			msg->length = msg->result;
+		break;
+	case DFU_REMOTE_GETSTATUS:
+		msg->result = h->get_status(handle, &status);
+		if (msg->result >= 0)
+			dfu_sm_set_state_unchecked(handle, status.bState);
+		_pack_status(msg->status, &status);
+		break;
+	case DFU_REMOTE_CLRSTATUS:
+		msg->result = h->clear_status(handle);
+		break;
+	case DFU_REMOTE_GETSTATE:
+		msg->result = h->get_state(handle);
+		break;
+	case DFU_REMOTE_ABORT:
+		msg->result = h->abort(handle);
+		break;
+	default:
+		fprintf(stderr, "remote: unknown request %u\n", msg->op);
+		msg->result = -1;
+		break;
+	}
+	return 0;
+}
+
+/**
+ * serve the device of @p handle, which has to be in DFU mode, to one
+ * client connecting to @p addr
+ *
+ * @return 0 if the client said goodbye, < 0 on error
+ */
+int dfu_remote_serve(dfu_handle *handle, const char *addr,
+		     uint16_t idVendor, uint16_t idProduct,
+		     uint16_t bcdDevice, unsigned int transfer_size)
+{
+	struct dfu_remote_msg msg;
+	struct dfu_remote_hello hello;
+	unsigned char *buf;
+	const char *path;
+	int lfd, fd, ret = -1;
+	unsigned int requests = 0;
+
+	buf = malloc(DFU_REMOTE_MAX_DATA);
+	if (!buf)
+		return -ENOMEM;
+
+	lfd = _listen(addr);
+	if (lfd < 0)
+		goto out_free;
+
+	printf("Waiting for a client on %s...\n", addr);
+	do
+		fd = accept(lfd, NULL, NULL);
+	while (fd < 0 && errno == EINTR);
+	close(lfd);
+	if (_is_local(addr, &path))
+		unlink(path);
+	if (fd < 0) {
+		perror("accept");
+		goto out_free;
+	}
+	if (!_is_local(addr, &path))
+		_nodelay(fd);
+	printf("Client connected\n");
+
+	while (_recv(fd, &msg, buf, DFU_REMOTE_MAX_DATA) == 0) {
+		const void *data = buf;
+
+		requests++;
+		if (msg.op == DFU_REMOTE_BYE) {
+			ret = 0;
+			break;
+		}
+
+		if (msg.op == DFU_REMOTE_HELLO) {
+			memset(&hello, 0, sizeof(hello));
+			hello.magic = htonl(DFU_REMOTE_MAGIC);
+			hello.idVendor = htons(idVendor);
+			hello.idProduct = htons(idProduct);
+			hello.bcdDevice = htons(bcdDevice);
+			hello.interface = htons(handle->interface);
+			hello.transfer_size = htons(transfer_size);
+			hello.state = dfu_sm_get_state(handle);
+			hello.dfu_ver = handle->dfu_ver;
+			hello.func_dfu = handle->func_dfu;
+			msg.result = 0;
+			msg.length = sizeof(hello);
+			data = &hello;
+		} else
+			_agent_request(handle, &msg, buf);
+
+		if (_send(fd, &msg, data) < 0)
+			break;
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "Client went away\n");
+	printf("Served %u request(s)\n", requests);
+	close(fd);
+ out_free:
+	free(buf);
+	return ret;
+}
+
+/* client handlers */
+
+static int _call(dfu_handle *handle, uint32_t op, uint32_t value,
+		 const void *out, uint32_t length, void *in, uint32_t max,
+		 struct dfu_status *status)
+{
+	struct remote *r = REMOTE(handle);
+	struct dfu_remote_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = op;
+	msg.value = value;
+	msg.want = in ? max : 0;
+	msg.length = length;
+	if (_send(r->fd, &msg, out) < 0 ||
+	    _recv(r->fd, &msg, in ? in : r->buf, in ? max : 0) < 0) {
+		fprintf(stderr, "%s: connection to agent lost (current state: %s)\n",
+			__FUNCTION__,
+			dfu_state_to_string(dfu_sm_get_state(handle)));
+		return -1;
+	}
+	if (msg.op != op) {
+		fprintf(stderr, "%s: unexpected reply %u to request %u\n",
+			__FUNCTION__, msg.op, op);
+		return -1;
+	}
+	if (status)
+		_unpack_status(status, msg.status);
+	return msg.result;
+}
+
+static int _remote_detach(dfu_handle *handle, const unsigned short timeout)
+{
+	return _call(handle, DFU_REMOTE_DETACH, timeout, NULL, 0, NULL, 0, NULL);
+}
+
+static int _remote_device_reset(dfu_handle *handle)
+{
+	return _call(handle, DFU_REMOTE_RESET, 0, NULL, 0, NULL, 0, NULL);
+}
+
+/* waits outside of a block happen on this side */
+static int _remote_status_poll_timeout(dfu_handle *handle,
+				       unsigned int poll_timeout)
+{
+	dfu_clock_sleep_ms(poll_timeout);
+	return 0;
+}
+
+static int _remote_download(dfu_handle *handle, const int transaction,
+			    const unsigned short length, const char *data)
+{
+	return _call(handle, DFU_REMOTE_DNLOAD, transaction, data, length,
+		     NULL, 0, NULL);
+}
+
+static int _remote_download_block(dfu_handle *handle, const int transaction,
+				  const unsigned short length,
+				  const char *data, struct dfu_status *status)
+{
+	return _call(handle, DFU_REMOTE_DNLOAD_BLOCK, transaction, data,
+		     length, NULL, 0, status);
+}
+
+static int _remote_upload(dfu_handle *handle, const int transaction,
+			  const unsigned short length, char *data)
+{
+	return _call(handle, DFU_REMOTE_UPLOAD, transaction, NULL, 0, data,
+		     length, NULL);
+}
+
+static int _remote_get_status(dfu_handle *handle, struct dfu_status *status)
+{
+	return _call(handle, DFU_REMOTE_GETSTATUS, 0, NULL, 0, NULL, 0, status);
+}
+
+static int _remote_clear_status(dfu_handle *handle)
+{
+	return _call(handle, DFU_REMOTE_CLRSTATUS, 0, NULL, 0, NULL, 0, NULL);
+}
+
+static int _remote_get_state(dfu_handle *handle)
+{
+	return _call(handle, DFU_REMOTE_GETSTATE, 0, NULL, 0, NULL, 0, NULL);
+}
+
+static int _remote_abort(dfu_handle *handle)
+{
+	return _call(handle, DFU_REMOTE_ABORT, 0, NULL, 0, NULL, 0, NULL);
+}
+
+static const struct dfu_transition_handlers _remote_handlers = {
+	.detach = _remote_detach,
+	.device_reset = _remote_device_reset,
+	.status_poll_timeout = _remote_status_poll_timeout,
+	.download = _remote_download,
+	.upload = _remote_upload,
+	.get_status = _remote_get_status,
+	.clear_status = _remote_clear_status,
+	.get_state = _remote_get_state,
+	.abort = _remote_abort,
+	.download_block = _remote_download_block,
+};
+
+/**
+ * connect to the agent at @p addr, and set up @p handle to drive the
+ * device it serves
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_remote_attach(dfu_handle *handle, const char *addr,
+		      uint16_t *idVendor, uint16_t *idProduct,
+		      uint16_t *bcdDevice, unsigned int *transfer_size)
+{
+	struct dfu_remote_hello hello;
+	struct remote *r;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	r->fd = _connect(addr);
+	if (r->fd < 0) {
+		free(r);
+		return -1;
+	}
+
+	handle->handlers = &_remote_handlers;
+	handle->transport = r;
+
+	if (_call(handle, DFU_REMOTE_HELLO, 0, NULL, 0, &hello, sizeof(hello),
+		  NULL) < 0 || ntohl(hello.magic) != DFU_REMOTE_MAGIC) {
+		fprintf(stderr, "remote: `%s' is no dfu-util agent\n", addr);
+		dfu_remote_close(handle);
+		return -1;
+	}
+
+	*idVendor = ntohs(hello.idVendor);
+	*idProduct = ntohs(hello.idProduct);
+	*bcdDevice = ntohs(hello.bcdDevice);
+	*transfer_size = ntohs(hello.transfer_size);
+	handle->interface = ntohs(hello.interface);
+	handle->dfu_ver = hello.dfu_ver;
+	handle->func_dfu = hello.func_dfu;
+	dfu_sm_set_state_unchecked(handle, hello.state);
+	return 0;
+}
+
+/* say goodbye to the agent */
+void dfu_remote_close(dfu_handle *handle)
+{
+	struct remote *r = REMOTE(handle);
+	struct dfu_remote_msg msg;
+
+	if (!r)
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = DFU_REMOTE_BYE;
+	_send(r->fd, &msg, NULL);
+	close(r->fd);
+	free(r);
+	handle->handlers = NULL;
+	handle->transport = NULL;
+}
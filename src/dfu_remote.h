@@ -0,0 +1,84 @@
+/*
+ * dfu-util - DFU requests over a stream socket
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_REMOTE_H
+#define _DFU_REMOTE_H
+
+#include <stdint.h>
+
+#include "dfu.h"
+
+#define DFU_REMOTE_MAGIC	0x44465532	/* "DFU2" */
+/* largest data stage accepted */
+#define DFU_REMOTE_MAX_DATA	65535
+
+enum dfu_remote_op {
+	DFU_REMOTE_HELLO = 1,
+	DFU_REMOTE_DETACH,
+	DFU_REMOTE_RESET,
+	DFU_REMOTE_DNLOAD,
+	DFU_REMOTE_UPLOAD,
+	DFU_REMOTE_GETSTATUS,
+	DFU_REMOTE_CLRSTATUS,
+	DFU_REMOTE_GETSTATE,
+	DFU_REMOTE_ABORT,
+	/* DNLOAD, then GETSTATUS and wait for bwPollTimeout until the
+	   device is done with the block */
+	DFU_REMOTE_DNLOAD_BLOCK,
+	DFU_REMOTE_BYE,
+};
+
+/**
+ * header of every request and reply, in network byte order; @p length
+ * bytes of data follow. A request carries OUT data, a reply IN data.
+ */
+struct dfu_remote_msg {
+	uint32_t op;
+	int32_t result;		/* reply: what the handler returned */
+	uint32_t value;		/* request: wValue or timeout */
+	uint32_t want;		/* request: IN data wanted */
+	uint32_t length;
+	uint8_t status[6];	/* reply: GETSTATUS as sent by the device */
+	uint8_t pad[2];
+} __attribute__ ((packed));
+
+/* data of the reply to DFU_REMOTE_HELLO */
+struct dfu_remote_hello {
+	uint32_t magic;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint16_t interface;
+	uint16_t transfer_size;
+	uint8_t state;
+	uint8_t dfu_ver;
+	struct usb_dfu_func_descriptor func_dfu;	/* little endian */
+} __attribute__ ((packed));
+
+int dfu_remote_serve(dfu_handle *handle, const char *addr,
+		     uint16_t idVendor, uint16_t idProduct,
+		     uint16_t bcdDevice, unsigned int transfer_size);
+
+int dfu_remote_attach(dfu_handle *handle, const char *addr,
+		      uint16_t *idVendor, uint16_t *idProduct,
+		      uint16_t *bcdDevice, unsigned int *transfer_size);
+void dfu_remote_close(dfu_handle *handle);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * dfu-util - resuming interrupted transfers
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Devices which place every block by its wBlockNum (or by a DfuSe
+ * address) don't need a failed transfer to start over. After a failed
+ * block, the device is brought back to dfuIDLE with DFU_CLRSTATUS or
+ * DFU_ABORT, and the transfer goes on with the first block it hasn't
+ * acknowledged.
+ *
+ * So that a later run can do the same, progress is also saved next to
+ * the image, in a checkpoint file named like it plus
+ * DFU_RESUME_SUFFIX. It is written every DFU_RESUME_INTERVAL blocks
+ * and when a transfer fails, and removed when it succeeds. A checkpoint
+ * names the device it was taken with, so that an interrupted transfer
+ * is never continued with another board.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <usb.h>
+
+#include "dfu.h"
+#include "dfu_sm.h"
+#include "usb_dfu.h"
+#include "dfu_log.h"
+#include "dfu_resume.h"
+#include "dfu_clock.h"
+#include "dfu_sched.h"
+
+#define RESUME_HEADER "# dfu-util checkpoint v2\n"
+
+/*
+ * the device of @p handle: vendor, product and release, and its serial
+ * number or, without one, the port it is attached to. A device not on
+ * this host, e.g. behind an agent, goes by the name of the handle.
+ */
+static void _device_id(dfu_handle *handle, char *id, size_t len)
+{
+	struct usb_device *dev;
+	char serial[64];
+	size_t n;
+
+	if (!handle->device) {
+		snprintf(id, len, "%s", handle->name ? handle->name : "-");
+		goto out;
+	}
+
+	dev = usb_device(handle->device);
+	n = snprintf(id, len, "%04x:%04x:%04x:", dev->descriptor.idVendor,
+		     dev->descriptor.idProduct, dev->descriptor.bcdDevice);
+	if (n >= len)
+		goto out;
+	if (dev->descriptor.iSerialNumber &&
+	    usb_get_string_simple(handle->device,
+				  dev->descriptor.iSerialNumber,
+				  serial, sizeof(serial)) > 0)
+		snprintf(id + n, len - n, "serial=%s", serial);
+	else {
+		snprintf(id + n, len - n, "port=");
+		n = strlen(id);
+		dfu_sched_port(dev, id + n, len - n);
+	}
+ out:
+	/* a single word in the checkpoint */
+	for (; *id; id++)
+		if (!isgraph((unsigned char) *id))
+			*id = '_';
+}
+
+static int _load(struct dfu_resume *r)
+{
+	unsigned long long size, offset;
+	unsigned int crc, transfer_size, block;
+	char line[384], dir[8], device[128];
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(r->path, "r");
+	if (!f)
+		return 0;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, RESUME_HEADER) ||
+	    !fgets(line, sizeof(line), f) ||
+	    sscanf(line, "%7s device=%127s size=%llu crc=%x transfer-size=%u "
+		   "block=%u offset=%llu", dir, device, &size, &crc,
+		   &transfer_size, &block, &offset) != 7)
+		goto out;
+
+	/* a checkpoint of another transfer, or of another device */
+	if (strcmp(dir, r->upload ? "upload" : "dnload") ||
+	    strcmp(device, r->device) ||
+	    size != r->size || crc != r->crc ||
+	    transfer_size != r->transfer_size)
+		goto out;
+
+	r->block = block;
+	r->offset = offset;
+	ret = 1;
+ out:
+	fclose(f);
+	return ret;
+}
+
+/**
+ * prepare to checkpoint a transfer to or from (@p upload) the file
+ * @p fname and the device of @p handle. For downloads, @p size and
+ * @p crc identify the image.
+ *
+ * @return 1 if a checkpoint of the same transfer was found, and
+ *	   r->block and r->offset tell where to go on; 0 otherwise
+ */
+int dfu_resume_begin(struct dfu_resume *r, dfu_handle *handle,
+		     const char *fname, int upload,
+		     unsigned long long size, uint32_t crc,
+		     unsigned int transfer_size)
+{
+	memset(r, 0, sizeof(*r));
+	snprintf(r->path, sizeof(r->path), "%s%s", fname, DFU_RESUME_SUFFIX);
+	_device_id(handle, r->device, sizeof(r->device));
+	r->upload = upload;
+	r->size = size;
+	r->crc = crc;
+	r->transfer_size = transfer_size;
+
+	return _load(r);
+}
+
+int dfu_resume_save(struct dfu_resume *r)
+{
+	char tmp[sizeof(r->path) + 16];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", r->path, (int)getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return -1;
+	}
+
+	fputs(RESUME_HEADER, f);
+	fprintf(f, "%s device=%s size=%llu crc=%08x transfer-size=%u "
+		"block=%u offset=%llu\n", r->upload ? "upload" : "dnload",
+		r->device, r->size, r->crc, r->transfer_size, r->block,
+		r->offset);
+
+	if (fclose(f) != 0 || rename(tmp, r->path) < 0) {
+		perror(r->path);
+		unlink(tmp);
+		return -1;
+	}
+	r->unsaved = 0;
+	return 0;
+}
+
+/**
+ * the device acknowledged everything before block @p block, which
+ * starts at byte @p offset
+ *
+ * @return 1 if the caller has to make the data before @p offset
+ *	   durable and call dfu_resume_save(), 0 otherwise
+ */
+int dfu_resume_update(struct dfu_resume *r, unsigned int block,
+		      unsigned long long offset)
+{
+	r->block = block;
+	r->offset = offset;
+	r->retries = 0;
+	return ++r->unsaved >= DFU_RESUME_INTERVAL;
+}
+
+/* the transfer is complete, the checkpoint is no longer needed */
+void dfu_resume_end(struct dfu_resume *r)
+{
+	unlink(r->path);
+}
+
+/**
+ * bring a device back to dfuIDLE after a failed request, without
+ * trusting what the state machine thinks the device's state is
+ *
+ * @return 0, or < 0 if the device can't be recovered
+ */
+int dfu_resume_recover(dfu_handle *handle)
+{
+	const struct dfu_transition_handlers *handlers = dfu_handlers(handle);
+	struct dfu_status status;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (handlers->get_status(handle, &status) < 0)
+			return -1;
+		dfu_sm_set_state_unchecked(handle, status.bState);
+
+		switch (status.bState) {
+		case DFU_STATE_dfuIDLE:
+			return 0;
+		case DFU_STATE_dfuERROR:
+			if (dfu_clear_status(handle) < 0)
+				return -1;
+			break;
+		case DFU_STATE_dfuDNBUSY:
+		case DFU_STATE_dfuMANIFEST:
+			dfu_clock_sleep_ms(dfu_poll_timeout(handle, &status));
+			break;
+		case DFU_STATE_dfuDNLOAD_SYNC:
+		case DFU_STATE_dfuDNLOAD_IDLE:
+		case DFU_STATE_dfuMANIFEST_SYNC:
+		case DFU_STATE_dfuUPLOAD_IDLE:
+			if (dfu_abort(handle) < 0)
+				return -1;
+			break;
+		default:
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"can't recover from state %s",
+				dfu_state_to_string(status.bState));
+			return -1;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,65 @@
+/*
+ * dfu-util - resuming interrupted transfers
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_RESUME_H
+#define _DFU_RESUME_H
+
+#include <stdint.h>
+#include "dfu.h"
+
+/* appended to the file name of the image for the checkpoint */
+#define DFU_RESUME_SUFFIX	".dfu-resume"
+/* blocks between two checkpoints written to disk */
+#define DFU_RESUME_INTERVAL	256
+/* attempts to recover from a failed block within one transfer */
+#define DFU_RESUME_RETRIES	3
+
+/**
+ * progress of a transfer, as acknowledged by the device, and where it
+ * is saved
+ */
+struct dfu_resume {
+	char path[4096];
+	int upload;
+	/* the transfer it belongs to */
+	char device[128];		/* see dfu_resume_begin() */
+	unsigned long long size;	/* image size, downloads only */
+	uint32_t crc;			/* image CRC, downloads only */
+	unsigned int transfer_size;
+	/* wBlockNum of the next block, and bytes before it */
+	unsigned int block;
+	unsigned long long offset;
+
+	unsigned int unsaved;		/* blocks since the last save */
+	int retries;
+};
+
+int dfu_resume_begin(struct dfu_resume *r, dfu_handle *handle,
+		     const char *fname, int upload,
+		     unsigned long long size, uint32_t crc,
+		     unsigned int transfer_size);
+int dfu_resume_update(struct dfu_resume *r, unsigned int block,
+		      unsigned long long offset);
+int dfu_resume_save(struct dfu_resume *r);
+void dfu_resume_end(struct dfu_resume *r);
+
+int dfu_resume_recover(dfu_handle *handle);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * dfu-util - image routing by DFU suffix
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * A station flashing boards of several products at once is given all
+ * their images, and each device is matched to its image by the ids in
+ * the DFU suffix, the same way the device checks them. 0xffff in the
+ * suffix matches any value; of several matching images, the one naming
+ * the most ids exactly is taken.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dfu.h"
+#include "dfu_image.h"
+#include "dfu_route.h"
+
+/**
+ * open and check all images in @p fnames. Each of them needs a DFU
+ * suffix, and no two of them may be made for the same devices.
+ *
+ * @return 0, or < 0 if an image can't be used
+ */
+int dfu_route_open(struct dfu_route *r, char * const *fnames, int count,
+		   int image_flags)
+{
+	int i, j;
+
+	r->count = 0;
+	r->images = calloc(count, sizeof(*r->images));
+	if (!r->images)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		struct dfu_image *img = &r->images[i];
+
+		if (dfu_image_open(img, fnames[i], image_flags) < 0)
+			goto out_fail;
+		r->count++;
+
+		if (img->format != DFU_FMT_RAW) {
+			fprintf(stderr, "%s has no DFU suffix to route it by\n",
+				img->fname);
+			goto out_fail;
+		}
+
+		for (j = 0; j < i; j++) {
+			const struct dfu_image *other = &r->images[j];
+
+			if (other->suffix.idVendor != img->suffix.idVendor ||
+			    other->suffix.idProduct != img->suffix.idProduct ||
+			    other->suffix.bcdDevice != img->suffix.bcdDevice)
+				continue;
+			fprintf(stderr, "%s and %s are both made for "
+				"0x%04x:0x%04x rev 0x%04x\n", other->fname,
+				img->fname, img->suffix.idVendor,
+				img->suffix.idProduct, img->suffix.bcdDevice);
+			goto out_fail;
+		}
+	}
+
+	return 0;
+
+ out_fail:
+	dfu_route_close(r);
+	return -EINVAL;
+}
+
+/**
+ * find the image for a device
+ *
+ * @return the index of the image in the pool, -ENOENT if there is
+ * none, or -EEXIST if several match equally well
+ */
+int dfu_route_lookup(const struct dfu_route *r, uint16_t idVendor,
+		     uint16_t idProduct, uint16_t bcdDevice)
+{
+	int i, best = -ENOENT, best_exact = -1, tie = 0;
+
+	for (i = 0; i < r->count; i++) {
+		int exact = dfu_image_match(&r->images[i], idVendor,
+					    idProduct, bcdDevice);
+
+		if (exact < 0 || exact < best_exact)
+			continue;
+		tie = exact == best_exact;
+		best = i;
+		best_exact = exact;
+	}
+
+	return tie ? -EEXIST : best;
+}
+
+void dfu_route_close(struct dfu_route *r)
+{
+	int i;
+
+	for (i = 0; i < r->count; i++)
+		dfu_image_close(&r->images[i]);
+	free(r->images);
+	r->images = NULL;
+	r->count = 0;
+}
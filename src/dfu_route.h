@@ -0,0 +1,45 @@
+/*
+ * dfu-util - image routing by DFU suffix
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_ROUTE_H
+#define _DFU_ROUTE_H
+
+#include <stdint.h>
+
+#include "dfu_image.h"
+
+/**
+ * a pool of images for devices of different kinds. Each device is
+ * sent the image whose DFU suffix names its idVendor, idProduct and
+ * bcdDevice, see dfu_route_lookup().
+ */
+struct dfu_route {
+	struct dfu_image *images;
+	int count;
+};
+
+int dfu_route_open(struct dfu_route *r, char * const *fnames, int count,
+		   int image_flags);
+int dfu_route_lookup(const struct dfu_route *r, uint16_t idVendor,
+		     uint16_t idProduct, uint16_t bcdDevice);
+void dfu_route_close(struct dfu_route *r);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * dfu-util - host controller and hub aware scheduling
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Boards behind the same host controller, and even more so behind the
+ * same hub, share one link. Starting all of them at once only makes
+ * them wait for each other, and slow devices run into timeouts. So
+ * every bus and every external hub gets a budget of devices that may
+ * download at the same time.
+ *
+ * The budget in effect (the limit) adapts: it is halved when a device
+ * of the group fails, which is what contention looks like, and grows
+ * back by one with every device finished successfully.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfu_sched.h"
+
+void dfu_sched_init(struct dfu_sched *s, unsigned int bus_budget,
+		    unsigned int hub_budget)
+{
+	memset(s, 0, sizeof(*s));
+	s->bus_budget = bus_budget;
+	s->hub_budget = hub_budget;
+}
+
+void dfu_sched_free(struct dfu_sched *s)
+{
+	free(s->groups);
+	s->groups = NULL;
+	s->count = s->alloc = 0;
+}
+
+/**
+ * look up the group @p name, creating it if needed
+ *
+ * @return index of the group, or < 0 on error
+ */
+int dfu_sched_group(struct dfu_sched *s, const char *name, int is_bus,
+		    int high_speed)
+{
+	struct dfu_sched_group *g;
+	unsigned int i;
+
+	for (i = 0; i < s->count; i++)
+		if (s->groups[i].is_bus == is_bus &&
+		    !strcmp(s->groups[i].name, name))
+			return i;
+
+	if (s->count == s->alloc) {
+		unsigned int alloc = s->alloc ? 2 * s->alloc : 8;
+
+		g = realloc(s->groups, alloc * sizeof(*g));
+		if (!g)
+			return -1;
+		s->groups = g;
+		s->alloc = alloc;
+	}
+
+	g = &s->groups[s->count];
+	memset(g, 0, sizeof(*g));
+	snprintf(g->name, sizeof(g->name), "%s", name);
+	g->is_bus = is_bus;
+	g->link_kbit = high_speed ? 480000 : 12000;
+	if (is_bus)
+		g->budget = s->bus_budget ? s->bus_budget : high_speed ?
+			DFU_SCHED_BUS_BUDGET_HS : DFU_SCHED_BUS_BUDGET_FS;
+	else
+		g->budget = s->hub_budget ? s->hub_budget : high_speed ?
+			DFU_SCHED_HUB_BUDGET_HS : DFU_SCHED_HUB_BUDGET_FS;
+	g->limit = g->budget;
+
+	return s->count++;
+}
+
+/* search the hub tree below @p node for @p dev */
+static struct usb_device *_find_parent(struct usb_device *node,
+				       struct usb_device *dev,
+				       char *path, size_t len)
+{
+	int i;
+
+	for (i = 0; i < node->num_children; i++) {
+		struct usb_device *child = node->children[i];
+		struct usb_device *parent;
+		size_t used = strlen(path);
+
+		if (!child)
+			continue;
+		snprintf(path + used, len - used, "%s%d", used ? "." : "", i + 1);
+		if (child == dev)
+			return node;
+		parent = _find_parent(child, dev, path, len);
+		if (parent)
+			return parent;
+		path[used] = '\0';
+	}
+	return NULL;
+}
+
+/**
+ * find the bus and the external hub @p dev is attached to, using the
+ * hub tree libusb-0.1 builds. @p hub is -1 for devices attached to
+ * the root hub, or if the tree is not available on this platform.
+ * @p path receives the position of the device in the tree, as a list
+ * of child indices.
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_sched_locate(struct dfu_sched *s, struct usb_device *dev,
+		     int *bus, int *hub, char *path, size_t len)
+{
+	struct usb_device *root = dev->bus->root_dev;
+	struct usb_device *parent = NULL;
+	char name[48];
+
+	path[0] = '\0';
+	if (root)
+		parent = _find_parent(root, dev, path, len);
+
+	snprintf(name, sizeof(name), "bus %.32s", dev->bus->dirname);
+	*bus = dfu_sched_group(s, name, 1,
+			       !root || root->descriptor.bcdUSB >= 0x0200);
+	if (*bus < 0)
+		return -1;
+	s->groups[*bus].devices++;
+
+	*hub = -1;
+	if (parent && parent != root) {
+		snprintf(name, sizeof(name), "hub %.32s/%03u",
+			 dev->bus->dirname, parent->devnum);
+		*hub = dfu_sched_group(s, name, 0,
+				       parent->descriptor.bcdUSB >= 0x0200);
+		if (*hub < 0)
+			return -1;
+		s->groups[*hub].devices++;
+	}
+
+	return 0;
+}
+
+/**
+ * the position of @p dev: its bus and the child indices from the root
+ * hub down, e.g. "001-1.3". Unlike the device number, it stays the
+ * same when the device is plugged in again at the same port.
+ */
+void dfu_sched_port(struct usb_device *dev, char *path, size_t len)
+{
+	char tree[32] = "";
+
+	if (dev->bus->root_dev)
+		_find_parent(dev->bus->root_dev, dev, tree, sizeof(tree));
+	snprintf(path, len, "%.32s-%s", dev->bus->dirname,
+		 tree[0] ? tree : "?");
+}
+
+static int _has_room(struct dfu_sched_group *g)
+{
+	return g->active < g->limit;
+}
+
+int dfu_sched_may_start(struct dfu_sched *s, int bus, int hub)
+{
+	if (bus >= 0 && !_has_room(&s->groups[bus]))
+		return 0;
+	if (hub >= 0 && !_has_room(&s->groups[hub]))
+		return 0;
+	return 1;
+}
+
+/**
+ * how busy the links of a device are, in per mille of their limits.
+ * Starting the device with the lowest load first spreads the work
+ * across all controllers and hubs.
+ */
+unsigned int dfu_sched_load(struct dfu_sched *s, int bus, int hub)
+{
+	unsigned int load = 0;
+
+	if (bus >= 0)
+		load = s->groups[bus].active * 1000 / s->groups[bus].limit;
+	if (hub >= 0) {
+		unsigned int l = s->groups[hub].active * 1000 / s->groups[hub].limit;
+
+		if (l > load)
+			load = l;
+	}
+	return load;
+}
+
+static void _update(struct dfu_sched_group *g, unsigned long long now)
+{
+	if (g->last_change) {
+		unsigned long long dt = now - g->last_change;
+
+		g->active_ms += g->active * dt;
+		if (g->active)
+			g->busy_ms += dt;
+	}
+	g->last_change = now;
+}
+
+void dfu_sched_start(struct dfu_sched *s, int bus, int hub,
+		     unsigned long long now)
+{
+	int i, ids[2] = { bus, hub };
+
+	for (i = 0; i < 2; i++) {
+		struct dfu_sched_group *g;
+
+		if (ids[i] < 0)
+			continue;
+		g = &s->groups[ids[i]];
+		_update(g, now);
+		g->active++;
+		if (g->active > g->max_active)
+			g->max_active = g->active;
+	}
+}
+
+void dfu_sched_stop(struct dfu_sched *s, int bus, int hub,
+		    unsigned long long now, int congested)
+{
+	int i, ids[2] = { bus, hub };
+
+	for (i = 0; i < 2; i++) {
+		struct dfu_sched_group *g;
+
+		if (ids[i] < 0)
+			continue;
+		g = &s->groups[ids[i]];
+		_update(g, now);
+		g->active--;
+		if (congested) {
+			g->timeouts++;
+			g->limit = g->limit > 1 ? g->limit / 2 : 1;
+		} else if (g->limit < g->budget)
+			g->limit++;
+	}
+}
+
+void dfu_sched_account(struct dfu_sched *s, int bus, int hub,
+		       unsigned long long bytes)
+{
+	if (bus >= 0)
+		s->groups[bus].bytes += bytes;
+	if (hub >= 0)
+		s->groups[hub].bytes += bytes;
+}
+
+/* per bus and hub utilisation report */
+void dfu_sched_print(struct dfu_sched *s, unsigned long long now)
+{
+	unsigned int i;
+
+	if (!s->count)
+		return;
+
+	printf("%-20s %7s %6s %6s %7s %10s %9s %6s\n", "link", "devices",
+	       "budget", "max", "avg", "KiB", "KiB/s", "util");
+	for (i = 0; i < s->count; i++) {
+		struct dfu_sched_group *g = &s->groups[i];
+		double rate = 0, avg = 0;
+
+		_update(g, now);
+		if (g->busy_ms) {
+			rate = g->bytes / 1.024 / g->busy_ms;
+			avg = (double) g->active_ms / g->busy_ms;
+		}
+		printf("%-20s %7u %6u %6u %7.1f %10llu %9.1f %5.1f%%",
+		       g->name, g->devices, g->budget, g->max_active, avg,
+		       g->bytes / 1024, rate,
+		       rate * 1024 * 8 / 10 / g->link_kbit);
+		if (g->timeouts)
+			printf(" (%u failure(s), limit now %u)", g->timeouts,
+			       g->limit);
+		printf("\n");
+	}
+}
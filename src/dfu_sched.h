@@ -0,0 +1,86 @@
+/*
+ * dfu-util - host controller and hub aware scheduling
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_SCHED_H
+#define _DFU_SCHED_H
+
+#include <stddef.h>
+#include <usb.h>
+
+/* default number of devices downloading at the same time behind one
+   host controller (bus) or one external hub, by link speed */
+#define DFU_SCHED_BUS_BUDGET_HS	16
+#define DFU_SCHED_BUS_BUDGET_FS	4
+#define DFU_SCHED_HUB_BUDGET_HS	8
+#define DFU_SCHED_HUB_BUDGET_FS	2
+
+/**
+ * devices sharing one link: all devices of a bus, or all devices
+ * behind an external hub.
+ */
+struct dfu_sched_group {
+	char name[48];
+	int is_bus;
+	unsigned int link_kbit;		/* 12000 or 480000 */
+	unsigned int budget;		/* configured maximum */
+	unsigned int limit;		/* current maximum, <= budget */
+	unsigned int active;
+
+	/* statistics */
+	unsigned int devices;
+	unsigned int max_active;
+	unsigned int timeouts;
+	unsigned long long bytes;
+	unsigned long long busy_ms;	/* time with a device active */
+	unsigned long long active_ms;	/* integral of active over time */
+	unsigned long long last_change;
+};
+
+struct dfu_sched {
+	struct dfu_sched_group *groups;
+	unsigned int count;
+	unsigned int alloc;
+	/* 0 selects the defaults above */
+	unsigned int bus_budget;
+	unsigned int hub_budget;
+};
+
+void dfu_sched_init(struct dfu_sched *s, unsigned int bus_budget,
+		    unsigned int hub_budget);
+void dfu_sched_free(struct dfu_sched *s);
+
+int dfu_sched_group(struct dfu_sched *s, const char *name, int is_bus,
+		    int high_speed);
+int dfu_sched_locate(struct dfu_sched *s, struct usb_device *dev,
+		     int *bus, int *hub, char *path, size_t len);
+void dfu_sched_port(struct usb_device *dev, char *path, size_t len);
+
+int dfu_sched_may_start(struct dfu_sched *s, int bus, int hub);
+unsigned int dfu_sched_load(struct dfu_sched *s, int bus, int hub);
+void dfu_sched_start(struct dfu_sched *s, int bus, int hub,
+		     unsigned long long now);
+void dfu_sched_stop(struct dfu_sched *s, int bus, int hub,
+		    unsigned long long now, int congested);
+void dfu_sched_account(struct dfu_sched *s, int bus, int hub,
+		       unsigned long long bytes);
+
+void dfu_sched_print(struct dfu_sched *s, unsigned long long now);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * dfu-util - concurrent download sessions
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every session owns its dfu_handle, including the state machine
+ * state, so sessions don't share anything but the image. Note that
+ * usb_strerror() of libusb-0.1 isn't thread safe, error messages of
+ * concurrent sessions may show each other's USB error string.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dfu.h"
+#include "dfu_sm.h"
+#include "usb_dfu.h"
+#include "dfu_quirks.h"
+#include "dfu_profile.h"
+#include "sam7dfu.h"
+#include "dfu_log.h"
+#include "dfu_session.h"
+
+static void _handle_init(dfu_handle *handle, struct usb_dev_handle *dev_handle,
+			 int interface, dfu_quirks quirks)
+{
+	memset(handle, 0, sizeof(*handle));
+	dfu_init(handle, 5000);
+	handle->device = dev_handle;
+	handle->interface = interface;
+	handle->quirk_flags = quirks;
+	handle->profile = dfu_profile_lookup(
+		usb_device(dev_handle)->descriptor.idVendor,
+		usb_device(dev_handle)->descriptor.idProduct,
+		usb_device(dev_handle)->descriptor.bcdDevice);
+}
+
+/**
+ * switch a device in runtime mode to DFU mode. The device will
+ * re-enumerate, so the bus has to be re-scanned afterwards.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int dfu_session_detach(struct usb_device *dev, int interface,
+		       dfu_quirks quirks)
+{
+	struct usb_dev_handle *dev_handle;
+	dfu_handle handle;
+	int state, ret = -1;
+
+	dev_handle = usb_open(dev);
+	if (!dev_handle) {
+		fprintf(stderr, "%s/%03u: cannot open device: %s\n",
+			dev->bus->dirname, dev->devnum, usb_strerror());
+		return -1;
+	}
+
+	if (usb_claim_interface(dev_handle, interface) < 0 ||
+	    usb_set_altinterface(dev_handle, 0) < 0) {
+		fprintf(stderr, "%s/%03u: cannot claim interface: %s\n",
+			dev->bus->dirname, dev->devnum, usb_strerror());
+		goto out_close;
+	}
+
+	_handle_init(&handle, dev_handle, interface, quirks);
+
+	state = dfu_get_state(&handle);
+	if (state < 0)
+		goto out_close;
+	dfu_sm_set_state_unchecked(&handle, state);
+
+	if (state == DFU_STATE_appIDLE && dfu_detach(&handle, 1000) < 0)
+		goto out_close;
+
+	/* the device drops off the bus here, errors are expected */
+	dfu_usb_reset(&handle);
+	ret = 0;
+
+ out_close:
+	usb_close(dev_handle);
+	return ret;
+}
+
+/**
+ * open the DFU mode device @p dev and bring it to dfuIDLE, ready for
+ * a download. A @p transfer_size of 0 selects the device's
+ * wTransferSize.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int dfu_session_open(struct dfu_session *s, struct usb_device *dev,
+		     int interface, int altsetting,
+		     unsigned int transfer_size, dfu_quirks quirks)
+{
+	dfu_handle *handle = &s->handle;
+	struct dfu_status status;
+	unsigned int page_size = getpagesize();
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	s->done_fd = -1;
+	s->dev = dev;
+	s->interface = interface;
+	s->altsetting = altsetting;
+	snprintf(s->name, sizeof(s->name), "%.32s/%03u",
+		 dev->bus->dirname, dev->devnum);
+
+	s->dev_handle = usb_open(dev);
+	if (!s->dev_handle) {
+		dfu_log(DFU_LOG_ERROR, s->name, "cannot open device: %s",
+			usb_strerror());
+		return -1;
+	}
+
+	if (usb_claim_interface(s->dev_handle, interface) < 0) {
+		dfu_log(DFU_LOG_ERROR, s->name, "cannot claim interface: %s",
+			usb_strerror());
+		goto out_close;
+	}
+
+	if (usb_set_altinterface(s->dev_handle, altsetting) < 0) {
+		dfu_log(DFU_LOG_ERROR, s->name,
+			"cannot set alternate interface: %s", usb_strerror());
+		goto out_close;
+	}
+
+	_handle_init(handle, s->dev_handle, interface, quirks);
+	handle->name = s->name;
+
+ status_again:
+	if (dfu_get_status(handle, &status) < 0) {
+		dfu_log(DFU_LOG_ERROR, s->name, "error get_status: %s",
+			usb_strerror());
+		goto out_close;
+	}
+
+	/* force the statemachine into current status */
+	dfu_sm_set_state_unchecked(handle, status.bState);
+
+	switch (status.bState) {
+	case DFU_STATE_dfuIDLE:
+		break;
+	case DFU_STATE_dfuERROR:
+		if (dfu_clear_status(handle) < 0)
+			goto out_close;
+		goto status_again;
+	case DFU_STATE_dfuDNLOAD_IDLE:
+	case DFU_STATE_dfuUPLOAD_IDLE:
+		if (dfu_abort(handle) < 0)
+			goto out_close;
+		goto status_again;
+	default:
+		dfu_log(DFU_LOG_ERROR, s->name,
+			"device is in state %s, not in DFU mode",
+			dfu_state_to_string(status.bState));
+		goto out_close;
+	}
+
+	/* Obtain DFU functional descriptor */
+	ret = usb_get_descriptor(s->dev_handle, 0x21, interface,
+				 &handle->func_dfu, sizeof(handle->func_dfu));
+	if (ret < 0) {
+		if (!dfu_quirk_is_set(&handle->quirk_flags,
+				      QUIRK_IGNORE_INVALID_FUNCTIONAL_DESCRIPTOR)) {
+			dfu_log(DFU_LOG_ERROR, s->name,
+				"error obtaining DFU functional descriptor: %s",
+				usb_strerror());
+			goto out_close;
+		}
+		handle->func_dfu.bmAttributes = USB_DFU_CAN_DOWNLOAD |
+			USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL;
+		handle->func_dfu.bcdDFUVersion = USB_DFU_VER_1_0;
+		if (!transfer_size)
+			transfer_size = page_size;
+	} else if (!transfer_size) {
+		transfer_size = dfu_transfer_size(handle);
+	}
+
+	if (transfer_size > page_size)
+		transfer_size = page_size;
+	s->transfer_size = transfer_size;
+
+	/* quirk overwriting DFU version */
+	if (dfu_quirk_is_set(&handle->quirk_flags, QUIRK_FORCE_DFU_VERSION_1_0))
+		handle->func_dfu.bcdDFUVersion = USB_DFU_VER_1_0;
+	else if (dfu_quirk_is_set(&handle->quirk_flags, QUIRK_FORCE_DFU_VERSION_1_1))
+		handle->func_dfu.bcdDFUVersion = USB_DFU_VER_1_1;
+
+	if (handle->func_dfu.bcdDFUVersion == USB_DFU_VER_1_1)
+		handle->dfu_ver = DFU_VERSION_1_1;
+	else
+		handle->dfu_ver = DFU_VERSION_1_0;
+
+	return 0;
+
+ out_close:
+	usb_close(s->dev_handle);
+	s->dev_handle = NULL;
+	return -1;
+}
+
+static void *_session_thread(void *v)
+{
+	struct dfu_session *s = v;
+
+	s->result = sam7dfu_do_dnload_image(&s->handle, s->transfer_size,
+					    s->image, 1);
+	if (s->done_fd >= 0 && write(s->done_fd, &s, sizeof(s)) < 0)
+		perror("session");
+	return NULL;
+}
+
+/**
+ * start downloading @p img to the device on a new thread. @p img must
+ * stay loaded until dfu_session_join() returned.
+ *
+ * @return 0, or < 0 if the thread couldn't be created
+ */
+int dfu_session_start(struct dfu_session *s, const struct dfu_image *img)
+{
+	int ret;
+
+	s->image = img;
+	s->result = -1;
+
+	ret = pthread_create(&s->thread, NULL, _session_thread, s);
+	if (ret) {
+		fprintf(stderr, "%s: can't start session: %s\n",
+			s->name, strerror(ret));
+		return -ret;
+	}
+
+	s->running = 1;
+	return 0;
+}
+
+/**
+ * wait for the download started by dfu_session_start() to finish
+ *
+ * @return the download's result, 0 on success
+ */
+int dfu_session_join(struct dfu_session *s)
+{
+	if (s->running) {
+		pthread_join(s->thread, NULL);
+		s->running = 0;
+	}
+	return s->result;
+}
+
+void dfu_session_close(struct dfu_session *s)
+{
+	dfu_session_join(s);
+	if (s->dev_handle) {
+		usb_release_interface(s->dev_handle, s->interface);
+		usb_close(s->dev_handle);
+		s->dev_handle = NULL;
+	}
+}
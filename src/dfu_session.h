@@ -0,0 +1,63 @@
+/*
+ * dfu-util - concurrent download sessions
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_SESSION_H
+#define _DFU_SESSION_H
+
+#include <pthread.h>
+#include <usb.h>
+
+#include "dfu.h"
+#include "dfu_image.h"
+
+/**
+ * one device in DFU mode, receiving an image on its own thread. all
+ * sessions share the same read-only dfu_image.
+ */
+struct dfu_session {
+	struct usb_device *dev;
+	struct usb_dev_handle *dev_handle;
+	int interface;
+	int altsetting;
+	dfu_handle handle;
+	unsigned int transfer_size;
+	/* "bus/devnum", for messages */
+	char name[40];
+
+	const struct dfu_image *image;
+	int result;
+	pthread_t thread;
+	int running;
+	/* if not -1, the session's address is written here once the
+	   download finished, so it can be joined without waiting */
+	int done_fd;
+};
+
+int dfu_session_detach(struct usb_device *dev, int interface,
+		       dfu_quirks quirks);
+
+int dfu_session_open(struct dfu_session *s, struct usb_device *dev,
+		     int interface, int altsetting,
+		     unsigned int transfer_size, dfu_quirks quirks);
+int dfu_session_start(struct dfu_session *s, const struct dfu_image *img);
+int dfu_session_join(struct dfu_session *s);
+void dfu_session_close(struct dfu_session *s);
+
+#endif
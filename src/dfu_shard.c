@@ -0,0 +1,332 @@
+/*
+ * dfu-util - one worker process per USB bus
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * libusb-0.1 keeps its bus and device lists, and the last error
+ * message, in global variables. Instead of sharing them between
+ * threads, every bus gets a worker process of its own. Workers are
+ * forked after the image was loaded, so they share its pages.
+ *
+ * The output of a worker is passed on line by line, tagged with its
+ * bus. Progress arrives as struct dfu_engine_progress records on a
+ * second pipe, and is summed up over all buses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dfu_shard.h"
+
+struct shard {
+	const char *bus;
+	pid_t pid;
+	int out_fd;
+	int report_fd;
+	int status;
+
+	char line[256];
+	size_t line_len;
+	unsigned char rec[sizeof(struct dfu_engine_progress)];
+	size_t rec_len;
+	struct dfu_engine_progress progress;
+	int reported;
+};
+
+static unsigned long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* write one progress record; short enough to be written atomically */
+void dfu_shard_report(int fd, const struct dfu_engine_progress *p)
+{
+	ssize_t ret;
+
+	if (fd < 0)
+		return;
+	do
+		ret = write(fd, p, sizeof(*p));
+	while (ret < 0 && errno == EINTR);
+}
+
+static int _spawn(struct shard *sh, dfu_shard_worker worker, void *user)
+{
+	int out[2], report[2];
+
+	if (pipe(out) < 0)
+		return -1;
+	if (pipe(report) < 0) {
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	sh->pid = fork();
+	if (sh->pid < 0) {
+		close(out[0]);
+		close(out[1]);
+		close(report[0]);
+		close(report[1]);
+		return -1;
+	}
+
+	if (!sh->pid) {
+		int ret;
+
+		close(out[0]);
+		close(report[0]);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		close(out[1]);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+		ret = worker(sh->bus, report[1], user);
+		fflush(stdout);
+		_exit(ret < 0 ? 1 : 0);
+	}
+
+	close(out[1]);
+	close(report[1]);
+	sh->out_fd = out[0];
+	sh->report_fd = report[0];
+	return 0;
+}
+
+static void _flush_line(struct shard *sh)
+{
+	if (!sh->line_len)
+		return;
+	printf("bus %s: %.*s\n", sh->bus, (int) sh->line_len, sh->line);
+	sh->line_len = 0;
+}
+
+/* pass on the worker's output, one tagged line at a time */
+static int _read_output(struct shard *sh)
+{
+	char buf[512];
+	ssize_t len, i;
+
+	len = read(sh->out_fd, buf, sizeof(buf));
+	if (len < 0 && errno == EINTR)
+		return 0;
+	if (len <= 0) {
+		_flush_line(sh);
+		close(sh->out_fd);
+		sh->out_fd = -1;
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n') {
+			_flush_line(sh);
+			continue;
+		}
+		if (sh->line_len == sizeof(sh->line))
+			_flush_line(sh);
+		sh->line[sh->line_len++] = buf[i];
+	}
+	return 0;
+}
+
+static int _read_report(struct shard *sh)
+{
+	ssize_t len;
+
+	len = read(sh->report_fd, sh->rec + sh->rec_len,
+		   sizeof(sh->rec) - sh->rec_len);
+	if (len < 0 && errno == EINTR)
+		return 0;
+	if (len <= 0) {
+		close(sh->report_fd);
+		sh->report_fd = -1;
+		return 0;
+	}
+
+	sh->rec_len += len;
+	if (sh->rec_len == sizeof(sh->rec)) {
+		memcpy(&sh->progress, sh->rec, sizeof(sh->progress));
+		sh->reported = 1;
+		sh->rec_len = 0;
+		return 1;
+	}
+	return 0;
+}
+
+static void _sum(struct shard *shards, int count,
+		 struct dfu_engine_progress *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < count; i++) {
+		sum->count += shards[i].progress.count;
+		sum->done += shards[i].progress.done;
+		sum->failed += shards[i].progress.failed;
+		sum->bytes += shards[i].progress.bytes;
+		sum->total += shards[i].progress.total;
+	}
+}
+
+static void _print_progress(struct shard *shards, int count)
+{
+	struct dfu_engine_progress sum;
+
+	_sum(shards, count, &sum);
+	printf("Progress: %d of %d device(s) done, %d failed, %llu of %llu KiB\n",
+	       sum.done, sum.count, sum.failed, sum.bytes / 1024,
+	       sum.total / 1024);
+}
+
+/**
+ * run @p worker for every bus in @p buses, each in a process of its
+ * own, and wait for all of them
+ *
+ * @return the number of buses whose worker failed, or < 0 on error
+ */
+int dfu_shard_run(char **buses, int count, dfu_shard_worker worker,
+		  void *user)
+{
+	struct shard *shards;
+	struct pollfd *fds;
+	struct dfu_engine_progress sum;
+	unsigned long long last = 0;
+	int i, changed = 0, failed = 0, running = 0;
+
+	shards = calloc(count, sizeof(*shards));
+	fds = calloc(2 * count, sizeof(*fds));
+	if (!shards || !fds) {
+		free(shards);
+		free(fds);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+
+		sh->bus = buses[i];
+		sh->out_fd = sh->report_fd = -1;
+		if (_spawn(sh, worker, user) < 0) {
+			perror("cannot start worker");
+			sh->pid = -1;
+			sh->status = -1;
+			continue;
+		}
+		printf("Started worker %d for bus %s\n", (int) sh->pid, sh->bus);
+		running++;
+	}
+
+	while (running) {
+		unsigned long long now;
+		int n = 0;
+
+		for (i = 0; i < count; i++) {
+			if (shards[i].out_fd >= 0) {
+				fds[n].fd = shards[i].out_fd;
+				fds[n].events = POLLIN;
+				n++;
+			}
+			if (shards[i].report_fd >= 0) {
+				fds[n].fd = shards[i].report_fd;
+				fds[n].events = POLLIN;
+				n++;
+			}
+		}
+		if (!n)
+			break;
+
+		if (poll(fds, n, DFU_SHARD_PROGRESS_MS) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < count; i++) {
+			struct shard *sh = &shards[i];
+			int j;
+
+			for (j = 0; j < n; j++) {
+				if (!(fds[j].revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+				if (fds[j].fd == sh->out_fd)
+					_read_output(sh);
+				else if (fds[j].fd == sh->report_fd)
+					changed |= _read_report(sh);
+			}
+		}
+
+		now = _now_ms();
+		if (changed && now >= last + DFU_SHARD_PROGRESS_MS) {
+			_print_progress(shards, count);
+			last = now;
+			changed = 0;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+		int status = -1;
+
+		if (sh->out_fd >= 0)
+			close(sh->out_fd);
+		if (sh->report_fd >= 0)
+			close(sh->report_fd);
+		if (sh->pid <= 0) {
+			failed++;
+			continue;
+		}
+
+		while (waitpid(sh->pid, &status, 0) < 0 && errno == EINTR)
+			;
+		if (status != -1 && WIFEXITED(status) && !WEXITSTATUS(status))
+			printf("bus %s: ok", sh->bus);
+		else if (status != -1 && WIFSIGNALED(status))
+			printf("bus %s: worker killed by signal %d", sh->bus,
+			       WTERMSIG(status));
+		else
+			printf("bus %s: FAILED", sh->bus);
+		if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+		if (sh->reported)
+			printf(", %d of %d device(s) updated",
+			       sh->progress.done, sh->progress.count);
+		printf("\n");
+	}
+
+	_sum(shards, count, &sum);
+	printf("%d of %d device(s) updated successfully on %d bus(es), "
+	       "%d worker(s) failed\n", sum.done, sum.count, count, failed);
+
+	free(fds);
+	free(shards);
+	return failed;
+}
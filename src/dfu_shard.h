@@ -0,0 +1,41 @@
+/*
+ * dfu-util - one worker process per USB bus
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_SHARD_H
+#define _DFU_SHARD_H
+
+#include "dfu_engine.h"
+
+/* interval of the aggregated progress line */
+#define DFU_SHARD_PROGRESS_MS	1000
+
+/**
+ * download to all devices on @p bus, reporting progress to
+ * @p report_fd with dfu_shard_report(). Runs in its own process.
+ *
+ * @return 0 if all devices were updated, < 0 otherwise
+ */
+typedef int (*dfu_shard_worker)(const char *bus, int report_fd, void *user);
+
+int dfu_shard_run(char **buses, int count, dfu_shard_worker worker,
+		  void *user);
+void dfu_shard_report(int fd, const struct dfu_engine_progress *p);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * dfu-util - simulated DFU 1.0 device
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The device side of DFU 1.0 (appendix A of the spec), for dry runs
+ * of the download engine without any hardware. Requests are answered
+ * synchronously; the return values follow usb_control_msg(), with a
+ * stalled request returning -EPIPE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <usb.h>
+
+#include "dfu.h"
+#include "dfu_sm.h"
+#include "dfu_sim.h"
+#include "dfu_clock.h"
+#include "crc32.h"
+
+void dfu_sim_init(struct dfu_sim *sim, const char *name)
+{
+	memset(sim, 0, sizeof(*sim));
+	snprintf(sim->name, sizeof(sim->name), "%s", name);
+
+	sim->func_dfu.bLength = USB_DT_DFU_SIZE;
+	sim->func_dfu.bDescriptorType = 0x21;
+	sim->func_dfu.bmAttributes = USB_DFU_CAN_DOWNLOAD |
+		USB_DFU_CAN_UPLOAD | USB_DFU_MANIFEST_TOL;
+	sim->func_dfu.wDetachTimeOut = cpu_to_le16(1000);
+	sim->func_dfu.wTransferSize = cpu_to_le16(DFU_SIM_TRANSFER_SIZE);
+	sim->func_dfu.bcdDFUVersion = USB_DFU_VER_1_0;
+
+	sim->poll_timeout = DFU_SIM_POLL_TIMEOUT;
+	sim->manifest_timeout = DFU_SIM_MANIFEST_TIMEOUT;
+	sim->state = DFU_STATE_dfuIDLE;
+	sim->status = DFU_STATUS_OK;
+}
+
+void dfu_sim_free(struct dfu_sim *sim)
+{
+	free(sim->mem);
+	sim->mem = NULL;
+	sim->mem_len = sim->mem_alloc = 0;
+}
+
+/* a USB reset: the new firmware starts if it was manifested */
+void dfu_sim_reset(struct dfu_sim *sim)
+{
+	/* a device which isn't manifestation tolerant doesn't answer
+	   the final GETSTATUS, but waits for this reset */
+	if (sim->state == DFU_STATE_dfuMANIFEST && dfu_clock_ms() >= sim->busy_until)
+		sim->manifested = 1;
+
+	sim->state = sim->manifested ? DFU_STATE_appIDLE : DFU_STATE_dfuERROR;
+	sim->status = sim->manifested ? DFU_STATUS_OK : DFU_STATUS_errFIRMWARE;
+}
+
+static int _stall(struct dfu_sim *sim, int status)
+{
+	sim->stalls++;
+	sim->state = DFU_STATE_dfuERROR;
+	sim->status = status;
+	return -EPIPE;
+}
+
+/**
+ * the block numbered @p wValue at or before block @p blocks. wBlockNum
+ * wraps at 16 bits, so a transfer going on after an interruption is
+ * taken to continue at the last block of that number.
+ *
+ * @return the block, or < 0 if no block before @p blocks has that number
+ */
+static long long _block_at(size_t blocks, uint16_t wValue)
+{
+	uint16_t back = blocks - wValue;
+
+	return back > blocks ? -1 : (long long)(blocks - back);
+}
+
+static int _dnload(struct dfu_sim *sim, uint16_t wValue,
+		   const unsigned char *data, uint16_t wLength)
+{
+	long long at = 0;
+
+	switch (sim->state) {
+	case DFU_STATE_dfuIDLE:
+		if (!wLength)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		/* blocks are placed by wBlockNum, so an interrupted
+		   download can go on with the block that failed */
+		if (!sim->manifested && sim->block_size)
+			at = _block_at(sim->mem_len / sim->block_size, wValue);
+		if (at < 0 || (sim->discard && at &&
+			       at * sim->block_size != sim->mem_len))
+			return _stall(sim, DFU_STATUS_errADDRESS);
+		sim->mem_len = at * sim->block_size;
+		if (!at) {
+			sim->block_size = wLength;
+			sim->crc = crc32_init();
+		}
+		sim->manifested = 0;
+		sim->block = wValue;
+		/* fall through */
+	case DFU_STATE_dfuDNLOAD_IDLE:
+		if (!wLength) {
+			sim->state = DFU_STATE_dfuMANIFEST_SYNC;
+			return 0;
+		}
+		if (wLength > le16_to_cpu(sim->func_dfu.wTransferSize))
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		/* wBlockNum counts up and wraps at 16 bits */
+		if (wValue != sim->block)
+			return _stall(sim, DFU_STATUS_errADDRESS);
+		sim->block++;
+
+		if (sim->discard) {
+			sim->crc = crc32_buf(sim->crc, data, wLength);
+			sim->mem_len += wLength;
+			sim->state = DFU_STATE_dfuDNLOAD_SYNC;
+			return wLength;
+		}
+		if (sim->mem_len + wLength > sim->mem_alloc) {
+			size_t alloc = sim->mem_alloc ? 2 * sim->mem_alloc : 65536;
+			unsigned char *mem;
+
+			while (alloc < sim->mem_len + wLength)
+				alloc *= 2;
+			mem = realloc(sim->mem, alloc);
+			if (!mem)
+				return _stall(sim, DFU_STATUS_errWRITE);
+			sim->mem = mem;
+			sim->mem_alloc = alloc;
+		}
+		memcpy(sim->mem + sim->mem_len, data, wLength);
+		sim->mem_len += wLength;
+		sim->state = DFU_STATE_dfuDNLOAD_SYNC;
+		return wLength;
+	default:
+		return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+	}
+}
+
+static int _get_status(struct dfu_sim *sim, unsigned char *data,
+		       uint16_t wLength)
+{
+	unsigned long long now = dfu_clock_ms();
+	unsigned int timeout = 0;
+
+	if (wLength < 6)
+		return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+
+	switch (sim->state) {
+	case DFU_STATE_dfuDNLOAD_SYNC:
+		/* the block is being written now */
+		sim->state = DFU_STATE_dfuDNBUSY;
+		timeout = sim->poll_timeout;
+		sim->busy_until = now + timeout;
+		break;
+	case DFU_STATE_dfuDNBUSY:
+		/* not allowed before bwPollTimeout has passed */
+		if (now < sim->busy_until)
+			return _stall(sim, DFU_STATUS_errNOTDONE);
+		sim->state = DFU_STATE_dfuDNLOAD_IDLE;
+		break;
+	case DFU_STATE_dfuMANIFEST_SYNC:
+		if (!sim->manifested) {
+			sim->state = DFU_STATE_dfuMANIFEST;
+			timeout = sim->manifest_timeout;
+			sim->busy_until = now + timeout;
+		} else
+			sim->state = DFU_STATE_dfuIDLE;
+		break;
+	case DFU_STATE_dfuMANIFEST:
+		if (now < sim->busy_until)
+			return _stall(sim, DFU_STATUS_errNOTDONE);
+		sim->manifested = 1;
+		if (sim->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
+			sim->state = DFU_STATE_dfuIDLE;
+		else
+			sim->state = DFU_STATE_dfuMANIFEST_WAIT_RESET;
+		break;
+	case DFU_STATE_dfuMANIFEST_WAIT_RESET:
+		/* only a reset gets the device out of here */
+		return -EPIPE;
+	default:
+		break;
+	}
+
+	data[0] = sim->status;
+	data[1] = timeout & 0xff;
+	data[2] = (timeout >> 8) & 0xff;
+	data[3] = (timeout >> 16) & 0xff;
+	data[4] = sim->state;
+	data[5] = 0;
+	return 6;
+}
+
+static int _upload(struct dfu_sim *sim, uint16_t wValue,
+		   unsigned char *data, uint16_t wLength)
+{
+	long long at;
+	size_t len;
+
+	switch (sim->state) {
+	case DFU_STATE_dfuIDLE:
+		if (sim->discard)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		/* blocks of wLength bytes, numbered by wBlockNum; an
+		   upload that was aborted goes on like a download */
+		if (sim->upload_offset)
+			at = _block_at(sim->upload_offset / wLength, wValue);
+		else
+			at = wValue;
+		if (at < 0 || at * wLength > sim->mem_len)
+			return _stall(sim, DFU_STATUS_errADDRESS);
+		sim->upload_offset = at * wLength;
+		/* fall through */
+	case DFU_STATE_dfuUPLOAD_IDLE:
+		len = sim->mem_len - sim->upload_offset;
+		if (len > wLength)
+			len = wLength;
+		memcpy(data, sim->mem + sim->upload_offset, len);
+		sim->upload_offset += len;
+		/* a short frame ends the upload */
+		if (len < wLength) {
+			sim->state = DFU_STATE_dfuIDLE;
+			sim->upload_offset = 0;
+		} else
+			sim->state = DFU_STATE_dfuUPLOAD_IDLE;
+		return len;
+	default:
+		return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+	}
+}
+
+/**
+ * handle one control request to the simulated device
+ *
+ * @return number of bytes transferred, or < 0 (-EPIPE on stall)
+ */
+int dfu_sim_control(struct dfu_sim *sim, uint8_t bmRequestType,
+		    uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		    unsigned char *data, uint16_t wLength)
+{
+	sim->requests++;
+
+	if (sim->hang_after && sim->requests > sim->hang_after)
+		return -ETIMEDOUT;
+
+	/* the DFU functional descriptor is the only standard request
+	   a DFU mode device needs to answer here */
+	if (bmRequestType == USB_ENDPOINT_IN &&
+	    bRequest == USB_REQ_GET_DESCRIPTOR) {
+		int len = USB_DT_DFU_SIZE;
+
+		if (wValue >> 8 != 0x21)
+			return -EPIPE;
+		if (len > wLength)
+			len = wLength;
+		memcpy(data, &sim->func_dfu, len);
+		return len;
+	}
+
+	if ((bmRequestType & ~USB_ENDPOINT_IN) != USB_TYPE_DFU)
+		return -EPIPE;
+
+	switch (bRequest) {
+	case USB_REQ_DFU_DNLOAD:
+		return _dnload(sim, wValue, data, wLength);
+	case USB_REQ_DFU_UPLOAD:
+		return _upload(sim, wValue, data, wLength);
+	case USB_REQ_DFU_GETSTATUS:
+		return _get_status(sim, data, wLength);
+	case USB_REQ_DFU_CLRSTATUS:
+		if (sim->state != DFU_STATE_dfuERROR)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		sim->state = DFU_STATE_dfuIDLE;
+		sim->status = DFU_STATUS_OK;
+		return 0;
+	case USB_REQ_DFU_GETSTATE:
+		if (wLength < 1)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		data[0] = sim->state;
+		return 1;
+	case USB_REQ_DFU_ABORT:
+		if (sim->state != DFU_STATE_dfuIDLE &&
+		    sim->state != DFU_STATE_dfuDNLOAD_SYNC &&
+		    sim->state != DFU_STATE_dfuDNLOAD_IDLE &&
+		    sim->state != DFU_STATE_dfuMANIFEST_SYNC &&
+		    sim->state != DFU_STATE_dfuUPLOAD_IDLE)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		sim->state = DFU_STATE_dfuIDLE;
+		return 0;
+	case USB_REQ_DFU_DETACH:
+		if (sim->state != DFU_STATE_appIDLE)
+			return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+		sim->state = DFU_STATE_appDETACH;
+		return 0;
+	default:
+		return _stall(sim, DFU_STATUS_errSTALLEDPKT);
+	}
+}
+
+/* dfu_transition_handlers for the synchronous dfu_* functions */
+
+#define SIM(handle) ((struct dfu_sim *) (handle)->transport)
+
+static int _sim_request(dfu_handle *handle, int dir, uint8_t bRequest,
+			uint16_t wValue, void *data, uint16_t wLength)
+{
+	unsigned int us = SIM(handle)->latency;
+	int ret;
+
+	/* in virtual time, nothing would take no time at all */
+	if (!us && dfu_clock_is_virtual())
+		us = DFU_SIM_REQUEST_US;
+	if (us)
+		dfu_clock_sleep_us(us);
+	ret = dfu_sim_control(SIM(handle), dir | USB_TYPE_DFU, bRequest, wValue,
+			      handle->interface, data, wLength);
+	if (ret < 0)
+		fprintf(stderr, "%s: request %u stalled (current state: %s)\n",
+			SIM(handle)->name, bRequest,
+			dfu_state_to_string(dfu_sm_get_state(handle)));
+	return ret;
+}
+
+static int _sim_detach(dfu_handle *handle, const unsigned short timeout)
+{
+	return _sim_request(handle, USB_ENDPOINT_OUT, USB_REQ_DFU_DETACH,
+			    timeout, NULL, 0) < 0 ? -1 : 0;
+}
+
+static int _sim_device_reset(dfu_handle *handle)
+{
+	dfu_sim_reset(SIM(handle));
+	return 0;
+}
+
+static int _sim_status_poll_timeout(dfu_handle *handle,
+				    unsigned int poll_timeout)
+{
+	dfu_clock_sleep_ms(poll_timeout);
+	return 0;
+}
+
+static int _sim_download(dfu_handle *handle, const int transaction,
+			 const unsigned short length, const char *data)
+{
+	/* the simulated device doesn't write to OUT data either */
+	return _sim_request(handle, USB_ENDPOINT_OUT, USB_REQ_DFU_DNLOAD,
+			    transaction, (char *) data, length);
+}
+
+static int _sim_upload(dfu_handle *handle, const int transaction,
+		       const unsigned short length, char *data)
+{
+	return _sim_request(handle, USB_ENDPOINT_IN, USB_REQ_DFU_UPLOAD,
+			    transaction, data, length);
+}
+
+static int _sim_get_status(dfu_handle *handle, struct dfu_status *status)
+{
+	unsigned char buf[6];
+
+	if (_sim_request(handle, USB_ENDPOINT_IN, USB_REQ_DFU_GETSTATUS, 0,
+			 buf, sizeof(buf)) != 6)
+		return -1;
+
+	status->bStatus = buf[0];
+	status->bwPollTimeout = buf[1] | (buf[2] << 8) | (buf[3] << 16);
+	status->bState = buf[4];
+	status->iString = buf[5];
+	return 0;
+}
+
+static int _sim_clear_status(dfu_handle *handle)
+{
+	return _sim_request(handle, USB_ENDPOINT_OUT, USB_REQ_DFU_CLRSTATUS, 0,
+			    NULL, 0) < 0 ? -1 : 0;
+}
+
+static int _sim_get_state(dfu_handle *handle)
+{
+	unsigned char state;
+
+	if (_sim_request(handle, USB_ENDPOINT_IN, USB_REQ_DFU_GETSTATE, 0,
+			 &state, 1) != 1)
+		return -1;
+	return state;
+}
+
+static int _sim_abort(dfu_handle *handle)
+{
+	return _sim_request(handle, USB_ENDPOINT_OUT, USB_REQ_DFU_ABORT, 0,
+			    NULL, 0) < 0 ? -1 : 0;
+}
+
+static const struct dfu_transition_handlers _sim_handlers = {
+	.detach = _sim_detach,
+	.device_reset = _sim_device_reset,
+	.status_poll_timeout = _sim_status_poll_timeout,
+	.download = _sim_download,
+	.upload = _sim_upload,
+	.get_status = _sim_get_status,
+	.clear_status = _sim_clear_status,
+	.get_state = _sim_get_state,
+	.abort = _sim_abort,
+};
+
+/* drive @p sim through the dfu_* functions of @p handle */
+void dfu_sim_attach(struct dfu_sim *sim, dfu_handle *handle)
+{
+	handle->handlers = &_sim_handlers;
+	handle->transport = sim;
+	handle->interface = 0;
+	handle->func_dfu = sim->func_dfu;
+	handle->dfu_ver = sim->func_dfu.bcdDFUVersion == USB_DFU_VER_1_1 ?
+		DFU_VERSION_1_1 : DFU_VERSION_1_0;
+	dfu_sm_set_state_unchecked(handle, sim->state);
+}
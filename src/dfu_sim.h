@@ -0,0 +1,92 @@
+/*
+ * dfu-util - simulated DFU 1.0 device
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_SIM_H
+#define _DFU_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dfu.h"
+
+/* defaults of a simulated device */
+#define DFU_SIM_TRANSFER_SIZE	2048
+#define DFU_SIM_POLL_TIMEOUT	5	/* bwPollTimeout in ms */
+#define DFU_SIM_MANIFEST_TIMEOUT 20
+/* us a request takes in virtual time without a latency of its own,
+   one high speed microframe */
+#define DFU_SIM_REQUEST_US	125
+/* firmware larger than this is best received with dfu_sim.discard */
+#define DFU_SIM_MEM_MAX		(256 << 20)
+
+/**
+ * a DFU mode device, answering control requests the way a real one
+ * does, including stalls on protocol errors. Every block is "busy"
+ * for bwPollTimeout ms; a GETSTATUS before that time is up is
+ * stalled, so a host not honouring bwPollTimeout fails.
+ */
+struct dfu_sim {
+	char name[40];
+	struct usb_dfu_func_descriptor func_dfu;
+	unsigned int poll_timeout;
+	unsigned int manifest_timeout;
+
+	/* device side state */
+	int state;
+	int status;
+	unsigned short block;		/* next expected wBlockNum */
+	unsigned long long busy_until;	/* ms, dfu_clock_ms() */
+	size_t upload_offset;
+	unsigned int block_size;	/* of the first block downloaded */
+
+	/* received firmware. With @p discard set, it isn't kept, only
+	   its length and CRC, so images larger than the memory of the
+	   host can be sent; such a device can't be read back. */
+	unsigned char *mem;
+	size_t mem_len;
+	size_t mem_alloc;
+	int manifested;
+	int discard;
+	uint32_t crc;
+
+	/* counters */
+	unsigned int requests;
+	unsigned int stalls;
+
+	/* stop answering after this many requests, like a board that
+	   hung up. 0 for never. */
+	unsigned int hang_after;
+
+	/* us each request takes, like the round trip over a real bus.
+	   0 for none, or DFU_SIM_REQUEST_US in virtual time. */
+	unsigned int latency;
+};
+
+void dfu_sim_init(struct dfu_sim *sim, const char *name);
+void dfu_sim_free(struct dfu_sim *sim);
+
+int dfu_sim_control(struct dfu_sim *sim, uint8_t bmRequestType,
+		    uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		    unsigned char *data, uint16_t wLength);
+void dfu_sim_reset(struct dfu_sim *sim);
+
+void dfu_sim_attach(struct dfu_sim *sim, dfu_handle *handle);
+
+#endif
@@ -24,8 +24,8 @@
 #include "dfu.h"
 #include "dfu_sm.h"
 #include "usb_dfu.h"
-
-static int dfu_state = DFU_STATE_dfuERROR;
+#include "dfu_sm_prof.h"
+#include "dfu_log.h"
 
 static const char *dfu_event_names[] = {
 	[DFU_EV_DETACH]		= "DFU_DETACH",
@@ -88,13 +88,14 @@ const char *dfu_sm_guards_to_string(int guard_flags)
 /**
  * Evaluate a event within the finite state machine. Complies to DFU 1.0 and DFU 1.1
  *
+ * @param[in] dfu_state - the current state
  * @param[in] event - event ID
  * @param[in] guardflags - flags of event guards
  * @param[out] event_exists - wether a event with ID event exists in current
  * @param[in] silent - be silent and don't bark on event errors
  state, but it does not necessarily need to be allowed (depends on the actual @p guardflags)
  */
-static int _dfu_sm_get_next_state(enum DFU_SM_EVENT event, unsigned int guardflags, int *event_exists, int silent)
+static int _dfu_sm_get_next_state(int dfu_state, enum DFU_SM_EVENT event, unsigned int guardflags, int *event_exists, int silent)
 {
 	int event_exists_dummy;
 	if(!event_exists)
@@ -620,14 +621,14 @@ static int _dfu_sm_get_next_state(enum DFU_SM_EVENT event, unsigned int guardfla
 	{
 		if(*event_exists)
 		{
-			fprintf( stderr, "ERROR: The event %s exists but it's invalid because guards don't match (state = %s, guards = %s).\n",
+			dfu_log( DFU_LOG_ERROR, NULL, "ERROR: The event %s exists but it's invalid because guards don't match (state = %s, guards = %s).",
 				 dfu_sm_event_to_string(event),
 				 dfu_state_to_string(dfu_state),
 				 dfu_sm_guards_to_string(guardflags) );
 		}
 		else
 		{
-			fprintf( stderr, "ERROR: The event %s from current state does not exist (state = %s, guards = %s).\n",
+			dfu_log( DFU_LOG_ERROR, NULL, "ERROR: The event %s from current state does not exist (state = %s, guards = %s).",
 				 dfu_sm_event_to_string(event),
 				 dfu_state_to_string(dfu_state),
 				 dfu_sm_guards_to_string(guardflags) );
@@ -640,7 +641,7 @@ static int _dfu_sm_get_next_state(enum DFU_SM_EVENT event, unsigned int guardfla
 
 int dfu_sm_get_next_state(dfu_handle *handle, enum DFU_SM_EVENT event, unsigned int guardflags)
 {
-	return _dfu_sm_get_next_state(event, guardflags, NULL, 0);
+	return _dfu_sm_get_next_state(handle->dfu_state, event, guardflags, NULL, 0);
 }
 
 /**
@@ -654,13 +655,13 @@ int dfu_sm_get_next_state(dfu_handle *handle, enum DFU_SM_EVENT event, unsigned
 int dfu_sm_state_has_event(dfu_handle *handle, enum DFU_SM_EVENT event)
 {
 	int res;
-	_dfu_sm_get_next_state(event, 0, &res, 1);
+	_dfu_sm_get_next_state(handle->dfu_state, event, 0, &res, 1);
 
 	if(!res)
 	{
-		fprintf( stderr, "ERROR: The event %s from current state does not exist (state = %s).\n",
+		dfu_log( DFU_LOG_ERROR, handle->name, "ERROR: The event %s from current state does not exist (state = %s).",
 			 dfu_sm_event_to_string(event),
-			 dfu_state_to_string(dfu_state) );
+			 dfu_state_to_string(handle->dfu_state) );
 	}
 
 	return res!=0;
@@ -719,18 +720,19 @@ int dfu_sm_set_state_checked(dfu_handle *handle, enum dfu_state state)
 
 	/* is the new state available & a valid transition? */
 	if(state >= 0 && state < dfu_state_count &&
-	   _sm_transitions[dfu_state] & (1<<state))
+	   _sm_transitions[handle->dfu_state] & (1<<state))
 	{
 		valid = 1;
 	}
 
 	if(!valid)
 	{
-		printf("Fatal error: illegal state transition detected (%s (=%d) -> %s (=%d))\n",
-		       dfu_state_to_string(dfu_state),
-		       dfu_state,
-		       dfu_state_to_string(state),
-		       state);
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"Fatal error: illegal state transition detected (%s (=%d) -> %s (=%d))",
+			dfu_state_to_string(handle->dfu_state),
+			handle->dfu_state,
+			dfu_state_to_string(state),
+			state);
 		return -1;
 	}
 
@@ -740,13 +742,15 @@ int dfu_sm_set_state_checked(dfu_handle *handle, enum dfu_state state)
 	/* fflush(stdout); */
 
 	/* error msg output */
-	if(dfu_state != state &&
+	if(handle->dfu_state != state &&
 	   state == DFU_STATE_dfuERROR)
 	{
-		printf("Device entered error state!");
+		dfu_log(DFU_LOG_WARN, handle->name, "Device entered error state!");
 	}
 
-	dfu_state = state;
+	handle->dfu_state = state;
+	if(handle->sm_prof)
+		dfu_sm_prof_enter(handle->sm_prof, state);
 
 	return 0;
 }
@@ -758,7 +762,7 @@ int dfu_sm_set_state_checked(dfu_handle *handle, enum dfu_state state)
  */
 int dfu_sm_get_state(dfu_handle *handle)
 {
-	return dfu_state;
+	return handle->dfu_state;
 }
 
 /**
@@ -772,5 +776,7 @@ void dfu_sm_set_state_unchecked(dfu_handle *handle, enum dfu_state state)
 	/* 	 "[state reset: -> %s]\n", */
 	/* 	 dfu_state_to_string(state)); */
 
-	dfu_state = state;
+	handle->dfu_state = state;
+	if(handle->sm_prof)
+		dfu_sm_prof_enter(handle->sm_prof, state);
 }
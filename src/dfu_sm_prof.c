@@ -0,0 +1,172 @@
+/*
+ * dfu-util - state machine profiler
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * Every state change is timestamped, and the time between two changes
+ * is charged to the state left. Time in dfuDNBUSY and dfuMANIFEST is
+ * split into what the device asked for with bwPollTimeout and what the
+ * host took on top of that (sleeping longer, the GETSTATUS round trip),
+ * which tells a slow device from a slow host. The result is printed as
+ * a table, and written as folded stacks for flame graph tools:
+ *
+ *	dfu-util;dfuDNBUSY;bwPollTimeout 735000
+ *	dfu-util;dfuDNBUSY;host 65100
+ *
+ * with the time in microseconds.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dfu.h"
+#include "dfu_sm_prof.h"
+#include "dfu_clock.h"
+
+void dfu_sm_prof_init(struct dfu_sm_prof *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->state = -1;
+}
+
+/* the state machine is (now) in @p state */
+void dfu_sm_prof_enter(struct dfu_sm_prof *p, int state)
+{
+	unsigned long long now = dfu_clock_us();
+
+	if (state < 0 || state >= dfu_state_count)
+		return;
+
+	if (p->state < 0) {
+		p->start = now;
+	} else {
+		p->dwell[p->state] += now - p->enter;
+		p->transitions[p->state][state]++;
+		if (p->state == state) {
+			p->enter = now;
+			return;
+		}
+	}
+	p->state = state;
+	p->enter = now;
+	p->visits[state]++;
+}
+
+/* the host waits @p ms for the device, as told by bwPollTimeout */
+void dfu_sm_prof_busy(struct dfu_sm_prof *p, unsigned int ms)
+{
+	if (p->state >= 0)
+		p->busy[p->state] += ms * 1000ULL;
+}
+
+/* charge the current state up to now */
+static void _flush(struct dfu_sm_prof *p)
+{
+	unsigned long long now = dfu_clock_us();
+
+	if (p->state < 0)
+		return;
+	p->dwell[p->state] += now - p->enter;
+	p->enter = now;
+}
+
+void dfu_sm_prof_print(struct dfu_sm_prof *p)
+{
+	unsigned long long total = 0;
+	int i, j;
+
+	_flush(p);
+	for (i = 0; i < dfu_state_count; i++)
+		total += p->dwell[i];
+
+	printf("State profile, %llu ms:\n", total / 1000);
+	printf("%-24s %7s %10s %9s %6s %10s %10s\n", "state", "visits",
+	       "total-ms", "avg-ms", "share", "busy-ms", "host-ms");
+	for (i = 0; i < dfu_state_count; i++) {
+		if (!p->visits[i])
+			continue;
+		printf("%-24s %7u %10.1f %9.2f %5.1f%%", dfu_state_to_string(i),
+		       p->visits[i], p->dwell[i] / 1000.0,
+		       p->dwell[i] / 1000.0 / p->visits[i],
+		       total ? 100.0 * p->dwell[i] / total : 0.0);
+		if (p->busy[i])
+			printf(" %10.1f %10.1f", p->busy[i] / 1000.0,
+			       p->dwell[i] > p->busy[i] ?
+			       (p->dwell[i] - p->busy[i]) / 1000.0 : 0.0);
+		printf("\n");
+	}
+
+	printf("Transitions:\n");
+	for (i = 0; i < dfu_state_count; i++)
+		for (j = 0; j < dfu_state_count; j++)
+			if (p->transitions[i][j])
+				printf("  %s -> %s: %u\n",
+				       dfu_state_to_string(i),
+				       dfu_state_to_string(j),
+				       p->transitions[i][j]);
+}
+
+/**
+ * write the time per state to @p fname, in the folded stack format
+ * of flamegraph.pl and similar tools
+ *
+ * @return 0, or < 0 if the file can't be written
+ */
+int dfu_sm_prof_write_folded(struct dfu_sm_prof *p, const char *fname)
+{
+	FILE *f;
+	int i;
+
+	_flush(p);
+
+	f = fopen(fname, "w");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+
+	for (i = 0; i < dfu_state_count; i++) {
+		const char *name = dfu_state_to_string(i);
+
+		if (!p->dwell[i])
+			continue;
+		if (!p->busy[i]) {
+			fprintf(f, "dfu-util;%s %llu\n", name, p->dwell[i]);
+			continue;
+		}
+		/* the host may wake up before the time is up, too */
+		if (p->busy[i] > p->dwell[i]) {
+			fprintf(f, "dfu-util;%s;bwPollTimeout %llu\n", name,
+				p->dwell[i]);
+			continue;
+		}
+		fprintf(f, "dfu-util;%s;bwPollTimeout %llu\n", name,
+			p->busy[i]);
+		if (p->dwell[i] > p->busy[i])
+			fprintf(f, "dfu-util;%s;host %llu\n", name,
+				p->dwell[i] - p->busy[i]);
+	}
+
+	if (fclose(f) < 0) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * dfu-util - state machine profiler
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DFU_SM_PROF_H
+#define _DFU_SM_PROF_H
+
+#include "usb_dfu.h"
+
+/**
+ * where a transfer spends its time, by DFU state. Attached to a
+ * dfu_handle, it is told every state change by dfu_sm_*().
+ */
+struct dfu_sm_prof {
+	int state;			/* current state, -1 before the first */
+	unsigned long long enter;	/* us the state was entered at */
+	unsigned long long start;
+	unsigned long long dwell[dfu_state_count];	/* us */
+	/* bwPollTimeout waited for in the state, in us */
+	unsigned long long busy[dfu_state_count];
+	unsigned int visits[dfu_state_count];
+	unsigned int transitions[dfu_state_count][dfu_state_count];
+};
+
+void dfu_sm_prof_init(struct dfu_sm_prof *p);
+void dfu_sm_prof_enter(struct dfu_sm_prof *p, int state);
+void dfu_sm_prof_busy(struct dfu_sm_prof *p, unsigned int ms);
+void dfu_sm_prof_print(struct dfu_sm_prof *p);
+int dfu_sm_prof_write_folded(struct dfu_sm_prof *p, const char *fname);
+
+#endif
@@ -21,6 +21,23 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/*
+ * Suffixes are added to, and verified on, whole sets of images at a
+ * time: every file named, and the images found in every directory
+ * named, are handed to a pool of threads. Each file is checksummed in
+ * pieces of SUFFIX_READ_SIZE bytes, or once no files are left waiting
+ * and other threads would be idle, a large one is mapped and
+ * checksummed by crc32_buf_parallel(). The results are printed as a
+ * table, in the order the files were given.
+ *
+ * The idVendor, idProduct and bcdDevice of a suffix come from a map
+ * of file name patterns (see dfu_batch_load_map()), or from -d. A
+ * file that has a valid suffix already is left alone, so running the
+ * same batch twice is harmless.
+ */
+
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -29,56 +46,560 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <usb.h>
 #include "dfu.h"
 #include "dfu_sm.h"
+#include "dfu_suffix.h"
 #include "crc32.h"
 
+/* files are read and checksummed in pieces of this size */
+#define SUFFIX_READ_SIZE	(4*1024*1024)
+
+/* a line of the map: file name pattern and the ids for it */
+struct suffix_map_entry {
+	char *pattern;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+};
+
+static struct suffix_map_entry *suffix_map;
+static unsigned int suffix_map_len;
+
+/* ids for files not in the map, 0xffff meaning any */
+static uint16_t default_vendor = 0xffff;
+static uint16_t default_product = 0xffff;
+static int have_default;
+
+enum batch_result {
+	RESULT_ADDED,		/* suffix appended */
+	RESULT_PRESENT,		/* had the same suffix already */
+	RESULT_OK,		/* verified */
+	RESULT_MISSING,		/* no suffix */
+	RESULT_CORRUPT,		/* suffix with a wrong checksum */
+	RESULT_MISMATCH,	/* suffix for other ids */
+	RESULT_ERROR,		/* can't be read or written */
+};
+
+static const char *result_names[] = {
+	"added", "present", "ok", "missing", "corrupt", "mismatch", "error",
+};
+
+struct batch_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	/* the ids expected, from the map or -d */
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	int have_ids;
+
+	enum batch_result result;
+	struct dfu_file_suffix suffix;	/* found or written */
+	uint32_t crc;			/* calculated */
+	unsigned long long size;	/* of the firmware */
+	int error;			/* errno for RESULT_ERROR */
+};
+
+struct batch {
+	enum dfu_batch_mode mode;
+	struct batch_file *files;
+	unsigned int count;
+	unsigned int alloc;
+
+	pthread_mutex_t lock;
+	unsigned int next;	/* next file for a worker */
+};
+
+static int _parse_id(const char *str, char **end, uint16_t *id)
+{
+	unsigned long val;
+
+	if (*str == '*') {
+		*id = 0xffff;
+		*end = (char *)str + 1;
+		return 0;
+	}
+	val = strtoul(str, end, 16);
+	if (*end == str || val > 0xffff)
+		return -1;
+	*id = val;
+	return 0;
+}
+
 /**
- * add dfu firmware suffix to file @p fname
+ * load the map of file name patterns to suffix ids from @p path. Each
+ * line holds a shell pattern, matched against the path of a file if
+ * it contains a slash and against the file name otherwise, followed
+ * by VENDOR:PRODUCT[:RELEASE] in hex (any of them may be *). The first
+ * matching line counts.
+ *
+ * @return 0, or < 0 on error
  */
-int add_file_suffix(const char *fname)
+int dfu_batch_load_map(const char *path)
 {
-	struct dfu_file_suffix suffix;
-	char buf[2048];
-	uint32_t crc;
-	int fd, i, len;
+	char line[512];
+	unsigned int lineno = 0;
 	int ret = 0;
+	FILE *f;
 
-	fd = open(fname, O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd < 0) {
-		fprintf(stderr, "Can't open firmware file: %s (%d)\n", strerror(errno), errno);
-		ret = -1;
-		goto done;
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
 	}
-	crc = crc32_init();
-	while (1) {
-		len = read(fd, buf, 2048);
-		if (len == 0) break;
-		for (i = 0; i < len; i++)
-			crc = crc32_byte(crc, buf[i]);
+
+	while (fgets(line, sizeof(line), f)) {
+		struct suffix_map_entry e, *map;
+		char *pattern, *ids, *end, *save;
+
+		lineno++;
+		if ((end = strchr(line, '#')))
+			*end = '\0';
+		pattern = strtok_r(line, " \t\r\n", &save);
+		if (!pattern)
+			continue;
+		ids = strtok_r(NULL, " \t\r\n", &save);
+
+		e.bcdDevice = 0xffff;
+		if (!ids || strtok_r(NULL, " \t\r\n", &save) ||
+		    _parse_id(ids, &end, &e.idVendor) < 0 || *end != ':' ||
+		    _parse_id(end + 1, &end, &e.idProduct) < 0 ||
+		    (*end == ':' && _parse_id(end + 1, &end, &e.bcdDevice) < 0) ||
+		    *end) {
+			fprintf(stderr, "%s:%u: expected `PATTERN "
+				"VENDOR:PRODUCT[:RELEASE]'\n", path, lineno);
+			ret = -1;
+			break;
+		}
+
+		map = realloc(suffix_map, (suffix_map_len + 1) * sizeof(*map));
+		e.pattern = strdup(pattern);
+		if (!map || !e.pattern) {
+			free(e.pattern);
+			ret = -ENOMEM;
+			break;
+		}
+		suffix_map = map;
+		suffix_map[suffix_map_len++] = e;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/* the ids for files not in the map, e.g. from -d */
+void dfu_batch_set_default(uint16_t idVendor, uint16_t idProduct)
+{
+	default_vendor = idVendor;
+	default_product = idProduct;
+	have_default = 1;
+}
+
+static const struct suffix_map_entry *_map_lookup(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	unsigned int i;
+
+	name = name ? name + 1 : path;
+	for (i = 0; i < suffix_map_len; i++) {
+		const char *pattern = suffix_map[i].pattern;
+
+		if (strchr(pattern, '/') ?
+		    !fnmatch(pattern, path, FNM_PATHNAME) :
+		    !fnmatch(pattern, name, 0))
+			return &suffix_map[i];
 	}
+	return NULL;
+}
 
-	suffix.bcdDFU = cpu_to_le16(0x0100);
-	suffix.ucDfuSignature[0] = 'U';
-	suffix.ucDfuSignature[1] = 'F';
-	suffix.ucDfuSignature[2] = 'D';
-	suffix.bLength = DFU_FILE_SUFFIX_SIZE;
+/* whether a file found in a directory is an image to work on */
+static int _is_image(const char *path)
+{
+	size_t len = strlen(path);
 
-	memcpy(buf, &suffix, DFU_FILE_SUFFIX_SIZE);
-	for (i = 0; i < DFU_FILE_SUFFIX_SIZE - 4; i++)
-		crc = crc32_byte(crc, buf[i]);
+	if (suffix_map_len)
+		return _map_lookup(path) != NULL;
+	return (len > 4 && !strcmp(path + len - 4, ".bin")) ||
+		(len > 4 && !strcmp(path + len - 4, ".dfu"));
+}
 
-	suffix.dwCRC = cpu_to_le32(crc);
+static int _add_file(struct batch *b, const char *path, const struct stat *st)
+{
+	const struct suffix_map_entry *m = _map_lookup(path);
+	struct batch_file *f;
+	unsigned int i;
 
-	if (write(fd, &suffix, DFU_FILE_SUFFIX_SIZE) < 0)
-		printf("Can't write suffix block: %s (%d)\n", strerror(errno), errno);
-	else
-		printf("Successfully wrote suffix block (checksum: %08x)\n", crc);
+	/* named twice, e.g. as a file and in its directory */
+	for (i = 0; i < b->count; i++)
+		if (b->files[i].dev == st->st_dev &&
+		    b->files[i].ino == st->st_ino)
+			return 0;
 
- done:
-	close(fd);
+	if (b->count == b->alloc) {
+		unsigned int alloc = b->alloc ? 2 * b->alloc : 64;
+
+		f = realloc(b->files, alloc * sizeof(*f));
+		if (!f)
+			return -ENOMEM;
+		b->files = f;
+		b->alloc = alloc;
+	}
+
+	f = &b->files[b->count];
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(path);
+	if (!f->path)
+		return -ENOMEM;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	if (m) {
+		f->idVendor = m->idVendor;
+		f->idProduct = m->idProduct;
+		f->bcdDevice = m->bcdDevice;
+		f->have_ids = 1;
+	} else {
+		f->idVendor = default_vendor;
+		f->idProduct = default_product;
+		f->bcdDevice = 0xffff;
+		f->have_ids = have_default;
+	}
+	b->count++;
+	return 0;
+}
+
+static int _cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* the images in directory @p path and below, sorted by name */
+static int _add_dir(struct batch *b, const char *path)
+{
+	char **names = NULL;
+	unsigned int i, count = 0;
+	struct dirent *de;
+	int ret = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		char **n;
+
+		if (de->d_name[0] == '.')
+			continue;
+		n = realloc(names, (count + 1) * sizeof(*names));
+		if (!n) {
+			ret = -ENOMEM;
+			break;
+		}
+		names = n;
+		names[count] = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (!names[count]) {
+			ret = -ENOMEM;
+			break;
+		}
+		sprintf(names[count++], "%s/%s", path, de->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, count, sizeof(*names), _cmp_names);
+	for (i = 0; i < count; i++) {
+		struct stat st;
+
+		if (ret == 0 && stat(names[i], &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				ret = _add_dir(b, names[i]);
+			else if (S_ISREG(st.st_mode) && _is_image(names[i]))
+				ret = _add_file(b, names[i], &st);
+		}
+		free(names[i]);
+	}
+	free(names);
 	return ret;
 }
 
+/* CRC of the first @p len bytes of @p fd, on several threads if
+   @p parallel and the file is large enough to be split */
+static int _crc_file(int fd, char *buf, unsigned long long len,
+		     int parallel, uint32_t *crc)
+{
+	unsigned long long pos = 0;
+
+	*crc = crc32_init();
+	if (parallel && len >= 2 * CRC32_PARALLEL_MIN &&
+	    len <= (size_t) -1) {
+		void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map != MAP_FAILED) {
+			*crc = crc32_buf_parallel(*crc, map, len);
+			munmap(map, len);
+			return 0;
+		}
+	}
+	while (pos < len) {
+		size_t n = len - pos < SUFFIX_READ_SIZE ?
+			len - pos : SUFFIX_READ_SIZE;
+		ssize_t rc = pread(fd, buf, n, pos);
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return rc < 0 ? -errno : -EIO;
+		*crc = crc32_buf(*crc, buf, rc);
+		pos += rc;
+	}
+	return 0;
+}
+
+/* a field of the map given as `*' matches anything */
+static int _id_match(uint16_t map, uint16_t id)
+{
+	return map == 0xffff || map == id;
+}
+
+static int _ids_match(const struct batch_file *f,
+		      const struct dfu_file_suffix *s)
+{
+	return !f->have_ids ||
+		(_id_match(f->idVendor, le16_to_cpu(s->idVendor)) &&
+		 _id_match(f->idProduct, le16_to_cpu(s->idProduct)) &&
+		 _id_match(f->bcdDevice, le16_to_cpu(s->bcdDevice)));
+}
+
+/* whether the other threads have run out of files */
+static int _queue_empty(struct batch *b)
+{
+	int empty;
+
+	pthread_mutex_lock(&b->lock);
+	empty = b->next >= b->count;
+	pthread_mutex_unlock(&b->lock);
+	return empty;
+}
+
+static void _process(struct batch *b, struct batch_file *f, char *buf)
+{
+	struct dfu_file_suffix *s = &f->suffix;
+	struct stat st;
+	uint32_t crc;
+	int fd, ret;
+
+	fd = open(f->path, b->mode == DFU_BATCH_SUFFIX ? O_RDWR : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		f->error = errno;
+		goto error;
+	}
+
+	/* is there a suffix already? */
+	if (st.st_size >= DFU_FILE_SUFFIX_SIZE &&
+	    pread(fd, s, DFU_FILE_SUFFIX_SIZE,
+		  st.st_size - DFU_FILE_SUFFIX_SIZE) == DFU_FILE_SUFFIX_SIZE &&
+	    !memcmp(s->ucDfuSignature, "UFD", 3) &&
+	    s->bLength == DFU_FILE_SUFFIX_SIZE) {
+		f->size = st.st_size - DFU_FILE_SUFFIX_SIZE;
+		ret = _crc_file(fd, buf, st.st_size - 4, _queue_empty(b),
+				&f->crc);
+		if (ret < 0) {
+			f->error = -ret;
+			goto error;
+		}
+		if (f->crc != le32_to_cpu(s->dwCRC))
+			f->result = RESULT_CORRUPT;
+		else if (!_ids_match(f, s))
+			f->result = RESULT_MISMATCH;
+		else
+			f->result = b->mode == DFU_BATCH_SUFFIX ?
+				RESULT_PRESENT : RESULT_OK;
+		goto out;
+	}
+
+	f->size = st.st_size;
+	if (b->mode == DFU_BATCH_VERIFY) {
+		f->result = RESULT_MISSING;
+		goto out;
+	}
+
+	ret = _crc_file(fd, buf, st.st_size, _queue_empty(b), &crc);
+	if (ret < 0) {
+		f->error = -ret;
+		goto error;
+	}
+
+	memset(s, 0xff, sizeof(*s));
+	s->idVendor = cpu_to_le16(f->idVendor);
+	s->idProduct = cpu_to_le16(f->idProduct);
+	s->bcdDevice = cpu_to_le16(f->bcdDevice);
+	s->bcdDFU = cpu_to_le16(0x0100);
+	memcpy(s->ucDfuSignature, "UFD", 3);
+	s->bLength = DFU_FILE_SUFFIX_SIZE;
+	crc = crc32_buf(crc, s, DFU_FILE_SUFFIX_SIZE - 4);
+	s->dwCRC = cpu_to_le32(crc);
+	f->crc = crc;
+
+	errno = 0;
+	if (pwrite(fd, s, DFU_FILE_SUFFIX_SIZE, st.st_size) !=
+	    DFU_FILE_SUFFIX_SIZE) {
+		f->error = errno ? errno : EIO;
+		/* don't leave half a suffix behind */
+		if (ftruncate(fd, st.st_size) < 0)
+			perror(f->path);
+		goto error;
+	}
+	f->result = RESULT_ADDED;
+	goto out;
+
+ error:
+	f->result = RESULT_ERROR;
+ out:
+	if (fd >= 0 && close(fd) < 0 && f->result == RESULT_ADDED) {
+		f->error = errno;
+		f->result = RESULT_ERROR;
+	}
+}
+
+static void *_worker(void *v)
+{
+	struct batch *b = v;
+	char *buf;
+
+	buf = malloc(SUFFIX_READ_SIZE);
+
+	while (1) {
+		struct batch_file *f;
+
+		pthread_mutex_lock(&b->lock);
+		f = b->next < b->count ? &b->files[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+		if (!f)
+			break;
+
+		if (buf)
+			_process(b, f, buf);
+		else {
+			f->result = RESULT_ERROR;
+			f->error = ENOMEM;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void _print_table(const struct batch *b)
+{
+	unsigned int i, counts[RESULT_ERROR + 1];
+
+	memset(counts, 0, sizeof(counts));
+	printf("%-9s %-8s %-14s %12s  %s\n", "result", "checksum",
+	       "device", "bytes", "file");
+
+	for (i = 0; i < b->count; i++) {
+		const struct batch_file *f = &b->files[i];
+		const struct dfu_file_suffix *s = &f->suffix;
+
+		counts[f->result]++;
+		if (f->result == RESULT_ERROR) {
+			printf("%-9s %-8s %-14s %12s  %s: %s\n", "error", "-",
+			       "-", "-", f->path, strerror(f->error));
+			continue;
+		}
+		if (f->result == RESULT_MISSING) {
+			printf("%-9s %-8s %-14s %12llu  %s\n", "missing", "-",
+			       "-", f->size, f->path);
+			continue;
+		}
+
+		printf("%-9s %08x %04x:%04x:%04x %12llu  %s",
+		       result_names[f->result], f->crc,
+		       le16_to_cpu(s->idVendor), le16_to_cpu(s->idProduct),
+		       le16_to_cpu(s->bcdDevice), f->size, f->path);
+		if (f->result == RESULT_CORRUPT)
+			printf(" (expected %08x)", le32_to_cpu(s->dwCRC));
+		else if (f->result == RESULT_MISMATCH)
+			printf(" (expected %04x:%04x:%04x)", f->idVendor,
+			       f->idProduct, f->bcdDevice);
+		printf("\n");
+	}
+
+	printf("%u file(s):", b->count);
+	for (i = 0; i <= RESULT_ERROR; i++)
+		if (counts[i])
+			printf(" %u %s", counts[i], result_names[i]);
+	printf("\n");
+}
+
+/**
+ * add suffixes to, or verify, the files named by @p paths and the
+ * images found in the directories among them, on up to @p jobs
+ * threads (0 for one per CPU)
+ *
+ * @return 0 if every file has a valid suffix for its ids now, < 0
+ *	   otherwise
+ */
+int dfu_batch_run(enum dfu_batch_mode mode, char **paths, int count,
+		  unsigned int jobs)
+{
+	struct batch b;
+	pthread_t *threads;
+	unsigned int i, started = 0;
+	int ret = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.mode = mode;
+
+	for (i = 0; i < (unsigned int)count && ret == 0; i++) {
+		struct stat st;
+
+		if (stat(paths[i], &st) < 0) {
+			perror(paths[i]);
+			ret = -1;
+		} else if (S_ISDIR(st.st_mode))
+			ret = _add_dir(&b, paths[i]);
+		else
+			ret = _add_file(&b, paths[i], &st);
+	}
+	if (ret < 0)
+		goto out;
+
+	if (!jobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = cpus > 0 ? cpus : 1;
+	}
+	if (jobs > b.count)
+		jobs = b.count;
+
+	threads = calloc(jobs, sizeof(*threads));
+	pthread_mutex_init(&b.lock, NULL);
+	for (i = 0; threads && i < jobs; i++, started++)
+		if (pthread_create(&threads[i], NULL, _worker, &b) != 0)
+			break;
+	/* whatever is left, e.g. if no thread could be started */
+	_worker(&b);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&b.lock);
+	free(threads);
+
+	_print_table(&b);
+	for (i = 0; i < b.count; i++)
+		if (b.files[i].result > RESULT_OK)
+			ret = -1;
+
+ out:
+	for (i = 0; i < b.count; i++)
+		free(b.files[i].path);
+	free(b.files);
+	return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * dfu-util - DFU CRC / file suffix
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_SUFFIX_H
+#define _DFU_SUFFIX_H
+
+#include <stdint.h>
+
+enum dfu_batch_mode {
+	DFU_BATCH_SUFFIX,	/* append missing suffixes */
+	DFU_BATCH_VERIFY,	/* only check them */
+};
+
+int dfu_batch_load_map(const char *path);
+void dfu_batch_set_default(uint16_t idVendor, uint16_t idProduct);
+int dfu_batch_run(enum dfu_batch_mode mode, char **paths, int count,
+		  unsigned int jobs);
+
+#endif
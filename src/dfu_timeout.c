@@ -0,0 +1,142 @@
+/*
+ * dfu-util - adaptive request timeouts
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A device that stopped answering costs a whole usb_timeout per
+ * request before anybody notices. Instead, the latency of every kind
+ * of request is tracked the way TCP tracks round trip times (RFC 6298):
+ * a smoothed mean and mean deviation, and a timeout of mean plus four
+ * deviations. Until enough requests of a kind have completed, and never
+ * beyond it, the handle's usb_timeout is used.
+ *
+ * GETSTATUS and friends settle at a few ms, while DNLOAD and UPLOAD are
+ * tracked per length class, so large blocks keep the room they need.
+ * Each timeout in a row doubles the timeout of that kind. GETSTATUS
+ * and GETSTATE are sent again after a timeout, but only within
+ * DFU_TIMEOUT_RETRY_BUDGET times the first timeout, so a dead device
+ * is given up on after tens of ms rather than a usb_timeout.
+ *
+ * DNLOAD and UPLOAD move the device on and are never repeated, so one
+ * expired timeout fails the transfer. They get the full usb_timeout
+ * until their length class has a long history, never less than twice
+ * the slowest request in it, and a timeout throws the history away.
+ */
+
+#include <string.h>
+
+#include "usb_dfu.h"
+#include "dfu_timeout.h"
+
+void dfu_timeout_init(struct dfu_timeouts *t)
+{
+	memset(t, 0, sizeof(*t));
+}
+
+static struct dfu_rto *_rto(struct dfu_timeouts *t, int bRequest,
+			    unsigned int wLength)
+{
+	unsigned int class = 0;
+
+	if (bRequest < 0 || bRequest >= DFU_TIMEOUT_REQUESTS)
+		bRequest = USB_REQ_DFU_DNLOAD;
+	if (bRequest == USB_REQ_DFU_DNLOAD || bRequest == USB_REQ_DFU_UPLOAD)
+		for (wLength >>= 6; wLength && class < DFU_TIMEOUT_CLASSES - 1;
+		     wLength >>= 1)
+			class++;
+
+	return &t->rto[bRequest * DFU_TIMEOUT_CLASSES + class];
+}
+
+/**
+ * the timeout for a request, at most @p ceiling
+ *
+ * @return milliseconds
+ */
+unsigned int dfu_timeout_get(struct dfu_timeouts *t, int bRequest,
+			     unsigned int wLength, unsigned int ceiling)
+{
+	struct dfu_rto *r = _rto(t, bRequest, wLength);
+	unsigned long long ms;
+
+	if (r->samples < DFU_TIMEOUT_SAMPLES)
+		return ceiling;
+
+	ms = (r->srtt_us + 4ULL * r->rttvar_us) / 1000 + 1;
+	if (ms < DFU_TIMEOUT_MIN_MS)
+		ms = DFU_TIMEOUT_MIN_MS;
+	if (!dfu_timeout_idempotent(bRequest)) {
+		if (r->samples < DFU_TIMEOUT_TRANSFER_SAMPLES)
+			return ceiling;
+		if (ms < 2ULL * r->max_us / 1000 + 1)
+			ms = 2ULL * r->max_us / 1000 + 1;
+	}
+	ms <<= r->backoff;
+
+	return ms < ceiling ? ms : ceiling;
+}
+
+/**
+ * whether a request may be sent again after it timed out. Sending a
+ * status request again doesn't change what the device does next,
+ * though the lost one may have moved it on already, e.g. from
+ * dfuDNLOAD-SYNC to dfuDNBUSY, and the repeated one reports that.
+ *
+ * @return 1 for GETSTATUS and GETSTATE
+ */
+int dfu_timeout_idempotent(int bRequest)
+{
+	return bRequest == USB_REQ_DFU_GETSTATUS ||
+	       bRequest == USB_REQ_DFU_GETSTATE;
+}
+
+/* a request took @p elapsed_us, or @p timed_out */
+void dfu_timeout_sample(struct dfu_timeouts *t, int bRequest,
+			unsigned int wLength, unsigned long long elapsed_us,
+			int timed_out)
+{
+	struct dfu_rto *r = _rto(t, bRequest, wLength);
+	unsigned int sample = elapsed_us > 0xffffffffULL ?
+		0xffffffff : elapsed_us;
+	int err;
+
+	if (timed_out) {
+		t->expired++;
+		if (r->backoff < 16)
+			r->backoff++;
+		if (!dfu_timeout_idempotent(bRequest))
+			r->samples = 0;
+		return;
+	}
+	r->backoff = 0;
+	if (sample > r->max_us)
+		r->max_us = sample;
+
+	if (!r->samples++) {
+		r->max_us = sample;
+		r->srtt_us = sample;
+		r->rttvar_us = sample / 2;
+		return;
+	}
+
+	/* gains of 1/8 and 1/4, as in RFC 6298 */
+	err = (int)(sample - r->srtt_us);
+	r->srtt_us += err / 8;
+	r->rttvar_us += ((err < 0 ? -err : err) - (int)r->rttvar_us) / 4;
+}
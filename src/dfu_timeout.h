@@ -0,0 +1,60 @@
+/*
+ * dfu-util - adaptive request timeouts
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_TIMEOUT_H
+#define _DFU_TIMEOUT_H
+
+/* the shortest timeout ever used, in ms */
+#define DFU_TIMEOUT_MIN_MS	20
+/* requests of a kind completed before their timeout adapts */
+#define DFU_TIMEOUT_SAMPLES	8
+/* the same for DNLOAD and UPLOAD, which are never repeated */
+#define DFU_TIMEOUT_TRANSFER_SAMPLES	32
+/* a status request and its repeats take at most this many times the
+   timeout of the first attempt */
+#define DFU_TIMEOUT_RETRY_BUDGET	3
+/* DNLOAD and UPLOAD are told apart by length: < 64, < 128, ... bytes */
+#define DFU_TIMEOUT_CLASSES	8
+/* DFU class requests, DETACH to ABORT */
+#define DFU_TIMEOUT_REQUESTS	7
+
+/* latency of one kind of request */
+struct dfu_rto {
+	unsigned int samples;
+	unsigned int srtt_us;		/* smoothed latency */
+	unsigned int rttvar_us;		/* its mean deviation */
+	unsigned int max_us;		/* the slowest one seen */
+	unsigned int backoff;		/* timeouts in a row */
+};
+
+struct dfu_timeouts {
+	struct dfu_rto rto[DFU_TIMEOUT_REQUESTS * DFU_TIMEOUT_CLASSES];
+	unsigned int expired;
+};
+
+void dfu_timeout_init(struct dfu_timeouts *t);
+unsigned int dfu_timeout_get(struct dfu_timeouts *t, int bRequest,
+			     unsigned int wLength, unsigned int ceiling);
+int dfu_timeout_idempotent(int bRequest);
+void dfu_timeout_sample(struct dfu_timeouts *t, int bRequest,
+			unsigned int wLength, unsigned long long elapsed_us,
+			int timed_out);
+
+#endif
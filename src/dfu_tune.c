@@ -0,0 +1,307 @@
+/*
+ * dfu-util - transfer size autotuning
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The largest transfer size a device offers isn't always the fastest
+ * one. While a transfer runs, its first blocks are sent at different
+ * sizes, from the advertised wTransferSize downwards, and the fastest
+ * size is used for the rest of it. Every candidate moves the same
+ * number of bytes, so blocks stay aligned to the size being tried.
+ *
+ * The result is remembered per device model (idVendor, idProduct,
+ * bcdDevice) and direction, and used instead of tuning on later runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+#include "dfu_tune.h"
+#include "dfu_clock.h"
+
+#define TUNE_HEADER "# dfu-util transfer sizes v1\n"
+
+struct tune_entry {
+	unsigned int idVendor;
+	unsigned int idProduct;
+	unsigned int bcdDevice;
+	int upload;
+	unsigned int size;
+};
+
+static struct tune_entry tune_entries[DFU_TUNE_MAX_ENTRIES];
+static unsigned int tune_count;
+static int tune_loaded;
+static int tune_disabled;
+static char tune_file[4096];
+
+/* don't use remembered sizes; a new result is still stored */
+void dfu_tune_disable(void)
+{
+	tune_disabled = 1;
+}
+
+/* $DFU_UTIL_TUNE, or dfu-util/transfer-size in $XDG_CACHE_HOME or ~/.cache */
+static const char *_path(void)
+{
+	const char *env;
+
+	if (tune_file[0])
+		return tune_file;
+
+	if ((env = getenv("DFU_UTIL_TUNE")) && *env)
+		snprintf(tune_file, sizeof(tune_file), "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		snprintf(tune_file, sizeof(tune_file),
+			 "%s/dfu-util/transfer-size", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(tune_file, sizeof(tune_file),
+			 "%s/.cache/dfu-util/transfer-size", env);
+	else
+		return NULL;
+
+	return tune_file;
+}
+
+static void _load(void)
+{
+	char line[128], dir[4];
+	const char *path;
+	FILE *f;
+
+	if (tune_loaded)
+		return;
+	tune_loaded = 1;
+
+	path = _path();
+	if (!path)
+		return;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, TUNE_HEADER))
+		goto out;
+
+	while (tune_count < DFU_TUNE_MAX_ENTRIES &&
+	       fgets(line, sizeof(line), f)) {
+		struct tune_entry *e = &tune_entries[tune_count];
+
+		if (sscanf(line, "%4x:%4x:%4x %3s %u", &e->idVendor,
+			   &e->idProduct, &e->bcdDevice, dir, &e->size) != 5 ||
+		    !e->size)
+			continue;
+		e->upload = !strcmp(dir, "up");
+		tune_count++;
+	}
+
+ out:
+	fclose(f);
+}
+
+static int _mkdir_parents(const char *path)
+{
+	char dir[sizeof(tune_file)];
+	char *p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = dir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	return 0;
+}
+
+static void _save(void)
+{
+	char tmp[sizeof(tune_file) + 32];
+	const char *path = _path();
+	unsigned int i;
+	FILE *f;
+
+	if (!path || _mkdir_parents(path) < 0)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fputs(TUNE_HEADER, f);
+	for (i = 0; i < tune_count; i++) {
+		struct tune_entry *e = &tune_entries[i];
+
+		fprintf(f, "%04x:%04x:%04x %s %u\n", e->idVendor,
+			e->idProduct, e->bcdDevice, e->upload ? "up" : "dn",
+			e->size);
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static struct tune_entry *_find(uint16_t idVendor, uint16_t idProduct,
+				uint16_t bcdDevice, int upload)
+{
+	unsigned int i;
+
+	for (i = 0; i < tune_count; i++) {
+		struct tune_entry *e = &tune_entries[i];
+
+		if (e->idVendor == idVendor && e->idProduct == idProduct &&
+		    e->bcdDevice == bcdDevice && e->upload == upload)
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * the transfer size found for a device model earlier
+ *
+ * @return the size, or 0 if there is none
+ */
+unsigned int dfu_tune_lookup(uint16_t idVendor, uint16_t idProduct,
+			     uint16_t bcdDevice, int upload)
+{
+	struct tune_entry *e;
+
+	if (tune_disabled)
+		return 0;
+
+	_load();
+	e = _find(idVendor, idProduct, bcdDevice, upload);
+	return e ? e->size : 0;
+}
+
+static void _store(struct dfu_tune *t, unsigned int size)
+{
+	struct tune_entry *e;
+
+	_load();
+	e = _find(t->idVendor, t->idProduct, t->bcdDevice, t->upload);
+	if (!e) {
+		/* drop the oldest entry if full */
+		if (tune_count == DFU_TUNE_MAX_ENTRIES) {
+			memmove(&tune_entries[0], &tune_entries[1],
+				(tune_count - 1) * sizeof(*e));
+			tune_count--;
+		}
+		e = &tune_entries[tune_count++];
+		e->idVendor = t->idVendor;
+		e->idProduct = t->idProduct;
+		e->bcdDevice = t->bcdDevice;
+		e->upload = t->upload;
+	}
+	e->size = size;
+	_save();
+}
+
+/**
+ * start tuning a transfer to or from (@p upload) a device, whose
+ * largest transfer size is @p max_size
+ */
+void dfu_tune_init(struct dfu_tune *t, uint16_t idVendor, uint16_t idProduct,
+		   uint16_t bcdDevice, int upload, unsigned int max_size)
+{
+	unsigned int size;
+
+	memset(t, 0, sizeof(*t));
+	t->idVendor = idVendor;
+	t->idProduct = idProduct;
+	t->bcdDevice = bcdDevice;
+	t->upload = upload;
+	t->best = -1;
+
+	/* only sizes dividing the largest one, to keep blocks aligned */
+	for (size = max_size; t->count < DFU_TUNE_MAX_CANDIDATES; size /= 2) {
+		t->sizes[t->count++] = size;
+		if (size % 2 || size / 2 < DFU_TUNE_MIN_SIZE)
+			break;
+	}
+	t->window = max_size * DFU_TUNE_WINDOW_BLOCKS;
+
+	/* nothing to choose from */
+	if (t->count == 1)
+		t->best = 0;
+}
+
+static void _decide(struct dfu_tune *t)
+{
+	unsigned int i;
+
+	t->best = 0;
+	for (i = 1; i < t->current; i++)
+		if (t->rate[i] > t->rate[t->best])
+			t->best = i;
+
+	printf("\nTransfer size autotuning:");
+	for (i = 0; i < t->current; i++)
+		printf(" %u: %.1f KiB/s%s", t->sizes[i], t->rate[i] / 1024,
+		       i == (unsigned int) t->best ? " (chosen)" : "");
+	printf("\n");
+}
+
+/* the size of the next block */
+unsigned int dfu_tune_next(struct dfu_tune *t)
+{
+	if (t->best >= 0)
+		return t->sizes[t->best];
+	if (!t->done)
+		t->start_us = dfu_clock_us();
+	return t->sizes[t->current];
+}
+
+/* @p bytes of the last block were transferred */
+void dfu_tune_account(struct dfu_tune *t, unsigned int bytes)
+{
+	unsigned long long elapsed;
+	int last;
+
+	if (t->best >= 0)
+		return;
+
+	t->done += bytes;
+	/* a short block ends the transfer */
+	last = bytes < t->sizes[t->current];
+	if (t->done < t->window && !last)
+		return;
+
+	elapsed = dfu_clock_us() - t->start_us;
+	t->rate[t->current++] = t->done * 1000000.0 / (elapsed ? elapsed : 1);
+	t->done = 0;
+
+	if (!last && t->current < t->count)
+		return;
+
+	_decide(t);
+	/* a transfer ending early still uses the measurements so far,
+	   but they aren't complete enough to remember */
+	if (!last)
+		_store(t, t->sizes[t->best]);
+}
@@ -0,0 +1,64 @@
+/*
+ * dfu-util - transfer size autotuning
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_TUNE_H
+#define _DFU_TUNE_H
+
+#include <stdint.h>
+
+/* smallest transfer size tried */
+#define DFU_TUNE_MIN_SIZE	64
+/* candidates are the largest size, halved until DFU_TUNE_MIN_SIZE */
+#define DFU_TUNE_MAX_CANDIDATES	16
+/* each candidate transfers this many blocks of the largest size */
+#define DFU_TUNE_WINDOW_BLOCKS	4
+/* number of device models remembered */
+#define DFU_TUNE_MAX_ENTRIES	256
+
+/**
+ * measures the throughput of a transfer at several transfer sizes,
+ * one after another, and picks the fastest
+ */
+struct dfu_tune {
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	int upload;
+
+	unsigned int sizes[DFU_TUNE_MAX_CANDIDATES];
+	double rate[DFU_TUNE_MAX_CANDIDATES];	/* bytes per second */
+	unsigned int count;
+	unsigned int current;		/* candidate being measured */
+	unsigned int window;		/* bytes per candidate */
+	unsigned int done;		/* bytes of the current window */
+	unsigned long long start_us;
+	int best;			/* index, or -1 until decided */
+};
+
+void dfu_tune_init(struct dfu_tune *t, uint16_t idVendor, uint16_t idProduct,
+		   uint16_t bcdDevice, int upload, unsigned int max_size);
+unsigned int dfu_tune_next(struct dfu_tune *t);
+void dfu_tune_account(struct dfu_tune *t, unsigned int bytes);
+
+unsigned int dfu_tune_lookup(uint16_t idVendor, uint16_t idProduct,
+			     uint16_t bcdDevice, int upload);
+void dfu_tune_disable(void);
+
+#endif
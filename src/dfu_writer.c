@@ -0,0 +1,578 @@
+/*
+ * dfu-util - asynchronous upload file writer
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The USB loop fills chunks of DFU_WRITER_CHUNK_SIZE bytes in place
+ * (dfu_writer_buf() / dfu_writer_commit()); a separate thread
+ * computes the CRC (and digests) over each full chunk and writes it
+ * out with as few syscalls as possible. Aligned blocks which are
+ * entirely zero are not written but left as holes, so dumps of mostly
+ * empty memories stay sparse on disk. Erased flash (0xff) can't be
+ * represented by a hole and is always written.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32.h"
+#include "dfu_digest.h"
+#include "dfu_writer.h"
+
+/* ugly hack for Win32 */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct writer_chunk {
+	char *data;
+	size_t len;
+};
+
+struct dfu_writer {
+	int fd;
+	char *fname;
+	int preallocated;
+	/* writing to a pipe: strictly in order, no holes */
+	int stream;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct writer_chunk chunks[DFU_WRITER_CHUNKS];
+	/* next chunk for the writer thread */
+	unsigned int head;
+	/* chunks handed over to, and not yet released by the thread */
+	unsigned int queued;
+	int closing;
+	/* errno of the first failed write, sticky */
+	int error;
+
+	/* only touched by the writer thread, or after it is idle */
+	off_t offset;
+	off_t holes;
+	uint32_t crc;
+	struct dfu_digest *digest;	/* or NULL */
+};
+
+/* where the data of a writer opened on "-" goes */
+static int _stdout_fd = STDOUT_FILENO;
+
+static int _all_zero(const char *buf, size_t len)
+{
+	return len == 0 || (buf[0] == 0 && !memcmp(buf, buf+1, len-1));
+}
+
+static int _pwrite_all(int fd, const char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t rc = pwrite(fd, buf, len, offset);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+static int _write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t rc = write(fd, buf, len);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* a run of zero blocks: skip it, or punch it out of the preallocation */
+static int _write_hole(struct dfu_writer *w, const char *buf, size_t len,
+		       off_t offset)
+{
+	if (w->preallocated) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+		if (fallocate(w->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			      offset, len) < 0)
+#endif
+			return _pwrite_all(w->fd, buf, len, offset);
+	}
+
+	w->holes += len;
+	return 0;
+}
+
+/* write @p c at the current offset, one syscall per data or zero run */
+static int _write_chunk(struct dfu_writer *w, struct writer_chunk *c)
+{
+	size_t pos = 0, run = 0;
+	int run_zero = 0;
+	int ret;
+
+	w->crc = crc32_buf(w->crc, c->data, c->len);
+	dfu_digest_update(w->digest, c->data, c->len);
+
+	if (w->stream) {
+		ret = _write_all(w->fd, c->data, c->len);
+		if (ret < 0)
+			return ret;
+		w->offset += c->len;
+		return 0;
+	}
+
+	while (pos < c->len) {
+		off_t at = w->offset + pos;
+		size_t blk = DFU_WRITER_HOLE_SIZE - (at % DFU_WRITER_HOLE_SIZE);
+		int zero;
+
+		if (blk > c->len - pos)
+			blk = c->len - pos;
+
+		/* only whole, aligned blocks can become holes */
+		zero = blk == DFU_WRITER_HOLE_SIZE &&
+			_all_zero(c->data + pos, blk);
+
+		if (run && zero != run_zero) {
+			const char *from = c->data + pos - run;
+
+			ret = run_zero ? _write_hole(w, from, run, at - run) :
+				_pwrite_all(w->fd, from, run, at - run);
+			if (ret < 0)
+				return ret;
+			run = 0;
+		}
+		run_zero = zero;
+		run += blk;
+		pos += blk;
+	}
+
+	if (run) {
+		const char *from = c->data + pos - run;
+		off_t at = w->offset + pos - run;
+
+		ret = run_zero ? _write_hole(w, from, run, at) :
+			_pwrite_all(w->fd, from, run, at);
+		if (ret < 0)
+			return ret;
+	}
+
+	w->offset += c->len;
+	return 0;
+}
+
+static void *_writer_thread(void *v)
+{
+	struct dfu_writer *w = v;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		struct writer_chunk *c;
+		int ret = 0;
+
+		while (!w->queued && !w->closing)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->queued)
+			break;
+
+		c = &w->chunks[w->head];
+		pthread_mutex_unlock(&w->lock);
+
+		/* after an error, chunks are drained without writing
+		   so the producer never blocks forever */
+		if (!w->error)
+			ret = _write_chunk(w, c);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret < 0 && !w->error)
+			w->error = -ret;
+		c->len = 0;
+		w->head = (w->head + 1) % DFU_WRITER_CHUNKS;
+		w->queued--;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/* take the first @p len bytes already in the file into the CRC and
+   digests */
+static int _crc_existing(struct dfu_writer *w, off_t len)
+{
+	char *buf = w->chunks[0].data;
+	off_t pos = 0;
+
+	while (pos < len) {
+		size_t n = len - pos < DFU_WRITER_CHUNK_SIZE ?
+			len - pos : DFU_WRITER_CHUNK_SIZE;
+		ssize_t ret = pread(w->fd, buf, n, pos);
+
+		if (ret <= 0) {
+			fprintf(stderr, "%s: can't read the first %lld bytes "
+				"back\n", w->fname, (long long)len);
+			return -1;
+		}
+		w->crc = crc32_buf(w->crc, buf, ret);
+		dfu_digest_update(w->digest, buf, ret);
+		pos += ret;
+	}
+	w->offset = len;
+	return 0;
+}
+
+static struct dfu_writer *_open(const char *fname, off_t size_hint,
+				off_t resume_at, struct dfu_digest *digest)
+{
+	struct dfu_writer *w;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->fname = strdup(fname);
+	for (i = 0; i < DFU_WRITER_CHUNKS; i++) {
+		w->chunks[i].data = malloc(DFU_WRITER_CHUNK_SIZE);
+		if (!w->chunks[i].data)
+			goto out_free;
+	}
+	if (!w->fname)
+		goto out_free;
+
+	if (!strcmp(fname, "-")) {
+		w->fd = dup(_stdout_fd);
+		w->stream = 1;
+		/* neither seekable nor worth preallocating */
+		resume_at = size_hint = 0;
+	} else if (resume_at)
+		w->fd = open(fname, O_RDWR|O_BINARY);
+	else
+		w->fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
+	if (w->fd < 0) {
+		perror(fname);
+		goto out_free;
+	}
+
+	w->crc = crc32_init();
+	w->digest = digest;
+	if (resume_at && _crc_existing(w, resume_at) < 0) {
+		close(w->fd);
+		goto out_free;
+	}
+	/* what the interrupted run wrote after its checkpoint is stale,
+	   and zero blocks are skipped, not written over it */
+	if (resume_at && ftruncate(w->fd, resume_at) < 0) {
+		perror(fname);
+		close(w->fd);
+		goto out_free;
+	}
+
+	if (size_hint > 0) {
+#ifdef HAVE_FALLOCATE
+		if (fallocate(w->fd, 0, 0, size_hint) == 0)
+			w->preallocated = 1;
+		else
+			fprintf(stderr, "%s: can't preallocate %lld bytes: %s\n",
+				fname, (long long)size_hint, strerror(errno));
+#else
+		fprintf(stderr, "%s: preallocation isn't supported on this "
+			"system\n", fname);
+#endif
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if (pthread_create(&w->thread, NULL, _writer_thread, w) != 0) {
+		fprintf(stderr, "%s: can't start writer thread\n", fname);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		close(w->fd);
+		goto out_free;
+	}
+
+	return w;
+
+ out_free:
+	for (i = 0; i < DFU_WRITER_CHUNKS; i++)
+		free(w->chunks[i].data);
+	free(w->fname);
+	free(w);
+	return NULL;
+}
+
+/**
+ * keep stdout to itself for the data of a writer opened on "-". From
+ * now on, everything else printed to stdout goes to stderr instead.
+ *
+ * @return 0, or < 0 on error
+ */
+int dfu_writer_claim_stdout(void)
+{
+	fflush(stdout);
+	_stdout_fd = dup(STDOUT_FILENO);
+	if (_stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("stdout");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * create @p fname for writing, or write to stdout if it is "-". If
+ * @p size_hint is > 0, the expected amount of data, the file is
+ * preallocated to avoid fragmentation. If @p digest isn't NULL, the
+ * data is hashed into it by the writer thread as well.
+ *
+ * @return a new writer, or NULL on error
+ */
+struct dfu_writer *dfu_writer_open(const char *fname, off_t size_hint,
+				   struct dfu_digest *digest)
+{
+	return _open(fname, size_hint, 0, digest);
+}
+
+/**
+ * go on writing @p fname after its first @p offset bytes, which are
+ * kept and included in the CRC and @p digest
+ *
+ * @return a new writer, or NULL on error
+ */
+struct dfu_writer *dfu_writer_resume(const char *fname, off_t offset,
+				     struct dfu_digest *digest)
+{
+	return _open(fname, 0, offset, digest);
+}
+
+/* hand the chunk being filled over to the writer thread. the caller
+   holds w->lock. */
+static void _submit_locked(struct dfu_writer *w)
+{
+	struct writer_chunk *c;
+
+	c = &w->chunks[(w->head + w->queued) % DFU_WRITER_CHUNKS];
+	if (!c->len)
+		return;
+
+	w->queued++;
+	pthread_cond_broadcast(&w->cond);
+
+	/* wait for a free chunk to continue with */
+	while (w->queued == DFU_WRITER_CHUNKS)
+		pthread_cond_wait(&w->cond, &w->lock);
+}
+
+static int _report_error(struct dfu_writer *w)
+{
+	fprintf(stderr, "%s: write failed: %s\n", w->fname,
+		strerror(w->error));
+	return -1;
+}
+
+/**
+ * get room for up to @p len bytes, to be filled in place (e.g. by
+ * dfu_upload()) and then passed to dfu_writer_commit(). The USB loop
+ * only blocks here if all chunks are still waiting for the disk.
+ *
+ * @return pointer to the buffer, or NULL on error
+ */
+char *dfu_writer_buf(struct dfu_writer *w, size_t len)
+{
+	struct writer_chunk *c;
+	int error;
+
+	if (len > DFU_WRITER_CHUNK_SIZE)
+		return NULL;
+
+	pthread_mutex_lock(&w->lock);
+	c = &w->chunks[(w->head + w->queued) % DFU_WRITER_CHUNKS];
+	if (c->len + len > DFU_WRITER_CHUNK_SIZE) {
+		_submit_locked(w);
+		c = &w->chunks[(w->head + w->queued) % DFU_WRITER_CHUNKS];
+	}
+	error = w->error;
+	pthread_mutex_unlock(&w->lock);
+
+	if (error) {
+		_report_error(w);
+		return NULL;
+	}
+
+	return c->data + c->len;
+}
+
+/**
+ * account @p len bytes, stored at the pointer obtained from the last
+ * dfu_writer_buf() call.
+ *
+ * @return 0, or < 0 if an earlier write has failed
+ */
+int dfu_writer_commit(struct dfu_writer *w, size_t len)
+{
+	struct writer_chunk *c;
+	int error;
+
+	pthread_mutex_lock(&w->lock);
+	c = &w->chunks[(w->head + w->queued) % DFU_WRITER_CHUNKS];
+	c->len += len;
+	if (c->len == DFU_WRITER_CHUNK_SIZE)
+		_submit_locked(w);
+	error = w->error;
+	pthread_mutex_unlock(&w->lock);
+
+	if (error)
+		return _report_error(w);
+	return 0;
+}
+
+/* copy @p len bytes of @p data into the writer */
+int dfu_writer_write(struct dfu_writer *w, const void *data, size_t len)
+{
+	while (len) {
+		size_t n = len < DFU_WRITER_CHUNK_SIZE ?
+			len : DFU_WRITER_CHUNK_SIZE;
+		char *buf = dfu_writer_buf(w, n);
+
+		if (!buf)
+			return -1;
+		memcpy(buf, data, n);
+		if (dfu_writer_commit(w, n) < 0)
+			return -1;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * wait until everything handed to the writer is on disk. A file is
+ * extended over trailing holes, so that it is as long as the data
+ * written, e.g. for a checkpoint taken after zero blocks.
+ *
+ * @param[out] crc - CRC over all bytes written so far (optional)
+ * @return 0, or < 0 if a write has failed
+ */
+int dfu_writer_sync(struct dfu_writer *w, uint32_t *crc)
+{
+	struct stat st;
+
+	pthread_mutex_lock(&w->lock);
+	_submit_locked(w);
+	while (w->queued)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	if (crc)
+		*crc = w->crc;
+
+	if (w->error)
+		return _report_error(w);
+
+	/* the writer thread is idle, the file is ours */
+	if (!w->stream && (fstat(w->fd, &st) < 0 ||
+			   (st.st_size < w->offset &&
+			    ftruncate(w->fd, w->offset) < 0))) {
+		perror(w->fname);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * stop hashing the data into the digest passed at open, e.g. before
+ * the suffix is appended. Only after dfu_writer_sync(), when the
+ * writer thread is idle.
+ */
+void dfu_writer_end_digest(struct dfu_writer *w)
+{
+	w->digest = NULL;
+}
+
+/**
+ * flush, stop the writer thread and close the file. The file is cut
+ * to the amount of data written, dropping unused preallocation.
+ *
+ * @param[out] total - number of bytes written (optional)
+ * @param[out] holes - number of bytes left as holes (optional)
+ * @return 0, or < 0 if any write has failed
+ */
+int dfu_writer_close(struct dfu_writer *w, off_t *total, off_t *holes)
+{
+	int ret = 0;
+	int i;
+
+	if (dfu_writer_sync(w, NULL) < 0)
+		ret = -1;
+
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	/* trailing holes only exist once the size is set */
+	if (!w->stream && ftruncate(w->fd, w->offset) < 0) {
+		perror(w->fname);
+		ret = -1;
+	}
+	if (close(w->fd) < 0) {
+		perror(w->fname);
+		ret = -1;
+	}
+
+	if (total)
+		*total = w->offset;
+	if (holes)
+		*holes = w->holes;
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	for (i = 0; i < DFU_WRITER_CHUNKS; i++)
+		free(w->chunks[i].data);
+	free(w->fname);
+	free(w);
+
+	return ret;
+}
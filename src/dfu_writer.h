@@ -0,0 +1,51 @@
+/*
+ * dfu-util - asynchronous upload file writer
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DFU_WRITER_H
+#define _DFU_WRITER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* data is handed to the writer thread in chunks of this size */
+#define DFU_WRITER_CHUNK_SIZE	(4*1024*1024)
+/* number of chunks in flight between the USB loop and the writer */
+#define DFU_WRITER_CHUNKS	4
+/* all-zero, aligned blocks of this size are left as holes */
+#define DFU_WRITER_HOLE_SIZE	4096
+
+struct dfu_writer;
+struct dfu_digest;
+
+int dfu_writer_claim_stdout(void);
+struct dfu_writer *dfu_writer_open(const char *fname, off_t size_hint,
+				   struct dfu_digest *digest);
+struct dfu_writer *dfu_writer_resume(const char *fname, off_t offset,
+				     struct dfu_digest *digest);
+
+char *dfu_writer_buf(struct dfu_writer *w, size_t len);
+int dfu_writer_commit(struct dfu_writer *w, size_t len);
+int dfu_writer_write(struct dfu_writer *w, const void *data, size_t len);
+
+int dfu_writer_sync(struct dfu_writer *w, uint32_t *crc);
+void dfu_writer_end_digest(struct dfu_writer *w);
+int dfu_writer_close(struct dfu_writer *w, off_t *total, off_t *holes);
+
+#endif
@@ -21,6 +21,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -28,14 +30,38 @@
 #include <getopt.h>
 #include <usb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "dfu.h"
 #include "dfu_sm.h"
 #include "usb_dfu.h"
 #include "sam7dfu.h"
+#include "dfu_cache.h"
+#include "dfu_image.h"
+#include "dfu_writer.h"
+#include "dfu_session.h"
+#include "dfu_engine.h"
+#include "dfu_sim.h"
+#include "dfu_shard.h"
+#include "dfu_remote.h"
+#include "dfu_tune.h"
+#include "dfu_profile.h"
+#include "dfu_digest.h"
+#include "dfu_suffix.h"
+#include "dfu_route.h"
+#include "dfu_hotplug.h"
+#include "dfu_sm_prof.h"
+#include "dfu_heatmap.h"
+#include "dfu_progress.h"
+#include "dfu_log.h"
+#include "dfu_clock.h"
+#include "crc32.h"
 #include "dfu-version.h"
 #ifdef HAVE_CONFIG_H
-#include "config.h"
 #endif
 
 #ifdef HAVE_USBPATH_H
@@ -44,6 +70,12 @@
 
 int debug;
 static int verbose = 0;
+/* devices downloading at once per bus and per hub, 0 for the default */
+static unsigned int bus_budget = 0;
+static unsigned int hub_budget = 0;
+/* how transfers are rendered, and how often; 0 for the default */
+static enum dfu_progress_mode progress_mode = DFU_PROGRESS_BAR;
+static unsigned int progress_ms = 0;
 
 #define DFU_IFF_DFU		0x0001	/* DFU Mode, (not Runtime) */
 #define DFU_IFF_VENDOR		0x0100
@@ -53,6 +85,7 @@ static int verbose = 0;
 #define DFU_IFF_ALT		0x1000
 #define DFU_IFF_DEVNUM		0x2000
 #define DFU_IFF_PATH		0x4000
+#define DFU_IFF_BUS		0x8000
 
 struct usb_vendprod {
 	u_int16_t vendor;
@@ -68,6 +101,7 @@ struct dfu_if {
 	int bus;
 	u_int8_t devnum;
 	const char *path;
+	const char *bus_name;
 	unsigned int flags;
 	struct usb_device *dev;
 
@@ -236,6 +270,9 @@ static int iterate_dfu_devices(struct dfu_if *dif,
 	/* Walk the tree and find our device. */
 	for (usb_bus = usb_get_busses(); NULL != usb_bus;
 	     usb_bus = usb_bus->next) {
+		if (dif && (dif->flags & DFU_IFF_BUS) &&
+		    strcmp(usb_bus->dirname, dif->bus_name))
+			continue;
 		for (dev = usb_bus->devices; NULL != dev; dev = dev->next) {
 			int retval;
 
@@ -295,6 +332,811 @@ static int count_dfu_devices(struct dfu_if *dif)
 }
 
 
+struct usb_device_list {
+	struct usb_device **devs;
+	int count;
+	int alloc;
+};
+
+static int _collect_cb(struct usb_device *dev, void *user)
+{
+	struct usb_device_list *list = user;
+
+	if (list->count == list->alloc) {
+		int alloc = list->alloc ? 2 * list->alloc : 16;
+		struct usb_device **devs;
+
+		devs = realloc(list->devs, alloc * sizeof(*devs));
+		if (!devs)
+			return -ENOMEM;
+		list->devs = devs;
+		list->alloc = alloc;
+	}
+	list->devs[list->count++] = dev;
+	return 0;
+}
+
+/* Collect all matching DFU capable devices within system */
+static int collect_dfu_devices(struct dfu_if *dif, struct usb_device_list *list)
+{
+	list->count = 0;
+	return iterate_dfu_devices(dif, _collect_cb, list);
+}
+
+/* milliseconds a device needs to re-enumerate after a reset */
+static unsigned int reset_delay(const struct dfu_profile *profile)
+{
+	if (profile->set & DFU_PROFILE_RESET_DELAY)
+		return profile->reset_delay;
+	return 2000;
+}
+
+static dfu_quirks device_quirks(struct usb_device *dev, int auto_detect,
+				dfu_quirks *manual_quirks)
+{
+	dfu_quirks quirks;
+
+	dfu_quirks_clear(&quirks);
+	if (auto_detect)
+		quirks = dfu_quirks_detect(0, dev->descriptor.idVendor,
+					   dev->descriptor.idProduct,
+					   dev->descriptor.bcdDevice);
+	dfu_quirks_insert(&quirks, manual_quirks);
+	return quirks;
+}
+
+/* Thread per device: used where the download engine isn't available */
+static int multi_dnload_threads(struct dfu_if *targets, int count,
+				const struct dfu_image **images,
+				unsigned int transfer_size,
+				int quirks_auto_detect,
+				dfu_quirks *manual_quirks,
+				unsigned long long *bytes)
+{
+	struct dfu_session *sessions;
+	struct dfu_progress progress;
+	int i, num_ok = 0;
+
+	sessions = calloc(count, sizeof(*sessions));
+	if (!sessions)
+		return 0;
+	if (dfu_progress_init(&progress, progress_mode, progress_ms,
+			      count) < 0) {
+		dfu_progress_free(&progress);
+		free(sessions);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct dfu_if *t = &targets[i];
+
+		if (dfu_session_open(&sessions[i], t->dev,
+				     t->interface, t->altsetting,
+				     transfer_size,
+				     device_quirks(t->dev,
+						   quirks_auto_detect,
+						   manual_quirks)) < 0)
+			continue;
+
+		printf("%s: [0x%04x:0x%04x] starting download, transfer size 0x%04x\n",
+		       sessions[i].name, t->vendor, t->product,
+		       sessions[i].transfer_size);
+		sessions[i].handle.progress = dfu_progress_dev(&progress,
+							       sessions[i].name);
+		dfu_session_start(&sessions[i], images[i]);
+	}
+
+	dfu_progress_start(&progress);
+	for (i = 0; i < count; i++) {
+		struct dfu_session *s = &sessions[i];
+
+		if (s->dev_handle && dfu_session_join(s) == 0) {
+			num_ok++;
+			*bytes += images[i]->size;
+		}
+	}
+	/* nothing may be printed in between the progress lines */
+	dfu_log_flush();
+	dfu_progress_stop(&progress);
+	dfu_progress_free(&progress);
+
+	for (i = 0; i < count; i++) {
+		struct dfu_session *s = &sessions[i];
+
+		if (!s->dev_handle)
+			continue;
+		printf("%s: download %s\n", s->name,
+		       s->result == 0 ? "finished" : "FAILED");
+		dfu_session_close(s);
+	}
+
+	printf("%d of %d device(s) updated successfully\n", num_ok, count);
+
+	free(sessions);
+	return num_ok;
+}
+
+static void _report_progress(void *user, const struct dfu_engine_progress *p)
+{
+	dfu_shard_report(*(int *) user, p);
+}
+
+/* All devices driven by the single threaded download engine */
+static int multi_dnload_engine(struct dfu_if *targets, int count,
+			       const struct dfu_image **images,
+			       unsigned int transfer_size,
+			       int quirks_auto_detect,
+			       dfu_quirks *manual_quirks, int report_fd,
+			       unsigned long long *bytes)
+{
+	struct dfu_engine *engine;
+	struct dfu_progress progress;
+	int i, failed;
+
+	/* a worker of --per-bus only reports to its parent */
+	if (dfu_progress_init(&progress, report_fd >= 0 ? DFU_PROGRESS_NONE :
+			      progress_mode, progress_ms, count) < 0) {
+		dfu_progress_free(&progress);
+		return 0;
+	}
+	engine = dfu_engine_new(NULL);
+	if (!engine) {
+		dfu_progress_free(&progress);
+		return 0;
+	}
+	dfu_engine_set_budget(engine, bus_budget, hub_budget);
+	if (report_fd >= 0)
+		dfu_engine_set_progress(engine, _report_progress, &report_fd);
+	else
+		dfu_engine_set_meter(engine, &progress);
+
+	for (i = 0; i < count; i++) {
+		struct dfu_if *t = &targets[i];
+
+		dfu_engine_add_usb(engine, t->dev, t->interface,
+				   t->altsetting, transfer_size,
+				   device_quirks(t->dev, quirks_auto_detect,
+						 manual_quirks), images[i]);
+	}
+
+	printf("Starting download to %d device(s)...\n", count);
+	dfu_progress_start(&progress);
+	failed = dfu_engine_run(engine);
+	dfu_log_flush();
+	dfu_progress_stop(&progress);
+	dfu_engine_print_stats(engine);
+	for (i = 0; i < count; i++)
+		if (dfu_engine_result(engine, i) == 0)
+			*bytes += images[i]->size;
+	dfu_engine_free(engine);
+	dfu_progress_free(&progress);
+
+	return count - failed;
+}
+
+/* The image of @p route for a device, or NULL if the device has to
+ * be left alone */
+static const struct dfu_image *route_image(const struct dfu_route *route,
+					   struct usb_device *dev)
+{
+	const char *why = "no image is made for it";
+	int i;
+
+	i = dfu_route_lookup(route, dev->descriptor.idVendor,
+			     dev->descriptor.idProduct,
+			     dev->descriptor.bcdDevice);
+	if (i >= 0) {
+		printf("%s/%03u: [0x%04x:0x%04x rev 0x%04x] <- %s\n",
+		       dev->bus->dirname, dev->devnum,
+		       dev->descriptor.idVendor, dev->descriptor.idProduct,
+		       dev->descriptor.bcdDevice, route->images[i].fname);
+		return &route->images[i];
+	}
+
+	if (i == -EEXIST)
+		why = "several images match it equally well";
+	fprintf(stderr, "%s/%03u: [0x%04x:0x%04x rev 0x%04x] refused, %s\n",
+		dev->bus->dirname, dev->devnum, dev->descriptor.idVendor,
+		dev->descriptor.idProduct, dev->descriptor.bcdDevice, why);
+	return NULL;
+}
+
+/* Download one image to all matching devices at once. The image is
+ * loaded a single time, and all devices are sent blocks straight out
+ * of it. With a @p route, each device is sent the image made for it
+ * instead, and devices without one are refused before any transfer.
+ * If @p report_fd isn't -1, progress is reported there. */
+static int multi_dnload(struct dfu_if *dif, struct dfu_image *image,
+			const struct dfu_route *route,
+			unsigned int transfer_size, int quirks_auto_detect,
+			dfu_quirks *manual_quirks, int report_fd)
+{
+	struct usb_device_list list = { NULL, 0, 0 };
+	struct dfu_if *targets = NULL;
+	const struct dfu_image **images = NULL;
+	struct dfu_engine_progress result;
+	unsigned long long bytes = 0;
+	int i, num_detached = 0, num_targets = 0, num_ok = 0;
+	unsigned int delay = 0;
+
+	if (collect_dfu_devices(dif, &list) < 0)
+		goto out;
+
+	/* switch all runtime mode devices to DFU mode first */
+	for (i = 0; i < list.count; i++) {
+		const struct dfu_profile *profile;
+		struct dfu_if rt_dif;
+
+		memset(&rt_dif, 0, sizeof(rt_dif));
+		rt_dif.dev = list.devs[i];
+		if (!get_first_dfu_if(&rt_dif) || rt_dif.flags & DFU_IFF_DFU)
+			continue;
+
+		printf("Detaching %s/%03u...\n", rt_dif.dev->bus->dirname,
+		       rt_dif.dev->devnum);
+		if (dfu_session_detach(rt_dif.dev, rt_dif.interface,
+				       device_quirks(rt_dif.dev,
+						     quirks_auto_detect,
+						     manual_quirks)) < 0)
+			continue;
+		num_detached++;
+
+		/* wait for the slowest device to come back */
+		profile = dfu_profile_lookup(rt_dif.dev->descriptor.idVendor,
+					     rt_dif.dev->descriptor.idProduct,
+					     rt_dif.dev->descriptor.bcdDevice);
+		if (reset_delay(profile) > delay)
+			delay = reset_delay(profile);
+	}
+
+	if (num_detached) {
+		dfu_clock_sleep_ms(delay);
+		usb_find_devices();
+		if (collect_dfu_devices(dif, &list) < 0)
+			goto out;
+	}
+
+	if (!list.count) {
+		fprintf(stderr, "No DFU capable USB device found\n");
+		goto out;
+	}
+
+	targets = calloc(list.count, sizeof(*targets));
+	images = calloc(list.count, sizeof(*images));
+	if (!targets || !images)
+		goto out;
+
+	for (i = 0; i < list.count; i++) {
+		struct dfu_if *t = &targets[num_targets];
+
+		t->dev = list.devs[i];
+		if (!get_first_dfu_if(t) || !(t->flags & DFU_IFF_DFU)) {
+			fprintf(stderr, "%s/%03u: device didn't enter DFU mode\n",
+				list.devs[i]->bus->dirname,
+				list.devs[i]->devnum);
+			continue;
+		}
+		if (dif->flags & DFU_IFF_IFACE)
+			t->interface = dif->interface;
+		if (dif->flags & DFU_IFF_ALT)
+			t->altsetting = dif->altsetting;
+		images[num_targets] = route ? route_image(route, t->dev) :
+			image;
+		if (!images[num_targets])
+			continue;
+		num_targets++;
+	}
+
+	if (!num_targets)
+		goto out;
+	if (dfu_engine_supported())
+		num_ok = multi_dnload_engine(targets, num_targets, images,
+					     transfer_size, quirks_auto_detect,
+					     manual_quirks, report_fd, &bytes);
+	else
+		num_ok = multi_dnload_threads(targets, num_targets, images,
+					      transfer_size, quirks_auto_detect,
+					      manual_quirks, &bytes);
+
+ out:
+	memset(&result, 0, sizeof(result));
+	result.count = list.count;
+	result.done = num_ok;
+	result.failed = list.count - num_ok;
+	result.bytes = result.total = bytes;
+	dfu_shard_report(report_fd, &result);
+
+	free(images);
+	free(targets);
+	free(list.devs);
+	return num_ok && num_ok == list.count ? 0 : -1;
+}
+
+struct shard_job {
+	struct dfu_if *dif;
+	struct dfu_image *image;
+	const struct dfu_route *route;
+	unsigned int transfer_size;
+	int quirks_auto_detect;
+	dfu_quirks *manual_quirks;
+};
+
+/* runs in a worker process of its own, see dfu_shard.c */
+static int shard_worker(const char *bus, int report_fd, void *user)
+{
+	struct shard_job *job = user;
+	struct dfu_if dif = *job->dif;
+
+	dif.bus_name = bus;
+	dif.flags |= DFU_IFF_BUS;
+	return multi_dnload(&dif, job->image, job->route, job->transfer_size,
+			    job->quirks_auto_detect, job->manual_quirks,
+			    report_fd);
+}
+
+/* Like multi_dnload(), but with a worker process per USB bus */
+static int sharded_dnload(struct dfu_if *dif, struct dfu_image *image,
+			  const struct dfu_route *route,
+			  unsigned int transfer_size, int quirks_auto_detect,
+			  dfu_quirks *manual_quirks)
+{
+	struct usb_device_list list = { NULL, 0, 0 };
+	struct shard_job job = { dif, image, route, transfer_size,
+				 quirks_auto_detect, manual_quirks };
+	char **buses = NULL;
+	int i, j, num_buses = 0, ret = -1;
+
+	if (collect_dfu_devices(dif, &list) < 0)
+		goto out;
+	if (!list.count) {
+		fprintf(stderr, "No DFU capable USB device found\n");
+		goto out;
+	}
+
+	buses = calloc(list.count, sizeof(*buses));
+	if (!buses)
+		goto out;
+
+	for (i = 0; i < list.count; i++) {
+		char *name = list.devs[i]->bus->dirname;
+
+		for (j = 0; j < num_buses; j++)
+			if (!strcmp(buses[j], name))
+				break;
+		if (j == num_buses)
+			buses[num_buses++] = name;
+	}
+
+	printf("Downloading to %d device(s) on %d bus(es)\n", list.count,
+	       num_buses);
+	if (dfu_shard_run(buses, num_buses, shard_worker, &job) == 0)
+		ret = 0;
+
+ out:
+	free(buses);
+	free(list.devs);
+	return ret;
+}
+
+/* A port of the station, see watch_dnload() */
+struct watch_port {
+	char port[32];
+	enum { PORT_PENDING, PORT_DETACHED, PORT_RUNNING, PORT_DONE } state;
+	unsigned int busnum;
+	unsigned int devnum;
+	unsigned long long plugged;	/* ms the board was attached at */
+	unsigned long long retry_until;	/* PORT_PENDING: give up then */
+	unsigned long long gone;	/* PORT_DONE: ms it was removed at */
+	unsigned int reboot_ms;		/* time the board takes to come back */
+	int failed;			/* PORT_DONE: the download failed */
+	uint16_t vendor, product;
+	struct dfu_session session;
+};
+
+/* how long a device node may take to show up after its uevent */
+#define WATCH_SETTLE_MS		1000
+
+static volatile sig_atomic_t watch_stop;
+
+static void _watch_signal(int sig)
+{
+	watch_stop = 1;
+}
+
+static unsigned long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct watch_port *watch_port(struct watch_port ***ports, int *count,
+				     const char *name)
+{
+	struct watch_port **n, *p;
+	int i;
+
+	for (i = 0; i < *count; i++)
+		if (!strcmp((*ports)[i]->port, name))
+			return (*ports)[i];
+
+	/* sessions run on their own threads, so ports never move */
+	p = calloc(1, sizeof(*p));
+	n = realloc(*ports, (*count + 1) * sizeof(*n));
+	if (!p || !n) {
+		free(p);
+		if (n)
+			*ports = n;
+		return NULL;
+	}
+	snprintf(p->port, sizeof(p->port), "%s", name);
+	p->state = PORT_DONE;
+	n[(*count)++] = p;
+	*ports = n;
+	return p;
+}
+
+/* Detach or start the board on @p p, once libusb sees it.
+ * @return 0 if it's being handled, > 0 to try again later, or < 0 if
+ * it's to be left alone */
+static int watch_start(struct watch_port *p, struct dfu_if *dif,
+		       const struct dfu_image *image,
+		       unsigned int transfer_size, int quirks_auto_detect,
+		       dfu_quirks *manual_quirks, int done_fd)
+{
+	struct usb_device_list list = { NULL, 0, 0 };
+	struct dfu_if t;
+	char bus[8];
+	int i, ret = 1;
+
+	usb_find_busses();
+	usb_find_devices();
+	if (collect_dfu_devices(dif, &list) < 0)
+		return -1;
+
+	snprintf(bus, sizeof(bus), "%03u", p->busnum);
+	memset(&t, 0, sizeof(t));
+	for (i = 0; i < list.count; i++)
+		if (!strcmp(list.devs[i]->bus->dirname, bus) &&
+		    list.devs[i]->devnum == p->devnum)
+			t.dev = list.devs[i];
+	free(list.devs);
+
+	if (!t.dev) {
+		/* not a matching DFU device, or libusb can't see it yet */
+		return _now_ms() < p->retry_until ? 1 : -1;
+	}
+	if (!get_first_dfu_if(&t))
+		return -1;
+
+	p->vendor = t.dev->descriptor.idVendor;
+	p->product = t.dev->descriptor.idProduct;
+	p->reboot_ms = 2 * reset_delay(dfu_profile_lookup(
+		t.dev->descriptor.idVendor, t.dev->descriptor.idProduct,
+		t.dev->descriptor.bcdDevice));
+
+	if (!(t.flags & DFU_IFF_DFU)) {
+		printf("%s: [0x%04x:0x%04x] detaching\n", p->port, p->vendor,
+		       p->product);
+		if (dfu_session_detach(t.dev, t.interface,
+				       device_quirks(t.dev, quirks_auto_detect,
+						     manual_quirks)) < 0)
+			return -1;
+		p->state = PORT_DETACHED;
+		return 0;
+	}
+
+	if (dif->flags & DFU_IFF_IFACE)
+		t.interface = dif->interface;
+	if (dif->flags & DFU_IFF_ALT)
+		t.altsetting = dif->altsetting;
+
+	ret = dfu_session_open(&p->session, t.dev, t.interface, t.altsetting,
+			       transfer_size,
+			       device_quirks(t.dev, quirks_auto_detect,
+					     manual_quirks));
+	if (ret < 0)
+		return ret;
+	p->session.done_fd = done_fd;
+	printf("%s: [0x%04x:0x%04x] starting download, transfer size 0x%04x\n",
+	       p->port, p->vendor, p->product, p->session.transfer_size);
+	ret = dfu_session_start(&p->session, image);
+	if (ret < 0) {
+		dfu_session_close(&p->session);
+		return ret;
+	}
+	p->state = PORT_RUNNING;
+	return 0;
+}
+
+struct watch_stats {
+	int ok;
+	int failed;
+	unsigned long long latency_min;
+	unsigned long long latency_max;
+	unsigned long long latency_sum;
+};
+
+static void watch_finish(struct watch_port *p, struct watch_stats *st)
+{
+	struct dfu_session *s = &p->session;
+	unsigned long long now = _now_ms(), latency = 0;
+	int ret;
+
+	ret = dfu_session_join(s);
+	if (s->handle.dnload_start)
+		latency = s->handle.dnload_start - p->plugged;
+	printf("%s: [0x%04x:0x%04x] %s, %zu bytes in %llu ms, "
+	       "plug to first DNLOAD %llu ms\n", p->port, p->vendor,
+	       p->product, ret == 0 ? "ok" : "FAILED", s->image->size,
+	       now - p->plugged, latency);
+	dfu_session_close(s);
+
+	p->failed = ret < 0;
+	if (ret < 0) {
+		st->failed++;
+	} else {
+		st->ok++;
+		if (!st->latency_min || latency < st->latency_min)
+			st->latency_min = latency;
+		if (latency > st->latency_max)
+			st->latency_max = latency;
+		st->latency_sum += latency;
+	}
+	p->state = PORT_DONE;
+	p->gone = 0;
+}
+
+/* Wait for boards to be attached, and download @p image to each of
+ * them as soon as it shows up, be it in runtime or in DFU mode. The
+ * downloads run concurrently, on a thread each. A board that comes
+ * back after its update isn't updated again; one plugged in later on
+ * the same port is. Runs until interrupted. */
+static int watch_dnload(struct dfu_if *dif, const struct dfu_image *image,
+			unsigned int transfer_size, int quirks_auto_detect,
+			dfu_quirks *manual_quirks)
+{
+	struct dfu_hotplug hotplug;
+	struct dfu_hotplug_event ev[64];
+	struct watch_port **ports = NULL;
+	struct watch_stats st;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	int done[2];
+	int i, n, count = 0, running;
+
+	if (dfu_hotplug_open(&hotplug) < 0)
+		return -1;
+	if (pipe(done) < 0) {
+		perror("pipe");
+		dfu_hotplug_close(&hotplug);
+		return -1;
+	}
+	fcntl(done[0], F_SETFL, O_NONBLOCK);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _watch_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	memset(&st, 0, sizeof(st));
+	printf("Waiting for devices (%s), press Ctrl-C to stop...\n",
+	       hotplug.fd >= 0 ? "hotplug events" : "polling sysfs");
+
+	for (;;) {
+		int timeout = hotplug.fd >= 0 ? -1 : DFU_HOTPLUG_POLL_MS;
+
+		running = 0;
+		for (i = 0; i < count; i++) {
+			if (ports[i]->state == PORT_PENDING)
+				timeout = 50;
+			if (ports[i]->state == PORT_RUNNING)
+				running++;
+		}
+		if (watch_stop && !running)
+			break;
+
+		memset(pfd, 0, sizeof(pfd));
+		n = 0;
+		pfd[n].fd = done[0];
+		pfd[n++].events = POLLIN;
+		if (hotplug.fd >= 0 && !watch_stop) {
+			pfd[n].fd = hotplug.fd;
+			pfd[n++].events = POLLIN;
+		}
+		if (poll(pfd, n, watch_stop ? -1 : timeout) < 0 &&
+		    errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		/* finished downloads */
+		if (pfd[0].revents & POLLIN) {
+			struct dfu_session *s;
+
+			while (read(done[0], &s, sizeof(s)) == sizeof(s))
+				watch_finish((struct watch_port *)
+					     ((char *) s - offsetof(
+						     struct watch_port,
+						     session)), &st);
+		}
+		if (watch_stop)
+			continue;
+
+		n = dfu_hotplug_read(&hotplug, ev, 64);
+		if (n < 0)
+			fprintf(stderr, "Missed hotplug events: %s\n",
+				strerror(-n));
+		for (i = 0; i < n; i++) {
+			struct watch_port *p = watch_port(&ports, &count,
+							  ev[i].port);
+
+			if (!p)
+				break;
+			if (!ev[i].added) {
+				if (p->state == PORT_DONE && !p->gone)
+					p->gone = ev[i].time;
+				else if (p->state == PORT_PENDING)
+					p->state = PORT_DONE;
+				continue;
+			}
+
+			if (p->state == PORT_RUNNING)
+				continue;
+			if (p->state == PORT_DONE && !p->failed && p->gone &&
+			    ev[i].time - p->gone < p->reboot_ms) {
+				printf("%s: back after its update\n", p->port);
+				p->gone = 0;
+				continue;
+			}
+			if (p->state != PORT_DETACHED)
+				p->plugged = ev[i].time;
+			p->state = PORT_PENDING;
+			p->busnum = ev[i].busnum;
+			p->devnum = ev[i].devnum;
+			p->retry_until = ev[i].time + WATCH_SETTLE_MS;
+		}
+
+		/* boards whose device libusb can see by now */
+		for (i = 0; i < count; i++) {
+			struct watch_port *p = ports[i];
+
+			if (p->state == PORT_PENDING &&
+			    watch_start(p, dif, image, transfer_size,
+					quirks_auto_detect, manual_quirks,
+					done[1]) < 0)
+				p->state = PORT_DONE;
+		}
+	}
+
+	printf("%d device(s) updated, %d failed", st.ok, st.failed);
+	if (st.ok)
+		printf(", plug to first DNLOAD %llu/%llu/%llu ms "
+		       "(min/avg/max)", st.latency_min,
+		       st.latency_sum / st.ok, st.latency_max);
+	printf("\n");
+
+	for (i = 0; i < count; i++)
+		free(ports[i]);
+	free(ports);
+	close(done[0]);
+	close(done[1]);
+	dfu_hotplug_close(&hotplug);
+	return st.failed ? -1 : 0;
+}
+
+/* Digests of an image downloaded to several devices, hashed once */
+static int image_digest(struct dfu_digest *digest,
+			const struct dfu_image *image, const char *name)
+{
+	unsigned char *buf = NULL;
+	size_t offset, len;
+
+	if (!digest)
+		return 0;
+	dfu_digest_init(digest, digest->algs);
+	if (image->data)
+		dfu_digest_update(digest, image->data, image->size);
+	else {
+		buf = malloc(DFU_IMAGE_CHUNK);
+		if (!buf)
+			return -1;
+		for (offset = 0; offset < image->size; offset += len) {
+			len = image->size - offset < DFU_IMAGE_CHUNK ?
+				image->size - offset : DFU_IMAGE_CHUNK;
+			dfu_digest_update(digest, dfu_image_block(image, offset,
+								  len, buf),
+					  len);
+		}
+		free(buf);
+	}
+	return dfu_digest_report(digest, name);
+}
+
+/* Dry run of the download engine against simulated devices */
+static int sim_dnload(const char *filename, int image_flags, int count,
+		      int dead, int poll_timeout, unsigned int transfer_size,
+		      struct dfu_digest *digest)
+{
+	struct dfu_engine *engine = NULL;
+	struct dfu_progress progress;
+	struct dfu_sim *sims;
+	struct dfu_image image;
+	uint32_t crc = 0;
+	int i, ret = -1;
+
+	sims = calloc(count, sizeof(*sims));
+	if (!sims)
+		return -1;
+	if (dfu_progress_init(&progress, progress_mode, progress_ms,
+			      count) < 0)
+		goto out_free;
+
+	if (dfu_image_open(&image, filename, image_flags) < 0)
+		goto out_free;
+
+	engine = dfu_engine_new(&image);
+	if (!engine)
+		goto out_close;
+	dfu_engine_set_budget(engine, bus_budget, hub_budget);
+	dfu_engine_set_meter(engine, &progress);
+
+	for (i = 0; i < count; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "sim%d", i);
+		dfu_sim_init(&sims[i], name);
+		if (poll_timeout >= 0)
+			sims[i].poll_timeout = poll_timeout;
+		/* large images are only checksummed, not kept */
+		sims[i].discard = image.size > DFU_SIM_MEM_MAX;
+		/* the last ones hang up part way through */
+		if (i >= count - dead)
+			sims[i].hang_after = image.size / 2 /
+				le16_to_cpu(sims[i].func_dfu.wTransferSize) + 1;
+		dfu_engine_add_sim(engine, &sims[i], transfer_size);
+	}
+
+	printf("Starting download to %d simulated device(s)...\n", count);
+	dfu_progress_start(&progress);
+	ret = dfu_engine_run(engine) ? -1 : 0;
+	dfu_log_flush();
+	dfu_progress_stop(&progress);
+	dfu_engine_print_stats(engine);
+
+	/* check what arrived */
+	crc = crc32_init();
+	if ((image.size > DFU_SIM_MEM_MAX || !image.data) &&
+	    dfu_image_crc(&image, &crc) < 0) {
+		ret = -1;
+		goto out_free_sims;
+	}
+	for (i = 0; i < count; i++) {
+		if (sims[i].mem_len == image.size && sims[i].manifested &&
+		    (sims[i].discard ? sims[i].crc == crc :
+		     image.data ? !memcmp(sims[i].mem, image.data, image.size) :
+		     crc32_buf(crc32_init(), sims[i].mem, image.size) == crc))
+			continue;
+		fprintf(stderr, "%s: image received incompletely or corrupted\n",
+			sims[i].name);
+		ret = -1;
+	}
+	if (ret == 0 && image_digest(digest, &image, filename) < 0)
+		ret = -1;
+
+ out_free_sims:
+	dfu_engine_free(engine);
+	for (i = 0; i < count; i++)
+		dfu_sim_free(&sims[i]);
+ out_close:
+	dfu_image_close(&image);
+ out_free:
+	dfu_progress_free(&progress);
+	free(sims);
+	return ret;
+}
+
 static int list_dfu_interfaces(void)
 {
 	struct usb_bus *usb_bus;
@@ -375,14 +1217,38 @@ static void help(void)
 		"  -a --alt alt\t\t\tSpecify the Altsetting of the DFU Interface\n"
 		"\t\t\t\tby name or by number\n"
 		"  -t --transfer-size\t\tSpecify the number of bytes per USB Transfer\n"
-		"  -U --upload file\t\tRead firmware from device into <file>\n"
-		"  -D --download file\t\tWrite firmware from <file> into device\n"
+		"  -U --upload file\t\tRead firmware from device into <file> (- for stdout)\n"
+		"  -Z --upload-size bytes\tExpected upload size, used to preallocate <file>\n"
+		"  -D --download file\t\tWrite firmware from <file> (- for stdin) into device\n"
+		"\t\t\t\t(raw with DFU suffix, Intel HEX, S-record or ELF)\n"
+		"  -m --multiple\t\t\tDownload to all matching devices at the same time\n"
+		"  -P --per-bus\t\t\tLike -m, with a worker process per USB bus\n"
+		"  -g --route file ...\t\tLike -m, sending each device the <file> whose DFU suffix names it\n"
+		"  -W --watch\t\t\tDownload to each matching device as soon as it is plugged in\n"
+		"  -L --lock-image\t\tLock the downloaded image into memory\n"
+		"  -X --simulate count[:dead[:poll]]\tDownload to <count> simulated devices instead\n"
+		"  -K --virtual-time\t\tDon't wait for simulated devices, report the modelled times\n"
+		"  -B --budget bus[:hub]\t\tDevices downloading at once per bus and hub\n"
+		"  -A --agent address\t\tServe the device to a remote dfu-util at <address>\n"
+		"  -r --remote address\t\tUse the device served by the agent at <address>\n"
 	        "  -C --compare file\t\tUpload firmware from device and check if it equals <file>\n"
-	        "  -S --add-suffix file\t\tAppend DFU suffix to raw firmware <file>, including checksum and device info set via -d\n"
+	        "  -S --add-suffix file|dir ...\tAppend DFU suffix to raw firmware <file>s, including checksum and device info set via -d\n"
+		"  -y --verify-suffix file|dir ...\tCheck the DFU suffix of <file>s\n"
+		"  -M --suffix-map file\t\tDevice info for -S and -y by file name pattern\n"
+		"  -j --jobs n\t\t\tFiles processed at once by -S and -y\n"
 		"  -R --reset\t\t\tIssue USB Reset signalling once we're finished\n"
 	        "  -Q --list-quirks\t\t\tList known work-arounds for device specific quirks\n"
-	        "  -N --no-quirk\t\t\tDisable all device specific work-arounds, and adhere to DFU standards\n"
+	        "  -N --no-quirk\t\t\tDisable all device specific work-arounds and profiles, and adhere to DFU standards\n"
 	        "  -q --quirk qId\t\t\tEnable quirk qId. using -q disables quirk auto-detection\n"
+		"  -T --autotune\t\t\tFind the fastest transfer size for this device model\n"
+		"  -k --resume\t\t\tRetry failed blocks, and go on where an interrupted transfer stopped\n"
+		"  -H --hash alg[,alg]\t\tHash the firmware with sha256 and/or blake3\n"
+		"  -O --hash-file file\t\tAppend the digests to <file>\n"
+		"  -s --sm-profile file\t\tProfile the time spent per DFU state, write folded stacks to <file>\n"
+		"  -E --log text|json\t\tWrite messages about devices as text or JSON lines\n"
+		"  -o --progress mode[:ms]\tShow progress as a bar, as JSON lines or not at all (bar|json|none), every <ms>\n"
+		"  -e --heatmap file[:bytes]\tTime the download per region of <bytes> of the image, write CSV to <file>\n"
+		"  -n --no-cache\t\t\tAlways recompute image checksums and transfer sizes, don't use cached results\n"
 		);
 }
 
@@ -406,22 +1272,186 @@ static struct option opts[] = {
 	{ "alt", 1, 0, 'a' },
 	{ "transfer-size", 1, 0, 't' },
 	{ "upload", 1, 0, 'U' },
+	{ "upload-size", 1, 0, 'Z' },
 	{ "download", 1, 0, 'D' },
+	{ "multiple", 0, 0, 'm' },
+	{ "per-bus", 0, 0, 'P' },
+	{ "route", 0, 0, 'g' },
+	{ "watch", 0, 0, 'W' },
+	{ "lock-image", 0, 0, 'L' },
+	{ "simulate", 1, 0, 'X' },
+	{ "virtual-time", 0, 0, 'K' },
+	{ "budget", 1, 0, 'B' },
+	{ "agent", 1, 0, 'A' },
+	{ "remote", 1, 0, 'r' },
 	{ "compare", 1, 0, 'C' },
 	{ "add-suffix", 1, 0, 'S' },
+	{ "verify-suffix", 1, 0, 'y' },
+	{ "suffix-map", 1, 0, 'M' },
+	{ "jobs", 1, 0, 'j' },
 	{ "reset", 0, 0, 'R' },
 	{ "list-quirks", 0, 0, 'Q' },
 	{ "no-quirk", 0, 0, 'N' },
 	{ "quirk", 1, 0, 'q' },
+	{ "autotune", 0, 0, 'T' },
+	{ "resume", 0, 0, 'k' },
+	{ "hash", 1, 0, 'H' },
+	{ "hash-file", 1, 0, 'O' },
+	{ "sm-profile", 1, 0, 's' },
+	{ "heatmap", 1, 0, 'e' },
+	{ "progress", 1, 0, 'o' },
+	{ "log", 1, 0, 'E' },
+	{ "no-cache", 0, 0, 'n' },
 };
 
 enum mode {
 	MODE_NONE,
 	MODE_UPLOAD,
 	MODE_DOWNLOAD,
-	MODE_COMPARE
+	MODE_COMPARE,
+	MODE_SUFFIX,
+	MODE_VERIFY
 };
 
+/* Use the transfer size found fastest for this device model before,
+   or find it during this transfer */
+static void autotune(dfu_handle *handle, struct dfu_tune *tune,
+		     uint16_t vendor, uint16_t product, uint16_t release,
+		     enum mode mode, unsigned int *transfer_size)
+{
+	int upload = mode == MODE_UPLOAD;
+	unsigned int size;
+
+	size = dfu_tune_lookup(vendor, product, release, upload);
+	if (size && size <= *transfer_size) {
+		*transfer_size = size;
+		printf("Transfer Size = 0x%04x (autotuned before)\n", size);
+		return;
+	}
+
+	dfu_tune_init(tune, vendor, product, release, upload, *transfer_size);
+	handle->tune = tune;
+	printf("Autotuning transfer size, trying %u sizes\n", tune->count);
+}
+
+/* Print the time spent per state, and write it to @p fname as folded
+ * stacks; @p prof may be NULL */
+static int sm_prof_report(struct dfu_sm_prof *prof, const char *fname)
+{
+	if (!prof)
+		return 0;
+	dfu_sm_prof_print(prof);
+	return dfu_sm_prof_write_folded(prof, fname);
+}
+
+/* Serve a simulated device to a remote client */
+static int sim_agent(const char *addr)
+{
+	struct dfu_sim sim;
+	dfu_handle handle;
+	int ret;
+
+	dfu_init(&handle, 5000);
+	dfu_sim_init(&sim, "sim0");
+	dfu_sim_attach(&sim, &handle);
+
+	ret = dfu_remote_serve(&handle, addr, 0, 0, 0,
+			       le16_to_cpu(sim.func_dfu.wTransferSize));
+	printf("%s: %lu bytes received, firmware %smanifested\n", sim.name,
+	       (unsigned long) sim.mem_len, sim.manifested ? "" : "not ");
+
+	dfu_sim_free(&sim);
+	return ret;
+}
+
+/* Upload or download through the device served by an agent */
+static int remote_transfer(const char *addr, enum mode mode,
+			   const char *filename, unsigned int transfer_size,
+			   off_t upload_size, int image_flags, int final_reset,
+			   int quirks_auto_detect, dfu_quirks *manual_quirks,
+			   int tune, int resume, struct dfu_digest *digest,
+			   struct dfu_sm_prof *sm_prof, const char *sm_profile)
+{
+	struct dfu_status status;
+	struct dfu_tune tuner;
+	struct dfu_progress progress;
+	dfu_handle handle;
+	uint16_t vendor, product, release;
+	unsigned int agent_transfer_size;
+	int ret = -1;
+
+	if (dfu_progress_init(&progress, progress_mode, progress_ms, 1) < 0) {
+		dfu_progress_free(&progress);
+		return -1;
+	}
+	dfu_init(&handle, 5000);
+	handle.resume = resume;
+	handle.digest = digest;
+	handle.sm_prof = sm_prof;
+	printf("Connecting to agent %s...\n", addr);
+	if (dfu_remote_attach(&handle, addr, &vendor, &product, &release,
+			      &agent_transfer_size) < 0) {
+		dfu_progress_free(&progress);
+		return -1;
+	}
+	handle.progress = dfu_progress_dev(&progress, addr);
+	/* in log records, and what checkpoints are taken with */
+	handle.name = addr;
+
+	handle.profile = dfu_profile_lookup(vendor, product, release);
+	if (quirks_auto_detect)
+		handle.quirk_flags = handle.profile->quirks;
+	dfu_quirks_insert(&handle.quirk_flags, manual_quirks);
+
+	/* the agent brought the device to dfuIDLE already */
+	if (dfu_get_status(&handle, &status) < 0)
+		goto out;
+	printf("Remote device 0x%04x:0x%04x, state = %s, status = %d\n",
+	       vendor, product, dfu_state_to_string(status.bState),
+	       status.bStatus);
+	if (status.bState != DFU_STATE_dfuIDLE) {
+		fprintf(stderr, "Remote device isn't ready\n");
+		goto out;
+	}
+
+	if (!transfer_size || transfer_size > agent_transfer_size)
+		transfer_size = agent_transfer_size;
+	printf("Transfer Size = 0x%04x\n", transfer_size);
+	if (tune)
+		autotune(&handle, &tuner, vendor, product, release, mode,
+			 &transfer_size);
+
+	dfu_progress_start(&progress);
+	switch (mode) {
+	case MODE_UPLOAD:
+		ret = sam7dfu_do_upload(&handle, transfer_size, filename,
+					upload_size);
+		break;
+	case MODE_DOWNLOAD:
+		ret = sam7dfu_do_dnload(&handle, transfer_size, filename,
+					image_flags);
+		break;
+	default:
+		fprintf(stderr, "Unsupported mode: %u\n", mode);
+		break;
+	}
+	dfu_log_flush();
+	dfu_progress_stop(&progress);
+	if (sm_prof_report(sm_prof, sm_profile) < 0)
+		ret = -1;
+
+	if (ret >= 0 && final_reset) {
+		printf("Resetting USB to switch back to runtime mode\n");
+		if (dfu_handlers(&handle)->device_reset(&handle) < 0)
+			fprintf(stderr, "error resetting after download\n");
+	}
+
+ out:
+	dfu_remote_close(&handle);
+	dfu_progress_free(&progress);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	struct usb_vendprod vendprod;
@@ -429,6 +1459,7 @@ int main(int argc, char **argv)
 	int num_devs;
 	int num_ifs;
 	unsigned int transfer_size = 0;
+	off_t upload_size = 0;
 	enum mode mode = MODE_NONE;
 	struct dfu_status status;
 	int quirks_auto_detect = 1;
@@ -438,11 +1469,32 @@ int main(int argc, char **argv)
 	char *alt_name = NULL; /* query alt name if non-NULL */
 	char *end;
 	int final_reset = 0;
+	int multiple = 0;
+	int per_bus = 0;
+	int route = 0;
+	int watch = 0;
+	const char *agent_addr = NULL;
+	const char *remote_addr = NULL;
+	int simulate = 0;
+	int simulate_dead = 0;
+	int simulate_poll = -1;
+	int virtual_time = 0;
+	int tune = 0;
+	int resume = 0;
+	unsigned int jobs = 0;
+	unsigned int digests = 0;
+	struct dfu_digest digest;
+	const char *sm_profile = NULL;
+	struct dfu_sm_prof sm_prof;
+	struct dfu_progress progress;
+	enum dfu_log_format log_format = DFU_LOG_TEXT;
+	char dev_name[40];
+	char *heatmap_file = NULL;
+	struct dfu_heatmap heatmap;
+	struct dfu_tune tuner;
+	int image_flags = 0;
 	int page_size = getpagesize();
 	int ret;
-	
-	printf("dfu-util - (C) 2007-2008 by OpenMoko Inc.\n"
-	       "This program is Free Software and has ABSOLUTELY NO WARRANTY\n\n");
 
 	dfu_quirks_clear(&manual_quirks);
 
@@ -455,7 +1507,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		int c, option_index = 0;
-		c = getopt_long(argc, argv, "hVvld:p:c:i:a:t:U:D:C:S:RQNq:", opts,
+		c = getopt_long(argc, argv, "hVvld:p:c:i:a:t:U:Z:D:mPgWLX:B:A:r:C:S:y:M:j:RQNq:nTkH:O:s:e:o:E:K", opts,
 				&option_index);
 		if (c == -1)
 			break;
@@ -525,19 +1577,86 @@ int main(int argc, char **argv)
 			mode = MODE_UPLOAD;
 			filename = optarg;
 			break;
+		case 'Z':
+			upload_size = strtoull(optarg, &end, 0);
+			if (*end || upload_size < 0) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
 		case 'D':
 			mode = MODE_DOWNLOAD;
 			filename = optarg;
 			break;
+		case 'm':
+			multiple = 1;
+			break;
+		case 'P':
+			multiple = 1;
+			per_bus = 1;
+			break;
+		case 'g':
+			multiple = 1;
+			route = 1;
+			break;
+		case 'W':
+			watch = 1;
+			break;
+		case 'L':
+			image_flags |= DFU_IMAGE_LOCK;
+			break;
+		case 'X':
+			simulate = strtoul(optarg, &end, 0);
+			if (*end == ':')
+				simulate_dead = strtoul(end + 1, &end, 0);
+			if (*end == ':')
+				simulate_poll = strtoul(end + 1, &end, 0);
+			if (*end || simulate <= 0 || simulate_dead > simulate) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'K':
+			virtual_time = 1;
+			break;
+		case 'B':
+			bus_budget = strtoul(optarg, &end, 0);
+			if (*end == ':')
+				hub_budget = strtoul(end + 1, &end, 0);
+			if (*end) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'A':
+			agent_addr = optarg;
+			break;
+		case 'r':
+			remote_addr = optarg;
+			break;
 		case 'C':
 			mode = MODE_COMPARE;
 			/* TODO: verify firmware */
 			filename = optarg;
 			break;
 		case 'S':
+			mode = MODE_SUFFIX;
 			filename = optarg;
-			add_file_suffix(filename);
-			exit(0);
+			break;
+		case 'y':
+			mode = MODE_VERIFY;
+			filename = optarg;
+			break;
+		case 'M':
+			if (dfu_batch_load_map(optarg) < 0)
+				exit(2);
+			break;
+		case 'j':
+			jobs = strtoul(optarg, &end, 0);
+			if (*end) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
 			break;
 		case 'R':
 			final_reset = 1;
@@ -549,11 +1668,86 @@ int main(int argc, char **argv)
 			break;
 		case 'N':
 			quirks_auto_detect = 0;
+			dfu_profile_disable();
 			break;
 		case 'q':
 			quirks_auto_detect = 0;
 			dfu_quirk_set(&manual_quirks, atoi(optarg));
 			break;
+		case 'T':
+			tune = 1;
+			break;
+		case 'k':
+			resume = 1;
+			break;
+		case 'H':
+			if (dfu_digest_parse(optarg, &digests) < 0) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'O':
+			dfu_digest_set_export(optarg);
+			break;
+		case 's':
+			sm_profile = optarg;
+			dfu_sm_prof_init(&sm_prof);
+			break;
+		case 'e': {
+			/* the region size is optional, file names may
+			   have colons of their own */
+			char *colon = strrchr(optarg, ':');
+			unsigned long bucket = 0;
+
+			if (colon) {
+				bucket = strtoul(colon + 1, &end, 0);
+				if (*end || !bucket || bucket > 1 << 30) {
+					fprintf(stderr, "unable to parse `%s'\n",
+						optarg);
+					exit(2);
+				}
+				*colon = '\0';
+			}
+			heatmap_file = optarg;
+			dfu_heatmap_init(&heatmap, bucket);
+			break;
+		}
+		case 'E':
+			if (!strcmp(optarg, "text"))
+				log_format = DFU_LOG_TEXT;
+			else if (!strcmp(optarg, "json"))
+				log_format = DFU_LOG_JSON;
+			else {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'o': {
+			size_t len = strcspn(optarg, ":");
+
+			if (!strncmp(optarg, "bar", len) && len == 3)
+				progress_mode = DFU_PROGRESS_BAR;
+			else if (!strncmp(optarg, "json", len) && len == 4)
+				progress_mode = DFU_PROGRESS_JSON;
+			else if (!strncmp(optarg, "none", len) && len == 4)
+				progress_mode = DFU_PROGRESS_NONE;
+			else
+				len = 0;
+			if (len && optarg[len] == ':') {
+				progress_ms = strtoul(optarg + len + 1, &end, 0);
+				if (*end || !progress_ms)
+					len = 0;
+			}
+			if (!len) {
+				fprintf(stderr, "unable to parse `%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		}
+		case 'n':
+			dfu_cache_disable();
+			dfu_tune_disable();
+			break;
 
 		default:
 			help();
@@ -561,19 +1755,204 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (mode == MODE_NONE) {
+	/* the file named with the option and all further arguments */
+	if (mode == MODE_SUFFIX || mode == MODE_VERIFY) {
+		char **paths = calloc(argc - optind + 1, sizeof(*paths));
+
+		if (!paths)
+			exit(1);
+		paths[0] = filename;
+		memcpy(paths + 1, argv + optind,
+		       (argc - optind) * sizeof(*paths));
+		if (dif->flags & DFU_IFF_VENDOR)
+			dfu_batch_set_default(dif->vendor, dif->product);
+		ret = dfu_batch_run(mode == MODE_SUFFIX ? DFU_BATCH_SUFFIX :
+				    DFU_BATCH_VERIFY, paths,
+				    argc - optind + 1, jobs);
+		free(paths);
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	/* virtual time only holds as long as every device is simulated */
+	if (virtual_time && (!simulate || agent_addr)) {
+		fprintf(stderr, "--virtual-time only works with --simulate\n");
+		exit(2);
+	}
+
+	if (agent_addr && simulate) {
+		ret = sim_agent(agent_addr);
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (mode == MODE_NONE && !agent_addr) {
 		fprintf(stderr, "You need to specify one of -D or -U\n");
 		help();
 		exit(2);
 	}
 
-	if (!filename) {
+	if (!filename && !agent_addr) {
 		fprintf(stderr, "You need to specify a filename to -D -r -U\n");
 		help();
 		exit(2);
 	}
 
+	/* the firmware goes to stdout, everything else to stderr */
+	if (mode == MODE_UPLOAD && !strcmp(filename, "-") &&
+	    dfu_writer_claim_stdout() < 0)
+		exit(1);
+
+	printf("dfu-util - (C) 2007-2008 by OpenMoko Inc.\n"
+	       "This program is Free Software and has ABSOLUTELY NO WARRANTY\n\n");
+
+	/* devices are talked to without waiting for the console */
+	if (dfu_log_start(log_format,
+			  verbose ? DFU_LOG_DEBUG : DFU_LOG_INFO) < 0)
+		exit(1);
+	atexit(dfu_log_stop);
+
+	/* a checkpoint is only valid for blocks of one size */
+	if (resume && tune) {
+		fprintf(stderr, "--resume can't be combined with --autotune\n");
+		exit(2);
+	}
+	if (resume && (multiple || per_bus || simulate || watch)) {
+		fprintf(stderr, "--resume only works with a single device\n");
+		exit(2);
+	}
+	/* only the local poll loop sees the device's bwPollTimeouts */
+	if (heatmap_file && (mode != MODE_DOWNLOAD || remote_addr ||
+			     multiple || per_bus || simulate || watch)) {
+		fprintf(stderr, "--heatmap only works with --download "
+			"to a single local device\n");
+		exit(2);
+	}
+	if (resume && filename && !strcmp(filename, "-")) {
+		fprintf(stderr, "--resume needs a file, not a pipe\n");
+		exit(2);
+	}
+
+	if (digests) {
+		dfu_digest_init(&digest, digests);
+		if (verbose && digests & DFU_DIGEST_SHA256)
+			printf("SHA-256 implementation: %s\n", sha256_impl());
+	}
+
+	if (remote_addr) {
+		ret = remote_transfer(remote_addr, mode, filename,
+				      transfer_size, upload_size, image_flags,
+				      final_reset, quirks_auto_detect,
+				      &manual_quirks, tune, resume,
+				      digests ? &digest : NULL,
+				      sm_profile ? &sm_prof : NULL, sm_profile);
+		dfu_cache_print_stats();
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (simulate) {
+		if (mode != MODE_DOWNLOAD) {
+			fprintf(stderr, "--simulate only works with --download\n");
+			exit(2);
+		}
+		dfu_clock_set_virtual(virtual_time);
+		ret = sim_dnload(filename, image_flags, simulate,
+				 simulate_dead, simulate_poll, transfer_size,
+				 digests ? &digest : NULL);
+		dfu_cache_print_stats();
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (watch) {
+		struct dfu_image image;
+
+		if (mode != MODE_DOWNLOAD || multiple || alt_name ||
+		    dif->flags & (DFU_IFF_PATH|DFU_IFF_DEVNUM)) {
+			fprintf(stderr, "--watch only works with --download, "
+				"selecting devices by --device and the "
+				"altsetting by number\n");
+			exit(2);
+		}
+		/* loaded once for all boards to come */
+		if (dfu_image_open(&image, filename, image_flags) < 0)
+			exit(1);
+		ret = watch_dnload(dif, &image, transfer_size,
+				   quirks_auto_detect, &manual_quirks);
+		if (image_digest(digests ? &digest : NULL, &image,
+				 filename) < 0)
+			ret = -1;
+		dfu_image_close(&image);
+		dfu_cache_print_stats();
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (multiple) {
+		struct dfu_image image;
+		struct dfu_route pool = { NULL, 0 };
+		int i;
+
+		if (mode != MODE_DOWNLOAD || alt_name ||
+		    dif->flags & (DFU_IFF_PATH|DFU_IFF_DEVNUM)) {
+			fprintf(stderr, "--multiple only works with --download, "
+				"selecting devices by --device and the "
+				"altsetting by number\n");
+			exit(2);
+		}
+		/* loaded before any worker is forked, so they share it */
+		if (route) {
+			/* the file named with -D and all further arguments */
+			char **fnames = calloc(argc - optind + 1,
+					       sizeof(*fnames));
+
+			if (!fnames)
+				exit(1);
+			fnames[0] = filename;
+			memcpy(fnames + 1, argv + optind,
+			       (argc - optind) * sizeof(*fnames));
+			ret = dfu_route_open(&pool, fnames, argc - optind + 1,
+					     image_flags);
+			free(fnames);
+			if (ret < 0)
+				exit(1);
+			printf("Routing %d image(s) by DFU suffix\n",
+			       pool.count);
+		} else if (dfu_image_open(&image, filename, image_flags) < 0)
+			exit(1);
+
+		if (per_bus)
+			ret = sharded_dnload(dif, route ? NULL : &image,
+					     route ? &pool : NULL,
+					     transfer_size, quirks_auto_detect,
+					     &manual_quirks);
+		else
+			ret = multi_dnload(dif, route ? NULL : &image,
+					   route ? &pool : NULL, transfer_size,
+					   quirks_auto_detect, &manual_quirks,
+					   -1);
+
+		if (route) {
+			for (i = 0; ret == 0 && i < pool.count; i++)
+				if (image_digest(digests ? &digest : NULL,
+						 &pool.images[i],
+						 pool.images[i].fname) < 0)
+					ret = -1;
+			dfu_route_close(&pool);
+		} else {
+			if (ret == 0 && image_digest(digests ? &digest : NULL,
+						     &image, filename) < 0)
+				ret = -1;
+			dfu_image_close(&image);
+		}
+		dfu_cache_print_stats();
+		exit(ret < 0 ? 1 : 0);
+	}
+
 	dfu_init(&handle, 5000);
+	handle.resume = resume;
+	if (digests)
+		handle.digest = &digest;
+	if (sm_profile)
+		handle.sm_prof = &sm_prof;
+	if (heatmap_file)
+		handle.heatmap = &heatmap;
 
 	num_devs = count_dfu_devices(dif);
 	if (num_devs == 0) {
@@ -610,11 +1989,11 @@ int main(int argc, char **argv)
 	handle.interface = _rt_dif.interface;
 
 	/* automatic quirk detection */
+	handle.profile = dfu_profile_lookup(_rt_dif.dev->descriptor.idVendor,
+					    _rt_dif.dev->descriptor.idProduct,
+					    _rt_dif.dev->descriptor.bcdDevice);
 	if(quirks_auto_detect)
-	{
-		/* TODO: let the detection be influenced by bcdDFU, bcdDevice */
-		handle.quirk_flags = dfu_quirks_detect(0, dif->vendor, dif->product, 0);
-	}
+		handle.quirk_flags = handle.profile->quirks;
 	/* merge with manual quirks */
 	dfu_quirks_insert(&handle.quirk_flags, &manual_quirks);
 	if(!dfu_quirks_is_empty(&handle.quirk_flags))
@@ -712,7 +2091,7 @@ int main(int argc, char **argv)
 				}
 			}
 
-			sleep(2);
+			dfu_clock_sleep_ms(reset_delay(handle.profile));
 			break;
 		case DFU_STATE_dfuERROR:
 			printf("dfuERROR, clearing status\n");
@@ -791,6 +2170,24 @@ int main(int argc, char **argv)
 
 	print_dfu_if(dif, NULL);
 
+	/* the device may have become another one in DFU mode */
+	handle.profile = dfu_profile_lookup(dif->dev->descriptor.idVendor,
+					    dif->dev->descriptor.idProduct,
+					    dif->dev->descriptor.bcdDevice);
+	if (quirks_auto_detect)
+		dfu_quirks_insert(&handle.quirk_flags,
+				  (dfu_quirks *) &handle.profile->quirks);
+	if (handle.profile->set || handle.profile->name[0]) {
+		printf("Selected profile: ");
+		dfu_profile_print(handle.profile);
+	}
+	if (handle.profile->set & DFU_PROFILE_VERIFY) {
+		if (handle.profile->verify == DFU_VERIFY_ALWAYS)
+			image_flags |= DFU_IMAGE_RECHECK;
+		else if (handle.profile->verify == DFU_VERIFY_NEVER)
+			image_flags |= DFU_IMAGE_TRUST;
+	}
+
 	num_ifs = count_dfu_interfaces(dif->dev);
 	if (num_ifs < 0) {
 		fprintf(stderr, "No DFU Interface after RESET?!?\n");
@@ -906,7 +2303,7 @@ int main(int argc, char **argv)
 	}
 	else
 	{
-		transfer_size = le16_to_cpu(handle.func_dfu.wTransferSize);
+		transfer_size = dfu_transfer_size(&handle);
 	}
 
 	/* why is this limited to page_size, a host-dependent value? (sgiessl) */
@@ -944,6 +2341,11 @@ int main(int argc, char **argv)
 	printf("Device functional descriptor: %s\n",
 	       dfu_func_descriptor_to_string(&handle.func_dfu));
 
+	if (tune && !agent_addr)
+		autotune(&handle, &tuner, dif->dev->descriptor.idVendor,
+			 dif->dev->descriptor.idProduct,
+			 dif->dev->descriptor.bcdDevice, mode, &transfer_size);
+
 	if (DFU_STATUS_OK != status.bStatus ) {
 		printf("WARNING: DFU Status: '%s'\n",
 			dfu_status_to_string(status.bStatus));
@@ -957,21 +2359,48 @@ int main(int argc, char **argv)
 		}
         }
 
+	if (agent_addr) {
+		ret = dfu_remote_serve(&handle, agent_addr,
+				       dif->dev->descriptor.idVendor,
+				       dif->dev->descriptor.idProduct,
+				       dif->dev->descriptor.bcdDevice,
+				       transfer_size);
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (dfu_progress_init(&progress, progress_mode, progress_ms, 1) < 0)
+		exit(1);
+	snprintf(dev_name, sizeof(dev_name), "%.31s/%03u",
+		 dif->dev->bus->dirname, dif->dev->devnum);
+	handle.progress = dfu_progress_dev(&progress, dev_name);
+	dfu_progress_start(&progress);
 	switch (mode) {
 	case MODE_UPLOAD:
-		if (sam7dfu_do_upload(&handle,
-				  transfer_size, filename) < 0)
-			exit(1);
+		ret = sam7dfu_do_upload(&handle,
+				  transfer_size, filename, upload_size);
 		break;
 	case MODE_DOWNLOAD:
-		if (sam7dfu_do_dnload(&handle,
-				  transfer_size, filename) < 0)
-			exit(1);
+		ret = sam7dfu_do_dnload(&handle,
+				  transfer_size, filename, image_flags);
 		break;
 	default:
 		fprintf(stderr, "Unsupported mode: %u\n", mode);
 		exit(1);
 	}
+	dfu_log_flush();
+	dfu_progress_stop(&progress);
+	dfu_progress_free(&progress);
+	if (heatmap_file) {
+		dfu_heatmap_print(&heatmap);
+		if (dfu_heatmap_write_csv(&heatmap, heatmap_file) < 0)
+			ret = -1;
+		dfu_heatmap_free(&heatmap);
+	}
+	if (sm_prof_report(sm_profile ? &sm_prof : NULL, sm_profile) < 0 ||
+	    ret < 0)
+		exit(1);
+
+	dfu_cache_print_stats();
 
 	if (final_reset) {
 		if(dfu_quirk_is_set(&handle.quirk_flags, QUIRK_OPENMOKO_DETACH_BEFORE_FINAL_RESET))
@@ -4,6 +4,8 @@
  * (C) 2007-2008 by Harald Welte <laforge@gnumonks.org>
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,380 +16,346 @@
 #include <string.h>
 #include <usb.h>
 
-#include "config.h"
 #include "dfu.h"
 #include "dfu_sm.h"
 #include "crc32.h"
 #include "usb_dfu.h"
 #include "dfu_quirks.h"
 #include "sam7dfu.h"
+#include "dfu_image.h"
+#include "dfu_writer.h"
+#include "dfu_tune.h"
+#include "dfu_resume.h"
+#include "dfu_digest.h"
+#include "dfu_heatmap.h"
+#include "dfu_progress.h"
+#include "dfu_log.h"
 
 /* ugly hack for Win32 */
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+/**
+ * after a failed block, get the device back to dfuIDLE and make the
+ * next request the first block it hasn't acknowledged
+ *
+ * @return 0 if the transfer can go on, or < 0
+ */
+static int _recover(dfu_handle *handle, struct dfu_resume *r)
+{
+	if (!r || r->retries++ >= DFU_RESUME_RETRIES)
+		return -1;
+	if (dfu_resume_recover(handle) < 0)
+		return -1;
+
+	handle->transaction = r->block;
+	dfu_log(DFU_LOG_INFO, handle->name,
+		"Recovered, going on with block %u (byte %llu)",
+		r->block, r->offset);
+	return 0;
+}
+
 int sam7dfu_do_upload(dfu_handle *handle, 
-		      int xfer_size, const char *fname)
+		      int xfer_size, const char *fname, off_t size_hint)
 {
-	int i = 0;
-	int ret, fd, total_bytes = 0;
-	char *buf = malloc(xfer_size);
+	unsigned long long total_bytes = 0;
+	struct dfu_writer *writer;
+	int ret;
 	struct dfu_file_suffix suffix;
+	struct dfu_resume resume, *r = NULL;
 	struct dfu_status dst;
 	uint32_t crc = 0;
-
-	if (!buf)
-		return -ENOMEM;
-
-	fd = creat(fname, 0644);
-	if (fd < 0) {
-		perror(fname);
-		ret = fd;
-		goto out_free;
+	off_t holes = 0;
+
+	if (handle->resume) {
+		r = &resume;
+		if (dfu_resume_begin(r, handle, fname, 1, 0, 0, xfer_size)) {
+			printf("Resuming upload at block %u (byte %llu)\n",
+			       r->block, r->offset);
+			handle->transaction = r->block;
+			total_bytes = r->offset;
+		} else
+			r->block = handle->transaction;
 	}
-	
-	printf("bytes_per_hash=%u\n", xfer_size);
-	printf("Starting upload: [");
-	fflush(stdout);
+	/* the device is read on this thread; CRC, digests and disk I/O
+	   are done by the writer thread */
+	if (total_bytes)
+		writer = dfu_writer_resume(fname, total_bytes, handle->digest);
+	else
+		writer = dfu_writer_open(fname, size_hint, handle->digest);
+	if (!writer)
+		return -1;
 
-	crc = crc32_init();
+	printf("Starting upload...\n");
+	fflush(stdout);
+	dfu_progress_begin(handle->progress, size_hint > 0 ? size_hint : 0,
+			   total_bytes);
 
 	while (1) {
-		int rc, write_rc;
+		int rc, size = xfer_size;
+		char *buf;
 
 		ret = dfu_get_status(handle, &dst);
 		if (ret < 0) {
-			fprintf(stderr, "Error during upload get_status\n");
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Error during upload get_status");
+			if (_recover(handle, r) == 0)
+				continue;
 			goto out_close;
 		}
 
 		if (dst.bStatus != DFU_STATUS_OK) {
-			printf("\rFirmware upload ... aborting (status %d state %d)\n",
-			       dst.bStatus, dst.bState);
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Firmware upload ... aborting (status %d state %d)",
+				dst.bStatus, dst.bState);
+			if (_recover(handle, r) == 0)
+				continue;
+			ret = -1;
 			goto out_close;
 		}
 
-		rc = dfu_upload(handle, xfer_size, buf);
+		if (handle->tune)
+			size = dfu_tune_next(handle->tune);
+
+		buf = dfu_writer_buf(writer, size);
+		if (!buf) {
+			ret = -1;
+			goto out_close;
+		}
+
+		rc = dfu_upload(handle, size, buf);
 		if (rc < 0) {
+			if (_recover(handle, r) == 0)
+				continue;
 			ret = rc;
 			goto out_close;
 		}
-		write_rc = write(fd, buf, rc);
-		if (write_rc < rc) {
-			fprintf(stderr, "Short file write: %s\n",
-				strerror(errno));
-			ret = total_bytes;
+		if (handle->tune)
+			dfu_tune_account(handle->tune, rc);
+		dfu_progress_add(handle->progress, rc);
+		if (dfu_writer_commit(writer, rc) < 0) {
+			ret = -1;
 			goto out_close;
 		}
 		total_bytes += rc;
 
-		for (i = 0; i < rc; i++)
-			crc = crc32_byte(crc, buf[i]);
+		/* only data on disk may be checkpointed */
+		if (r && dfu_resume_update(r, handle->transaction,
+					   total_bytes) &&
+		    dfu_writer_sync(writer, NULL) == 0)
+			dfu_resume_save(r);
 
-		if (rc < xfer_size) {
+		if (rc < size) {
 			/* last block, return */
 			break;
 		}
-		putchar('#');
-		fflush(stdout);
 	}
 	ret = 0;
 
-	printf("] finished! read %d bytes.\n", total_bytes);
-	fflush(stdout);
+	/* wait for the writer, it owns the CRC and digests over the data */
+	if (dfu_writer_sync(writer, &crc) < 0) {
+		ret = -1;
+		goto out_close;
+	}
+	dfu_writer_end_digest(writer);
 
 	/* suffix */
+	memset(&suffix, 0xff, sizeof(suffix));
 	suffix.bcdDFU = cpu_to_le16(0x0100);
 	suffix.ucDfuSignature[0] = 'U';
 	suffix.ucDfuSignature[1] = 'F';
 	suffix.ucDfuSignature[2] = 'D';
 	suffix.bLength = DFU_FILE_SUFFIX_SIZE;
 
-	memcpy(buf, &suffix, DFU_FILE_SUFFIX_SIZE);
-	for (i = 0; i < DFU_FILE_SUFFIX_SIZE - 4; i++)
-		crc = crc32_byte(crc, buf[i]);
-
+	crc = crc32_buf(crc, &suffix, DFU_FILE_SUFFIX_SIZE - 4);
 	suffix.dwCRC = cpu_to_le32(crc);
 
-	if (write(fd, &suffix, DFU_FILE_SUFFIX_SIZE) < 0)
-		printf("Can't write suffix block: %s (%d)\n", strerror(errno), errno);
-	else
-		printf("Appended suffix block to image (firmware checksum: %08x)\n", crc);
-
+	if (dfu_writer_write(writer, &suffix, DFU_FILE_SUFFIX_SIZE) < 0)
+		ret = -1;
 
  out_close:
-	close(fd);
- out_free:
-	free(buf);
-	
+	if (dfu_writer_close(writer, NULL, &holes) < 0)
+		ret = -1;
+	if (r && ret < 0)
+		dfu_resume_save(r);
+	else if (r)
+		dfu_resume_end(r);
+	dfu_progress_end(handle->progress, ret == 0);
+	if (ret == 0) {
+		printf("Upload finished, read %llu bytes\n", total_bytes);
+		printf("Appended suffix block to image (firmware checksum: %08x)\n", crc);
+		if (holes)
+			printf("%lld bytes of zeroes left as holes in %s\n",
+			       (long long)holes, fname);
+		if (dfu_digest_report(handle->digest, fname) < 0)
+			ret = -1;
+	}
+
 	return ret;
 }
 
-#define PROGRESS_BAR_WIDTH 50
-
 #define MIN(a, b) (((a)<(b))?(a):(b))
 #define MAX(a, b) (((a)>(b))?(a):(b))
 
-/**
- * Assuming the buffer @p buf contains the dfu file image including a
- * DFU suffix, do a CRC checksum and suffix check of the image.
- *
- * @return 0 if the file is valid, or -1 if the image is invalid.
- */
-static int dfu_file_suffix_check(const char *fname, struct dfu_file_suffix *suffix, uint32_t *calculated_crc)
+/* hash the first @p len bytes of @p img, in blocks built in @p buf */
+static void _digest_image(dfu_handle *handle, const struct dfu_image *img,
+			  size_t len, unsigned char *buf, size_t buf_len)
 {
-	struct dfu_file_suffix suffix_dummy, suffix_tmp;
-	uint32_t dummy_calc_crc;
-	int i = 0;
-	int bytes_read = 0;
-	int ret;
-	int fd = -1;
-	struct stat st;
-	char buf[3];
-
-	if(!calculated_crc)
-		calculated_crc = &dummy_calc_crc;
-	if(!suffix)
-		suffix = &suffix_dummy;
-
+	size_t offset, n;
 
-	fd = open(fname, O_RDONLY|O_BINARY);
-	if (fd < 0) {
-		perror(fname);
-		ret = fd;
-		goto out_error;
+	if (!handle->digest)
+		return;
+	if (img->data) {
+		dfu_digest_update(handle->digest, img->data, len);
+		return;
 	}
-
-	ret = fstat(fd, &st);
-	if (ret < 0) {
-		perror(fname);
-		goto out_error;
-	}
-
-	if (st.st_size <= 0 /* + DFU_HDR */) {
-		fprintf(stderr, "File seems a bit too small...\n");
-		ret = -EINVAL;
-		goto out_error;
+	for (offset = 0; offset < len; offset += n) {
+		n = MIN(len - offset, buf_len);
+		dfu_digest_update(handle->digest,
+				  dfu_image_block(img, offset, n, buf), n);
 	}
-
-	if(st.st_size <= DFU_FILE_SUFFIX_SIZE)
-	{
-		fprintf(stderr, "firmware image too small. it needs to be at least dfu suffix size\n");
-		goto out_error;
-	}
-
-	*calculated_crc = crc32_init();
-
-	while((st.st_size-bytes_read) > 0 &&
-	      (ret = read(fd, buf, MIN(sizeof(buf), (st.st_size-bytes_read)))) != 0)
-	{
-		if(ret < 0)
-		{
-			perror("Can't read firmware file %s");
-			goto out_error;
-		}
-
-		for (i = 0; i < MAX(0,
-				    MIN(ret, (st.st_size-4-bytes_read))); i++)
-			*calculated_crc = crc32_byte(*calculated_crc, buf[i]);
-
-		/* copy over suffix block */
-		int dfu_suffix_offset = (st.st_size-DFU_FILE_SUFFIX_SIZE);
-		if(bytes_read >= dfu_suffix_offset) {
-			memcpy( ((char*)&suffix_tmp) + (bytes_read - dfu_suffix_offset),
-			       buf, ret);
-		}
-		else if (bytes_read+ret > (st.st_size-DFU_FILE_SUFFIX_SIZE))
-		{
-			const int len = (bytes_read+ret - (st.st_size-DFU_FILE_SUFFIX_SIZE));
-			memcpy(&suffix_tmp,
-			       buf+ret-len, len);
-		}
-
-		bytes_read += ret;
-	}
-
-	*suffix = suffix_tmp;
-	/* take care of endianness */
-	suffix->dwCRC = le32_to_cpu(suffix_tmp.dwCRC);
-
-	return *calculated_crc == suffix->dwCRC;
-
- out_error:
-	if(fd >= 0)
-	{
-		close(fd);
-		fd = -1;
-	}
-	return 0;
 }
 
-int sam7dfu_do_dnload(dfu_handle *handle,
-		      int xfer_size, const char *fname)
+/**
+ * send the image @p img to the device, block by block, waiting for
+ * dfuDNLOAD-IDLE after each one. Blocks of raw images are passed to
+ * the transport straight out of the image, which is never copied;
+ * those of loaded images are built in a buffer of this session. With
+ * @p r, the download starts at r->offset and failed blocks are
+ * retried.
+ *
+ * @return 0, or < 0 on error
+ */
+static int _dnload_blocks(dfu_handle *handle, int xfer_size,
+			  const struct dfu_image *img, int quiet,
+			  struct dfu_resume *r)
 {
-	int ret = -1, fd = -1, bytes_sent = 0;
-	unsigned int bytes_per_hash, hashes = 0;
-	char *buf = malloc(xfer_size);
-	struct stat st;
+	unsigned long long bytes_sent = r ? r->offset : 0;
+	unsigned long long total = img->size;
+	unsigned char *buf = NULL;
+	size_t buf_len = 0;
 	struct dfu_status dst;
-
-	if (!buf)
-		return -ENOMEM;
-
-        /* validate DFU suffix */
-        int validate_image = 1;
-        if(validate_image)
-        {
-		uint32_t calculated_crc = 0;
-		struct dfu_file_suffix suffix = {};
-
-		int valid = dfu_file_suffix_check(fname, &suffix, &calculated_crc);
-
-		printf("Firmware Checksum\t%08x ", calculated_crc);
-		if(valid)
-			printf("(%s)\n", "valid");
-		else
-			printf("(%s, expected %08x)\n", "corrupt", suffix.dwCRC);
-
-		/* TODO: warn if idVendor, idDevice etc. don't match -> s. section B */
-
-		if (!valid) {
-			ret = -1;
-			goto out_error;
+	int ret = -1;
+
+	if (!img->data) {
+		buf_len = MAX(xfer_size, DFU_IMAGE_CHUNK);
+		buf = malloc(buf_len);
+		if (!buf) {
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Unable to allocate a block buffer");
+			return -ENOMEM;
 		}
-        }
-
-	/* open */
-	fd = open(fname, O_RDONLY|O_BINARY);
-	if (fd < 0) {
-		perror(fname);
-		ret = fd;
-		goto out_error;
-	}
-
-	ret = fstat(fd, &st);
-	if (ret < 0) {
-		perror(fname);
-		goto out_error;
-	}
-
-	if (st.st_size <= 0 /* + DFU_HDR */) {
-		fprintf(stderr, "File seems a bit too small...\n");
-		ret = -EINVAL;
-		goto out_error;
 	}
 
-	if(st.st_size <= DFU_FILE_SUFFIX_SIZE)
-	{
-		fprintf(stderr, "firmware image too small. it needs to be at least dfu suffix size\n");
-		goto out_error;
+	if (!quiet) {
+		printf("Starting download...\n");
+		fflush(stdout);
 	}
-
-        /* upload, with progress bar */
-	bytes_per_hash = st.st_size / PROGRESS_BAR_WIDTH;
-	if (bytes_per_hash == 0)
-		bytes_per_hash = 1;
-	printf("bytes_per_hash=%u\n", bytes_per_hash);
-#if 0
-	read(fd, DFU_HDR);
-#endif
-	printf("Starting download: [");
-	fflush(stdout);
-	while (bytes_sent < st.st_size - DFU_FILE_SUFFIX_SIZE) {
-		int hashes_todo;
-
-		ret = read(fd, buf, MIN(xfer_size, st.st_size - DFU_FILE_SUFFIX_SIZE - bytes_sent) );
-		if (ret < 0) {
-			perror(fname);
-			goto out_error;
-		}
-
-		if (ret == 0)
-		{
-			perror("premature end of file");
-			goto out_error;
+	/* the device has the part sent before resuming already */
+	dfu_progress_begin(handle->progress, total, bytes_sent);
+	_digest_image(handle, img, bytes_sent, buf, buf_len);
+	while (bytes_sent < total) {
+		const unsigned char *block;
+		int size = xfer_size;
+
+		if (handle->tune)
+			size = dfu_tune_next(handle->tune);
+		size = MIN((unsigned long long)size, total - bytes_sent);
+		if (buf && (size_t)size > buf_len) {
+			unsigned char *b = realloc(buf, size);
+
+			if (!b) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			buf = b;
+			buf_len = size;
 		}
+		block = dfu_image_block(img, bytes_sent, size, buf);
 
-		ret = dfu_download(handle, ret, ret ? buf : NULL);
+		ret = dfu_download_block(handle, size, (const char *) block,
+					 &dst);
 		if (ret < 0) {
-			fprintf(stderr, "Error during download\n");
-			goto out_error;
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Error during download");
+			if (_recover(handle, r) == 0)
+				continue;
+			goto out;
 		}
-		bytes_sent += ret;
-
-		do {
-			ret = dfu_get_status(handle, &dst);
-			if (ret < 0) {
-				fprintf(stderr, "Error during download get_status\n");
-				goto out_error;
-			}
 
-			if(dfu_sm_get_state(handle) == DFU_STATE_dfuDNBUSY)
-			{
-				int timeout = dst.bwPollTimeout;
-				if(dfu_quirk_is_set(&handle->quirk_flags, QUIRK_OPENMOKO_DNLOAD_STATUS_POLL_TIMEOUT))
-				{
-					timeout = 5;
-				}
-				if(dfu_status_poll_timeout(handle,
-							   timeout) < 0)
-					goto out_error;
-			}
-
-		} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE);
-		if (dst.bStatus != DFU_STATUS_OK) {
-			printf(" failed!\n");
-			printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
-			       dfu_state_to_string(dst.bState), dst.bStatus,
-			       dfu_status_to_string(dst.bStatus));
+		if (dst.bState != DFU_STATE_dfuDNLOAD_IDLE ||
+		    dst.bStatus != DFU_STATUS_OK) {
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Download failed, state(%u) = %s, status(%u) = %s",
+				dst.bState, dfu_state_to_string(dst.bState),
+				dst.bStatus, dfu_status_to_string(dst.bStatus));
+			if (_recover(handle, r) == 0)
+				continue;
 			ret = -1;
-			goto out_error;
+			goto out;
 		}
 
-		hashes_todo = (bytes_sent / bytes_per_hash) - hashes;
-		hashes += hashes_todo;
-		while (hashes_todo--)
-			putchar('#');
-		fflush(stdout);
+		dfu_digest_update(handle->digest, block, ret);
+		if (handle->heatmap)
+			dfu_heatmap_block(handle->heatmap, bytes_sent, ret);
+		bytes_sent += ret;
+		dfu_progress_add(handle->progress, ret);
+		if (handle->tune)
+			dfu_tune_account(handle->tune, ret);
+		if (r && dfu_resume_update(r, handle->transaction, bytes_sent))
+			dfu_resume_save(r);
 	}
 
 	/* send one zero sized download request to signalize end */
-	ret = dfu_download(handle, 0, NULL);
-	if (ret >= 0)
-		ret = bytes_sent;
-	
-	printf("] finished!\n");
-	fflush(stdout);
+	if (dfu_download(handle, 0, NULL) < 0) {
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"Error ending the download");
+		ret = -1;
+		goto out;
+	}
+	ret = 0;
+ out:
+	free(buf);
+	return ret;
+}
+
+/**
+ * finish a download: wait for the device to manifest the new
+ * firmware, and reset it if it isn't manifestation tolerant.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+static int _dnload_manifest(dfu_handle *handle, int quiet)
+{
+	struct dfu_status dst;
+	int ret;
 
 get_status:
 	/* We are now in MANIFEST_SYNC state */
 
 	ret = dfu_get_status(handle, &dst);
 	if (ret < 0) {
-		fprintf(stderr, "unable to read DFU status\n");
-		goto out_error;
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"unable to read DFU status");
+		return ret;
 	}
-	printf("state(%u) = %s, status(%u) = %s\n", dst.bState, 
-	       dfu_state_to_string(dst.bState), dst.bStatus,
-	       dfu_status_to_string(dst.bStatus));
+	if (!quiet)
+		dfu_log(DFU_LOG_INFO, handle->name,
+			"state(%u) = %s, status(%u) = %s", dst.bState,
+			dfu_state_to_string(dst.bState), dst.bStatus,
+			dfu_status_to_string(dst.bStatus));
 
 	if(dfu_sm_get_state(handle) == DFU_STATE_dfuMANIFEST) {
-		unsigned int timeout = dst.bwPollTimeout;
-
-		if(dfu_quirk_is_set(&handle->quirk_flags, QUIRK_OPENMOKO_MANIFEST_STATUS_POLL_TIMEOUT))
-		{
-			printf("Overwriting dfuMANIFEST_SYNC status poll timeout to 1 second (QUIRK_OPENMOKO_MANIFEST_STATUS_POLL_TIMEOUT)\n");
-
-			/* 1 second */
-			timeout = 1*1000*1000;
-		}
+		if(dfu_quirk_is_set(&handle->quirk_flags, QUIRK_OPENMOKO_MANIFEST_STATUS_POLL_TIMEOUT) && !quiet)
+			dfu_log(DFU_LOG_INFO, handle->name,
+				"Overwriting dfuMANIFEST_SYNC status poll timeout to 1 second (QUIRK_OPENMOKO_MANIFEST_STATUS_POLL_TIMEOUT)");
 
 		/* dfu_status_poll_timeout() does an internal
 		   statemachine transition based on bitManifestationTolerant */
 		if(dfu_status_poll_timeout(handle,
-					   timeout) < 0)
-			goto out_error;
+					   dfu_poll_timeout(handle, &dst)) < 0)
+			return -1;
 
 		if(dfu_sm_get_state(handle) == DFU_STATE_dfuMANIFEST_SYNC)
 		{
@@ -400,10 +368,13 @@ get_status:
 	case DFU_STATE_dfuIDLE:
 		/* the device isn't able to do any USB communication
 		   anymore; the host must reset it now. */
-		if(handle->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
-			printf("Manifestation complete, device state is dfuIDLE now (bitManifestationTolerant=1)\n");
-		else
-			printf("WARNING: expected state dfuMANIFEST_WAIT_RESET but new state is dfuIDLE (Manifestation complete, bitManifestationTolerant=0)\n");
+		if(handle->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL) {
+			if (!quiet)
+				dfu_log(DFU_LOG_INFO, handle->name,
+					"Manifestation complete, device state is dfuIDLE now (bitManifestationTolerant=1)");
+		} else
+			dfu_log(DFU_LOG_WARN, handle->name,
+				"WARNING: expected state dfuMANIFEST_WAIT_RESET but new state is dfuIDLE (Manifestation complete, bitManifestationTolerant=0)");
 
 		break;
 
@@ -411,32 +382,272 @@ get_status:
 		/* the device isn't able to do any USB communication
 		   anymore; the host must reset it now. */
 		if(handle->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
-			printf("WARNING: expected state dfuIDLE but new state is dfuMANIFEST_WAIT_RESET (Manifestation complete, bitManifestationTolerant=1). Still attempting to do USB device reset.\n");
-		else
-			printf("Resetting USB device (bitManifestationTolerant=0)\n");
+			dfu_log(DFU_LOG_WARN, handle->name,
+				"WARNING: expected state dfuIDLE but new state is dfuMANIFEST_WAIT_RESET (Manifestation complete, bitManifestationTolerant=1). Still attempting to do USB device reset.");
+		else if (!quiet)
+			dfu_log(DFU_LOG_INFO, handle->name,
+				"Resetting USB device (bitManifestationTolerant=0)");
 
 		if(dfu_usb_reset(handle) < 0)
-			goto out_error;
+			return -1;
 		break;
 
 	default:
 		/* unexpected! */
-		printf("Unexpected device state %s while doing manifestation.\n",
-		       dfu_state_to_string(dfu_sm_get_state(handle)) );
+		dfu_log(DFU_LOG_WARN, handle->name,
+			"Unexpected device state %s while doing manifestation.",
+			dfu_state_to_string(dfu_sm_get_state(handle)));
 		break;
 	}
 
-	printf("Done!\n");
+	if (!quiet)
+		dfu_log(DFU_LOG_INFO, handle->name, "Done!");
+
+	return 0;
+}
+
+static int _dnload_image(dfu_handle *handle, int xfer_size,
+			 const struct dfu_image *img, int quiet,
+			 struct dfu_resume *r)
+{
+	int ret;
+
+	ret = _dnload_blocks(handle, xfer_size, img, quiet, r);
+	if (ret < 0)
+		return ret;
+
+	return _dnload_manifest(handle, quiet);
+}
+
+/**
+ * download the already loaded image @p img. The image is only read,
+ * so several sessions may download the same image concurrently.
+ * With @p quiet set, no progress is printed, only errors.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+int sam7dfu_do_dnload_image(dfu_handle *handle, int xfer_size,
+			    const struct dfu_image *img, int quiet)
+{
+	int ret;
+
+	ret = _dnload_image(handle, xfer_size, img, quiet, NULL);
+	dfu_progress_end(handle->progress, ret == 0);
+	return ret;
+}
+
+/**
+ * download a raw image read from @p fd as it arrives, e.g. from a pipe.
+ * The last DFU_FILE_SUFFIX_SIZE bytes read are always held back, as
+ * they may turn out to be the suffix, and the CRC is computed on the
+ * fly. It is checked before the last block is sent, so the device
+ * never manifests a corrupt image.
+ *
+ * @return 0 on success, or < 0 on error
+ */
+static int _dnload_stream(dfu_handle *handle, int xfer_size, int fd,
+			  int image_flags)
+{
+	struct dfu_file_suffix suffix;
+	unsigned long long bytes_sent = 0;
+	size_t have = 0, last, cap = xfer_size + DFU_FILE_SUFFIX_SIZE;
+	uint32_t crc = crc32_init();
+	struct dfu_status dst;
+	unsigned char *buf;
+	int eof = 0, ret = -1;
+
+	buf = malloc(cap);
+	if (!buf)
+		return -ENOMEM;
+
+	printf("Starting download...\n");
+	fflush(stdout);
+	/* the size of a stream isn't known */
+	dfu_progress_begin(handle->progress, 0, 0);
+
+	while (1) {
+		size_t size = xfer_size;
+
+		if (handle->tune)
+			size = dfu_tune_next(handle->tune);
+
+		/* a block, and what may be the suffix behind it */
+		while (!eof && have < size + DFU_FILE_SUFFIX_SIZE) {
+			ssize_t n = read(fd, buf + have, cap - have);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				perror("stdin");
+				goto out;
+			}
+			if (n == 0)
+				eof = 1;
+			have += n;
+		}
+		/* what is left is the last block and the suffix */
+		if (eof && have <= size + DFU_FILE_SUFFIX_SIZE)
+			break;
+
+		crc = crc32_buf(crc, buf, size);
+		dfu_digest_update(handle->digest, buf, size);
+		ret = dfu_download_block(handle, size, (const char *) buf, &dst);
+		if (ret < 0) {
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Error during download");
+			goto out;
+		}
+		if (dst.bState != DFU_STATE_dfuDNLOAD_IDLE ||
+		    dst.bStatus != DFU_STATUS_OK) {
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Download failed, state(%u) = %s, status(%u) = %s",
+				dst.bState, dfu_state_to_string(dst.bState),
+				dst.bStatus, dfu_status_to_string(dst.bStatus));
+			ret = -1;
+			goto out;
+		}
+		if (handle->tune)
+			dfu_tune_account(handle->tune, ret);
+		if (handle->heatmap)
+			dfu_heatmap_block(handle->heatmap, bytes_sent, size);
+
+		bytes_sent += size;
+		dfu_progress_add(handle->progress, size);
+		have -= size;
+		memmove(buf, buf + size, have);
+	}
+
+	if (have < DFU_FILE_SUFFIX_SIZE) {
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"firmware image too small. it needs to be at least dfu suffix size");
+		ret = -EINVAL;
+		goto out_abort;
+	}
+	last = have - DFU_FILE_SUFFIX_SIZE;
+	memcpy(&suffix, buf + last, DFU_FILE_SUFFIX_SIZE);
+
+	/* the CRC covers everything but the dwCRC field itself */
+	crc = crc32_buf(crc, buf, last);
+	crc = crc32_buf(crc, &suffix, DFU_FILE_SUFFIX_SIZE - 4);
+	dfu_digest_update(handle->digest, buf, last);
+	if (!(image_flags & DFU_IMAGE_TRUST) &&
+	    crc != le32_to_cpu(suffix.dwCRC)) {
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"Firmware Checksum\t%08x (%s, expected %08x)", crc,
+			"corrupt", le32_to_cpu(suffix.dwCRC));
+		ret = -EINVAL;
+		goto out_abort;
+	}
 
- out_error:
-	if(fd >= 0)
-	{
-		close(fd);
-		fd = -1;
+	if (last) {
+		ret = dfu_download_block(handle, last, (const char *) buf,
+					 &dst);
+		if (ret < 0 || dst.bState != DFU_STATE_dfuDNLOAD_IDLE ||
+		    dst.bStatus != DFU_STATUS_OK) {
+			dfu_log(DFU_LOG_ERROR, handle->name,
+				"Error during download");
+			ret = -1;
+			goto out;
+		}
+		if (handle->heatmap)
+			dfu_heatmap_block(handle->heatmap, bytes_sent, last);
+		bytes_sent += last;
+		dfu_progress_add(handle->progress, last);
 	}
-	free(buf);
-	buf = NULL;
 
+	/* send one zero sized download request to signalize end */
+	if (dfu_download(handle, 0, NULL) < 0) {
+		dfu_log(DFU_LOG_ERROR, handle->name,
+			"Error ending the download");
+		ret = -1;
+		goto out;
+	}
+
+	printf("Firmware Checksum\t%08x (%s), %llu bytes\n", crc,
+	       image_flags & DFU_IMAGE_TRUST ? "not checked" : "valid",
+	       bytes_sent);
+	fflush(stdout);
+
+	ret = _dnload_manifest(handle, 0);
+	if (ret == 0 && dfu_digest_report(handle->digest, "-") < 0)
+		ret = -1;
+	goto out;
+
+ out_abort:
+	/* back to dfuIDLE, without manifesting what was sent */
+	dfu_abort(handle);
+ out:
+	free(buf);
 	return ret;
 }
 
+int sam7dfu_do_dnload(dfu_handle *handle,
+		      int xfer_size, const char *fname, int image_flags)
+{
+	struct dfu_resume resume, *r = NULL;
+	struct dfu_image img;
+	int ret;
+
+	if (!strcmp(fname, "-")) {
+		ret = _dnload_stream(handle, xfer_size, STDIN_FILENO,
+				     image_flags);
+		goto out;
+	}
+
+	ret = dfu_image_open(&img, fname, image_flags);
+	if (ret < 0)
+		return ret;
+
+	if (handle->device && img.format == DFU_FMT_RAW) {
+		struct usb_device *dev = usb_device(handle->device);
+
+		if (dfu_image_match(&img, dev->descriptor.idVendor,
+				    dev->descriptor.idProduct,
+				    dev->descriptor.bcdDevice) < 0)
+			fprintf(stderr, "WARNING: %s is made for device "
+				"0x%04x:0x%04x rev 0x%04x, not for this "
+				"0x%04x:0x%04x rev 0x%04x\n", fname,
+				img.suffix.idVendor, img.suffix.idProduct,
+				img.suffix.bcdDevice, dev->descriptor.idVendor,
+				dev->descriptor.idProduct,
+				dev->descriptor.bcdDevice);
+	}
+
+	/* progress of an earlier attempt to download the same image. The
+	   CRC of a raw image is known already, which saves reading a
+	   large one once more. */
+	if (handle->resume) {
+		uint32_t crc = img.calculated_crc;
+
+		if (img.format != DFU_FMT_RAW) {
+			crc = crc32_init();
+			ret = dfu_image_crc(&img, &crc);
+			if (ret < 0)
+				goto out_close;
+		}
+
+		r = &resume;
+		if (dfu_resume_begin(r, handle, fname, 0, img.size, crc,
+				     xfer_size)) {
+			printf("Resuming download at block %u (byte %llu)\n",
+			       r->block, r->offset);
+			handle->transaction = r->block;
+		} else
+			r->block = handle->transaction;
+	}
+
+	ret = _dnload_image(handle, xfer_size, &img, 0, r);
+	if (r && ret < 0)
+		dfu_resume_save(r);
+	else if (r)
+		dfu_resume_end(r);
+	if (ret == 0 && dfu_digest_report(handle->digest, fname) < 0)
+		ret = -1;
+
+ out_close:
+	dfu_image_close(&img);
+ out:
+	/* only after manifestation is it known whether the device took it */
+	dfu_progress_end(handle->progress, ret == 0);
+	return ret;
+}
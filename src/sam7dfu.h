@@ -1,10 +1,14 @@
 #ifndef _SAM7DFU_H
 #define _SAM7DFU_H
 
+struct dfu_image;
+
 int sam7dfu_do_upload(dfu_handle *handle, 
-		      int xfer_size, const char *fname);
+		      int xfer_size, const char *fname, off_t size_hint);
 int sam7dfu_do_dnload(dfu_handle *handle,
-		      int xfer_size, const char *fname);
+		      int xfer_size, const char *fname, int image_flags);
+int sam7dfu_do_dnload_image(dfu_handle *handle, int xfer_size,
+			    const struct dfu_image *img, int quiet);
 
 int sam7dfu_do_suffix(const char *fname);
 
@@ -0,0 +1,272 @@
+/*
+ * dfu-util - SHA-256
+ *
+ * Copyright (C) 2010      by Sandro Giessl <s.giessl@niftylight.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * SHA-256 as of FIPS 180-4. On x86 CPUs with the SHA extensions, the
+ * blocks are compressed by the sha256rnds2/sha256msg instructions,
+ * which is several times faster than the generic code and keeps up
+ * with any USB link. The implementation is picked on first use.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "sha256.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/* compress @p n blocks of SHA256_BLOCK_SIZE bytes at @p data */
+static void _blocks_generic(uint32_t h[8], const unsigned char *data,
+			    size_t n)
+{
+	uint32_t w[64];
+	int i;
+
+	while (n--) {
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t)data[4*i] << 24 | data[4*i+1] << 16 |
+				data[4*i+2] << 8 | data[4*i+3];
+		for (; i < 64; i++) {
+			uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^
+				(w[i-15] >> 3);
+			uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^
+				(w[i-2] >> 10);
+
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		for (i = 0; i < 64; i++) {
+			uint32_t t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+				((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+				((a & b) ^ (a & c) ^ (b & c));
+
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+		data += SHA256_BLOCK_SIZE;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+/* the same with the SHA extensions, four rounds per step */
+__attribute__((target("sha,sse4.1")))
+static void _blocks_sha_ni(uint32_t h[8], const unsigned char *data,
+			   size_t n)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i abef, cdgh, tmp;
+
+	/* the instructions want the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]),
+				0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]),
+				 0x1b);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+	while (n--) {
+		__m128i abef_save = abef, cdgh_save = cdgh;
+		__m128i w[4], msg;
+		int i;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(data + 16*i)), bswap);
+			else
+				w[i%4] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(
+						_mm_sha256msg1_epu32(w[i%4],
+								     w[(i+1)%4]),
+						_mm_alignr_epi8(w[(i+3)%4],
+								w[(i+2)%4], 4)),
+					w[(i+3)%4]);
+
+			msg = _mm_add_epi32(w[i%4], _mm_loadu_si128(
+				(const __m128i *)&K[4*i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static int _have_sha_ni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & bit_SSE4_1))
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx >> 29) & 1;
+}
+#endif
+
+static void (*_blocks)(uint32_t h[8], const unsigned char *data, size_t n);
+static const char *_impl;
+static pthread_once_t _pick_once = PTHREAD_ONCE_INIT;
+
+static void _pick(void)
+{
+	_blocks = _blocks_generic;
+	_impl = "generic";
+#ifdef HAVE_SHA_NI
+	if (_have_sha_ni()) {
+		_blocks = _blocks_sha_ni;
+		_impl = "sha-ni";
+	}
+#endif
+}
+
+/* name of the implementation in use, for diagnostics */
+const char *sha256_impl(void)
+{
+	pthread_once(&_pick_once, _pick);
+	return _impl;
+}
+
+void sha256_init(struct sha256 *s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	pthread_once(&_pick_once, _pick);
+	memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+	s->used = 0;
+}
+
+void sha256_update(struct sha256 *s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	s->len += len;
+
+	if (s->used) {
+		size_t n = SHA256_BLOCK_SIZE - s->used;
+
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->used, p, n);
+		s->used += n;
+		p += n;
+		len -= n;
+		if (s->used < SHA256_BLOCK_SIZE)
+			return;
+		_blocks(s->h, s->buf, 1);
+		s->used = 0;
+	}
+
+	/* whole blocks straight from the caller's buffer */
+	if (len >= SHA256_BLOCK_SIZE) {
+		size_t n = len / SHA256_BLOCK_SIZE;
+
+		_blocks(s->h, p, n);
+		p += n * SHA256_BLOCK_SIZE;
+		len -= n * SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(s->buf, p, len);
+	s->used = len;
+}
+
+void sha256_final(struct sha256 *s, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+	uint64_t bits = s->len * 8;
+	int i;
+
+	s->buf[s->used++] = 0x80;
+	if (s->used > SHA256_BLOCK_SIZE - 8) {
+		memset(s->buf + s->used, 0, SHA256_BLOCK_SIZE - s->used);
+		_blocks(s->h, s->buf, 1);
+		s->used = 0;
+	}
+	memset(s->buf + s->used, 0, SHA256_BLOCK_SIZE - 8 - s->used);
+	for (i = 0; i < 8; i++)
+		s->buf[SHA256_BLOCK_SIZE - 1 - i] = bits >> (8 * i);
+	_blocks(s->h, s->buf, 1);
+
+	for (i = 0; i < 8; i++) {
+		digest[4*i] = s->h[i] >> 24;
+		digest[4*i+1] = s->h[i] >> 16;
+		digest[4*i+2] = s->h[i] >> 8;
+		digest[4*i+3] = s->h[i];
+	}
+}
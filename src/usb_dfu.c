@@ -27,10 +27,56 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <usb.h>
 #include "dfu.h"
 #include "dfu_sm.h"
+#include "dfu_log.h"
+#include "dfu_clock.h"
+
+static unsigned long long _now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ *  usb_control_msg() to the DFU interface, with a timeout adapted to
+ *  the latency of earlier requests of the same kind; a status request
+ *  that times out is sent again, as dfu_request_retry() allows
+ *
+ *  returns what usb_control_msg() returns
+ */
+static int _control_msg( dfu_handle *handle, int requesttype,
+			 int request, int value, int index,
+			 char *bytes, int size )
+{
+	unsigned int first, timeout, spent = 0;
+	unsigned long long start;
+	int ret;
+
+	first = timeout = dfu_request_timeout(handle, request, size);
+	for (;;) {
+		start = _now_us();
+		ret = usb_control_msg(handle->device, requesttype, request,
+				      value, index, bytes, size, timeout);
+		if (ret >= 0 || ret == -ETIMEDOUT)
+			dfu_request_done(handle, request, size,
+					 _now_us() - start,
+					 ret == -ETIMEDOUT);
+		if (ret != -ETIMEDOUT)
+			break;
+		spent += timeout;
+		timeout = dfu_request_retry(handle, request, size, first,
+					    spent);
+		if (!timeout)
+			break;
+	}
+	return ret;
+}
 
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
@@ -40,7 +86,7 @@
 static int _usb_dfu10_detach( dfu_handle *handle,
 			      const unsigned short timeout )
 {
-	if(usb_control_msg( handle->device,
+	if(_control_msg( handle,
 			    /* bmRequestType */
 			    USB_ENDPOINT_OUT | USB_TYPE_CLASS |
 			    USB_RECIP_INTERFACE,
@@ -48,11 +94,10 @@ static int _usb_dfu10_detach( dfu_handle *handle,
 			    /* wValue        */ timeout,
 			    /* wIndex        */ handle->interface,
 			    /* Data          */ NULL,
-			    /* wLength       */ 0,
-			    handle->usb_timeout ) < 0)
+			    /* wLength       */ 0 ) < 0)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror());
@@ -76,8 +121,8 @@ static int _usb_dfu10_usb_reset( dfu_handle *handle)
 
 	if( (ret = usb_reset(handle->device)) < 0 && ret != -ENODEV)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror());
@@ -100,7 +145,7 @@ static int _usb_dfu10_status_poll_timeout( dfu_handle *handle,
 					   unsigned int poll_timeout )
 {
 	/* wait for timeout */
-	usleep(poll_timeout*1000);
+	dfu_clock_sleep_ms(poll_timeout);
 
 	return 0;
 }
@@ -110,28 +155,29 @@ static int _usb_dfu10_status_poll_timeout( dfu_handle *handle,
  *
  *  length    - the total number of bytes to transfer to the USB
  *              device - must be less than wTransferSize
- *  data      - the data to transfer
+ *  data      - the data to transfer; it is never written to, the
+ *              cast below is only needed as usb_control_msg() takes
+ *              a plain char pointer for both directions
  *
  *  returns the number of bytes written or < 0 on error
  */
 static int _usb_dfu10_download( dfu_handle *handle,
 				const int transaction,
 				const unsigned short length,
-				char* data )
+				const char* data )
 {
 	int ret = -1;
 
-	if( (ret = usb_control_msg( handle->device,
+	if( (ret = _control_msg( handle,
 				    /* bmRequestType */ USB_ENDPOINT_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 				    /* bRequest      */ USB_REQ_DFU_DNLOAD,
 				    /* wValue        */ transaction,
 				    /* wIndex        */ handle->interface,
-				    /* Data          */ data,
-				    /* wLength       */ length,
-				    handle->usb_timeout )) < 0)
+				    /* Data          */ (char *) data,
+				    /* wLength       */ length )) < 0)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror() );
@@ -157,17 +203,16 @@ static int _usb_dfu10_upload( dfu_handle *handle,
 {
 	int ret = -1;
 
-	if( (ret = usb_control_msg( handle->device,
+	if( (ret = _control_msg( handle,
 				    /* bmRequestType */ USB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 				    /* bRequest      */ USB_REQ_DFU_UPLOAD,
 				    /* wValue        */ transaction,
 				    /* wIndex        */ handle->interface,
 				    /* Data          */ data,
-				    /* wLength       */ length,
-				    handle->usb_timeout )) < 0)
+				    /* wLength       */ length )) < 0)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror() );
@@ -189,17 +234,16 @@ static int _usb_dfu10_get_status( dfu_handle *handle,
 {
 	char buffer[6];
 
-	if(usb_control_msg( handle->device,
+	if(_control_msg( handle,
 			    /* bmRequestType */ USB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 			    /* bRequest      */ USB_REQ_DFU_GETSTATUS,
 			    /* wValue        */ 0,
 			    /* wIndex        */ handle->interface,
 			    /* Data          */ buffer,
-			    /* wLength       */ sizeof(buffer),
-			    handle->usb_timeout ) != 6)
+			    /* wLength       */ sizeof(buffer) ) != 6)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror());
@@ -224,17 +268,16 @@ static int _usb_dfu10_get_status( dfu_handle *handle,
  */
 static int _usb_dfu10_clear_status( dfu_handle *handle)
 {
-	if( usb_control_msg( handle->device,
+	if( _control_msg( handle,
 			     /* bmRequestType */ USB_ENDPOINT_OUT| USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 			     /* bRequest      */ USB_REQ_DFU_CLRSTATUS,
 			     /* wValue        */ 0,
 			     /* wIndex        */ handle->interface,
 			     /* Data          */ NULL,
-			     /* wLength       */ 0,
-			     handle->usb_timeout ) < 0)
+			     /* wLength       */ 0 ) < 0)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror());
@@ -257,17 +300,16 @@ static int _usb_dfu10_get_state( dfu_handle *handle)
 {
 	char buffer[1];
 
-	if(usb_control_msg( handle->device,
+	if(_control_msg( handle,
 			    /* bmRequestType */ USB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 			    /* bRequest      */ USB_REQ_DFU_GETSTATE,
 			    /* wValue        */ 0,
 			    /* wIndex        */ handle->interface,
 			    /* Data          */ buffer,
-			    /* wLength       */ 1,
-			    handle->usb_timeout ) < 0)
+			    /* wLength       */ 1 ) < 0)
 	{
-		fprintf( stderr,
-			 "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name,
+			 "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)), usb_strerror());
 		return -1;
@@ -283,16 +325,15 @@ static int _usb_dfu10_get_state( dfu_handle *handle)
  */
 static int _usb_dfu10_abort( dfu_handle *handle)
 {
-	if(usb_control_msg( handle->device,
+	if(_control_msg( handle,
 			    /* bmRequestType */ USB_ENDPOINT_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 			    /* bRequest      */ USB_REQ_DFU_ABORT,
 			    /* wValue        */ 0,
 			    /* wIndex        */ handle->interface,
 			    /* Data          */ NULL,
-			    /* wLength       */ 0,
-			    handle->usb_timeout ) < 0)
+			    /* wLength       */ 0 ) < 0)
 	{
-		fprintf( stderr, "%s: USB transaction failed (current state: %s): %s\n",
+		dfu_log( DFU_LOG_ERROR, handle->name, "%s: USB transaction failed (current state: %s): %s",
 			 __FUNCTION__,
 			 dfu_state_to_string(dfu_sm_get_state(handle)),
 			 usb_strerror());